@@ -64,7 +64,7 @@ embedded_cpp_entry_points = """
 torch::Tensor entry(torch::Tensor t) {
     using namespace ks::entry_points;
     auto ks_t = convert_argument<ks::tensor<1, ks::Float>>(t);
-    auto ks_ret = ks::vgelu(&g_alloc, ks_t);
+    auto ks_ret = ks::vgelu(get_allocator(), ks_t);
     return convert_return_value<torch::Tensor>(ks_ret);
 }
 
@@ -72,7 +72,7 @@ torch::Tensor entry_vjp(torch::Tensor t, torch::Tensor dret) {
     using namespace ks::entry_points;
     auto ks_t = convert_argument<ks::tensor<1, ks::Float>>(t);
     auto ks_dret = convert_argument<ks::tensor<1, ks::Float>>(dret);
-    auto ks_ret = ks::sufrev_vgelu(&g_alloc, ks_t, ks_dret);
+    auto ks_ret = ks::sufrev_vgelu(get_allocator(), ks_t, ks_dret);
     return convert_return_value<torch::Tensor>(ks_ret);
 }
 """
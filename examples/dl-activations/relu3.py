@@ -282,7 +282,7 @@ embedded_cpp_entry_points = """
 torch::Tensor entry(torch::Tensor t) {
     using namespace ks::entry_points;
     auto ks_t = convert_argument<ks::tensor<1, ks::Float>>(t);
-    auto ks_ret = ks::vrelu3(&g_alloc, ks_t);
+    auto ks_ret = ks::vrelu3(get_allocator(), ks_t);
     return convert_return_value<torch::Tensor>(ks_ret);
 }
 
@@ -290,7 +290,7 @@ torch::Tensor entry_vjp(torch::Tensor t, torch::Tensor dret) {
     using namespace ks::entry_points;
     auto ks_t = convert_argument<ks::tensor<1, ks::Float>>(t);
     auto ks_dret = convert_argument<ks::tensor<1, ks::Float>>(dret);
-    auto ks_ret = ks::sufrev_vrelu3(&g_alloc, ks_t, ks_dret);
+    auto ks_ret = ks::sufrev_vrelu3(get_allocator(), ks_t, ks_dret);
     return convert_return_value<torch::Tensor>(ks_ret);
 }
 """
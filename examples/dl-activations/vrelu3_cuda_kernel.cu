@@ -24,16 +24,21 @@ inline __device__ scalar_t relu3_backward(scalar_t grad, scalar_t x) {
 
 struct Relu3_forward
 {
+  // Nothing is allocated, so no thread arenas are needed
+  static constexpr size_t thread_bytes = 0;
+
   template<typename scalar_t>
-  inline __device__ scalar_t operator()(scalar_t input) {
+  inline __device__ scalar_t operator()(ks::allocator *, scalar_t input) {
     return relu3_forward(input);
   }
 };
 
 struct Relu3_backward
 {
+  static constexpr size_t thread_bytes = 0;
+
   template<typename scalar_t>
-  inline __device__ scalar_t operator()(scalar_t grad, scalar_t x) {
+  inline __device__ scalar_t operator()(ks::allocator *, scalar_t grad, scalar_t x) {
     return relu3_backward(grad, x);
   }
 };
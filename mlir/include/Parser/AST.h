@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Casting.h"
 
@@ -123,6 +124,10 @@ struct Type {
     return !(*this == that);
   }
 
+  friend llvm::hash_code hash_value(Type const& t) {
+    return llvm::hash_combine(t.type, llvm::hash_combine_range(t.subTypes.begin(), t.subTypes.end()));
+  }
+
 protected:
   ValidType type;
   std::vector<Type> subTypes;
@@ -188,6 +193,11 @@ struct StructuredName {
 };
 std::ostream& operator<<(std::ostream& s, StructuredName const& t);
 
+inline llvm::hash_code hash_value(StructuredName const& n) {
+  return llvm::hash_combine(llvm::hash_combine_range(n.derivations.begin(), n.derivations.end()),
+                            n.baseFunctionName, n.baseFunctionArgType);
+}
+
 struct Signature {
   StructuredName name;
   Type argType;   
@@ -202,8 +212,21 @@ struct Signature {
   bool operator!=(Signature const& that) const { return !(*this == that); }
 
   std::string getMangledName() const;
+
+  /// For unordered containers
+  struct Hash {
+    size_t operator()(Signature const& s) const;
+  };
 };
 
+inline llvm::hash_code hash_value(Signature const& s) {
+  return llvm::hash_combine(s.name, s.argType);
+}
+
+inline size_t Signature::Hash::operator()(Signature const& s) const {
+  return hash_value(s);
+}
+
 std::ostream& operator<<(std::ostream& s, Signature const& t);
 
 /// A node in the AST.
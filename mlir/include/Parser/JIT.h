@@ -0,0 +1,47 @@
+/* Copyright Microsoft Corp. 2020 */
+#ifndef _KSC_JIT_H_
+#define _KSC_JIT_H_
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Support/Error.h"
+
+namespace Knossos {
+namespace MLIR {
+
+/// In-process compilation of ks source: each module is parsed, built by
+/// the Generator, lowered by emitLLVM and compiled into this process, so
+/// that its functions can be called through the pointers from lookup.
+///
+/// This is the same ORC set-up as mlir::ExecutionEngine, but with an
+/// object cache on disk: when cacheDir is given, the object code of each
+/// module is kept there, named by a hash of its optimized LLVM IR and the
+/// host CPU, and reused by later processes which compile the same module.
+class JIT {
+  std::unique_ptr<llvm::ObjectCache> cache;
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  int optLevel;
+  std::string target;  // The host CPU name and features, for the cache key
+
+  JIT(int optLevel, std::unique_ptr<llvm::ObjectCache> cache)
+      : cache(std::move(cache)), optLevel(optLevel) {}
+
+public:
+  static llvm::Expected<std::unique_ptr<JIT>> create(int optLevel,
+                                                     std::string const& cacheDir = "");
+
+  /// Compile the ks source, whose name (for error messages) is filename
+  llvm::Error addSource(std::string const& source, llvm::StringRef filename);
+
+  /// The address of the function with the given (mangled) name
+  llvm::Expected<void*> lookup(llvm::StringRef name);
+};
+
+} // namespace MLIR
+} // namespace Knossos
+
+#endif // _KSC_JIT_H_
@@ -5,21 +5,29 @@
 #include <cassert>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
 
 namespace Knossos {
 namespace AST {
   
+/// The single copy of a filename, which lives as long as the process, so
+/// that each Location refers to it rather than holding its own
+llvm::StringRef internFilename(llvm::StringRef filename);
+
 /// Code location.
 struct Location {
-  std::shared_ptr<std::string> filename;
+  llvm::StringRef filename;
   size_t line;
   size_t column;
 
-  Location(const std::string& s, size_t line, size_t column):
-    filename(std::make_shared<std::string>(s)),
+  Location(llvm::StringRef s, size_t line, size_t column):
+    filename(internFilename(s)),
     line(line),
     column(column)
   {}
@@ -44,45 +52,46 @@ inline std::ostream& operator<<(std::ostream& s, Location const& loc) { return l
 /// Non-Values are lets, def/decl, ops, calls, control flow
 ///
 /// Do not confuse with "continuation values", those are higher level.
+///
+/// Tokens are allocated in the Lexer's arena and live as long as it does.
+/// A value refers to the Lexer's copy of the source text, and children are
+/// an array in the arena, so a Token owns nothing and needs no destructor.
 struct Token {
-  using Ptr = std::unique_ptr<Token>;
-  Token(Location loc, std::string str) : isValue(true), value(str), loc(loc) {}
-  Token(Location loc, char delim = '(') : isValue(false), value(1, delim), loc(loc) {}
+  using Ptr = const Token*;
+  Token(Location loc, llvm::StringRef str) : isValue(true), delim(0), value(str), loc(loc) {}
+  Token(Location loc, char delim, llvm::ArrayRef<Ptr> children)
+    : isValue(false), delim(delim), children(children), loc(loc) {}
 
   const bool isValue;
 
-  void addChild(Token::Ptr tok) {
-    assert(!isValue && "Can't add children to values");
-    children.push_back(std::move(tok));
-  }
-  std::vector<Ptr> const& getChildren() const {
+  llvm::ArrayRef<Ptr> getChildren() const {
     assert(!isValue && "No children in a value token");
     return children;
   }
-  std::string const& getValue() const {
+  llvm::StringRef getValue() const {
     assert(isValue && "Not a value token");
     return value;
   }
   const Token *getChild(size_t idx) const {
     assert(!isValue && "No children in a value token");
     assert(idx < children.size() && "Offset error");
-    return children[idx].get();
+    return children[idx];
   }
 
   const Token *getHead() const {
     assert(!isValue && "No children in a value token");
     assert(children.size() > 0 && "No head");
-    return children[0].get();
+    return children[0];
   }
 
   llvm::ArrayRef<Ptr> getTail() const {
     assert(!isValue && "No children in a value token");
     assert(children.size() > 0 && "No tail");
-    return llvm::ArrayRef<Ptr>(children).slice(1);
+    return children.slice(1);
   }
   char getDelimeter() const {
     assert(!isValue && "No children in a value token");
-    return value[0];
+    return delim;
   }
   bool isSquareBracket() const {
     return getDelimeter() == '[';
@@ -98,8 +107,9 @@ struct Token {
 
 
 private:
-  std::string value;
-  std::vector<Ptr> children;
+  char delim;
+  llvm::StringRef value;
+  llvm::ArrayRef<Ptr> children;
   Location loc;
 
   // Pretty printing
@@ -111,6 +121,9 @@ private:
   static ppresult pprint(Token const* tok, int indent = 0, int width = 80);
 };
 
+static_assert(std::is_trivially_destructible<Token>::value,
+              "Tokens are freed with the Lexer's arena, without destruction");
+
 inline std::ostream& operator<<(std::ostream& s, Token const* tok) 
 {
   return tok->dump(s);
@@ -123,9 +136,16 @@ inline std::string Token::pprint(int width) const
 
 /// Tokenise the text into recursive tokens grouped by parenthesis.
 ///
-/// The Lexer will pass the ownership of the Tokens to the Parser.
+/// The Tokens belong to the Lexer, so it must outlive their users.  The
+/// text is either copied, or read in place from a MemoryBuffer (which maps
+/// large files rather than reading them).  The whole text can be lexed into
+/// one token, or, with lexTopLevel, one top-level expression at a time, so
+/// that a caller can releaseTokens once it has converted each one.
 class Lexer {
-  std::string code;
+  std::string ownedCode;
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  llvm::StringRef code;
+  llvm::BumpPtrAllocator arena;
   size_t len;
   Location loc;
   size_t multiLineComments;
@@ -135,15 +155,35 @@ class Lexer {
 
   char get();
   char peek(int offset = 0);
+  Token::Ptr lexNext();
+  void checkClosingBracket(char c);
+
+  template <typename... Args>
+  Token::Ptr makeToken(Args&&... args) {
+    return new (arena.Allocate<Token>()) Token(std::forward<Args>(args)...);
+  }
 
 public:
   Lexer(Location const& loc, std::string const& code);
+  Lexer(Location const& loc, std::unique_ptr<llvm::MemoryBuffer> buffer);
+  // Tokens refer to code, so it must stay put
+  Lexer(Lexer const&) = delete;
+  Lexer& operator=(Lexer const&) = delete;
 
   void setVerbosity(int v) {
       verbosity = v;
   }
 
+  /// The whole text (or the rest of a bracketed list) as one token
   Token::Ptr lex(char c = 0);
+
+  /// The next top-level expression, or null at the end of the text
+  Token::Ptr lexTopLevel();
+
+  /// Free every token lexed so far
+  void releaseTokens() {
+    arena.Reset();
+  }
 };
 
 }} // namespace
@@ -34,19 +34,30 @@ class Generator {
   // Current function (for basic block placement)
   mlir::FuncOp currentFunc;
 
-  // Cache for functions and variables
-  std::map<std::string, mlir::FuncOp> functions;
+  // Build the bodies of definitions concurrently
+  bool parallel = false;
+
+  // Cache for functions and variables.  The Generators which build bodies
+  // concurrently each have their own variables, but share the functions of
+  // the Generator which made them, which are all declared beforehand.
+  std::map<std::string, mlir::FuncOp> ownFunctions;
+  std::map<std::string, mlir::FuncOp> &functions;
   std::map<std::string, Values> variables;
 
+  Generator(mlir::MLIRContext &context, std::map<std::string, mlir::FuncOp> &functions);
+
   // Helpers
   Types ConvertType(const AST::Type &type, size_t dim=0);
   mlir::Value memrefCastForCall(mlir::Value orig);
+  size_t numValues(const AST::Type &type);
+  Values tupleElement(const AST::Type &type, Values const& vals, size_t idx);
   mlir::Attribute getAttr(const AST::Expr* op);
 
   // Module level builders
   void buildGlobal(const AST::Block* block);
   mlir::FuncOp buildDecl(const AST::Declaration* decl);
   mlir::FuncOp buildDef(const AST::Definition* def);
+  void buildBody(const AST::Definition* def, mlir::FuncOp func);
 
   // Function level builders
   Values buildNode(const AST::Expr*);
@@ -62,6 +73,19 @@ class Generator {
   Values buildGet(const AST::Get*);
   Values buildFold(const AST::Fold*);
 
+  // Loop builders, for build and fold
+  mlir::Operation* buildLoop(mlir::Value upperBound, mlir::ValueRange iterArgs);
+  Values endLoop(mlir::Operation* loop, mlir::ValueRange results);
+  mlir::Value buildLoad(llvm::ArrayRef<mlir::Operation*> loops, mlir::Value vec,
+                        mlir::ValueRange ivs);
+  void buildStore(llvm::ArrayRef<mlir::Operation*> loops, mlir::Value val, mlir::Value vec,
+                  mlir::ValueRange ivs);
+
+  // Vector elements (of tuples, or of nested vectors)
+  Values buildElement(llvm::ArrayRef<mlir::Operation*> loops, Values const& vec,
+                      mlir::ValueRange indices);
+  mlir::Value buildSlice(mlir::Value vec, mlir::ValueRange indices);
+
   // Variables
   void declareVariable(std::string const& name, Values vals);
 
@@ -71,12 +95,23 @@ class Generator {
 public:
   explicit Generator(mlir::MLIRContext &context);
 
+  // Registers and loads the dialects that the generator and the LLVM
+  // lowering use, which must be done before building
+  static void loadDialects(mlir::MLIRContext &context);
+
+  // Build the bodies of the definitions in a module in parallel, if the
+  // context is multithreaded.  With it, the function-level passes of
+  // emitLLVM also run in parallel, as they do whenever MLIR threading is on.
+  void setParallel(bool enable) { parallel = enable; }
+
   // Build from MLIR source
   const mlir::ModuleOp build(const std::string& mlir);
   // Build from KSC AST
   const mlir::ModuleOp build(const AST::Block* extraDecls, const AST::Expr* root);
-  // Emit LLVM IR
-  std::unique_ptr<llvm::Module> emitLLVM(int optLevel, llvm::LLVMContext & llvmContext);
+  // Emit LLVM IR, optimized at optLevel (0 to 3), reporting the time
+  // taken by each pass to stderr if timing is set
+  std::unique_ptr<llvm::Module> emitLLVM(int optLevel, llvm::LLVMContext & llvmContext,
+                                         bool timing = false);
 };
 
 } // namespace MLIR
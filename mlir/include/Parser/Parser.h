@@ -7,9 +7,11 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <iosfwd>
 
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringSwitch.h"
 
 #include "AST.h"
@@ -23,7 +25,7 @@ namespace Knossos { namespace AST {
 /// The parser will take ownership of the Tokens.
 class Parser {
   Lexer lex;
-  Token::Ptr rootT;
+  Token::Ptr rootT;  // Owned by lex
   Block::Ptr rootE;
   Block::Ptr extraDecls;
 
@@ -33,7 +35,7 @@ class Parser {
       LET, IF, TUPLE, GET,
       BUILD, FOLD, NA,
   };
-  Keyword isReservedWord(std::string name) const {
+  Keyword isReservedWord(llvm::StringRef name) const {
     return llvm::StringSwitch<Keyword>(name)
               .Case("def", Keyword::DEF)
               .Case("edef", Keyword::EDEF)
@@ -50,28 +52,26 @@ class Parser {
   /// Simple symbol table for parsing only (no validation)
   struct Symbols {
     Symbols(bool reassign=false) : reassign(reassign) {}
-    bool exists(std::string name) {
-      return symbols.find(name) != symbols.end();
+    bool exists(llvm::StringRef name) const {
+      return symbols.count(name);
     }
-    void set(std::string name, Expr* val) {
-      auto result = symbols.insert({name, val});
+    void set(llvm::StringRef name, Expr* val) {
+      auto result = symbols.try_emplace(name, val);
       // Already exists, replace
       if (!result.second && reassign)
-        symbols[name] = val;
+        result.first->second = val;
     }
-    Expr* get(std::string name) {
-      if (exists(name))
-        return symbols[name];
-      return nullptr;
+    Expr* get(llvm::StringRef name) const {
+      return symbols.lookup(name);
     }
   private:
     bool reassign;
-    std::map<std::string, Expr*> symbols;
+    llvm::StringMap<Expr*> symbols;
   };
   Symbols variables{true};
   Symbols rules;
 
-  std::map<Signature, Declaration*> function_decls;
+  std::unordered_map<Signature, Declaration*, Signature::Hash> function_decls;
 
   // Build AST nodes from Tokens
   Expr::Ptr parseToken(const Token *tok);
@@ -107,18 +107,25 @@ public:
       {
         lex.setVerbosity(verbosity);
       }
+  Parser(Location const& loc, std::unique_ptr<llvm::MemoryBuffer> buffer, int verbosity): 
+      lex(loc, std::move(buffer)),
+      rootT(nullptr), 
+      rootE(nullptr),
+      extraDecls(std::make_unique<Block>())
+      {
+        lex.setVerbosity(verbosity);
+      }
 
+  /// Lex the whole text, for getRootToken
   void tokenise() {
     assert(!rootT && "Won't overwrite root token");
     rootT = lex.lex();
   }
-  void parse() {
-    assert(!rootE && "Won't overwrite root node");
-    if (!rootT) tokenise();
-    rootE = parseBlock(rootT.get());
-  }
+  /// Parse the tokens, if tokenised, or else lex and parse one top-level
+  /// expression at a time, freeing the tokens of each once it is parsed
+  void parse();
   const Token* getRootToken() {
-    return rootT.get();
+    return rootT;
   }
   const Expr* getRootNode() {
     return rootE.get();
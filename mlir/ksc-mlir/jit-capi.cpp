@@ -0,0 +1,53 @@
+/* Copyright Microsoft Corp. 2020 */
+// C interface to the JIT, for callers such as Python's ctypes which
+// cannot use C++.  Errors are reported by returning null, after which
+// ksc_jit_last_error describes the problem.
+#include <string>
+
+#include "Parser/JIT.h"
+
+using namespace Knossos::MLIR;
+
+static thread_local std::string lastError;
+
+template <typename T>
+static T* reportError(llvm::Error err) {
+  lastError = llvm::toString(std::move(err));
+  return nullptr;
+}
+
+extern "C" {
+
+// A JIT at the given optimization level (0 to 3), caching object code in
+// cache_dir unless it is null or empty
+void* ksc_jit_create(int opt_level, const char* cache_dir) {
+  auto jit = JIT::create(opt_level, cache_dir ? cache_dir : "");
+  if (!jit)
+    return reportError<void>(jit.takeError());
+  return jit->release();
+}
+
+void ksc_jit_destroy(void* jit) {
+  delete static_cast<JIT*>(jit);
+}
+
+// Compiles ks source text: returns jit on success
+void* ksc_jit_add_source(void* jit, const char* source, const char* filename) {
+  if (auto err = static_cast<JIT*>(jit)->addSource(source, filename))
+    return reportError<void>(std::move(err));
+  return jit;
+}
+
+// The address of the compiled function with the given mangled name
+void* ksc_jit_lookup(void* jit, const char* name) {
+  auto addr = static_cast<JIT*>(jit)->lookup(name);
+  if (!addr)
+    return reportError<void>(addr.takeError());
+  return *addr;
+}
+
+const char* ksc_jit_last_error() {
+  return lastError.c_str();
+}
+
+}
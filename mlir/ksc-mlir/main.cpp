@@ -1,9 +1,8 @@
 #include <iostream>
-#include <fstream>
 
 #include "Parser/Parser.h"
 #include "Parser/MLIR.h"
-#include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
+#include "Parser/JIT.h"
 
 using namespace Knossos::AST;
 using namespace Knossos::MLIR;
@@ -25,12 +24,60 @@ enum class Action {
   TEST,
   EMIT_AST,
   EMIT_MLIR,
-  EMIT_LLVM
+  EMIT_LLVM,
+  JIT
 };
 
 void help() {
   cout << "Unit Test Syntax: ksc-mlir TEST [-v(v(v))]\n";
-  cout << " Compiler Syntax: ksc-mlir AST|MLIR|LLVM [-v(v(v))] <filename.ks>\n";
+  cout << " Compiler Syntax: ksc-mlir AST|MLIR|LLVM|JIT [-v(v(v))] [-O0|-O1|-O2|-O3] [-time] [-parallel] [-cache <dir>] <filename.ks>\n";
+  cout << "   -O<n>         optimize the LLVM output at level n (default -O0)\n";
+  cout << "   -time         report the time taken by each pass of the LLVM lowering\n";
+  cout << "   -parallel     build the MLIR of each definition on its own thread\n";
+  cout << "   JIT           compile in-process, then run main and print its result\n";
+  cout << "   -cache <dir>  keep the JIT's object code in dir, for later runs\n";
+}
+
+// Compile code in-process, then call its main (which takes no arguments)
+// and print the result
+static int runJIT(Parser &p, string const& code, llvm::StringRef filename,
+                  int optlevel, string const& cacheDir) {
+  const Definition* mainDef = nullptr;
+  for (auto &op: llvm::cast<Block>(p.getRootNode())->getOperands())
+    if (auto def = llvm::dyn_cast<Definition>(op.get()))
+      if (def->getMangledName() == "main")
+        mainDef = def;
+  if (!mainDef) {
+    cerr << "ERROR: JIT needs a function main with no arguments\n";
+    return 1;
+  }
+
+  auto jit = Knossos::MLIR::JIT::create(optlevel, cacheDir);
+  llvm::Error err = jit ? (*jit)->addSource(code, filename) : jit.takeError();
+  if (err) {
+    cerr << "ERROR: JIT compilation failed: " << llvm::toString(std::move(err)) << "\n";
+    return 1;
+  }
+  auto addr = (*jit)->lookup("main");
+  if (!addr) {
+    cerr << "ERROR: " << llvm::toString(addr.takeError()) << "\n";
+    return 1;
+  }
+
+  switch (mainDef->getType().getValidType()) {
+  case Type::Integer:
+    cout << reinterpret_cast<int64_t (*)()>(*addr)() << "\n";
+    return 0;
+  case Type::Float:
+    cout << reinterpret_cast<double (*)()>(*addr)() << "\n";
+    return 0;
+  case Type::Bool:
+    cout << (reinterpret_cast<bool (*)()>(*addr)() ? "true" : "false") << "\n";
+    return 0;
+  default:
+    cerr << "ERROR: JIT can only print a main which returns a scalar\n";
+    return 1;
+  }
 }
 
 int main(int argc, char **argv) {
@@ -55,6 +102,8 @@ int main(int argc, char **argv) {
     action = Action::EMIT_MLIR;
   else if (aStr == "LLVM")
     action = Action::EMIT_LLVM;
+  else if (aStr == "JIT")
+    action = Action::JIT;
   if (action == Action::NONE) {
     cout << "Invalid action!\n";
     help();
@@ -62,7 +111,10 @@ int main(int argc, char **argv) {
   }
 
   int verbosity = 0;
-  if (nextarg < argc && argv[nextarg][0] == '-') {
+  bool timing = false;
+  bool parallel = false;
+  string cacheDir;
+  while (nextarg < argc && argv[nextarg][0] == '-') {
     string arg(argv[nextarg++]);
     if (arg == "-v")
       verbosity = 1;
@@ -70,6 +122,14 @@ int main(int argc, char **argv) {
       verbosity = 2;
     else if (arg == "-vvv")
       verbosity = 3;
+    else if (arg.size() == 3 && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3')
+      optlevel = arg[2] - '0';
+    else if (arg == "-time")
+      timing = true;
+    else if (arg == "-parallel")
+      parallel = true;
+    else if (arg == "-cache" && nextarg < argc)
+      cacheDir = argv[nextarg++];
     else {
       std::cerr << "ksc-mlir: bad switch [" << arg << "]" << std::endl;
       return 2;
@@ -97,19 +157,17 @@ int main(int argc, char **argv) {
          << ". Must be [ks, kso, mlir]\n";
     return 1;
   }
-  ifstream file(filename.str());
-  if (!file.is_open()) {
+  // Large files are mapped rather than read
+  auto buffer = llvm::MemoryBuffer::getFile(filename);
+  if (!buffer) {
     cerr << "Invalid filename [" << filename.str() << "]!\n";
     help();
     return 1;
   }
+  llvm::StringRef code = (*buffer)->getBuffer();
 
-  // Read whole file into a string
-  // TODO: Don't
-  string code((istreambuf_iterator<char>(file)),istreambuf_iterator<char>());
-
-  // Parse and output AST if requested
-  Parser p(Location {filename.str(), 1, 0}, code, verbosity);
+  // Parse and output AST if requested (p keeps the buffer, so code stays valid)
+  Parser p(Location {filename, 1, 0}, std::move(*buffer), verbosity);
   if (source == Source::KSC) {
     p.parse();
     if (!p.getRootNode()) {
@@ -123,20 +181,25 @@ int main(int argc, char **argv) {
     }
   }
 
-  // FIXME: registering dialects must happen before building the context
-  // Create a more logical API that doesn't require it to be done by the caller
+  if (action == Action::JIT) {
+    if (source != Source::KSC) {
+      cerr << "ERROR: JIT needs a ks source file\n";
+      return 1;
+    }
+    return runJIT(p, code.str(), filename, optlevel, cacheDir);
+  }
+
   mlir::MLIRContext context;
-  mlir::registerAllDialects(context);
-  mlir::registerLLVMDialectTranslation(context);
-  context.loadDialect<mlir::StandardOpsDialect, mlir::math::MathDialect>();
+  Generator::loadDialects(context);
 
   // Call generator and print output (MLIR/LLVM)
   Generator g(context);
+  g.setParallel(parallel);
   mlir::ModuleOp module;
   if (source == Source::KSC)
     module = g.build(p.getExtraDecls(), p.getRootNode());
   else if (source == Source::MLIR)
-    module = g.build(code);
+    module = g.build(code.str());
 
   if (!module) {
     cerr << "ERROR: MLIR lowering failed\n";
@@ -147,7 +210,7 @@ int main(int argc, char **argv) {
   } 
   else if (action == Action::EMIT_LLVM) {
     llvm::LLVMContext llvmContext;
-    auto llvm = g.emitLLVM(optlevel, llvmContext);
+    auto llvm = g.emitLLVM(optlevel, llvmContext, timing);
     if (!llvm) {
       cerr << "ERROR: LLVM lowering failed\n";
       return 1;
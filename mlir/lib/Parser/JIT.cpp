@@ -0,0 +1,155 @@
+/* Copyright Microsoft Corp. 2020 */
+#include "Parser/JIT.h"
+#include "Parser/MLIR.h"
+#include "Parser/Parser.h"
+
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace Knossos::MLIR;
+using namespace std;
+
+//============================================================ Object cache
+
+namespace {
+
+// Object files in a directory, named by module identifier, which the JIT
+// sets to a hash of the module
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string dir;
+
+  std::string path(const llvm::Module *m) const {
+    llvm::SmallString<128> p(dir);
+    llvm::sys::path::append(p, m->getModuleIdentifier() + ".o");
+    return p.str().str();
+  }
+
+public:
+  explicit DiskObjectCache(std::string dir) : dir(std::move(dir)) {}
+
+  void notifyObjectCompiled(const llvm::Module *m, llvm::MemoryBufferRef obj) override {
+    // Write to a file of our own then rename, so that a concurrent reader
+    // sees all or nothing, and concurrent writers don't share a file
+    std::string file = path(m);
+    int fd;
+    llvm::SmallString<128> tmp;
+    if (llvm::sys::fs::createUniqueFile(file + ".%%%%%%.tmp", fd, tmp))
+      return;
+    {
+      llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+      out << obj.getBuffer();
+    }
+    if (llvm::sys::fs::rename(tmp, file))
+      llvm::sys::fs::remove(tmp);
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *m) override {
+    auto buf = llvm::MemoryBuffer::getFile(path(m));
+    if (!buf)
+      return nullptr;
+    return std::move(*buf);
+  }
+};
+
+llvm::Error makeError(llvm::Twine const& message) {
+  return llvm::make_error<llvm::StringError>(message, llvm::inconvertibleErrorCode());
+}
+
+} // namespace
+
+//============================================================ JIT
+
+llvm::Expected<std::unique_ptr<JIT>> JIT::create(int optLevel, std::string const& cacheDir) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  std::unique_ptr<llvm::ObjectCache> cache;
+  if (!cacheDir.empty()) {
+    if (auto ec = llvm::sys::fs::create_directories(cacheDir))
+      return makeError("Cannot create JIT cache directory " + cacheDir + ": " + ec.message());
+    cache = std::make_unique<DiskObjectCache>(cacheDir);
+  }
+  std::unique_ptr<JIT> ret(new JIT(optLevel, std::move(cache)));
+
+  auto tmBuilder = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!tmBuilder)
+    return tmBuilder.takeError();
+  ret->target = tmBuilder->getCPU() + "\n" + tmBuilder->getFeatures().getString();
+  tmBuilder->setCodeGenOptLevel(optLevel > 2 ? llvm::CodeGenOpt::Aggressive
+                                : optLevel > 0 ? llvm::CodeGenOpt::Default
+                                : llvm::CodeGenOpt::None);
+
+  auto objectCache = ret->cache.get();
+  auto compiler = [objectCache](llvm::orc::JITTargetMachineBuilder jtmb)
+      -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+    auto tm = jtmb.createTargetMachine();
+    if (!tm)
+      return tm.takeError();
+    return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*tm), objectCache);
+  };
+  auto jit = llvm::orc::LLJITBuilder()
+                 .setJITTargetMachineBuilder(std::move(*tmBuilder))
+                 .setCompileFunctionCreator(compiler)
+                 .create();
+  if (!jit)
+    return jit.takeError();
+  ret->jit = std::move(*jit);
+
+  // Resolve malloc, the math library, and any edefs, in this process
+  auto &dylib = ret->jit->getMainJITDylib();
+  auto generator = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      ret->jit->getDataLayout().getGlobalPrefix());
+  if (!generator)
+    return generator.takeError();
+  dylib.addGenerator(std::move(*generator));
+
+  return std::move(ret);
+}
+
+llvm::Error JIT::addSource(std::string const& source, llvm::StringRef filename) {
+  AST::Parser p(AST::Location {filename.str(), 1, 0}, source, 0);
+  p.parse();
+  if (!p.getRootNode())
+    return makeError("AST lowering failed");
+
+  mlir::MLIRContext context;
+  Generator::loadDialects(context);
+  Generator g(context);
+  g.setParallel(true);
+  if (!g.build(p.getExtraDecls(), p.getRootNode()))
+    return makeError("MLIR lowering failed");
+
+  auto llvmContext = std::make_unique<llvm::LLVMContext>();
+  auto module = g.emitLLVM(optLevel, *llvmContext);
+  if (!module)
+    return makeError("LLVM lowering failed");
+  module->setDataLayout(jit->getDataLayout());
+  module->setTargetTriple(jit->getTargetTriple().str());
+
+  // The cache key covers everything which determines the object code,
+  // including the host CPU and its features, which the IR doesn't mention
+  if (cache) {
+    std::string ir;
+    llvm::raw_string_ostream os(ir);
+    os << "opt" << optLevel << "\n" << target << "\n";
+    module->print(os, nullptr);
+    os.flush();
+    module->setModuleIdentifier(llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(ir))));
+  }
+
+  return jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(module), std::move(llvmContext)));
+}
+
+llvm::Expected<void*> JIT::lookup(llvm::StringRef name) {
+  auto sym = jit->lookup(name);
+  if (!sym)
+    return sym.takeError();
+  return reinterpret_cast<void*>(sym->getAddress());
+}
@@ -2,6 +2,10 @@
 /* Copyright Microsoft Corp. 2020 */
 #include <iostream>
 #include <iomanip>
+#include <mutex>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSet.h"
 
 #include "Parser/Lexer.h"
 #include "Parser/Assert.h"
@@ -9,15 +13,35 @@
 using namespace std;
 
 namespace Knossos { namespace AST {
+llvm::StringRef internFilename(llvm::StringRef filename)
+{
+  static std::mutex mutex;
+  static llvm::StringSet<> filenames;
+  std::lock_guard<std::mutex> lock(mutex);
+  return filenames.insert(filename).first->getKey();
+}
+
 std::ostream& Location::dump(std::ostream& s) const
 {
-  return s << *filename << ":" << line << ":" << column;
+  return s << filename.str() << ":" << line << ":" << column;
 }
 
 //================================================ Lex source into Tokens
 
 Lexer::Lexer(Location const& loc, std::string const& code)
-    : code(code)
+    : ownedCode(code)
+    , code(ownedCode)
+    , len(this->code.size())
+    , loc(loc)
+    , pos(0)
+    , depth(0)
+    , verbosity(0)
+{
+}
+
+Lexer::Lexer(Location const& loc, std::unique_ptr<llvm::MemoryBuffer> buffer)
+    : buffer(std::move(buffer))
+    , code(this->buffer->getBuffer())
     , len(code.size())
     , loc(loc)
     , pos(0)
@@ -51,20 +75,15 @@ bool isValidIdentifierChar(char c)
     return chars.find(c) != std::string::npos; 
 }
 
-// Lex a token out, recurse if another entry point is found
-Token::Ptr Lexer::lex(char c)
+// Lex the next token at this depth, recursing into brackets, or return null
+// at the closing bracket (which is left for the caller) or end of file
+Token::Ptr Lexer::lexNext()
 {
-  ++depth;
-  Token* tok = new Token(loc, c);
-  char expected_closing_bracket = (c == 0) ? 0 : (c == '(') ? ')' : ']';
   while (pos < len) {
     char next = peek();
-    if (next == ')' || next == ']') {
-      ASSERT(next == expected_closing_bracket) << "\n" 
-        << loc << ": Mismatched bracket: expected " << expected_closing_bracket << ", saw " << next << std::endl;
-      break;
-    }
-        
+    if (next == ')' || next == ']')
+      return nullptr;
+
     Location cloc = loc;
     char c = get();
     switch (c) {
@@ -80,10 +99,7 @@ Token::Ptr Lexer::lex(char c)
         } while (c != '"');
 
         // Strings need to capture the quotes, too
-        auto str = code.substr(start, pos - start);
-        auto child = make_unique<Token>(cloc, str);
-        tok->addChild(move(child));
-        break;
+        return makeToken(cloc, code.substr(start, pos - start));
     }
 
     case ';': {
@@ -111,9 +127,9 @@ Token::Ptr Lexer::lex(char c)
     case '[':
     case '(': {
       // Recurse into sub-tokens
-      tok->addChild(lex(c));
+      Token::Ptr tok = lex(c);
       c = get();
-      break;
+      return tok;
     }
 
     case '\n':
@@ -128,8 +144,7 @@ Token::Ptr Lexer::lex(char c)
         auto start = pos-1;
         while (isValidIdentifierChar(peek()))
           get();
-        auto t = make_unique<Token>(cloc, code.substr(start, pos - start));
-        tok->addChild(move(t));
+        return makeToken(cloc, code.substr(start, pos - start));
       }
       else
         ASSERT(0) << "\n" << cloc << ": Unhandled character [" << c << "], code " << (0xff & c) 
@@ -137,9 +152,44 @@ Token::Ptr Lexer::lex(char c)
         // Should restore stream flags, but exiting anyway.  Wow, ostream formatting...
     }
   }
+  return nullptr;
+}
+
+void Lexer::checkClosingBracket(char c)
+{
+  char expected_closing_bracket = (c == 0) ? 0 : (c == '(') ? ')' : ']';
+  if (pos < len) {
+    char next = peek();
+    ASSERT(next == expected_closing_bracket) << "\n" 
+      << loc << ": Mismatched bracket: expected " << expected_closing_bracket << ", saw " << next << std::endl;
+  }
+}
+
+// Lex a token out, recurse if another entry point is found
+Token::Ptr Lexer::lex(char c)
+{
+  ++depth;
+  Location tokloc = loc;
+  llvm::SmallVector<Token::Ptr, 8> children;
+  while (Token::Ptr child = lexNext())
+    children.push_back(child);
+  checkClosingBracket(c);
+
+  // The children move to the arena, once there are no more of them
+  Token::Ptr* array = arena.Allocate<Token::Ptr>(children.size());
+  std::uninitialized_copy(children.begin(), children.end(), array);
+  Token::Ptr tok = makeToken(tokloc, c, llvm::ArrayRef<Token::Ptr>(array, children.size()));
   if (verbosity+1 > (int)depth) tok->dump(std::cerr << std::string(depth, '-'), depth) << "\n";
   --depth;
-  return Token::Ptr(tok);
+  return tok;
+}
+
+Token::Ptr Lexer::lexTopLevel()
+{
+  Token::Ptr tok = lexNext();
+  if (!tok)
+    checkClosingBracket(0);
+  return tok;
 }
 
 
@@ -157,14 +207,14 @@ Token::ppresult Token::pprint(Token const* tok, int indent, int width)
   const int tab = 2;
 
   if (tok->isValue)
-    return {tok->getValue().data(), tok->getValue().size()};
+    return {tok->getValue().str(), tok->getValue().size()};
 
   int mywidth = 1; // for parens
   int maxwidth = 0;
   bool first = true;
   std::vector<std::string> strs;
-  for (auto& t : tok->children) {
-    ppresult p = pprint(t.get(), indent+tab, width);
+  for (auto t : tok->children) {
+    ppresult p = pprint(t, indent+tab, width);
     if ((int)p.width > maxwidth)
       maxwidth = p.width;
     mywidth += (first ? 0 : 1) + p.width;
@@ -3,17 +3,29 @@
 #include <iostream>
 
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Casting.h"
+#include "llvm/Support/Parallel.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/IR/PassTimingInfo.h"
 
 #include "mlir/IR/Verifier.h"
 #include "mlir/Dialect/StandardOps/IR/Ops.h"
+#include "mlir/Dialect/SCF/SCF.h"
+#include "mlir/Dialect/Affine/IR/AffineOps.h"
+#include "mlir/Dialect/Affine/Passes.h"
 #include "mlir/IR/Attributes.h"
 #include "mlir/IR/Dialect.h"
 #include "mlir/Transforms/Passes.h"
 #include "mlir/Parser.h"
+#include "mlir/Conversion/AffineToStandard/AffineToStandard.h"
+#include "mlir/Conversion/SCFToStandard/SCFToStandard.h"
 #include "mlir/Conversion/StandardToLLVM/ConvertStandardToLLVMPass.h"
+#include "mlir/Conversion/VectorToLLVM/ConvertVectorToLLVM.h"
+#include "mlir/Conversion/VectorToSCF/VectorToSCF.h"
+#include "mlir/ExecutionEngine/OptUtils.h"
 #include "mlir/Target/LLVMIR/ModuleTranslation.h"
 #include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
 #include "mlir/Pass/Pass.h"
@@ -25,7 +37,18 @@ using namespace std;
 
 //============================================================ Helpers
 
-Generator::Generator(mlir::MLIRContext &context) : context(context), builder(&context), UNK(builder.getUnknownLoc()) {
+Generator::Generator(mlir::MLIRContext &context) : context(context), builder(&context), UNK(builder.getUnknownLoc()), functions(ownFunctions) {
+}
+
+Generator::Generator(mlir::MLIRContext &context, std::map<std::string, mlir::FuncOp> &functions)
+    : context(context), builder(&context), UNK(builder.getUnknownLoc()), functions(functions) {
+}
+
+void Generator::loadDialects(mlir::MLIRContext &context) {
+  mlir::registerAllDialects(context);
+  mlir::registerLLVMDialectTranslation(context);
+  context.loadDialect<mlir::StandardOpsDialect, mlir::math::MathDialect,
+                      mlir::scf::SCFDialect, mlir::AffineDialect>();
 }
 
 // Convert from AST type to MLIR
@@ -39,13 +62,23 @@ Types Generator::ConvertType(const AST::Type &type, size_t dim) {
     return {builder.getIntegerType(64)};
   case AST::Type::Float:
     return {builder.getF64Type()};
-  case AST::Type::Vector:
-    // FIXME: support nested vectors
-    assert(!type.getSubType().isVector());
-    if (dim)
-      return {mlir::MemRefType::get(dim, ConvertType(type.getSubType())[0])};
-    else
-      return {mlir::MemRefType::get(-1, ConvertType(type.getSubType())[0])};
+  case AST::Type::Vector: {
+    // Vectors of tuples are a memref for each (flattened) element of the
+    // tuple, and nested vectors are one memref of higher rank, so
+    // (Vec (Tuple Float (Vec Integer))) is memref<?xf64>, memref<?x?xi64>
+    int64_t size = dim ? dim : -1;
+    Types vecTys;
+    for (auto ty: ConvertType(type.getSubType())) {
+      if (auto memref = ty.dyn_cast<mlir::MemRefType>()) {
+        llvm::SmallVector<int64_t, 4> shape {size};
+        shape.append(memref.getShape().begin(), memref.getShape().end());
+        vecTys.push_back(mlir::MemRefType::get(shape, memref.getElementType()));
+      } else {
+        vecTys.push_back(mlir::MemRefType::get(size, ty));
+      }
+    }
+    return vecTys;
+  }
   case AST::Type::Tuple: {
     // FIXME: support nested tuples
     Types subTys;
@@ -66,16 +99,40 @@ Types Generator::ConvertType(const AST::Type &type, size_t dim) {
   }
 }
 
-// Cast to memref<?xTy> from any static type, so that we can call functions
+// Cast to memref<?x...xTy> from any static type, so that we can call functions
 // that have vectors as arguments (as they're all unknwon size)
 mlir::Value Generator::memrefCastForCall(mlir::Value orig) {
   assert(orig.getType().isa<mlir::MemRefType>());
   auto type = orig.getType().cast<mlir::MemRefType>();
   auto subTy = type.getElementType();
-  auto newTy = mlir::MemRefType::get(-1, subTy);
+  llvm::SmallVector<int64_t, 4> shape(type.getRank(), -1);
+  auto newTy = mlir::MemRefType::get(shape, subTy);
   return builder.create<mlir::MemRefCastOp>(UNK, orig, newTy);
 }
 
+// Whether a value is a memref with any dimension of static size
+static bool hasStaticDim(mlir::Value v) {
+  auto type = v.getType().dyn_cast<mlir::MemRefType>();
+  return type && llvm::any_of(type.getShape(), [](int64_t d) { return d != -1; });
+}
+
+// The number of values an AST type is lowered to: tuples and vectors of
+// tuples have one for each element
+size_t Generator::numValues(const AST::Type &type) {
+  return ConvertType(type).size();
+}
+
+// The values of element idx (from zero) of a tuple, whose values are vals
+Values Generator::tupleElement(const AST::Type &type, Values const& vals, size_t idx) {
+  assert(type.isTuple() && idx < type.getSubTypes().size());
+  size_t first = 0;
+  for (size_t i = 0; i < idx; i++)
+    first += numValues(type.getSubType(i));
+  size_t count = numValues(type.getSubType(idx));
+  assert(first + count <= vals.size());
+  return Values(vals.begin() + first, vals.begin() + first + count);
+}
+
 // Tuple arguments are serialised, but still accessed by the tuple name (via
 // get), so we need to add the same number of arguments as the function
 // declaration (flattened tuple), with each argument as a value of the tuple.
@@ -91,30 +148,22 @@ void Generator::serialiseArgs(const AST::Definition *def, mlir::Block &entry) {
   for (auto &arg: def->getArguments()) {
     auto var = llvm::dyn_cast<AST::Variable>(arg.get());
     assert(var && idx <= last);
-    // Non-tuple args are simple
-    if (!var->getType().isTuple()) {
-      declareVariable(var->getName(), {serialised[idx++]});
-      continue;
-    }
-
-    // Tuples need to know how many arguments, recursively, they have
-    auto type = ConvertType(arg->getType());
+    // Tuples (and vectors of tuples) need to know how many arguments,
+    // recursively, they have
     Values args;
-    size_t end = idx + type.size();
+    size_t end = idx + numValues(arg->getType());
     while (idx < end)
       args.push_back(serialised[idx++]);
     declareVariable(var->getName(), args);
-    idx += type.size();
   }
 }
 
-// Inefficient but will do for now
-static void dedup_declarations(vector<mlir::FuncOp> &decl, vector<mlir::FuncOp> def) {
-  for (auto &d: def) {
-    auto it = std::find(decl.begin(), decl.end(), d);
-    if (it != decl.end())
-      decl.erase(it);
-  }
+// Removes the declarations which also have definitions, keeping the order
+static void dedup_declarations(vector<mlir::FuncOp> &decl, vector<mlir::FuncOp> const& def) {
+  llvm::DenseSet<mlir::Operation*> defined;
+  for (auto d: def)
+    defined.insert(d.getOperation());
+  llvm::erase_if(decl, [&](mlir::FuncOp d) { return defined.count(d.getOperation()); });
 }
 
 // Helpers for number conversion
@@ -151,14 +200,26 @@ void Generator::buildGlobal(const AST::Block* block) {
   // FIXME: Find a way to use the functions map instead
   vector<mlir::FuncOp> declarations;
   vector<mlir::FuncOp> definitions;
+  vector<const AST::Definition*> parallelDefs;
+  bool buildInParallel = parallel && context.isMultithreadingEnabled();
   for (auto &op: block->getOperands()) {
     switch (op->kind) {
     case AST::Expr::Kind::Declaration:
       declarations.push_back(buildDecl(llvm::dyn_cast<AST::Declaration>(op.get())));
       continue;
-    case AST::Expr::Kind::Definition:
-      definitions.push_back(buildDef(llvm::dyn_cast<AST::Definition>(op.get())));
+    case AST::Expr::Kind::Definition: {
+      auto def = llvm::dyn_cast<AST::Definition>(op.get());
+      if (!buildInParallel) {
+        definitions.push_back(buildDef(def));
+        continue;
+      }
+      // Only declare it for now, so that every body can call it
+      if (!functions.count(def->getMangledName()))
+        buildDecl(def->getDeclaration());
+      definitions.push_back(functions[def->getMangledName()]);
+      parallelDefs.push_back(def);
       continue;
+    }
     case AST::Expr::Kind::Rule:
       // Ignore rules for now
       continue;
@@ -167,6 +228,14 @@ void Generator::buildGlobal(const AST::Block* block) {
     }
   }
 
+  // The functions are not yet in the module, and the generators only read
+  // the declarations of the others, so each body can be built separately
+  if (buildInParallel)
+    llvm::parallelForEachN(0, parallelDefs.size(), [&](size_t i) {
+      Generator g(context, functions);
+      g.buildBody(parallelDefs[i], definitions[i]);
+    });
+
   // Types were already checked by the AST, so if there's an
   // outline declaration already, we only insert the definition.
   dedup_declarations(declarations, definitions);
@@ -212,7 +281,11 @@ mlir::FuncOp Generator::buildDef(const AST::Definition* def) {
 
   auto func = functions[def->getMangledName()];
   assert(func);
+  buildBody(def, func);
+  return func;
+}
 
+void Generator::buildBody(const AST::Definition* def, mlir::FuncOp func) {
   // First basic block, with args
   auto &entryBlock = *func.addEntryBlock();
   builder.setInsertionPointToStart(&entryBlock);
@@ -224,7 +297,6 @@ mlir::FuncOp Generator::buildDef(const AST::Definition* def) {
 
   // Return the last value
   builder.create<mlir::ReturnOp>(UNK, last);
-  return func;
 }
 
 // Declare a variable
@@ -348,17 +420,29 @@ Values Generator::buildCall(const AST::Call* call) {
 #undef CREATE_CMP
 
   if (MATCH_2("index", Integer, Vector)) {
-    auto idx = buildArg(call,0);
-    auto vec = buildArg(call,1);
-    auto indTy = builder.getIndexType();
-    auto indIdx = builder.create<mlir::IndexCastOp>(UNK, idx, indTy);
-    mlir::ValueRange rangeIdx {indIdx};
-    return {builder.create<mlir::LoadOp>(UNK, vec, rangeIdx)};
+    // Nested indexing, (index j (index i m)), loads directly from the
+    // higher rank memref of m, rather than copying its row i
+    llvm::SmallVector<const AST::Expr*, 4> idxExprs {call->getOperand(0)};
+    const AST::Expr* vecExpr = call->getOperand(1);
+    while (auto inner = llvm::dyn_cast<AST::Call>(vecExpr)) {
+      if (!(inner->size() == 2 && inner->getDeclaration()->getName() == "index" &&
+            inner->getOperand(0)->getType() == AST::Type::Integer &&
+            inner->getOperand(1)->getType() == AST::Type::Vector))
+        break;
+      idxExprs.insert(idxExprs.begin(), inner->getOperand(0));
+      vecExpr = inner->getOperand(1);
+    }
+    Values indices;
+    for (auto e: idxExprs)
+      indices.push_back(builder.create<mlir::IndexCastOp>(UNK, Single(buildNode(e)),
+                                                         builder.getIndexType()));
+    auto vec = buildNode(vecExpr);
+    return buildElement({}, vec, indices);
   }
 
   if (MATCH_1("size", Vector)) {
-    auto vec = buildArg(call,0);
-    // FIXME: Support multi-dimensional vectors
+    // All the memrefs of a vector of tuples have the same size
+    auto vec = buildNode(call->getOperand(0))[0];
     auto dim = builder.create<mlir::DimOp>(UNK, vec, 0);
     auto intTy = builder.getIntegerType(64);
     return {builder.create<mlir::IndexCastOp>(UNK, dim, intTy)};
@@ -381,7 +465,8 @@ Values Generator::buildCall(const AST::Call* call) {
 #undef CREATE_2
 
   // Function call -- not a prim, should be known
-  mlir::FuncOp func = functions[name_mangled];
+  auto found = functions.find(name_mangled);
+  mlir::FuncOp func = found == functions.end() ? nullptr : found->second;
   ASSERT(!!func) << "Unknown function " << name << ", mangled name " << name_mangled;
 
   // Operands (tuples expand into individual operands)
@@ -392,17 +477,14 @@ Values Generator::buildCall(const AST::Call* call) {
       continue;
     }
 
-    auto range = buildNode(arg.get());
-    // Tuples
-    if (range.size() > 1)
-      operands.append(range.begin(), range.end());
-    // Static vectors need to be made dynamic
-    else if (Single(range).getType().isa<mlir::MemRefType>() &&
-              Single(range).getType().cast<mlir::MemRefType>().getDimSize(0) != -1)
-      operands.push_back(memrefCastForCall(Single(range)));
-    // Everything else
-    else
-      operands.push_back(Single(range));
+    // Tuples expand into several operands, and static vectors need to be
+    // made dynamic
+    for (auto v: buildNode(arg.get())) {
+      if (hasStaticDim(v))
+        operands.push_back(memrefCastForCall(v));
+      else
+        operands.push_back(v);
+    }
   }
   assert(func.getNumArguments() == operands.size() && "Arguments mismatch");
 
@@ -417,9 +499,11 @@ Values Generator::buildLet(const AST::Let* let) {
   auto init = buildNode(binding.getInit());
   if (binding.isTupleUnpacking()) {
     size_t tupleSize = binding.getTupleVariables().size();
-    assert(init.size() == tupleSize);
+    auto tupleType = binding.getInit()->getType();
+    assert(init.size() == numValues(tupleType));
     for (size_t ii = 0; ii != tupleSize; ++ii) {
-      declareVariable(binding.getTupleVariable(ii)->getName(), {init[ii]});
+      declareVariable(binding.getTupleVariable(ii)->getName(),
+                      tupleElement(tupleType, init, ii));
     }
   } else {
     declareVariable(binding.getVariable()->getName(), init);
@@ -456,92 +540,117 @@ Values Generator::buildCond(const AST::Condition* cond) {
   return mlir::ValueRange{rets};
 }
 
-// Builds loops creating vectors
-// FIXME: Use loop.for dialect
+// Whether expr refers to the variable name anywhere (even where it is
+// shadowed, which only makes this conservative)
+static bool usesVariable(const AST::Expr* expr, llvm::StringRef name) {
+  auto uses = [name](const AST::Expr* e) { return usesVariable(e, name); };
+  auto anyUses = [&](llvm::ArrayRef<AST::Expr::Ptr> es) {
+    return llvm::any_of(es, [&](const AST::Expr::Ptr& e) { return uses(e.get()); });
+  };
+  if (auto var = llvm::dyn_cast<AST::Variable>(expr))
+    return var->getName() == name;
+  if (auto block = llvm::dyn_cast<AST::Block>(expr))
+    return anyUses(block->getOperands());
+  if (auto call = llvm::dyn_cast<AST::Call>(expr))
+    return anyUses(call->getOperands());
+  if (auto let = llvm::dyn_cast<AST::Let>(expr))
+    return uses(let->getBinding().getInit()) || uses(let->getExpr());
+  if (auto cond = llvm::dyn_cast<AST::Condition>(expr))
+    return uses(cond->getCond()) || uses(cond->getIfBlock()) || uses(cond->getElseBlock());
+  if (auto build = llvm::dyn_cast<AST::Build>(expr))
+    return uses(build->getRange()) || uses(build->getExpr());
+  if (auto tuple = llvm::dyn_cast<AST::Tuple>(expr))
+    return anyUses(tuple->getElements());
+  if (auto get = llvm::dyn_cast<AST::Get>(expr))
+    return uses(get->getExpr());
+  if (auto fold = llvm::dyn_cast<AST::Fold>(expr))
+    return uses(fold->getInit()) || uses(fold->getVector()) || uses(fold->getBody());
+  return false;
+}
+
+// Builds loops creating vectors.  A build whose body is another build (of
+// a size which doesn't depend on the outer index) creates one memref of
+// higher rank, in a loop nest, and a build of tuples creates a memref for
+// each element of the tuple.
 Values Generator::buildBuild(const AST::Build* b) {
-  // Declare the bounded vector variable and allocate it
-  auto dim = Single(buildNode(b->getRange()));
+  llvm::SmallVector<const AST::Build*, 4> nest {b};
+  while (nest.back()->getExpr()->getType().isVector()) {
+    auto inner = llvm::dyn_cast<AST::Build>(nest.back()->getExpr());
+    ASSERT(inner) << "Vectors of vectors can only be lowered from nested builds";
+    for (auto outer: nest)
+      ASSERT(!usesVariable(inner->getRange(), outer->getVariable()->getName()))
+          << "Vectors of vectors must be rectangular: the size of the inner build"
+          << " depends on " << outer->getVariable()->getName();
+    nest.push_back(inner);
+  }
+
+  // Declare the bounded vector variables and allocate them
   auto indTy = builder.getIndexType();
-  auto dimIdx = builder.create<mlir::IndexCastOp>(UNK, dim, indTy);
-  auto elmTy = Single(ConvertType(b->getExpr()->getType()));
-  auto ivTy = dim.getType();
-  auto vecTy = mlir::MemRefType::get(-1, elmTy);
-  mlir::ValueRange dimArg {dimIdx};
-  auto vec = builder.create<mlir::AllocOp>(UNK, vecTy, dimArg);
-
-  // Declare the range, initialised with zero
-  auto zeroAttr = builder.getIntegerAttr(ivTy, 0);
-  auto zero = builder.create<mlir::ConstantOp>(UNK, ivTy, zeroAttr);
-  auto range = Single(buildNode(b->getRange()));
-
-  // Create all basic blocks and the condition
-  auto headBlock = currentFunc.addBlock();
-  headBlock->addArgument(ivTy);
-  auto bodyBlock = currentFunc.addBlock();
-  bodyBlock->addArgument(ivTy);
-  auto exitBlock = currentFunc.addBlock();
-  mlir::ValueRange indArg {zero};
-  builder.create<mlir::BranchOp>(UNK, headBlock, indArg);
-
-  // HEAD BLOCK: Compare induction with range, exit if equal or greater
-  builder.setInsertionPointToEnd(headBlock);
-  auto headIv = headBlock->getArgument(0);
-  auto cond = builder.create<mlir::CmpIOp>(UNK, mlir::CmpIPredicate::slt,
-                                           headIv, range);
-  mlir::ValueRange bodyArg{headIv};
-  mlir::ValueRange exitArgs{};
-  builder.create<mlir::CondBranchOp>(UNK, cond, bodyBlock, bodyArg, exitBlock,
-                                     exitArgs);
-
-  // BODY BLOCK: Lowers expression, store and increment
-  builder.setInsertionPointToEnd(bodyBlock);
-  auto bodyIv = bodyBlock->getArgument(0);
-  // Declare the local induction variable before using in body
-  auto varName = b->getVariable()->getName();
-  declareVariable(varName, {zero});
-  variables[varName] = {bodyIv};
-  // Build body and store result (no vector of tuples supported)
-  auto expr = Single(buildNode(b->getExpr()));
-  auto indIv = builder.create<mlir::IndexCastOp>(UNK, bodyIv, indTy);
-  mlir::ValueRange indices{indIv};
-  builder.create<mlir::StoreOp>(UNK, expr, vec, indices);
-  // Increment induction and loop
-  auto oneAttr = builder.getIntegerAttr(ivTy, 1);
-  auto one = builder.create<mlir::ConstantOp>(UNK, ivTy, oneAttr);
-  auto incr = builder.create<mlir::AddIOp>(UNK, bodyIv, one);
-  mlir::ValueRange headArg {incr};
-  builder.create<mlir::BranchOp>(UNK, headBlock, headArg);
-
-  // EXIT BLOCK: change insertion point before returning the final vector
-  builder.setInsertionPointToEnd(exitBlock);
-  return {memrefCastForCall(vec)};
+  Values dims;
+  Types ivTys;
+  for (auto build: nest) {
+    auto dim = Single(buildNode(build->getRange()));
+    dims.push_back(builder.create<mlir::IndexCastOp>(UNK, dim, indTy));
+    ivTys.push_back(dim.getType());
+  }
+  auto expr = nest.back()->getExpr();
+  Values vecs;
+  for (auto elmTy: ConvertType(expr->getType())) {
+    ASSERT(!elmTy.isa<mlir::MemRefType>()) << "Vectors in tuples in vectors are not supported";
+    llvm::SmallVector<int64_t, 4> shape(dims.size(), -1);
+    auto vecTy = mlir::MemRefType::get(shape, elmTy);
+    vecs.push_back(builder.create<mlir::AllocOp>(UNK, vecTy, dims));
+  }
+
+  // Loop over the ranges, storing one element per innermost iteration
+  llvm::SmallVector<mlir::Operation*, 4> loops;
+  Values ivs;
+  for (size_t i = 0; i < nest.size(); i++) {
+    loops.push_back(buildLoop(dims[i], {}));
+    auto iv = loops.back()->getRegion(0).front().getArgument(0);
+    ivs.push_back(iv);
+    // Declare the local induction variable before using in body
+    declareVariable(nest[i]->getVariable()->getName(),
+                    {builder.create<mlir::IndexCastOp>(UNK, iv, ivTys[i])});
+  }
+  auto elms = buildNode(expr);
+  assert(elms.size() == vecs.size());
+  for (size_t i = 0; i < vecs.size(); i++)
+    buildStore(loops, elms[i], vecs[i], ivs);
+  for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop)
+    endLoop(*loop, {});
+
+  Values rets;
+  for (auto vec: vecs)
+    rets.push_back(memrefCastForCall(vec));
+  return rets;
 }
 
 // Builds tuple creation
 Values Generator::buildTuple(const AST::Tuple* t) {
-  auto type = ConvertType(t->getType());
   Values elms;
-  // Nested tuples are serialised into one long list
+  // Nested tuples (and vectors of tuples) are serialised into one long list
   for (auto &e: t->getElements()) {
-    elms.push_back(Single(buildNode(e.get())));
+    auto vals = buildNode(e.get());
+    elms.append(vals.begin(), vals.end());
   }
-  return mlir::ValueRange{elms};
+  return elms;
 }
 
 // Builds index access to tuples
 Values Generator::buildGet(const AST::Get* g) {
-  // A get on a variable, returns the Nth element declared
+  // A get on a variable, returns the values of the Nth element declared
   auto var = llvm::dyn_cast<AST::Variable>(g->getExpr());
   if (var) {
     auto tuple = variables[var->getName()];
-    return {tuple[g->getIndex()-1]};
+    return tupleElement(var->getType(), tuple, g->getIndex()-1);
   }
 
   // Calls return multiple values, we need to lower the call first
   auto call = llvm::dyn_cast<AST::Call>(g->getExpr());
   if (call) {
     auto res = buildNode(call);
-    return {res[g->getIndex()-1]};
+    return tupleElement(call->getType(), res, g->getIndex()-1);
   }
 
   // A get on a constant, just returns the element directly
@@ -549,7 +658,6 @@ Values Generator::buildGet(const AST::Get* g) {
 }
 
 // Builds fold
-// FIXME: use loop.for, common up with build
 Values Generator::buildFold(const AST::Fold* f) {
   // Fold needs a tuple of two variables: the accumulator and the induction
   auto v = f->getVector();
@@ -560,81 +668,133 @@ Values Generator::buildFold(const AST::Fold* f) {
   assert(v->getType() == AST::Type::Vector && "Bad vector type in fold");
   assert(v->getType().getSubType() == acc_x->getType().getSubType(1));
 
-  // We can't build the variable here yet because this is an SSA representation
-  // and the body will get the wrong reference, so we just initialise the
-  // accumulator (the element x will be initialised by the load block)
+  // The accumulator is carried from one iteration to the next by the loop
   auto init = Single(buildNode(f->getInit()));  // TODO: this doesn't support Tuple accumulator types
-
-  // Context variables: vector (and elm type), max, IV init to zero
-  auto ivTy = builder.getIntegerType(64);
-  auto accTy = init.getType();
-  auto elmTy = Single(ConvertType(acc_x->getType().getSubType(1)));
-  auto vec = Single(buildNode(v));
-  auto dim = builder.create<mlir::DimOp>(UNK, vec, 0);
-  auto max = builder.create<mlir::IndexCastOp>(UNK, dim, ivTy);
-  auto zeroAttr = builder.getIntegerAttr(ivTy, 0);
-  auto zero = builder.create<mlir::ConstantOp>(UNK, ivTy, zeroAttr);
-
-  // Create all basic blocks and the condition
-  auto headBlock = currentFunc.addBlock();
-  headBlock->addArgument(accTy);
-  headBlock->addArgument(ivTy);
-  auto loadBlock = currentFunc.addBlock();
-  loadBlock->addArgument(accTy);
-  loadBlock->addArgument(ivTy);
-  auto bodyBlock = currentFunc.addBlock();
-  bodyBlock->addArgument(accTy);
-  bodyBlock->addArgument(elmTy);
-  bodyBlock->addArgument(ivTy);
-  auto tailBlock = currentFunc.addBlock();
-  tailBlock->addArgument(accTy);
-  mlir::ValueRange indArg {init, zero};
-  builder.create<mlir::BranchOp>(UNK, headBlock, indArg);
-
-  // The head block only checks the condition, we can't load anything until
-  // we know that it's safe to do so (for example, empty vectors)
-  builder.setInsertionPointToEnd(headBlock);
-  auto headAcc = headBlock->getArgument(0);
-  auto headIv = headBlock->getArgument(1);
-  auto cond = builder.create<mlir::CmpIOp>(UNK, mlir::CmpIPredicate::slt,
-                                           headIv, max);
-  mlir::ValueRange loadArgs{headAcc, headIv};
-  mlir::ValueRange exitArgs{headAcc};
-  builder.create<mlir::CondBranchOp>(UNK, cond, loadBlock, loadArgs, tailBlock,
-                                     exitArgs);
-
-  // The load block just fetches the element from the vector and passes as
-  // a serialised tuple { acc, x } to the body. If got here, assume it's safe
-  // to load the element "loadIv" from the vector
-  builder.setInsertionPointToEnd(loadBlock);
-  auto loadAcc = loadBlock->getArgument(0);
-  auto loadIv = loadBlock->getArgument(1);
-  auto indTy = builder.getIndexType();
-  auto indIdx = builder.create<mlir::IndexCastOp>(UNK, loadIv, indTy);
-  mlir::ValueRange rangeIdx {indIdx};
-  auto loaded = builder.create<mlir::LoadOp>(UNK, vec, rangeIdx);
-  mlir::ValueRange loadArg {loadAcc, loaded, loadIv};
-  builder.create<mlir::BranchOp>(UNK, bodyBlock, loadArg);
-
-  // Loop over the body of the lambda
-  builder.setInsertionPointToEnd(bodyBlock);
-  auto bodyAcc = bodyBlock->getArgument(0);
-  auto bodyElm = bodyBlock->getArgument(1);
-  auto bodyIv = bodyBlock->getArgument(2);
-  declareVariable(acc_x->getName(), {bodyAcc, bodyElm});
+  auto vec = buildNode(v);
+  auto dim = builder.create<mlir::DimOp>(UNK, vec[0], 0);
+
+  // The body of the lambda is evaluated on { acc, x }, where x is loaded
+  // from the vector (so is a tuple, or a row, for vectors of those), and
+  // its result is the accumulator of the next iteration
+  auto loop = buildLoop(dim, {init});
+  auto &body = loop->getRegion(0).front();
+  auto iv = body.getArgument(0);
+  auto acc = body.getArgument(1);
+  Values accElm {acc};
+  auto elm = buildElement({loop}, vec, {iv});
+  accElm.append(elm.begin(), elm.end());
+  declareVariable(acc_x->getName(), accElm);
   auto newAcc = Single(buildNode(f->getBody()));
 
-  // Increment IV
-  auto oneAttr = builder.getIntegerAttr(ivTy, 1);
-  auto one = builder.create<mlir::ConstantOp>(UNK, ivTy, oneAttr);
-  auto incr = builder.create<mlir::AddIOp>(UNK, bodyIv, one);
-  mlir::ValueRange headArg {newAcc, incr};
-  builder.create<mlir::BranchOp>(UNK, headBlock, headArg);
+  // And return the final accumulator
+  return endLoop(loop, {newAcc});
+}
+
+//============================================================ Loops
+
+// Creates a loop over [0, upperBound), which carries iterArgs from one
+// iteration to the next and returns their final values.  This is an
+// affine.for when the bound is a valid affine symbol (e.g. a function
+// argument or the size of one), so that the affine passes can transform
+// it, and an scf.for otherwise.  The builder is left in the loop body,
+// whose first argument is the induction variable, of index type, and the
+// rest are the iteration arguments.
+mlir::Operation* Generator::buildLoop(mlir::Value upperBound, mlir::ValueRange iterArgs) {
+  mlir::Operation* loop;
+  if (mlir::isValidSymbol(upperBound)) {
+    auto lbMap = builder.getConstantAffineMap(0);
+    auto ubMap = mlir::AffineMap::get(0, 1, builder.getAffineSymbolExpr(0));
+    loop = builder.create<mlir::AffineForOp>(UNK, mlir::ValueRange{}, lbMap,
+                                             mlir::ValueRange{upperBound}, ubMap,
+                                             1, iterArgs);
+  } else {
+    auto zero = builder.create<mlir::ConstantIndexOp>(UNK, 0);
+    auto one = builder.create<mlir::ConstantIndexOp>(UNK, 1);
+    loop = builder.create<mlir::scf::ForOp>(UNK, zero, upperBound, one, iterArgs);
+  }
+  // Without iteration arguments, the body already has its terminator
+  builder.setInsertionPointToStart(&loop->getRegion(0).front());
+  return loop;
+}
+
+// Ends the body of a loop from buildLoop, passing results to the next
+// iteration, and moves the builder past the loop
+Values Generator::endLoop(mlir::Operation* loop, mlir::ValueRange results) {
+  if (!results.empty()) {
+    if (llvm::isa<mlir::AffineForOp>(loop))
+      builder.create<mlir::AffineYieldOp>(UNK, results);
+    else
+      builder.create<mlir::scf::YieldOp>(UNK, results);
+  }
+  builder.setInsertionPointAfter(loop);
+  auto rets = loop->getResults();
+  return Values(rets.begin(), rets.end());
+}
+
+// Loads and stores of vectors, indexed by the induction variables of a loop
+// nest, which are affine if all the loops are
+static bool allAffine(llvm::ArrayRef<mlir::Operation*> loops) {
+  return !loops.empty() && llvm::all_of(loops, [](mlir::Operation* loop) {
+    return llvm::isa<mlir::AffineForOp>(loop);
+  });
+}
 
-  // And return the accumulator
-  builder.setInsertionPointToEnd(tailBlock);
-  auto tailAcc = tailBlock->getArgument(0);
-  return mlir::ValueRange{tailAcc};
+mlir::Value Generator::buildLoad(llvm::ArrayRef<mlir::Operation*> loops, mlir::Value vec,
+                                 mlir::ValueRange ivs) {
+  if (allAffine(loops))
+    return builder.create<mlir::AffineLoadOp>(UNK, vec, ivs);
+  return builder.create<mlir::LoadOp>(UNK, vec, ivs);
+}
+
+void Generator::buildStore(llvm::ArrayRef<mlir::Operation*> loops, mlir::Value val,
+                           mlir::Value vec, mlir::ValueRange ivs) {
+  if (allAffine(loops))
+    builder.create<mlir::AffineStoreOp>(UNK, val, vec, ivs);
+  else
+    builder.create<mlir::StoreOp>(UNK, val, vec, ivs);
+}
+
+// The element of vector vec at indices, which are the induction variables
+// of loops, if any.  Each memref of a vector of tuples gives one value of
+// the element, and a memref of higher rank than there are indices gives
+// a copy of the row (or plane...) at them.
+Values Generator::buildElement(llvm::ArrayRef<mlir::Operation*> loops, Values const& vec,
+                               mlir::ValueRange indices) {
+  Values elms;
+  for (auto v: vec) {
+    auto rank = v.getType().cast<mlir::MemRefType>().getRank();
+    assert(rank >= (int64_t)indices.size() && "Too many indices for vector");
+    if (rank == (int64_t)indices.size())
+      elms.push_back(buildLoad(loops, v, indices));
+    else
+      elms.push_back(buildSlice(v, indices));
+  }
+  return elms;
+}
+
+// Copies vec[indices..., :, ...] into a new memref, of the remaining rank
+mlir::Value Generator::buildSlice(mlir::Value vec, mlir::ValueRange indices) {
+  auto type = vec.getType().cast<mlir::MemRefType>();
+  Values dims;
+  for (int64_t d = indices.size(); d < type.getRank(); d++)
+    dims.push_back(builder.create<mlir::DimOp>(UNK, vec, d));
+  llvm::SmallVector<int64_t, 4> shape(dims.size(), -1);
+  auto sliceTy = mlir::MemRefType::get(shape, type.getElementType());
+  mlir::Value slice = builder.create<mlir::AllocOp>(UNK, sliceTy, dims);
+
+  llvm::SmallVector<mlir::Operation*, 4> loops;
+  Values ivs;
+  for (auto dim: dims) {
+    loops.push_back(buildLoop(dim, {}));
+    ivs.push_back(loops.back()->getRegion(0).front().getArgument(0));
+  }
+  Values from(indices.begin(), indices.end());
+  from.append(ivs.begin(), ivs.end());
+  auto elm = builder.create<mlir::LoadOp>(UNK, vec, from);
+  buildStore(loops, elm, slice, ivs);
+  for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop)
+    endLoop(*loop, {});
+  return slice;
 }
 
 // Lower constant literals
@@ -695,16 +855,61 @@ const mlir::ModuleOp Generator::build(const std::string& mlir) {
 
 //============================================================ LLVM IR Lowering
 
-unique_ptr<llvm::Module> Generator::emitLLVM(int optLevel, llvm::LLVMContext & llvmContext) {
+// The MLIR pipeline for each optimization level, before lowering to LLVM:
+//  -O1: inlining, canonicalization and CSE, loop-invariant code motion
+//       and fusion of the loops from build and fold
+//  -O2: also hoists the allocations of build out of loops where possible,
+//       and frees the ones which do not escape their function
+//  -O3: also tiles, unrolls and vectorizes the affine loops
+// The translated module is then optimized by LLVM at the same level.
+static void addOptimizationPasses(mlir::PassManager &pm, int optLevel) {
+  pm.addPass(mlir::createInlinerPass());
+  pm.addPass(mlir::createSymbolDCEPass());
+  mlir::OpPassManager &optPM = pm.nest<mlir::FuncOp>();
+  optPM.addPass(mlir::createCanonicalizerPass());
+  optPM.addPass(mlir::createCSEPass());
+  optPM.addPass(mlir::createLoopInvariantCodeMotionPass());
+  optPM.addPass(mlir::createAffineLoopInvariantCodeMotionPass());
+  optPM.addPass(mlir::createLoopFusionPass());
+  optPM.addPass(mlir::createCanonicalizerPass());
+  if (optLevel > 1) {
+    optPM.addPass(mlir::createBufferHoistingPass());
+    optPM.addPass(mlir::createBufferLoopHoistingPass());
+    optPM.addPass(mlir::createBufferDeallocationPass());
+  }
+  if (optLevel > 2) {
+    optPM.addPass(mlir::createLoopTilingPass());
+    optPM.addPass(mlir::createLoopUnrollPass(/*unrollFactor=*/4));
+    optPM.addPass(mlir::createSuperVectorizePass(/*virtualVectorSize=*/{8}));
+    optPM.addPass(mlir::createCanonicalizerPass());
+    optPM.addPass(mlir::createCSEPass());
+  }
+}
+
+unique_ptr<llvm::Module> Generator::emitLLVM(int optLevel, llvm::LLVMContext & llvmContext,
+                                             bool timing) {
   // The lowering "pass manager"
   mlir::PassManager pm(&context);
+  if (timing)
+    pm.enableTiming();
   if (optLevel > 0) {
-    pm.addPass(mlir::createInlinerPass());
-    pm.addPass(mlir::createSymbolDCEPass());
-    mlir::OpPassManager &optPM = pm.nest<mlir::FuncOp>();
-    optPM.addPass(mlir::createCanonicalizerPass());
-    optPM.addPass(mlir::createCSEPass());
+    // Definitions are the entry points of the module, so must survive
+    // symbol DCE; only declarations need to stay private
+    for (auto func : module->getOps<mlir::FuncOp>())
+      if (!func.isExternal())
+        func.setVisibility(mlir::SymbolTable::Visibility::Public);
+    addOptimizationPasses(pm, optLevel);
   }
+  // Then lower the loops (and vectors, from -O3) to branches, so that the
+  // rest is standard.  This is done for each function separately, so in
+  // parallel if the context is multithreaded.
+  mlir::OpPassManager &lowerPM = pm.nest<mlir::FuncOp>();
+  lowerPM.addPass(mlir::createLowerAffinePass());
+  if (optLevel > 2)
+    lowerPM.addPass(mlir::createConvertVectorToSCFPass());
+  lowerPM.addPass(mlir::createLowerToCFGPass());
+  if (optLevel > 2)
+    pm.addPass(mlir::createConvertVectorToLLVMPass());
   pm.addPass(mlir::createLowerToLLVMPass());
 
   // First lower to LLVM dialect
@@ -716,5 +921,18 @@ unique_ptr<llvm::Module> Generator::emitLLVM(int optLevel, llvm::LLVMContext & l
   // Then lower to LLVM IR
   auto llvmModule = mlir::translateModuleToLLVMIR(module.get(), llvmContext);
   assert(llvmModule);
+
+  // And optimize that
+  if (optLevel > 0) {
+    llvm::TimePassesIsEnabled = timing;
+    auto optimize = mlir::makeOptimizingTransformer(optLevel, /*sizeLevel=*/0,
+                                                    /*targetMachine=*/nullptr);
+    if (auto err = optimize(llvmModule.get())) {
+      llvm::errs() << "ERROR: LLVM optimization failed: " << err << "\n";
+      return nullptr;
+    }
+    if (timing)
+      llvm::reportAndResetTimings();
+  }
   return llvmModule;
 }
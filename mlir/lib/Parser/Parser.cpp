@@ -103,6 +103,19 @@ int ParseEnter::verbose = 0;
 
 
 //================================================ Parse Tokens into Exprs
+void Parser::parse() {
+  assert(!rootE && "Won't overwrite root node");
+  if (rootT) {
+    rootE = parseBlock(rootT);
+    return;
+  }
+  rootE = std::make_unique<Block>();
+  while (Token::Ptr tok = lex.lexTopLevel()) {
+    rootE->addOperand(parseToken(tok));
+    lex.releaseTokens();
+  }
+}
+
 // Creates an Expr for each token, validating
 Expr::Ptr Parser::parseToken(const Token *tok) {
   PARSE_ENTER;
@@ -174,7 +187,7 @@ Block::Ptr Parser::parseBlock(const Token *tok) {
   PARSE_ENTER;
   Block *b = new Block();
   for (auto &c : tok->getChildren())
-    b->addOperand(parseToken(c.get()));
+    b->addOperand(parseToken(c));
   return unique_ptr<Block>(b);
 }
 
@@ -202,7 +215,7 @@ Type Parser::parseType(const Token *tok) {
   if (type == AST::Type::Tuple) {
     std::vector<Type> types;
     for (auto &c: tok->getTail())
-      types.push_back(parseType(c.get()));
+      types.push_back(parseType(c));
     return Type(type, move(types));
   }
 
@@ -239,7 +252,7 @@ StructuredName Parser::parseStructuredName(const Token *tok) {
 
 StructuredName Parser::parseStructuredNameWithType(const Token * tok) {
   PARSE_ASSERT(tok->size() == 2 && tok->getChild(0)->isValue) << "Structured name is either [<id> <type>] or [<derivation> <sname>], not " << tok;
-  std::string id = tok->getChild(0)->getValue();
+  llvm::StringRef id = tok->getChild(0)->getValue();
   Token const* snd = tok->getChild(1);
   if (!snd->isValue && snd->isSquareBracket())
     return StructuredName(id, parseStructuredNameWithType(snd));
@@ -252,7 +265,7 @@ Expr::Ptr Parser::parseValue(const Token *tok) {
   PARSE_ENTER;
 
   PARSE_ASSERT(tok->isValue);
-  string value = tok->getValue();
+  llvm::StringRef value = tok->getValue();
 
   // Literals: 10.0 42 "Hello" (not hello, that's a variable use)
   Type::ValidType ty = LiteralType(value);
@@ -260,12 +273,12 @@ Expr::Ptr Parser::parseValue(const Token *tok) {
   if (ty != Type::None) {
     // Trim quotes "" from strings before creating constant
     if (ty == Type::String)
-      value = value.substr(1, value.length()-2);
+      value = value.substr(1, value.size()-2);
     return unique_ptr<Expr>(new Literal(value, ty));
   }
 
   // Variable use: name (without quotes)
-  PARSE_ASSERT(variables.exists(value)) << "Variable not declared [" << value << "]";
+  PARSE_ASSERT(variables.exists(value)) << "Variable not declared [" << value.str() << "]";
   auto val = variables.get(value);
   // Create new node, referencing existing variable
   PARSE_ASSERT(Variable::classof(val));
@@ -381,7 +394,7 @@ Call::Ptr Parser::parseCall(const Token *tok) {
   std::vector<Expr::Ptr> operands;
   operands.reserve(arity);
   for (auto &c : tok->getTail())
-    operands.push_back(parseToken(c.get()));
+    operands.push_back(parseToken(c));
 
   // Extract types
   std::vector<Type> types;
@@ -416,12 +429,12 @@ Variable::Ptr Parser::parseVariableWithType(const Token *tok) {
   PARSE_ASSERT(tok->getChild(1)->isValue && tok->getChild(1)->getValue() == ":");
 
   llvm::ArrayRef<Token::Ptr> children = tok->getChildren();
-  string value = children[0]->getValue();
+  llvm::StringRef value = children[0]->getValue();
 
   // Relaxed type syntax (ex: (x : Vec Float) instead of (x : (Vec Float))
   Type type(Type::None);
   if (tok->size() == 3) {
-    type = parseType(children[2].get());
+    type = parseType(children[2]);
   } else {
     // Re-build the type from children[2:]
     vector<const Token *> toks;
@@ -443,7 +456,7 @@ Binding Parser::parseBinding(const Token *tok) {
   Expr::Ptr expr = parseToken(tok->getChild(1));
 
   if (tok->getChild(0)->isValue) {
-    std::string value = tok->getChild(0)->getValue();
+    llvm::StringRef value = tok->getChild(0)->getValue();
     Variable::Ptr var = std::make_unique<Variable>(value, expr->getType());
     variables.set(value, var.get());
     return Binding(std::move(var), std::move(expr));
@@ -456,7 +469,7 @@ Binding Parser::parseBinding(const Token *tok) {
     for (size_t ii = 0; ii != tupleSize; ++ii) {
       const Token* v = tok->getChild(0)->getChild(ii);
       PARSE_ASSERT(v->isValue);
-      std::string value = v->getValue();
+      llvm::StringRef value = v->getValue();
       unpackingVars[ii] = std::make_unique<Variable>(value, expr->getType().getSubType(ii));
       variables.set(value, unpackingVars[ii].get());
     }
@@ -496,7 +509,7 @@ Declaration::Ptr Parser::parseEDef(const Token *tok) {
   else {
     std::vector<Type> argTypes;
     for (auto &c : args->getChildren())
-      argTypes.push_back(parseType(c.get()));
+      argTypes.push_back(parseType(c));
     argType = oneArgify(argTypes);
   }
   Signature sig{ parseStructuredName(name), std::move(argType) };
@@ -527,7 +540,7 @@ Definition::Ptr Parser::parseDef(const Token *tok) {
   // Many vars: ((a 1) (b 2))
   else
     for (auto &a : tok_args->getChildren())
-      arguments.push_back(parseVariableWithType(a.get()));
+      arguments.push_back(parseVariableWithType(a));
 
   // Create declaration early, to allow recursion
   StructuredName name = parseStructuredName(tok_name);
@@ -589,7 +602,7 @@ Tuple::Ptr Parser::parseTuple(const Token *tok) {
   PARSE_ASSERT(tok->getChild(0)->isValue && tok->getChild(0)->getValue() == "tuple");
   std::vector<Expr::Ptr> elements;
   for (auto &c: tok->getTail())
-    elements.push_back(parseToken(c.get()));
+    elements.push_back(parseToken(c));
   return make_unique<Tuple>(move(elements));
 }
 
@@ -645,7 +658,7 @@ Rule::Ptr Parser::parseRule(const Token *tok) {
   auto res = parseToken(tok->getChild(4));
   auto rule =
       make_unique<Rule>(unquoted, move(var), move(pat), move(res));
-  rules.set(unquoted.str(), rule.get());
+  rules.set(unquoted, rule.get());
   return rule;
 }
 
@@ -0,0 +1,51 @@
+// Benchmarks of test/ksc/adbench-lstm.ks
+#include "knossos-bench.h"
+
+// The generated C++ has a main of its own
+#define main ks_generated_main
+#include "adbench-lstm.cpp"
+#undef main
+
+using namespace ks;
+using ks::bench::random;
+
+int main(int argc, char** argv)
+{
+	bench::suite s("lstm", argc, argv);
+	std::mt19937_64 rng(0);
+
+	// L layers, hidden size H, C characters in the sequence
+	size_t const configs[][3] = { { 2, 10, 100 }, { 4, 100, 100 } };
+	for (auto& c : configs) {
+		size_t l = c[0], h = c[1], chars = c[2];
+		std::string group = "l" + std::to_string(l) + "_h" + std::to_string(h) + "_c" + std::to_string(chars);
+
+		allocator inputs;
+		using layer_t = Tuple<vec<Float>, vec<Float>, vec<Float>, vec<Float>, vec<Float>,
+		                      vec<Float>, vec<Float>, vec<Float>, vec<Float>, vec<Float>>;
+		auto main_params = vec<layer_t>::create(&inputs, Integer(l));
+		for (size_t i = 0; i < l; ++i) {
+			auto r = [&]() { return random<vec<Float>>(&inputs, rng, { h }); };
+			// Each of the weights and biases of the four gates, then the
+			// hidden state and cell
+			auto wf = r(), bf = r(), wi = r(), bi = r(), wo = r(), bo = r(), wc = r(), bc = r();
+			auto hidden = r(), cell = r();
+			main_params[Integer(i)] = make_Tuple(wf, bf, wi, bi, wo, bo, wc, bc, hidden, cell);
+		}
+		auto in_weight = random<vec<Float>>(&inputs, rng, { h });
+		auto out_weight = random<vec<Float>>(&inputs, rng, { h });
+		auto out_bias = random<vec<Float>>(&inputs, rng, { h });
+		auto sequence = vec<Tuple<vec<Float>, vec<Float>>>::create(&inputs, Integer(chars));
+		for (size_t i = 0; i < chars; ++i) {
+			auto input = random<vec<Float>>(&inputs, rng, { h });
+			auto target = random<vec<Float>>(&inputs, rng, { h });
+			sequence[Integer(i)] = make_Tuple(input, target);
+		}
+
+		s.run("test_inference[lstm_objective-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return lstm_objective$aT1$dT1fT1fT1fT1fT1fT1fT1fT1fT1fT1f$bT1fT1fT1fT1$dT1fT1f$b(
+				alloc, main_params, in_weight, out_weight, out_bias, sequence);
+		});
+	}
+	return s.finish();
+}
@@ -0,0 +1,40 @@
+// Benchmarks of test/ksc/gmm.ks: the objective, and its reverse mode
+#include "knossos-bench.h"
+
+// The generated C++ has a main of its own
+#define main ks_generated_main
+#include "gmm.cpp"
+#undef main
+
+using namespace ks;
+using ks::bench::random;
+
+int main(int argc, char** argv)
+{
+	bench::suite s("gmm", argc, argv);
+	std::mt19937_64 rng(0);
+
+	// N points, K components, D dimensions
+	size_t const configs[][3] = { { 1000, 10, 2 }, { 1000, 25, 20 }, { 100, 200, 64 } };
+	for (auto& c : configs) {
+		size_t n = c[0], k = c[1], d = c[2], tri_d = d * (d - 1) / 2;
+		std::string group = "n" + std::to_string(n) + "_k" + std::to_string(k) + "_d" + std::to_string(d);
+
+		allocator inputs;
+		auto x = random<vec<vec<Float>>>(&inputs, rng, { n, d });
+		auto alphas = random<vec<Float>>(&inputs, rng, { k });
+		auto means = random<vec<vec<Float>>>(&inputs, rng, { k, d });
+		auto qs = random<vec<vec<Float>>>(&inputs, rng, { k, d });
+		auto ls = random<vec<vec<Float>>>(&inputs, rng, { k, tri_d });
+		auto wishart = make_Tuple(Float(1.0), Integer(1));
+
+		s.run("test_inference[gmm_objective-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return gmm_knossos_gmm_objective$aT1T1fT1fT1T1fT1T1fT1T1f$dfi$b(alloc, x, alphas, means, qs, ls, wishart);
+		});
+		s.run("test_backwards[gmm_objective-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return rev$gmm_knossos_gmm_objective$aT1T1fT1fT1T1fT1T1fT1T1f$dfi$b(
+				alloc, make_Tuple(x, alphas, means, qs, ls, wishart), Float(1.0));
+		});
+	}
+	return s.finish();
+}
@@ -0,0 +1,34 @@
+// Benchmarks of test/ksc/logsumexp.ks, and its reverse mode
+#include "knossos-bench.h"
+
+// The generated C++ has a main of its own
+#define main ks_generated_main
+#include "logsumexp.cpp"
+#undef main
+
+using namespace ks;
+using ks::bench::random;
+
+int main(int argc, char** argv)
+{
+	bench::suite s("logsumexp", argc, argv);
+	std::mt19937_64 rng(0);
+
+	for (size_t n : { 100, 10000, 1000000 }) {
+		std::string group = "n" + std::to_string(n);
+
+		allocator inputs;
+		auto v = random<vec<Float>>(&inputs, rng, { n });
+
+		s.run("test_inference[logsumexp-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return logsumexp$aT1f(alloc, v);
+		});
+		s.run("test_inference[logsumexp_safe-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return logsumexp_safe$aT1f(alloc, v);
+		});
+		s.run("test_backwards[logsumexp-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return rev$logsumexp$aT1f(alloc, v, Float(1.0));
+		});
+	}
+	return s.finish();
+}
@@ -0,0 +1,46 @@
+// Benchmarks of test/ksc/mnistcnn.ks: inference, and its reverse mode
+#include "knossos-bench.h"
+
+// The generated C++ has a main of its own
+#define main ks_generated_main
+#include "mnistcnn.cpp"
+#undef main
+
+using namespace ks;
+using ks::bench::random;
+
+int main(int argc, char** argv)
+{
+	bench::suite s("mnistcnn", argc, argv);
+	std::mt19937_64 rng(0);
+
+	// A 28x28 image, two 5x5 convolutions (of k1 then k2 channels), each
+	// followed by a 2x2 max pool, then dense layers to d1 and 10 outputs
+	size_t const configs[][3] = { { 8, 16, 64 }, { 32, 64, 256 } };
+	for (auto& c : configs) {
+		size_t k1 = c[0], k2 = c[1], d1 = c[2];
+		std::string group = "k" + std::to_string(k1) + "_k" + std::to_string(k2) + "_d" + std::to_string(d1);
+
+		allocator inputs;
+		auto image = random<vec<vec<vec<Float>>>>(&inputs, rng, { 1, 28, 28 });
+		auto wk1 = random<vec<vec<vec<vec<Float>>>>>(&inputs, rng, { k1, 1, 5, 5 });
+		auto bk1 = random<vec<Float>>(&inputs, rng, { k1 });
+		auto wk2 = random<vec<vec<vec<vec<Float>>>>>(&inputs, rng, { k2, k1, 5, 5 });
+		auto bk2 = random<vec<Float>>(&inputs, rng, { k2 });
+		auto wd1 = random<vec<vec<vec<vec<Float>>>>>(&inputs, rng, { d1, k2, 7, 7 });
+		auto bd1 = random<vec<Float>>(&inputs, rng, { d1 });
+		auto wd2 = random<vec<vec<Float>>>(&inputs, rng, { 10, d1 });
+		auto bd2 = random<vec<Float>>(&inputs, rng, { 10 });
+		auto dret = random<vec<Float>>(&inputs, rng, { 10 });
+
+		s.run("test_inference[mnist-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return mnist$aT1T1T1fT1T1T1T1fT1fT1T1T1T1fT1fT1T1T1T1fT1fT1T1fT1f(
+				alloc, image, wk1, bk1, wk2, bk2, wd1, bd1, wd2, bd2);
+		});
+		s.run("test_backwards[mnist-Knossos C++-" + group + "]", group, [&](allocator * alloc) {
+			return rev$mnist$aT1T1T1fT1T1T1T1fT1fT1T1T1T1fT1fT1T1T1T1fT1fT1T1fT1f(
+				alloc, make_Tuple(image, wk1, bk1, wk2, bk2, wd1, bd1, wd2, bd2), dret);
+		});
+	}
+	return s.finish();
+}
@@ -0,0 +1,35 @@
+# Build and run the C++ benchmarks of src/bench/cpp, saving the results
+# beside pytest-benchmark's, so comparison_plot.py plots them together.
+# Run from the root of the repo; with BASELINE=<run>, e.g. BASELINE=0003,
+# each suite is compared to that earlier run, and the script fails if one
+# regressed.  Other arguments are passed to each benchmark.
+set -e
+
+BUILD=build/bench
+OUT=.benchmarks/$(uname -s)-cpp-$(uname -m)
+
+cmake -S src/bench/cpp -B $BUILD -DCMAKE_BUILD_TYPE=Release
+cmake --build $BUILD
+
+export KS_BENCH_COMMIT_ID=$(git rev-parse HEAD)
+export KS_BENCH_COMMIT_TIME=$(git log -1 --format=%cI)
+
+mkdir -p $OUT
+# One run writes a file per kernel, all named <run>_<commit>_cpp-<kernel>.json,
+# so the next run is one after the last <run> prefix
+LAST=$(ls $OUT | sed -n 's/^\([0-9]\{4\}\)_.*/\1/p' | sort -u | tail -n 1)
+if [ -z "$LAST" ]; then
+	N=0000
+else
+	N=$(printf "%04d" $((10#$LAST + 1)))
+fi
+STATUS=0
+for kernel in gmm adbench-lstm mnistcnn logsumexp; do
+	[ -x $BUILD/bench-$kernel ] || continue
+	ARGS="--json $OUT/${N}_${KS_BENCH_COMMIT_ID:0:8}_cpp-$kernel.json"
+	if [ -n "$BASELINE" ]; then
+		ARGS="$ARGS --compare $(ls $OUT/${BASELINE}_*_cpp-$kernel.json)"
+	fi
+	$BUILD/bench-$kernel $ARGS "$@" || STATUS=1
+done
+exit $STATUS
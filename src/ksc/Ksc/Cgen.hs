@@ -12,7 +12,7 @@ import           Prelude                 hiding ( lines
 
 import qualified Data.Map                      as Map
 import           Data.List                      ( intercalate )
-import           Data.Maybe                     ( mapMaybe )
+import           Data.Maybe                     ( isJust, mapMaybe )
 import           Control.Monad                  ( when )
 import qualified Control.Monad.State           as S
 import qualified System.Directory
@@ -22,6 +22,7 @@ import           System.Exit                    ( ExitCode(ExitSuccess) )
 
 import           Ksc.Lang                hiding ( (<>) )
 import qualified Ksc.OptLet
+import           Ksc.LangUtils            ( notFreeIn )
 
 import Debug.Trace
 
@@ -353,7 +354,8 @@ cgenDefE env (Def { def_fun = f, def_pat = param
       (params, withPackedParams) = params_withPackedParamsPat param
       CG cbodydecl cbodyexpr cbodytype _callocusage =
         runM $ cgenExpr env (withPackedParams body)
-      cbody       = cbodydecl ++ [ "return (" ++ generateCGRE cbodyexpr ++ ");" ]
+      cprofile    = "KS_PROFILE_SCOPE(" ++ show (render (pprUserFun f)) ++ ");"
+      cbody       = cprofile : cbodydecl ++ [ "return (" ++ generateCGRE cbodyexpr ++ ");" ]
       cvars       = map mkCTypedVar params
       cftypealias = "ty$" ++ cf
       cparams     = "ks::allocator * " ++ allocatorParameterName ++ concatMap (", " ++) cvars
@@ -411,6 +413,86 @@ cgenExprWithoutResettingAlloc env = \case
         ctype
         (allocatorUsageOfCType ctype <> UsesAndResetsAllocator)
 
+  -- Special case for a sumbuild of builds
+  --     sumbuild n (\i. build m (\j. e))
+  -- where m does not depend on i.  The C++ sumbuild_build adds each e
+  -- into the result directly, rather than building a temporary tensor
+  -- for each i.  It is passed the curried body \i. \j. e.
+  Call tf@(TFun retty (Fun JustFun (PrimFunT P_sumbuild)))
+       (Tuple [n, Lam i (Call (TFun _ (Fun JustFun (PrimFunT P_build))) (Tuple [m, Lam j e]))])
+    | TypeTensor _ elty <- retty
+    , i `notFreeIn` m
+    -> do
+    CG ndecl nexpr _ nallocusage <- cgenExprR env n
+    CG mdecl mexpr _ mallocusage <- cgenExprR env m
+    CG fdecl fexpr _ _           <- cgenExprR env (Lam i (Lam j e))
+    let cftype = mkCType retty
+    v <- freshCVar
+    return $ CG
+      (  ndecl ++ mdecl ++ fdecl
+      ++ [ cgenType cftype ++ " " ++ v ++ " = ks::sumbuild_build<" ++ cgenType (mkCType elty) ++ ">("
+             ++ cgenArgList tf (map generateCGRE [nexpr, mexpr, fexpr]) ++ ");" ]
+      )
+      (cgreVar v)
+      cftype
+      (funAllocatorUsage tf cftype <> nallocusage <> mallocusage)
+
+  -- Special case for a sumbuild of deltaVecs
+  --     sumbuild n (\i. deltaVec m k e)
+  -- where m does not depend on i.  The C++ sumbuild_deltaVec adds each e
+  -- into element k of the result, rather than building a temporary
+  -- tensor for each i.  It is passed \i. (k, e).
+  -- See Note [Sparse deltaVec and diag]
+  Call tf@(TFun retty (Fun JustFun (PrimFunT P_sumbuild)))
+       (Tuple [n, Lam i (Call (TFun _ (Fun JustFun (PrimFunT P_deltaVec))) (Tuple [m, k, e]))])
+    | TypeTensor _ elty <- retty
+    , i `notFreeIn` m
+    -> do
+    CG ndecl nexpr _ nallocusage <- cgenExprR env n
+    CG mdecl mexpr _ mallocusage <- cgenExprR env m
+    CG fdecl fexpr _ _           <- cgenExprR env (Lam i (Tuple [k, e]))
+    let cftype = mkCType retty
+    v <- freshCVar
+    return $ CG
+      (  ndecl ++ mdecl ++ fdecl
+      ++ [ cgenType cftype ++ " " ++ v ++ " = ks::sumbuild_deltaVec<" ++ cgenType (mkCType elty) ++ ">("
+             ++ cgenArgList tf (map generateCGRE [nexpr, mexpr, fexpr]) ++ ");" ]
+      )
+      (cgreVar v)
+      cftype
+      (funAllocatorUsage tf cftype <> nallocusage <> mallocusage)
+
+  -- Special case for a deltaVec or diag which is directly consumed by
+  -- ts_add, ts_dot or sum, and so need not be materialized.
+  -- See Note [Sparse deltaVec and diag]
+  e | Just (consumer, takesAllocator, operands) <- sparseConsumer_maybe e -> do
+    cgops <- mapM (either (cgenEagerOperand env) (cgenSparseExpr env)) operands
+    let cftype = mkCType (typeof e)
+        cargs  = [ allocatorParameterName | takesAllocator ] ++ [ c | (_, c, _) <- cgops ]
+    v <- freshCVar
+    return $ CG
+      (  concat [ d | (d, _, _) <- cgops ]
+      ++ [ cgenType cftype ++ " " ++ v ++ " = " ++ consumer ++ "(" ++ intercalate ", " cargs ++ ");" ]
+      )
+      (cgreVar v)
+      cftype
+      (allocatorUsageOfCType cftype <> UsesAndResetsAllocator <> foldMap (\(_, _, u) -> u) cgops)
+
+  -- Special case for nested elementwise operations on tensors of Float,
+  -- which are run as one loop.  See Note [Lazy elementwise expressions]
+  e | Just (consumer, operands) <- lazyConsumer_maybe e -> do
+    cgops <- mapM (cgenLazyExpr env) operands
+    let cftype = mkCType (typeof e)
+    v <- freshCVar
+    return $ CG
+      (  concat [ d | (d, _, _) <- cgops ]
+      ++ [ cgenType cftype ++ " " ++ v ++ " = " ++ consumer ++ "("
+             ++ intercalate ", " (allocatorParameterName : [ c | (_, c, _) <- cgops ]) ++ ");" ]
+      )
+      (cgreVar v)
+      cftype
+      (allocatorUsageOfCType cftype <> UsesAndResetsAllocator <> foldMap (\(_, _, u) -> u) cgops)
+
   -- Special case for literal tuples.  Don't unpack with std::get.
   -- Just use the tuple components as the arguments.  See Note [Unpack
   -- tuple arguments]
@@ -649,6 +731,186 @@ cgenAnyFun tf cftype = case tf of
     Left primFun  -> cgenPrimFun primFun
     Right userFun -> cgenUserFun userFun
 
+{- Note [Lazy elementwise expressions]
+
+Each elementwise operation on a tensor, such as ts_add or map, writes
+a new tensor, so that a nested expression like
+
+    ts_add (ts_scale s x) (ts_neg y)
+
+makes two intermediate tensors, and reads and writes memory three times
+over.  Instead we generate
+
+    ks::lazy::evaluate($alloc, ks::lazy::add(ks::lazy::scale(s, x), ks::lazy::neg(y)))
+
+whose C++ (see knossos-lazy.h) computes each element of the result in
+one loop over x and y.  A sum or ts_dot of such an expression is fused
+likewise, into ks::lazy::sum or ks::lazy::dot, so that it is not
+written at all.
+
+The lazy operations are ts_add, ts_scale, ts_neg, map and aten::pow on
+tensors of Float (lazyNode_maybe).  Their scalar and function arguments
+are generated as usual, before the loop; any other tensor argument is a
+leaf of the expression.  We only fuse calls which are directly nested,
+as a let-bound tensor may be used more than once.
+-}
+
+isFloatTensor :: Type -> Bool
+isFloatTensor (TypeTensor _ TypeFloat) = True
+isFloatTensor _                        = False
+
+-- The ks::lazy function for an elementwise operation, and its
+-- arguments: Left for those evaluated as usual and Right for the
+-- tensors, which may be lazy themselves
+lazyNode_maybe :: TExpr -> Maybe (String, [Either TExpr TExpr])
+lazyNode_maybe e
+  | not (isFloatTensor (typeof e)) = Nothing
+  | otherwise = case e of
+      Call (TFun _ (Fun JustFun (PrimFunT P_ts_add))) (Tuple [a, b])
+        | isFloatTensor (typeof a), isFloatTensor (typeof b)
+        -> Just ("ks::lazy::add", [Right a, Right b])
+      Call (TFun _ (Fun JustFun (PrimFunT P_ts_scale))) (Tuple [s, t])
+        | TypeFloat <- typeof s
+        -> Just ("ks::lazy::scale", [Left s, Right t])
+      Call (TFun _ (Fun JustFun (PrimFunT P_ts_neg))) t
+        -> Just ("ks::lazy::neg", [Right t])
+      Call (TFun _ (Fun JustFun (PrimFunT P_map))) (Tuple [f, t])
+        | isFloatTensor (typeof t)
+        -> Just ("ks::lazy::map", [Left f, Right t])
+      Call (TFun _ (Fun JustFun (BaseFunId (BaseUserFunName "aten::pow") _))) (Tuple [t, i])
+        | isFloatTensor (typeof t)
+        -> Just ("ks::lazy::pow", [Right t, Left i])
+      _ -> Nothing
+
+isLazyNode :: TExpr -> Bool
+isLazyNode = isJust . lazyNode_maybe
+
+-- The ks::lazy function which consumes a nested elementwise expression,
+-- and its arguments, if e is one worth fusing
+lazyConsumer_maybe :: TExpr -> Maybe (String, [TExpr])
+lazyConsumer_maybe e = case e of
+  Call (TFun _ (Fun JustFun (PrimFunT P_sum))) t
+    | isLazyNode t
+    -> Just ("ks::lazy::sum", [t])
+  Call (TFun _ (Fun JustFun (PrimFunT P_ts_dot))) (Tuple [a, b])
+    | isFloatTensor (typeof a), isFloatTensor (typeof b)
+    , isLazyNode a || isLazyNode b
+    -> Just ("ks::lazy::dot", [a, b])
+  _ | Just (_, args) <- lazyNode_maybe e
+    , any (either (const False) isLazyNode) args
+    -> Just ("ks::lazy::evaluate", [e])
+  _ -> Nothing
+
+-- The declarations, C++ expression and allocator usage of an operand of
+-- a lazy expression
+cgenLazyExpr :: HasCallStack => CST -> TExpr -> M ([String], String, AllocatorUsage)
+cgenLazyExpr env e = case lazyNode_maybe e of
+  Just (f, args) -> do
+    cgargs <- mapM (either cgenEager (cgenLazyExpr env)) args
+    return ( concat [ d | (d, _, _) <- cgargs ]
+           , f ++ "(" ++ intercalate ", " [ c | (_, c, _) <- cgargs ] ++ ")"
+           , foldMap (\(_, _, u) -> u) cgargs )
+  Nothing -> cgenEagerOperand env e
+
+-- The declarations, C++ expression and allocator usage of an operand
+-- which is generated as usual
+cgenEagerOperand :: HasCallStack => CST -> TExpr -> M ([String], String, AllocatorUsage)
+cgenEagerOperand env e = do
+  CG decl expr _ usage <- cgenExprR env e
+  return (decl, generateCGRE expr, usage)
+
+{- Note [Sparse deltaVec and diag]
+
+Reverse-mode code is full of deltaVecs (from the reverse of index) and
+diags, usually added straight into something dense, as in
+
+    ts_add acc (deltaVec n i (ts_scale s dr))
+
+Materializing the deltaVec writes n zeros, and the ts_add reads them
+back, to change one element.  Instead, a deltaVec which is directly an
+operand of ts_add, ts_dot or sum is generated as
+
+    ks::ts_add($alloc, acc, ks::sparse_deltaVec($alloc, n, i, ...))
+
+whose C++ (see knossos-sparse.h) is a delta_tensor holding just the
+index and the value, and the ts_add copies acc and adds in one element.
+A ts_scale or ts_neg of such a deltaVec is a delta_tensor too; where one
+is not consumed by ts_add, ts_dot or sum, it is made dense by
+ks::densify.  Likewise a diag which is an operand of ts_add is a
+diag_tensor, which adds in only the diagonal.
+
+Finally
+
+    sumbuild n (\i. deltaVec m k e)
+
+where m does not depend on i, is generated as ks::sumbuild_deltaVec, which
+adds each e into element k of one result tensor.
+
+As for the lazy expressions (Note [Lazy elementwise expressions]), only
+directly nested calls are generated like this.  So a sparse tensor is
+never bound to a variable, copied down, or returned; it is consumed by
+the expression which made it.
+-}
+
+-- The C++ function which makes a sparse deltaVec, and its arguments:
+-- Left for those generated as usual and Right for a sparse operand
+sparseNode_maybe :: TExpr -> Maybe (String, [Either TExpr TExpr])
+sparseNode_maybe e = case e of
+  Call (TFun _ (Fun JustFun (PrimFunT P_deltaVec))) (Tuple [n, i, v])
+    -> Just ("ks::sparse_deltaVec", [Left n, Left i, Left v])
+  Call (TFun _ (Fun JustFun (PrimFunT P_ts_scale))) (Tuple [s, t])
+    | TypeFloat <- typeof s, isSparseNode t
+    -> Just ("ks::ts_scale", [Left s, Right t])
+  Call (TFun _ (Fun JustFun (PrimFunT P_ts_neg))) t
+    | isSparseNode t
+    -> Just ("ks::ts_neg", [Right t])
+  _ -> Nothing
+
+isSparseNode :: TExpr -> Bool
+isSparseNode = isJust . sparseNode_maybe
+
+-- A diag is only sparse as an operand of ts_add
+isSparseDiag :: TExpr -> Bool
+isSparseDiag (Call (TFun _ (Fun JustFun (PrimFunT P_diag))) (Tuple [_, _, _])) = True
+isSparseDiag _ = False
+
+-- The C++ function which consumes a sparse deltaVec or diag, whether it
+-- takes the allocator, and its arguments, if e is one
+sparseConsumer_maybe :: TExpr -> Maybe (String, Bool, [Either TExpr TExpr])
+sparseConsumer_maybe e = case e of
+  Call (TFun _ (Fun JustFun (PrimFunT P_ts_add))) (Tuple [a, b])
+    | isSparse a -> Just ("ks::ts_add", True, [Right a, Left b])
+    | isSparse b -> Just ("ks::ts_add", True, [Left a, Right b])
+  Call (TFun _ (Fun JustFun (PrimFunT P_ts_dot))) (Tuple [a, b])
+    | isSparseNode a -> Just ("ks::ts_dot", False, [Right a, Left b])
+    | isSparseNode b -> Just ("ks::ts_dot", False, [Left a, Right b])
+  Call (TFun _ (Fun JustFun (PrimFunT P_sum))) t
+    | isSparseNode t -> Just ("ks::sum", True, [Right t])
+  _ | Just (_, args) <- sparseNode_maybe e
+    , any (either (const False) isSparseNode) args
+    -> Just ("ks::densify", True, [Right e])
+  _ -> Nothing
+  where
+    isSparse a = isSparseNode a || isSparseDiag a
+
+-- The declarations, C++ expression and allocator usage of a sparse
+-- operand
+cgenSparseExpr :: HasCallStack => CST -> TExpr -> M ([String], String, AllocatorUsage)
+cgenSparseExpr env e
+  | Just (f, args) <- sparseNode_maybe e = cgenSparseCall f args
+  | Call (TFun _ (Fun JustFun (PrimFunT P_diag))) (Tuple [r, c, g]) <- e
+  = cgenSparseCall "ks::sparse_diag" [Left r, Left c, Left g]
+  | otherwise = cgenEagerOperand env e
+  where
+    -- The sparse value may refer to allocated memory, such as a tensor
+    -- value of a deltaVec
+    cgenSparseCall f args = do
+      cgargs <- mapM (either (cgenEagerOperand env) (cgenSparseExpr env)) args
+      return ( concat [ d | (d, _, _) <- cgargs ]
+             , f ++ "(" ++ intercalate ", " (allocatorParameterName : [ c | (_, c, _) <- cgargs ]) ++ ")"
+             , allocatorUsageOfCType (mkCType (typeof e)) <> UsesAndResetsAllocator
+               <> foldMap (\(_, _, u) -> u) cgargs )
+
 {- Note [Allocator usage of function calls]
 
 Every function takes an allocator as its first argument, with the
@@ -815,7 +1077,7 @@ cppGen includefiles defs =
         ]
       call_main =
         [ "int main() {"
-        , "  ks::allocator alloc{ 1'000'000'000 };"
+        , "  ks::allocator alloc;"
         , "  ks::main(&alloc);"
         , "  return 0;"
         , "}"
@@ -95,9 +95,21 @@ displayCppGenCompileAndRun :: HasCallStack
                            -> [String]
                            -> String
                            -> IO (String, (String, String))
-displayCppGenCompileAndRun roots compilername verbosity cppincludefiles files file = do
+displayCppGenCompileAndRun = displayCppGenCompileAndRunWithOpts []
+
+-- As displayCppGenCompileAndRun, passing extra options to the C++ compiler
+displayCppGenCompileAndRunWithOpts :: HasCallStack
+                                   => [String]
+                                   -> Roots
+                                   -> String
+                                   -> Maybe Int
+                                   -> [String]
+                                   -> [String]
+                                   -> String
+                                   -> IO (String, (String, String))
+displayCppGenCompileAndRunWithOpts opts roots compilername verbosity cppincludefiles files file = do
   { (exefile, cpp_kso) <- displayCppGenAndCompile
-                          roots (Ksc.Cgen.compile compilername) ".exe" verbosity cppincludefiles files file
+                          roots (Ksc.Cgen.compileWithOpts opts compilername) ".exe" verbosity cppincludefiles files file
   ; output <- Ksc.Cgen.runExe exefile
   ; pure (output, cpp_kso)
   }
@@ -13,7 +13,7 @@ import qualified Ksc.Pipeline
 import qualified Ksc.Cgen
 import qualified Control.Exception
 import qualified Data.Maybe
-import Data.List( intercalate )
+import Data.List( intercalate, stripPrefix )
 import qualified System.Directory
 import qualified System.Environment
 import qualified System.FilePath
@@ -250,12 +250,43 @@ dropWhile1 pred xs = case dropWhile pred xs of
   []  -> []
   _:t -> t
 
+{- Note [Test directives]
+
+A test file may contain lines such as
+
+    ; ksc-test-config: -DKS_PARALLEL -pthread
+    ; ksc-test-cpp-include: test-runtime.h
+
+Each ksc-test-config line makes testRunKS build and run the test once
+more, with those extra C++ compiler options, after the run with none.
+This is how runtime modes chosen by preprocessor flags (KS_PARALLEL,
+KS_SOA, the summation orders and so on) are tested.
+
+Each ksc-test-cpp-include names a header, in the test's directory, which
+the generated C++ includes after prelude.h.  It defines the edefs, in
+C++, through which a test reaches runtime code that ks can't express,
+such as fixed_tensor.
+-}
+
+-- The words following "; <name>:" on each line of a test which has one.
+-- See Note [Test directives]
+testDirectives :: String -> String -> [[String]]
+testDirectives name = map words . Data.Maybe.mapMaybe (stripPrefix ("; " ++ name ++ ":")) . lines
+
 testRunKS :: String -> [Char] -> IO ()
 testRunKS compiler ksFile = do
+  ksSource <- readFile ksFile
+  let configs  = [] : testDirectives "ksc-test-config" ksSource
+      includes = concat (testDirectives "ksc-test-cpp-include" ksSource)
+  mapM_ (testRunKSWithOpts compiler ksFile includes) configs
+
+testRunKSWithOpts :: String -> [Char] -> [String] -> [String] -> IO ()
+testRunKSWithOpts compiler ksFile includes opts = do
   let ksTest = System.FilePath.dropExtension ksFile
+      cflags = ("-I" ++ System.FilePath.takeDirectory ksFile) : opts
   (output, (_, ksoContents)) <-
-      Ksc.Pipeline.displayCppGenCompileAndRun
-      Nothing compiler Nothing ["prelude.h"] ["src/runtime/prelude"] ksTest
+      Ksc.Pipeline.displayCppGenCompileAndRunWithOpts
+      cflags Nothing compiler Nothing ("prelude.h" : includes) ["src/runtime/prelude"] ksTest
 
   _ <- case parseE ksoContents of
           Left e -> error ("Generated .kso failed to parse:\n"
@@ -283,11 +314,11 @@ testRunKS compiler ksFile = do
   case failures of
     []  -> putStrLn ("All "
                      ++ show (length groupedTestResults)
-                     ++ " tests passed: "
+                     ++ " tests passed" ++ concatMap (' ' :) opts ++ ": "
                      ++ intercalate ", " (map fst groupedTestResults))
     _:_ -> do
       putStrLn (unlines (reverse (take 30 (reverse (lines output)))))
-      error ("These tests failed:\n" ++ unlines failures)
+      error ("These tests failed" ++ concatMap (' ' :) opts ++ ":\n" ++ unlines failures)
 
 testHspec :: IO ()
 testHspec = do
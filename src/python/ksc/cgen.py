@@ -92,14 +92,31 @@ def entry_point_cpp_type(t, use_torch):
                 )
             return "torch::Tensor"
         else:
-            raise ValueError(f'Tensors in entry points are not supported "{t}"')
+            # Without torch, tensors of scalars are passed as NumPy arrays
+            # (see knossos-entry-points-numpy.h)
+            if not t.tensor_elem_type.is_scalar or t.tensor_elem_type == Type.String:
+                raise ValueError(
+                    f'Entry point signatures may only use tensors with scalar elements (not "{t}")'
+                )
+            # This is ks::entry_points::numpy_array, spelled out so that
+            # the declarations need only pybind11
+            return f"pybind11::array_t<{ks_cpp_type(t.tensor_elem_type)}, pybind11::array::c_style | pybind11::array::forcecast>"
     else:
         raise ValueError(f'Unable to generate C++ type for "{t}"')
 
 
 def generate_cpp_entry_points(
-    bindings_to_generate, decls, vectorization, use_torch=False, gpu=False
+    bindings_to_generate,
+    decls,
+    vectorization,
+    use_torch=False,
+    gpu=False,
+    async_bindings=(),
 ):
+    """
+    async_bindings are the names of those bindings which also get an
+    asynchronous entry point, named with the suffix _async
+    """
     decls_by_name = {decl.name: decl for decl in decls}
 
     def lookup_decl(structured_name):
@@ -117,7 +134,18 @@ def generate_cpp_entry_points(
                 gpu=gpu,
             )
             for binding_name, structured_name in bindings_to_generate
-        )
+        ),
+        *(
+            generate_cpp_async_entry_point(
+                binding_name + "_async",
+                lookup_decl(structured_name),
+                vectorization=vectorization,
+                use_torch=use_torch,
+                gpu=gpu,
+            )
+            for binding_name, structured_name in bindings_to_generate
+            if binding_name in async_bindings
+        ),
     )
 
     entry_point_header = (
@@ -125,13 +153,22 @@ def generate_cpp_entry_points(
         if gpu
         else "knossos-entry-points-torch.h"
         if use_torch
-        else "knossos-entry-points.h"
+        else "knossos-entry-points-numpy.h"
+    )
+
+    # Without torch, the declarations may mention NumPy arrays
+    numpy_header = "" if use_torch else "#include <pybind11/numpy.h>\n"
+
+    # The async_result returned by asynchronous entry points is needed by
+    # both the declarations and the definitions
+    async_header = (
+        '#include "knossos-entry-points-async.h"\n' if async_bindings else ""
     )
 
     return (
         f"""
 #include "knossos-types.h"
-
+{numpy_header}{async_header}
 namespace ks {{
 namespace entry_points {{
 namespace generated {{
@@ -142,7 +179,7 @@ namespace generated {{
 """,
         f"""
 #include "{entry_point_header}"
-
+{async_header}
 namespace ks {{
 namespace entry_points {{
 namespace generated {{
@@ -186,6 +223,15 @@ def generate_cpp_entry_point(
         if not use_torch:
             raise ValueError("VMap only available when using torch")
         return generate_cpp_vmap_entry_point(cpp_function_name, decl)
+    if decl.name.is_derived("suffwdpass") or decl.name.is_derived("sufrevpass"):
+        if not use_torch:
+            raise ValueError(
+                "Forward and reverse passes only available when using torch"
+            )
+        if decl.name.is_derived("suffwdpass"):
+            return generate_cpp_fwdpass_entry_point(cpp_function_name, decl)
+        else:
+            return generate_cpp_revpass_entry_point(cpp_function_name, decl)
 
     arg_types = arg_types_of_decl(decl)
     num_args = len(arg_types)
@@ -213,9 +259,20 @@ def generate_cpp_entry_point(
     for i in range(num_args):
         cpp += f"    auto ks_arg{i} = convert_argument<{ks_cpp_type(arg_types[i])}>(arg{i});\n"
 
-    # auto ks_ret = ks::my_kernel(&g_alloc, ks_arg0, ..., ks_arg7);
+    # The arguments have already been converted from Python by pybind11,
+    # so with torch none of the call needs the GIL
+    if use_torch:
+        cpp += "    pybind11::gil_scoped_release ks_nogil;\n"
+
+    # static thread_local memory_planner planner;
+    # auto ks_ret = planner.call([&](ks::allocator * alloc) {
+    #     return ks::my_kernel(alloc, ks_arg0, ..., ks_arg7);
+    # }, ks_arg0, ..., ks_arg7);
     cpp += f"""
-    auto ks_ret = ks::{ks_function_name}(&g_alloc {join_args("", lambda i: f", ks_arg{i}")});
+    static thread_local memory_planner planner;
+    auto ks_ret = planner.call([&](ks::allocator * alloc) {{
+        return ks::{ks_function_name}(alloc {join_args("", lambda i: f", ks_arg{i}")});
+    }}{join_args("", lambda i: f", ks_arg{i}")});
 """
 
     # convert return value and return
@@ -226,6 +283,132 @@ def generate_cpp_entry_point(
     return cpp_declaration, cpp
 
 
+def generate_cpp_async_entry_point(
+    cpp_function_name: str,
+    decl: Def,
+    vectorization: VecSpec,
+    use_torch: bool,
+    gpu: bool,
+):
+    """
+    An entry point which converts its arguments and returns at once an
+    async_result, from which Python collects the result of the call (see
+    knossos-entry-points-async.h)
+    """
+    if not use_torch:
+        raise ValueError("Asynchronous entry points only available when using torch")
+    if gpu or not isinstance(vectorization, VecSpec_None):
+        raise ValueError(
+            "Asynchronous entry points not available with vectorization or GPU"
+        )
+
+    arg_types = arg_types_of_decl(decl)
+    num_args = len(arg_types)
+
+    def join_args(sep, callable):
+        return sep.join(callable(i) for i in range(num_args))
+
+    ks_function_name = utils.encode_name(decl.name.mangled())
+
+    cpp_arg_types = [entry_point_cpp_type(t, use_torch=True) for t in arg_types]
+    cpp_return_type = entry_point_cpp_type(decl.return_type, use_torch=True)
+
+    # ks::entry_points::async_result entry_async(torch::Tensor arg0, ..., torch::Tensor arg7)
+    cpp_function = f"ks::entry_points::async_result {cpp_function_name}({join_args(', ', lambda i: f'{cpp_arg_types[i]} arg{i}')})"
+
+    cpp_declaration = f"{cpp_function};\n"
+
+    # The compute function captures the torch arguments, whose memory the
+    # converted arguments may refer to, to keep them alive
+    cpp = f"""
+{cpp_function} {{
+    return call_async(
+        [&]() {{
+            return ks::make_Tuple({join_args(", ", lambda i: f"convert_argument<{ks_cpp_type(arg_types[i])}>(arg{i})")});
+        }},
+        [{join_args(", ", lambda i: f"arg{i}")}](auto const& ks_args) {{
+            return ks::{ks_function_name}(get_allocator(){join_args("", lambda i: f", ks::get<{i}>(ks_args)")});
+        }},
+        [](auto const& ks_ret) {{
+            return pybind11::cast(convert_return_value<{cpp_return_type}>(ks_ret));
+        }});
+}}
+"""
+    return cpp_declaration, cpp
+
+
+def generate_cpp_fwdpass_entry_point(cpp_function_name, decl):
+    """
+    An entry point for suffwdpass$f, which returns a Python tuple of the
+    result of f and a capsule holding the bog, for the matching
+    sufrevpass$f entry point (see bog_handle in knossos-entry-points-torch.h)
+    """
+    arg_types = arg_types_of_decl(decl)
+    num_args = len(arg_types)
+    result_type, bog_type = decl.return_type.tuple_elems()
+
+    def join_args(sep, callable):
+        return sep.join(callable(i) for i in range(num_args))
+
+    ks_function_name = utils.encode_name(decl.name.mangled())
+
+    cpp_arg_types = [entry_point_cpp_type(t, use_torch=True) for t in arg_types]
+    cpp_result_type = entry_point_cpp_type(result_type, use_torch=True)
+
+    # pybind11::tuple entry_fwdpass(torch::Tensor arg0, ..., torch::Tensor arg7)
+    cpp_function = f"pybind11::tuple {cpp_function_name}({join_args(', ', lambda i: f'{cpp_arg_types[i]} arg{i}')})"
+
+    cpp_declaration = f"{cpp_function};\n"
+
+    cpp = f"""
+{cpp_function} {{
+"""
+    for i in range(num_args):
+        cpp += f"    auto ks_arg{i} = convert_argument<{ks_cpp_type(arg_types[i])}>(arg{i});\n"
+
+    # Not planned (see memory_planner): the bog must outlive the workspace
+    cpp += f"""
+    ks::allocator * alloc = get_allocator();
+    ks::alloc_mark_t mark = alloc->mark();
+    auto ks_ret = ks::{ks_function_name}(alloc {join_args("", lambda i: f", ks_arg{i}")});
+    auto bog = make_bog_capsule<{ks_cpp_type(bog_type)}>(alloc, mark, ks::get<1>(ks_ret));
+    return pybind11::make_tuple(convert_return_value<{cpp_result_type}>(ks::get<0>(ks_ret)), bog);
+}}
+"""
+    return cpp_declaration, cpp
+
+
+def generate_cpp_revpass_entry_point(cpp_function_name, decl):
+    """
+    An entry point for sufrevpass$f, which takes the gradient of the
+    result of f and a capsule from the suffwdpass$f entry point
+    """
+    arg_types = arg_types_of_decl(decl)
+    if len(arg_types) != 2:
+        raise ValueError("A reverse pass takes a gradient and a bog")
+    dresult_type, bog_type = arg_types
+
+    ks_function_name = utils.encode_name(decl.name.mangled())
+
+    cpp_dresult_type = entry_point_cpp_type(dresult_type, use_torch=True)
+    cpp_return_type = entry_point_cpp_type(decl.return_type, use_torch=True)
+
+    # std::tuple<torch::Tensor, torch::Tensor> entry_revpass(torch::Tensor arg0, pybind11::capsule bog)
+    cpp_function = f"{cpp_return_type} {cpp_function_name}({cpp_dresult_type} arg0, pybind11::capsule bog)"
+
+    cpp_declaration = f"{cpp_function};\n"
+
+    cpp = f"""
+{cpp_function} {{
+    auto ks_arg0 = convert_argument<{ks_cpp_type(dresult_type)}>(arg0);
+    auto const& ks_bog = bog_of_capsule<{ks_cpp_type(bog_type)}>(bog);
+    auto ks_ret = ks::{ks_function_name}(get_allocator(), ks_arg0, ks_bog);
+    return convert_return_value<{cpp_return_type}>(ks_ret);
+}}
+"""
+    return cpp_declaration, cpp
+
+
 def generate_cpp_elementwise_entry_point(cpp_function_name, decl):
     arg_types = arg_types_of_decl(decl)
     if not all(a == Type.Float for a in arg_types):
@@ -253,16 +436,17 @@ def generate_cpp_elementwise_entry_point(cpp_function_name, decl):
     # auto* arg_data7 = arg7.data_ptr<float>();
     for i in range(num_args):
         cpp += f"""
-    KS_ASSERT(arg{i}.is_contiguous());
+    arg{i} = arg{i}.contiguous(); // No copy unless arg{i} is strided
     KS_ASSERT(arg{i}.scalar_type() == scalar_type_of_Float);
     auto* arg_data{i} = arg{i}.data_ptr<float>();
 """
-    # ret_data[i] = ks::my_op(&g_alloc, arg_data0[i], arg_data1[i]);
+    # ret_data[i] = ks::my_op(alloc, arg_data0[i], arg_data1[i]);
     cpp += f"""
+    ks::allocator * alloc = get_allocator();
     auto ret = torch::empty_like(arg0);
     auto* ret_data = ret.data_ptr<float>();
-    for (int i = 0, ne = arg0.numel(); i != ne; ++i) {{
-        ret_data[i] = ks::{ks_function_name}(&g_alloc {join_args("", lambda i: f", arg_data{i}[i]")});
+    for (int64_t i = 0, ne = arg0.numel(); i != ne; ++i) {{
+        ret_data[i] = ks::{ks_function_name}(alloc {join_args("", lambda i: f", arg_data{i}[i]")});
     }}
     return ret;
 }}
@@ -294,8 +478,8 @@ def generate_cpp_cuda_entry_point(cpp_function_name, decl):
     struct functor_{cpp_function_name}
     {{
         template<typename scalar_t>
-        inline __device__ scalar_t operator()({join_args(', ', lambda i: f'scalar_t arg{i}')}) {{
-            return {ks_function_name}(nullptr, {join_args(', ', lambda i: f'arg{i}')});
+        inline __device__ scalar_t operator()(ks::allocator * alloc, {join_args(', ', lambda i: f'scalar_t arg{i}')}) {{
+            return {ks_function_name}(alloc, {join_args(', ', lambda i: f'arg{i}')});
         }}
     }};
     {cpp_function} {{
@@ -341,6 +525,7 @@ torch::Tensor {cpp_function_name}({join_args(lambda k: f'torch::Tensor arg{k}')}
     cpp = f"""
 {cpp_function} {{
     int64_t n = arg0.size(0);
+    ks::allocator * alloc = get_allocator();
 """
 
     # auto ks_arg0 = convert_argument<ks::tensor<2,float>>(arg0)
@@ -348,32 +533,27 @@ torch::Tensor {cpp_function_name}({join_args(lambda k: f'torch::Tensor arg{k}')}
     # auto ks_arg7 = convert_argument<ks::tensor<1,int>>(arg7)
     for k in range(num_args):
         cpp += f"""
-    KS_ASSERT(arg{k}.is_contiguous());
     KS_ASSERT(arg{k}.scalar_type() == scalar_type_of_Float);
     KS_ASSERT(arg{k}.size(0) == n);
 
     auto ks_arg{k} = convert_argument<{ks_types[k]}>(arg{k});
 """
 
-    # Difficulty: depending on the rank of ks_ret, ks_ret[i] returns either
-    #   Rank 1: a reference to the float at  index i
-    #   Rank 2: an rvalue representing a view on subtensor i.
-    # inplace add must act differently on each, so we switch on the return dimension here
-
+    # Each element of the batch is computed by a call of the per-sample
+    # function on views of the batch-major inputs, and copied straight
+    # into the torch output; for_each_in_batch resets the arena between
+    # elements, and under KS_PARALLEL shares the batch between threads.
     ks_return_type = add_vmap_dimension(decl.return_type)
     ks_return_dim = ks_return_type.tensor_rank
     if ks_return_dim == 1:
         cpp += f"""
     // Create Torch return value
-    auto ret = torch::zeros({{n}});
+    auto ret = torch::empty({{n}}, torch::TensorOptions().dtype(scalar_type_of_Float));
     ks::Float* ret_ptr = ret.data_ptr<ks::Float>();
 
-    KS_MARK(&g_alloc, mark);
-    for (int i = 0; i != n; ++i) {{
-        ret_ptr[i] = ks::{ks_name}(&g_alloc {concat_args(lambda k: f", ks_arg{k}[i]")});
-        // We have copied the return value, can reset allocator
-        KS_RESET(&g_alloc, mark);
-    }}
+    for_each_in_batch(alloc, 0, n, [&](ks::allocator * alloc, ks::Integer i) {{
+        ret_ptr[i] = ks::{ks_name}(alloc {concat_args(lambda k: f", ks_arg{k}[i]")});
+    }});
 
     return ret;
 }}
@@ -384,28 +564,23 @@ torch::Tensor {cpp_function_name}({join_args(lambda k: f'torch::Tensor arg{k}')}
     KS_ASSERT(n > 0); // TODO: Zero-size tensors
 
     // Make the first call to determine output size
-    auto ret0 = ks::{ks_name}(&g_alloc {concat_args(lambda k: f", ks_arg{k}[0]")});
+    auto ret0 = ks::{ks_name}(alloc {concat_args(lambda k: f", ks_arg{k}[0]")});
 
     // Create Torch return value
     auto [{ks_sizes}] = ret0.size();
-    // TODO: use torch::empty here, and copydown below.
-    auto ret = torch::zeros({{n, {ks_sizes}}});
-    // And wrap it in ks - this is a view of the torch data, so convert_argument, not convert_return_value
-    auto ks_ret = convert_argument<ks::tensor<{ks_return_dim}, Float>>(ret);
+    auto ret = torch::empty({{n, {ks_sizes}}}, torch::TensorOptions().dtype(scalar_type_of_Float));
+    ks::Float* ret_ptr = ret.data_ptr<ks::Float>();
+    ks::Integer ne = ret0.num_elements();
 
     // Place 0th value in the output
-    auto ks_ret0 = ks_ret[0];
-    inplace_add(&ks_ret0, ret0); // This would update a temporary in the 1D case
+    std::memcpy(ret_ptr, ret0.data(), ne * sizeof(ks::Float));
 
     // And then place the rest
-    KS_MARK(&g_alloc, mark);
-    for (int i = 1; i != n; ++i) {{
-        auto val = ks::{ks_name}(&g_alloc {concat_args(lambda k: f", ks_arg{k}[i]")});
-        auto ks_ret_view = ks_ret[i];
-        inplace_add(&ks_ret_view, val);
-        // We have copied the return value, can reset allocator
-        KS_RESET(&g_alloc, mark);
-    }}
+    for_each_in_batch(alloc, 1, n, [&](ks::allocator * alloc, ks::Integer i) {{
+        auto val = ks::{ks_name}(alloc {concat_args(lambda k: f", ks_arg{k}[i]")});
+        KS_ASSERT(val.num_elements() == ne);
+        std::memcpy(ret_ptr + i * ne, val.data(), ne * sizeof(ks::Float));
+    }});
 
     return ret;
 }}
@@ -2,6 +2,8 @@ from dataclasses import dataclass
 from typing import List
 
 import atexit
+import functools
+import hashlib
 import os
 import subprocess
 import sysconfig
@@ -53,6 +55,20 @@ default_cflags = CFlags(
     ],
 )
 
+# Add to the cflags to run build, sumbuild and map across a thread pool
+# (sized by the KS_NUM_THREADS environment variable, if set)
+parallel_cflags = CFlags(
+    cl_flags=["/DKS_PARALLEL"], gcc_flags=["-DKS_PARALLEL", "-pthread"],
+)
+
+# Add to the cflags to record a profile of every generated function, which
+# the module returns from profile_chrome_trace() and profile_flat()
+profile_cflags = CFlags(cl_flags=["/DKS_PROFILE"], gcc_flags=["-DKS_PROFILE"])
+
+# Add to the cflags to store tensors of tuples as one tensor per field
+# (see knossos-soa.h)
+soa_cflags = CFlags(cl_flags=["/DKS_SOA"], gcc_flags=["-DKS_SOA"])
+
 
 def subprocess_run(cmd, env=None):
     return (
@@ -60,9 +76,96 @@ def subprocess_run(cmd, env=None):
     )
 
 
+# The C++ which ksc generates, and the modules which
+# build_py_module_from_cpp builds, are kept in compile_cache_dir(), named
+# by a hash of everything which determines them: the ks source, the
+# preludes and runtime headers (by content), the ksc binary and compiler,
+# and the flags.  So a process which compiles the same source as an earlier
+# one, or as a concurrent one, skips ksc and g++.  Entries are written to a
+# temporary name and then renamed, so readers see whole files or nothing;
+# two processes which miss together both compile, and the second rename
+# replaces an identical file.
+#
+# Set KSC_COMPILE_CACHE=0 to disable the cache, or KSC_COMPILE_CACHE_DIR
+# to move it.  Entries are never evicted: delete the directory to reclaim
+# the space.
+use_compile_cache = os.environ.get("KSC_COMPILE_CACHE", "1") != "0"
+
+
+def compile_cache_dir():
+    cache_dir = os.environ.get("KSC_COMPILE_CACHE_DIR") or os.path.join(
+        utils.get_ksc_build_dir(), "compile_cache"
+    )
+    os.makedirs(cache_dir, exist_ok=True)
+    return cache_dir
+
+
+@functools.lru_cache(maxsize=None)
+def _runtime_version(ksc_runtime_dir):
+    """
+    A hash of the contents of the runtime directory, which holds the
+    preludes and every header the generated C++ can include
+    """
+    h = hashlib.sha256()
+    for name in sorted(os.listdir(ksc_runtime_dir)):
+        path = os.path.join(ksc_runtime_dir, name)
+        if os.path.isfile(path):
+            h.update(name.encode() + b"\0")
+            with open(path, "rb") as f:
+                h.update(f.read())
+    return h.hexdigest()
+
+
+@functools.lru_cache(maxsize=None)
+def _compiler_version(compiler):
+    return subprocess_run([compiler, "--version"])
+
+
+def _file_identity(path):
+    try:
+        st = os.stat(path)
+    except OSError:
+        return path
+    return f"{path}:{st.st_size}:{st.st_mtime_ns}"
+
+
+def _cache_key(*parts):
+    h = hashlib.sha256()
+    for part in parts:
+        h.update(repr(part).encode() + b"\0")
+    return h.hexdigest()
+
+
+def _cache_write(path, contents):
+    with NamedTemporaryFile(
+        mode="w", dir=os.path.dirname(path), suffix=".tmp", delete=False
+    ) as f:
+        f.write(contents)
+    os.replace(f.name, path)
+
+
 def generate_cpp_from_ks(ks_str, ks_entry_points, preludes, prelude_headers):
     ksc_path, ksc_runtime_dir = utils.get_ksc_paths()
 
+    if use_compile_cache:
+        key = _cache_key(
+            "ksc",
+            ks_str,
+            [str(entry_point) for entry_point in ks_entry_points],
+            preludes,
+            prelude_headers,
+            _runtime_version(ksc_runtime_dir),
+            _file_identity(ksc_path),
+        )
+        cached_cpp = os.path.join(compile_cache_dir(), key + ".cpp")
+        cached_kso = os.path.join(compile_cache_dir(), key + ".kso")
+        # The .kso is written first, so the .cpp marks a complete entry
+        if os.path.isfile(cached_cpp):
+            print("generate_cpp_from_ks: Using cached", cached_cpp)
+            with open(cached_cpp) as f:
+                generated_cpp = f.read()
+            return generated_cpp, list(parse_ks_filename(cached_kso))
+
     with NamedTemporaryFile(mode="w", suffix=".ks", delete=False) as fks:
         fks.write(ks_str)
     with NamedTemporaryFile(mode="w", suffix=".kso", delete=False) as fkso:
@@ -121,6 +224,11 @@ def generate_cpp_from_ks(ks_str, ks_entry_points, preludes, prelude_headers):
     with open(fcpp.name) as f:
         generated_cpp = f.read()
 
+    if use_compile_cache:
+        with open(fkso.name) as f:
+            _cache_write(cached_kso, f.read())
+        _cache_write(cached_cpp, generated_cpp)
+
     # only delete these file if no error
     if not preserve_temporary_files:
 
@@ -139,6 +247,57 @@ def generate_cpp_from_ks(ks_str, ks_entry_points, preludes, prelude_headers):
     return generated_cpp, decls
 
 
+# build_py_module_from_cpp compiles the runtime's common part once for
+# each set of flags, and reuses it for every module: knossos-pch.h is
+# precompiled, and knossos-runtime.cpp, which holds the runtime's
+# non-template definitions and the instantiations in knossos-prebuilt.h,
+# is compiled to an object which each module links.  These are kept in
+# compile_cache_dir() whether or not use_compile_cache is set.  Set
+# KSC_PREBUILT_RUNTIME=0 to compile all of the runtime in each module.
+use_prebuilt_runtime = os.environ.get("KSC_PREBUILT_RUNTIME", "1") != "0"
+
+
+def _run_compiler(cmd):
+    print(cmd)
+    try:
+        subprocess.run(cmd, shell=True, capture_output=True, check=True)
+    except subprocess.CalledProcessError as e:
+        print(cmd)
+        print(e.output.decode("utf-8"))
+        print(e.stderr.decode("utf-8"))
+        raise
+
+
+def _prebuilt_runtime(flags, ksc_runtime_dir):
+    """
+    The precompiled header to -include, and the runtime object to link,
+    for modules compiled with flags, building them if necessary
+    """
+    key = _cache_key(
+        "runtime", flags, _runtime_version(ksc_runtime_dir), _compiler_version("g++")
+    )
+    runtime_dir = os.path.join(compile_cache_dir(), "runtime-" + key[:32])
+    os.makedirs(runtime_dir, exist_ok=True)
+
+    # g++ uses knossos-pch.h.gch in place of the knossos-pch.h beside it
+    pch_header = os.path.join(runtime_dir, "knossos-pch.h")
+    pch = pch_header + ".gch"
+    runtime_object = os.path.join(runtime_dir, "knossos-runtime.o")
+
+    def build(output, cmd):
+        if not os.path.isfile(output):
+            tmp = f"{output}.{os.getpid()}.tmp"
+            _run_compiler(cmd + f" -o {tmp}")
+            os.replace(tmp, output)
+
+    build(pch, f"g++ {flags} -x c++-header {ksc_runtime_dir}/knossos-pch.h")
+    if not os.path.isfile(pch_header):
+        with open(os.path.join(ksc_runtime_dir, "knossos-pch.h")) as f:
+            _cache_write(pch_header, f.read())
+    build(runtime_object, f"g++ {flags} -c {ksc_runtime_dir}/knossos-runtime.cpp")
+    return pch_header, runtime_object
+
+
 def build_py_module_from_cpp(cpp_str, profiling=False):
     """
     Build python module, independently of pytorch, non-ninja
@@ -146,34 +305,72 @@ def build_py_module_from_cpp(cpp_str, profiling=False):
     _ksc_path, ksc_runtime_dir = utils.get_ksc_paths()
     pybind11_path = utils.get_ksc_dir() + "/extern/pybind11"
 
-    with NamedTemporaryFile(mode="w", suffix=".cpp", delete=False) as fcpp:
-        fcpp.write(cpp_str)
-
     extension_suffix = sysconfig.get_config_var("EXT_SUFFIX")
     if extension_suffix is None:
         extension_suffix = sysconfig.get_config_var("SO")
 
-    with NamedTemporaryFile(mode="w", suffix=extension_suffix, delete=False) as fpymod:
-        pass
-    module_path = fpymod.name
-    module_name = os.path.basename(module_path).split(".")[0]
     python_includes = subprocess_run(
         [sys.executable, "-m", "pybind11", "--includes"],
         env={"PYTHONPATH": pybind11_path},
     )
+    flags = (
+        f"-I{ksc_runtime_dir} -I{pybind11_path}/include "
+        + python_includes
+        + " -Wall -Wno-unused-variable -Wno-unused-but-set-variable"
+        " -fmax-errors=1"
+        " -std=c++17"
+        " -O3"
+        " -fPIC"
+        + (" -g -pg -O3" if profiling else "")
+        + (" -DKS_PREBUILT_RUNTIME" if use_prebuilt_runtime else "")
+    )
+
+    if use_compile_cache:
+        key = _cache_key(
+            "g++",
+            cpp_str,
+            flags,
+            extension_suffix,
+            _runtime_version(ksc_runtime_dir),
+            _compiler_version("g++"),
+        )
+        # The module name is compiled into the module (as PyInit_<name>),
+        # so it is derived from the key rather than from a temporary file
+        module_name = "ksc_" + key[:32]
+        module_path = os.path.join(compile_cache_dir(), module_name + extension_suffix)
+        if os.path.isfile(module_path):
+            print("build_py_module_from_cpp: Using cached", module_path)
+            return module_name, module_path
+        with NamedTemporaryFile(
+            mode="w", dir=compile_cache_dir(), suffix=".tmp", delete=False
+        ) as fpymod:
+            pass
+    else:
+        with NamedTemporaryFile(
+            mode="w", suffix=extension_suffix, delete=False
+        ) as fpymod:
+            pass
+        module_path = fpymod.name
+        module_name = os.path.basename(module_path).split(".")[0]
+
+    with NamedTemporaryFile(mode="w", suffix=".cpp", delete=False) as fcpp:
+        fcpp.write(cpp_str)
+
+    if use_prebuilt_runtime:
+        pch_header, runtime_object = _prebuilt_runtime(flags, ksc_runtime_dir)
+        prebuilt_flags = f" -include {pch_header}"
+        prebuilt_objects = f" {runtime_object}"
+    else:
+        prebuilt_flags = prebuilt_objects = ""
+
     try:
         cmd = (
-            f"g++ -I{ksc_runtime_dir} -I{pybind11_path}/include "
-            + python_includes
-            + " -Wall -Wno-unused-variable -Wno-unused-but-set-variable"
-            " -fmax-errors=1"
-            " -std=c++17"
-            " -O3"
-            " -fPIC"
-            + (" -g -pg -O3" if profiling else "")
+            "g++ "
+            + flags
+            + prebuilt_flags
             + " -shared"
             + f" -DPYTHON_MODULE_NAME={module_name}"
-            f" -o {module_path} " + fcpp.name
+            f" -o {fpymod.name} " + fcpp.name + prebuilt_objects
         )
         print(cmd)
         subprocess.run(cmd, shell=True, capture_output=True, check=True)
@@ -182,18 +379,23 @@ def build_py_module_from_cpp(cpp_str, profiling=False):
         print(cmd)
         print(e.output.decode("utf-8"))
         print(e.stderr.decode("utf-8"))
+        if use_compile_cache:
+            os.unlink(fpymod.name)
 
         raise
 
+    if use_compile_cache:
+        os.replace(fpymod.name, module_path)
+
     if not preserve_temporary_files:
 
         @atexit.register
         def _():
-            print(
-                "ksc.utils.build_py_module_from_cpp: Deleting", fcpp.name, fpymod.name,
-            )
+            print("ksc.utils.build_py_module_from_cpp: Deleting", fcpp.name)
             os.unlink(fcpp.name)
-            os.unlink(fpymod.name)
+            if not use_compile_cache:
+                print("ksc.utils.build_py_module_from_cpp: Deleting", module_path)
+                os.unlink(module_path)
 
     return module_name, module_path
 
@@ -209,11 +411,14 @@ def generate_cpp_for_py_module_from_ks(
     use_aten=True,
     use_torch=False,
     gpu=False,
+    async_bindings=(),
 ):
     """Returns two strings of C++ code:
        The first string contains definitions of all ksc-generated functions and entry points.
        The second string defines a pybind module which uses the entry points.
        These can either be compiled separately or concatenated into a single source file.
+       Each binding named in async_bindings also gets an asynchronous entry
+       point, with the suffix _async (see knossos-entry-points-async.h).
        """
 
     def mangled_with_type(structured_name):
@@ -223,9 +428,14 @@ def generate_cpp_for_py_module_from_ks(
             )
         return structured_name.mangled()
 
+    python_names = [python_name for (python_name, _) in bindings_to_generate] + [
+        python_name + "_async"
+        for (python_name, _) in bindings_to_generate
+        if python_name in async_bindings
+    ]
     bindings = [
         (python_name, "ks::entry_points::generated::" + python_name)
-        for (python_name, _) in bindings_to_generate
+        for python_name in python_names
     ]
 
     preludes = ["prelude.ks"] + (["prelude-aten.ks"] if use_aten else [])
@@ -242,6 +452,7 @@ def generate_cpp_for_py_module_from_ks(
         vectorization=vectorization,
         use_torch=use_torch,
         gpu=gpu,
+        async_bindings=async_bindings,
     )
     cpp_pybind_module_declaration = generate_cpp_pybind_module_declaration(
         bindings, python_module_name
@@ -264,12 +475,23 @@ def generate_cpp_pybind_module_declaration(bindings_to_generate, python_module_n
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 
+#include "knossos-entry-points-async.h"
+
 namespace ks {
 namespace entry_points {
 
 void reset_allocator();
 size_t allocator_top();
 size_t allocator_peak();
+void set_allocator_size(size_t max_size);
+void set_default_allocator_size(size_t max_size);
+void set_zero_copy_outputs(bool enabled);
+bool zero_copy_outputs();
+void set_memory_planning(bool enabled);
+bool memory_planning();
+std::string profile_chrome_trace();
+std::string profile_flat();
+void profile_reset();
 
 }
 }
@@ -280,6 +502,18 @@ PYBIND11_MODULE("""
     m.def("reset_allocator", &ks::entry_points::reset_allocator);
     m.def("allocator_top", &ks::entry_points::allocator_top);
     m.def("allocator_peak", &ks::entry_points::allocator_peak);
+    m.def("set_allocator_size", &ks::entry_points::set_allocator_size);
+    m.def("set_default_allocator_size", &ks::entry_points::set_default_allocator_size);
+    m.def("set_zero_copy_outputs", &ks::entry_points::set_zero_copy_outputs);
+    m.def("zero_copy_outputs", &ks::entry_points::zero_copy_outputs);
+    m.def("set_memory_planning", &ks::entry_points::set_memory_planning);
+    m.def("memory_planning", &ks::entry_points::memory_planning);
+    m.def("profile_chrome_trace", &ks::entry_points::profile_chrome_trace);
+    m.def("profile_flat", &ks::entry_points::profile_flat);
+    m.def("profile_reset", &ks::entry_points::profile_reset);
+    m.def("set_async_threads", &ks::entry_points::set_async_threads);
+    m.def("async_threads", &ks::entry_points::async_threads);
+    ks::entry_points::bind_async_result(m);
 """
         + "\n".join(m_def(*t) for t in bindings_to_generate)
         + """
@@ -326,6 +560,7 @@ def build_module_using_pytorch_from_ks(
     use_aten=False,
     extra_cflags=[],
     gpu=False,
+    async_bindings=(),
 ):
     """Uses PyTorch C++ extension mechanism to build and load a module
 
@@ -338,6 +573,11 @@ def build_module_using_pytorch_from_ks(
       The StructuredName is the ksc function to expose to Python.  The
       str is the Python name given to that function when exposed.
       Each StructuredName must have a type attached
+
+    * async_bindings : Iterable[str]
+
+      The Python names of bindings which also get an asynchronous entry
+      point, whose Python name has the suffix _async
     """
     cpp_definitions, cpp_pybind = generate_cpp_for_py_module_from_ks(
         ks_str,
@@ -347,6 +587,7 @@ def build_module_using_pytorch_from_ks(
         use_aten=use_aten,
         use_torch=True,
         gpu=gpu,
+        async_bindings=async_bindings,
     )
 
     return build_module_using_pytorch_from_cpp_backend(
@@ -365,8 +606,17 @@ def build_module_using_pytorch_from_cpp(
     cpp_pybind = generate_cpp_pybind_module_declaration(
         bindings_to_generate, "TORCH_EXTENSION_NAME"
     )
+    # Unlike the output of ksc, hand-written C++ does not end by including
+    # the runtime's non-template definitions
     return build_module_using_pytorch_from_cpp_backend(
-        [("ksc.cpp", cpp_str + cpp_pybind + '#include "knossos-entry-points.cpp"\n')],
+        [
+            (
+                "ksc.cpp",
+                cpp_str
+                + cpp_pybind
+                + '#include "knossos.cpp"\n#include "knossos-entry-points.cpp"\n',
+            )
+        ],
         torch_extension_name,
         extra_cflags,
     )
@@ -0,0 +1,124 @@
+"""
+In-process compilation of ks source through the MLIR backend.
+
+    jit = MlirJit(opt_level=2, cache_dir="~/.cache/ksc-mlir")
+    jit.add_source(ks_str)
+    f = jit.function("f", [Type.Integer, Type.Float], Type.Float)
+    f(3, 1.5)
+
+Unlike ksc.compile, which runs ksc and then a C++ compiler for each
+module, this compiles in the calling process, with the JIT in
+libKscMlirJit (built alongside ksc-mlir), and calls the compiled code
+through ctypes.  With a cache_dir, the object code of each module is
+kept between processes, so a module which has been compiled before
+costs only its parse and lowering.
+
+Only functions whose arguments and results are Integer, Float or Bool
+can be called from Python so far: the MLIR backend passes vectors as
+expanded memref descriptors.
+"""
+
+import ctypes
+import os
+import sys
+
+from ksc.type import Type
+from ksc.utils import encode_name, get_ksc_build_dir
+
+_ctypes_of_scalar = {
+    "Integer": ctypes.c_int64,
+    "Float": ctypes.c_double,
+    "Bool": ctypes.c_bool,
+}
+
+
+def _ctype(ty: Type):
+    if ty.kind not in _ctypes_of_scalar:
+        raise ValueError(f"MlirJit cannot pass {ty} values to or from Python")
+    return _ctypes_of_scalar[ty.kind]
+
+
+def _default_library_path():
+    if "KSC_MLIR_JIT_LIB" in os.environ:
+        return os.environ["KSC_MLIR_JIT_LIB"]
+    if sys.platform == "win32":
+        name = "KscMlirJit.dll"
+    elif sys.platform == "darwin":
+        name = "libKscMlirJit.dylib"
+    else:
+        name = "libKscMlirJit.so"
+    return os.path.join(get_ksc_build_dir(), "lib", name)
+
+
+_lib = None
+
+
+def _get_lib(path=None):
+    global _lib
+    if _lib is None:
+        lib = ctypes.CDLL(path or _default_library_path())
+        lib.ksc_jit_create.restype = ctypes.c_void_p
+        lib.ksc_jit_create.argtypes = [ctypes.c_int, ctypes.c_char_p]
+        lib.ksc_jit_destroy.restype = None
+        lib.ksc_jit_destroy.argtypes = [ctypes.c_void_p]
+        lib.ksc_jit_add_source.restype = ctypes.c_void_p
+        lib.ksc_jit_add_source.argtypes = [
+            ctypes.c_void_p,
+            ctypes.c_char_p,
+            ctypes.c_char_p,
+        ]
+        lib.ksc_jit_lookup.restype = ctypes.c_void_p
+        lib.ksc_jit_lookup.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+        lib.ksc_jit_last_error.restype = ctypes.c_char_p
+        lib.ksc_jit_last_error.argtypes = []
+        _lib = lib
+    return _lib
+
+
+class MlirJitError(RuntimeError):
+    pass
+
+
+class MlirJit:
+    def __init__(self, opt_level=2, cache_dir=None, library_path=None):
+        self._lib = _get_lib(library_path)
+        if cache_dir is not None:
+            cache_dir = os.path.expanduser(cache_dir).encode()
+        self._jit = self._lib.ksc_jit_create(opt_level, cache_dir)
+        if not self._jit:
+            self._raise()
+
+    def _raise(self):
+        raise MlirJitError(self._lib.ksc_jit_last_error().decode())
+
+    def add_source(self, ks_str, filename="<string>"):
+        """
+        Compile ks_str.  Its functions may call those of any source added before.
+        """
+        if not self._lib.ksc_jit_add_source(
+            self._jit, ks_str.encode(), filename.encode()
+        ):
+            self._raise()
+
+    def function(self, name, arg_types, return_type):
+        """
+        A Python callable for the def of name with arguments arg_types,
+        mangled as ksc-mlir does, e.g. ("f", [Type.Integer, Type.Float]) is f$aif
+        """
+        if arg_types:
+            symbol = encode_name(name + "@" + "".join(t.shortstr() for t in arg_types))
+        else:
+            symbol = name
+        addr = self._lib.ksc_jit_lookup(self._jit, symbol.encode())
+        if not addr:
+            self._raise()
+        signature = ctypes.CFUNCTYPE(_ctype(return_type), *map(_ctype, arg_types))
+        f = signature(addr)
+        # The function pointer is only valid while the JIT is alive
+        f.jit = self
+        return f
+
+    def __del__(self):
+        if getattr(self, "_jit", None):
+            self._lib.ksc_jit_destroy(self._jit)
+            self._jit = None
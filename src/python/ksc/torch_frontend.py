@@ -3,6 +3,7 @@ from types import ModuleType
 from dataclasses import dataclass, field, replace
 from contextlib import contextmanager
 
+import concurrent.futures
 import functools
 import itertools
 import inspect
@@ -448,7 +449,11 @@ def torch_to_ks(val):
     Return a KS-compatible version of val.
     If val is a scalar, just return it as a float.
     If val is a tensor, we may need to
-       (a) make it contiguous
+       (a) make it contiguous, if it is going to a CUDA kernel.  A CPU
+           tensor is passed as it is: the C++ entry point uses a contiguous
+           tensor in place, and gathers any other (e.g. a transpose or a
+           slice) into a contiguous copy in the arena, since generated
+           code takes a contiguous ks tensor (see knossos-strided.h)
        (b) ensure it's not garbage-collected while we're holding a view to it.
     """
     if isinstance(val, float):
@@ -461,7 +466,10 @@ def torch_to_ks(val):
         if len(val.shape) == 0:
             return val.item()
 
-        return val.contiguous()  # Get data, or copy if not already contiguous
+        if val.is_cuda:
+            return val.contiguous()  # Get data, or copy if not already contiguous
+
+        return val
 
     raise NotImplementedError()
 
@@ -472,8 +480,13 @@ def forward_template(py_mod, ctx, *args):
     py_mod.reset_allocator()
     ks_args = (torch_to_ks(x) for x in args)
 
-    # Call it
-    outputs = py_mod.entry(*ks_args)
+    # Call it.  With a ctx, and a split forward pass, the bog (bag of
+    # gradients) is kept on the ctx, holding its memory in the arena
+    # until the ctx is freed, so that backward needn't recompute it.
+    if ctx is not None and hasattr(py_mod, "entry_fwdpass"):
+        outputs, ctx.bog = py_mod.entry_fwdpass(*ks_args)
+    else:
+        outputs = py_mod.entry(*ks_args)
 
     if ctx is not None:
         ctx.torch_vals = ks_args
@@ -483,9 +496,18 @@ def forward_template(py_mod, ctx, *args):
 
 
 def backward_template(py_mod, ctx, *args):
-    ks_args = make_tuple_if_many_args(torch_to_ks(x) for x in ctx.saved_tensors)
     ks_grad_args = make_tuple_if_many_args(torch_to_ks(x) for x in args)
-    outputs = py_mod.entry_vjp(ks_args, ks_grad_args)
+    if hasattr(ctx, "bog"):
+        # The bog may refer to the inputs in place, so read saved_tensors
+        # anyway: autograd then raises if an input was modified in place
+        # since forward, rather than the gradients being silently wrong
+        ctx.saved_tensors
+        outputs = py_mod.entry_revpass(ks_grad_args, ctx.bog)
+    else:
+        ks_args = make_tuple_if_many_args(
+            torch_to_ks(x) for x in ctx.saved_tensors
+        )
+        outputs = py_mod.entry_vjp(ks_args, ks_grad_args)
     return torch_from_ks(outputs)
 
 
@@ -551,6 +573,7 @@ def ksc_defs_to_module(
         generate_lm,
         extra_cflags=default_cflags,
         gpu=gpu,
+        split_passes=not generate_lm,
     )
 
 
@@ -562,12 +585,25 @@ def ksc_string_to_module(
     generate_lm,
     extra_cflags,
     gpu=False,
+    split_passes=False,
 ):
     der = "rev" if generate_lm else "sufrev"
     bindings_to_generate = [
         ("entry", entry_sn),
         ("entry_vjp", StructuredName((der, entry_sn))),
     ]
+    # entry_async, for KscStub.call_async
+    async_bindings = (
+        ["entry"] if isinstance(vectorization, VecSpec_None) and not gpu else []
+    )
+    if split_passes and isinstance(vectorization, VecSpec_None) and not gpu:
+        # Used by forward_template and backward_template, so that backward
+        # reuses the forward pass rather than recomputing it.  ks_str must
+        # define suffwdpass and sufrevpass of the entry.
+        bindings_to_generate += [
+            ("entry_fwdpass", StructuredName(("suffwdpass", entry_sn))),
+            ("entry_revpass", StructuredName(("sufrevpass", entry_sn))),
+        ]
     return build_module_using_pytorch_from_ks(
         ks_str,
         bindings_to_generate,
@@ -576,6 +612,7 @@ def ksc_string_to_module(
         use_aten=True,
         extra_cflags=extra_cflags,
         gpu=gpu,
+        async_bindings=async_bindings,
     )
 
 
@@ -710,6 +747,32 @@ class KscStub:
         """
         return self.ensure_compiled(args).py_mod.entry(*args)
 
+    def call_async(self, *args):
+        """
+        Call the Knossos compiled function with pytorch tensors, without
+        waiting for it.  Returns a concurrent.futures.Future of the result,
+        which may be awaited with asyncio.wrap_future.  The arguments are
+        converted before returning, so the next call's may be converted
+        while this one runs.  The call runs without the GIL, in an arena of
+        its own, and is not recorded for autograd.
+        """
+        py_mod = self.ensure_compiled(args).py_mod
+        if not hasattr(py_mod, "entry_async"):
+            raise ValueError("call_async is not available with vectorization or GPU")
+        async_result = py_mod.entry_async(*(torch_to_ks(x) for x in args))
+
+        future = concurrent.futures.Future()
+        future.set_running_or_notify_cancel()
+
+        def on_done():
+            try:
+                future.set_result(torch_from_ks(async_result.result()))
+            except BaseException as e:
+                future.set_exception(e)
+
+        async_result.add_done_callback(on_done)
+        return future
+
     def _entry_vjp(self, *args):
         """
         Directly call the Knossos vjp function.
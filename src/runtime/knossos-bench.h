@@ -0,0 +1,599 @@
+// Benchmark harness for compiled ks functions
+#pragma once
+
+/*
+A suite times functions which take an allocator, e.g.
+
+	ks::bench::suite s("gmm", argc, argv);
+	s.run("test_inference[gmm_objective-Knossos C++-n1000_k200_d64]", "n1000_k200_d64",
+		[&](ks::allocator * alloc) { return ks::gmm_knossos_gmm_objective$a...(alloc, x, ...); });
+	return s.finish();
+
+The function should return the result of the call, which run passes to
+do_not_optimize: the generated code is compiled into the same translation
+unit, so the compiler could otherwise inline it and delete work whose
+only use is the result.
+
+Each benchmark is called a few times to warm up, then the number of
+calls in a round is doubled until a round takes at least min_round_time,
+so that the clock resolution doesn't matter, and rounds are repeated
+until min_time has passed (and there have been at least min_rounds).
+The arena is reset after every call, so allocator_peak is the most that
+one call allocates.
+
+Reported, for each benchmark, are the statistics of the mean time per
+call in each round (median, quartiles...), the calls per second, the
+latency percentiles (p50, p99) of single calls, the allocator peak and,
+on Linux where perf_event_open is allowed, hardware counters per call.
+A round may hold many calls, which averages away their tail, so the
+latencies are measured apart from the rounds: calls are timed one at a
+time, again until min_time has passed (and there have been at least
+min_rounds of them).  finish() prints a table to stdout and, with
+--json <file>, writes the results in the format of pytest-benchmark's
+--benchmark-save, so that they can be stored under .benchmarks and
+plotted across commits by src/bench/comparison_plot.py.  The commit is
+taken from KS_BENCH_COMMIT_ID and KS_BENCH_COMMIT_TIME (ISO 8601), which
+src/bench/run-cpp-bench.sh sets from git.
+
+With --compare <file>, finish() also compares each median with that of
+the benchmark of the same name in an earlier JSON file, and fails
+(returns 1) if any is more than --threshold (default 0.1, i.e. 10%) slower.
+
+Options:
+	--json <file>         write the results
+	--compare <file>      compare with earlier results
+	--threshold <x>       the slowdown which --compare reports as a regression
+	--filter <s>          only run benchmarks whose name contains s
+	--min-time <sec>      (default 1.0)
+	--min-rounds <n>      (default 10)
+	--warmup <n>          calls before timing (default 3)
+	--no-counters         don't read hardware counters
+*/
+
+#include "knossos.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#endif
+
+namespace ks {
+namespace bench {
+
+	struct options_t {
+		std::string json;
+		std::string compare;
+		std::string filter;
+		double threshold = 0.1;
+		double min_time = 1.0;
+		double min_round_time = 1e-3;
+		int min_rounds = 10;
+		int max_rounds = 100000;
+		int max_latency_calls = 1000000;
+		int warmup = 3;
+		bool counters = true;
+	};
+
+	inline options_t parse_options(int argc, char** argv)
+	{
+		options_t opts;
+		for (int i = 1; i < argc; ++i) {
+			std::string arg = argv[i];
+			auto value = [&]() -> std::string {
+				if (i + 1 == argc) {
+					std::cerr << "ERROR: " << arg << " needs a value" << std::endl;
+					exit(2);
+				}
+				return argv[++i];
+			};
+			if (arg == "--json") opts.json = value();
+			else if (arg == "--compare") opts.compare = value();
+			else if (arg == "--filter") opts.filter = value();
+			else if (arg == "--threshold") opts.threshold = std::stod(value());
+			else if (arg == "--min-time") opts.min_time = std::stod(value());
+			else if (arg == "--min-rounds") opts.min_rounds = std::stoi(value());
+			else if (arg == "--warmup") opts.warmup = std::stoi(value());
+			else if (arg == "--no-counters") opts.counters = false;
+			else {
+				std::cerr << "ERROR: Unknown option " << arg << std::endl;
+				exit(2);
+			}
+		}
+		return opts;
+	}
+
+	// ===============================  Hardware counters  ==================================
+
+	/* Counts cycles, instructions, cache misses and branch misses of the
+	   calling thread, in user space, between start() and stop().  Counters
+	   which cannot be opened (e.g. under a restrictive perf_event_paranoid,
+	   or in a container) are left out. */
+	class counters_t
+	{
+	public:
+		struct counter_t {
+			char const* name;
+			int fd;
+			uint64_t total;
+		};
+
+		explicit counters_t(bool enabled)
+		{
+#ifdef __linux__
+			if (!enabled)
+				return;
+			add("cycles", PERF_COUNT_HW_CPU_CYCLES);
+			add("instructions", PERF_COUNT_HW_INSTRUCTIONS);
+			add("cache_misses", PERF_COUNT_HW_CACHE_MISSES);
+			add("branch_misses", PERF_COUNT_HW_BRANCH_MISSES);
+#else
+			(void)enabled;
+#endif
+		}
+
+		~counters_t()
+		{
+#ifdef __linux__
+			for (auto& c : counters_)
+				close(c.fd);
+#endif
+		}
+
+		counters_t(counters_t const&) = delete;
+		counters_t& operator=(counters_t const&) = delete;
+
+		void start()
+		{
+#ifdef __linux__
+			for (auto& c : counters_) {
+				ioctl(c.fd, PERF_EVENT_IOC_RESET, 0);
+				ioctl(c.fd, PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+		}
+
+		void stop()
+		{
+#ifdef __linux__
+			for (auto& c : counters_) {
+				ioctl(c.fd, PERF_EVENT_IOC_DISABLE, 0);
+				uint64_t value = 0;
+				if (read(c.fd, &value, sizeof(value)) == sizeof(value))
+					c.total += value;
+			}
+#endif
+		}
+
+		std::vector<counter_t> const& counters() const { return counters_; }
+
+	private:
+		std::vector<counter_t> counters_;
+
+#ifdef __linux__
+		void add(char const* name, uint64_t config)
+		{
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = config;
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+			if (fd >= 0)
+				counters_.push_back({ name, fd, 0 });
+		}
+#endif
+	};
+
+	// ===============================  Sink  ==================================
+
+	// Makes the compiler assume that value, and any memory it points to,
+	// is read here, so that the work which computed it can't be deleted
+	template<class T>
+	inline void do_not_optimize(T const& value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		asm volatile("" : : "g"(&value) : "memory");
+#else
+		static void const* volatile sink;
+		sink = &value;
+		_ReadWriteBarrier();
+#endif
+	}
+
+	// ===============================  Results  ==================================
+
+	struct result_t {
+		std::string name;
+		std::string group;
+		std::vector<double> round_times;   // Mean seconds per call, in each round
+		std::vector<double> sorted_times;  // round_times, sorted
+		std::vector<double> call_times;    // Seconds, for single calls, sorted
+		long long iterations = 0;          // Calls per round
+		size_t allocator_peak = 0;
+		std::vector<std::pair<std::string, double>> counters;   // Per call
+
+		// The q-quantile (0 to 1) of sorted, interpolating as numpy and
+		// pytest-benchmark do
+		static double quantile(std::vector<double> const& sorted, double q)
+		{
+			double pos = q * double(sorted.size() - 1);
+			size_t i = size_t(pos);
+			if (i + 1 >= sorted.size())
+				return sorted.back();
+			return sorted[i] + (pos - double(i)) * (sorted[i + 1] - sorted[i]);
+		}
+
+		// The q-quantile of the mean time per call of the rounds
+		double quantile(double q) const { return quantile(sorted_times, q); }
+
+		double median() const { return quantile(0.5); }
+
+		// The q-quantile of the latency of single calls
+		double latency(double q) const { return quantile(call_times, q); }
+
+		double p50() const { return latency(0.5); }
+		double p99() const { return latency(0.99); }
+		double min() const { return sorted_times.front(); }
+		double max() const { return sorted_times.back(); }
+
+		double mean() const
+		{
+			double sum = 0;
+			for (double t : round_times)
+				sum += t;
+			return sum / double(round_times.size());
+		}
+
+		double stddev() const
+		{
+			if (round_times.size() < 2)
+				return 0;
+			double m = mean(), sum = 0;
+			for (double t : round_times)
+				sum += (t - m) * (t - m);
+			return std::sqrt(sum / double(round_times.size() - 1));
+		}
+	};
+
+	inline std::string json_string(std::string const& s)
+	{
+		std::ostringstream os;
+		os << '"';
+		for (char c : s) {
+			switch (c) {
+			case '"': os << "\\\""; break;
+			case '\\': os << "\\\\"; break;
+			case '\n': os << "\\n"; break;
+			case '\t': os << "\\t"; break;
+			default:
+				if ((unsigned char)c < 0x20)
+					os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec;
+				else
+					os << c;
+			}
+		}
+		os << '"';
+		return os.str();
+	}
+
+	/* The median of each benchmark in a file written by write_json (or by
+	   pytest-benchmark).  This only looks for the "name" of each benchmark
+	   and the "median" which follows it, which is all that compare needs. */
+	inline std::map<std::string, double> read_medians(std::string const& filename)
+	{
+		std::ifstream f(filename);
+		std::stringstream ss;
+		ss << f.rdbuf();
+		std::string text = ss.str();
+
+		std::map<std::string, double> medians;
+		size_t pos = text.find("\"benchmarks\"");
+		std::string const name_key = "\"name\": \"", median_key = "\"median\": ";
+		while (pos != std::string::npos) {
+			pos = text.find(name_key, pos);
+			if (pos == std::string::npos)
+				break;
+			size_t begin = pos + name_key.size(), end = text.find('"', begin);
+			std::string name = text.substr(begin, end - begin);
+			size_t m = text.find(median_key, end);
+			size_t next = text.find(name_key, end);
+			if (m == std::string::npos || (next != std::string::npos && m > next)) {
+				pos = end;
+				continue;
+			}
+			medians[name] = std::strtod(text.c_str() + m + median_key.size(), nullptr);
+			pos = m;
+		}
+		return medians;
+	}
+
+	// ===============================  Suite  ==================================
+
+	class suite
+	{
+	public:
+		suite(std::string name, int argc, char** argv) :
+			name_(std::move(name)),
+			opts_(parse_options(argc, argv))
+		{ }
+
+		options_t const& options() const { return opts_; }
+
+		/* Times f(alloc), where alloc is an arena which is reset after each
+		   call, and records the result under name (in the given group of
+		   benchmarks of the same size, as comparison_plot.py expects).
+		   What f returns is passed to do_not_optimize. */
+		template<class F>
+		void run(std::string const& name, std::string const& group, F f)
+		{
+			if (!opts_.filter.empty() && name.find(opts_.filter) == std::string::npos)
+				return;
+
+			using clock_t = std::chrono::steady_clock;
+			auto mark = alloc_.mark();
+			auto call = [&]() {
+				if constexpr (std::is_void<decltype(f(&alloc_))>::value)
+					f(&alloc_);
+				else
+					do_not_optimize(f(&alloc_));
+				alloc_.reset(mark);
+			};
+
+			for (int i = 0; i < opts_.warmup; ++i)
+				call();
+
+			// Calls per round
+			long long iterations = 1;
+			for (;;) {
+				auto t0 = clock_t::now();
+				for (long long i = 0; i < iterations; ++i)
+					call();
+				std::chrono::duration<double> t = clock_t::now() - t0;
+				if (t.count() >= opts_.min_round_time || iterations >= (1ll << 30))
+					break;
+				iterations *= 2;
+			}
+
+			result_t r;
+			r.name = name;
+			r.group = group;
+			r.iterations = iterations;
+			counters_t counters(opts_.counters);
+			alloc_.reset_peak();
+			std::chrono::duration<double> total{ 0 };
+			while ((total.count() < opts_.min_time || (int)r.round_times.size() < opts_.min_rounds) &&
+				   (int)r.round_times.size() < opts_.max_rounds) {
+				counters.start();
+				auto t0 = clock_t::now();
+				for (long long i = 0; i < iterations; ++i)
+					call();
+				std::chrono::duration<double> t = clock_t::now() - t0;
+				counters.stop();
+				total += t;
+				r.round_times.push_back(t.count() / double(iterations));
+			}
+			r.allocator_peak = alloc_.peak() - mark;
+			double calls = double(iterations) * double(r.round_times.size());
+			for (auto& c : counters.counters())
+				r.counters.emplace_back(c.name, double(c.total) / calls);
+
+			total = std::chrono::duration<double>{ 0 };
+			while ((total.count() < opts_.min_time || (int)r.call_times.size() < opts_.min_rounds) &&
+				   (int)r.call_times.size() < opts_.max_latency_calls) {
+				auto t0 = clock_t::now();
+				call();
+				std::chrono::duration<double> t = clock_t::now() - t0;
+				total += t;
+				r.call_times.push_back(t.count());
+			}
+			std::sort(r.call_times.begin(), r.call_times.end());
+
+			r.sorted_times = r.round_times;
+			std::sort(r.sorted_times.begin(), r.sorted_times.end());
+			print(r);
+			results_.push_back(std::move(r));
+		}
+
+		// Writes and compares the results as the options ask: returns the
+		// exit code for main
+		int finish()
+		{
+			if (!opts_.json.empty()) {
+				std::ofstream f(opts_.json);
+				write_json(f);
+				if (!f) {
+					std::cerr << "ERROR: Could not write " << opts_.json << std::endl;
+					return 2;
+				}
+			}
+			if (!opts_.compare.empty())
+				return compare(read_medians(opts_.compare)) ? 0 : 1;
+			return 0;
+		}
+
+		// Whether no median is more than threshold slower than in baseline
+		bool compare(std::map<std::string, double> const& baseline) const
+		{
+			bool ok = true;
+			for (auto& r : results_) {
+				auto it = baseline.find(r.name);
+				if (it == baseline.end() || it->second <= 0)
+					continue;
+				double change = r.median() / it->second - 1;
+				bool regressed = change > opts_.threshold;
+				std::cout << (regressed ? "REGRESSION " : "           ") << r.name << ": "
+				          << std::showpos << std::fixed << std::setprecision(1) << change * 100 << "%"
+				          << std::noshowpos << std::defaultfloat << std::endl;
+				ok = ok && !regressed;
+			}
+			return ok;
+		}
+
+		void write_json(std::ostream& os) const
+		{
+			std::string now = iso_time(std::time(nullptr));
+			char const* commit_id = std::getenv("KS_BENCH_COMMIT_ID");
+			char const* commit_time = std::getenv("KS_BENCH_COMMIT_TIME");
+
+			os << std::setprecision(17);
+			os << "{\n";
+			os << "    \"machine_info\": {\n";
+			os << "        \"node\": " << json_string(machine("node")) << ",\n";
+			os << "        \"machine\": " << json_string(machine("machine")) << ",\n";
+			os << "        \"system\": " << json_string(machine("system")) << ",\n";
+			os << "        \"release\": " << json_string(machine("release")) << "\n";
+			os << "    },\n";
+			os << "    \"commit_info\": {\n";
+			os << "        \"id\": " << json_string(commit_id ? commit_id : "unknown") << ",\n";
+			os << "        \"time\": " << json_string(commit_time ? commit_time : now) << ",\n";
+			os << "        \"project\": \"knossos\"\n";
+			os << "    },\n";
+			os << "    \"benchmarks\": [";
+			for (size_t i = 0; i < results_.size(); ++i) {
+				auto& r = results_[i];
+				double iqr = r.quantile(0.75) - r.quantile(0.25);
+				os << (i ? "," : "") << "\n        {\n";
+				os << "            \"group\": " << json_string(r.group) << ",\n";
+				os << "            \"name\": " << json_string(r.name) << ",\n";
+				os << "            \"fullname\": " << json_string(name_ + "::" + r.name) << ",\n";
+				os << "            \"params\": null,\n";
+				os << "            \"param\": null,\n";
+				os << "            \"extra_info\": {\n";
+				os << "                \"suite\": " << json_string(name_) << ",\n";
+				os << "                \"p50\": " << r.p50() << ",\n";
+				os << "                \"p99\": " << r.p99() << ",\n";
+				os << "                \"latency_calls\": " << r.call_times.size() << ",\n";
+				os << "                \"allocator_peak\": " << r.allocator_peak;
+				for (auto& c : r.counters)
+					os << ",\n                " << json_string(c.first) << ": " << c.second;
+				os << "\n            },\n";
+				os << "            \"options\": {\n";
+				os << "                \"min_time\": " << opts_.min_time << ",\n";
+				os << "                \"min_rounds\": " << opts_.min_rounds << ",\n";
+				os << "                \"warmup\": " << opts_.warmup << ",\n";
+				os << "                \"timer\": \"steady_clock\"\n";
+				os << "            },\n";
+				os << "            \"stats\": {\n";
+				os << "                \"min\": " << r.min() << ",\n";
+				os << "                \"max\": " << r.max() << ",\n";
+				os << "                \"mean\": " << r.mean() << ",\n";
+				os << "                \"stddev\": " << r.stddev() << ",\n";
+				os << "                \"rounds\": " << r.round_times.size() << ",\n";
+				os << "                \"median\": " << r.median() << ",\n";
+				os << "                \"iqr\": " << iqr << ",\n";
+				os << "                \"q1\": " << r.quantile(0.25) << ",\n";
+				os << "                \"q3\": " << r.quantile(0.75) << ",\n";
+				os << "                \"ld15iqr\": " << std::max(r.min(), r.quantile(0.25) - 1.5 * iqr) << ",\n";
+				os << "                \"hd15iqr\": " << std::min(r.max(), r.quantile(0.75) + 1.5 * iqr) << ",\n";
+				os << "                \"ops\": " << 1 / r.mean() << ",\n";
+				os << "                \"total\": " << r.mean() * double(r.round_times.size()) << ",\n";
+				os << "                \"iterations\": " << r.iterations << "\n";
+				os << "            }\n";
+				os << "        }";
+			}
+			os << "\n    ],\n";
+			os << "    \"datetime\": " << json_string(now) << ",\n";
+			os << "    \"version\": \"3.2.3\"\n";
+			os << "}\n";
+		}
+
+	private:
+		std::string name_;
+		options_t opts_;
+		ks::allocator alloc_;
+		std::vector<result_t> results_;
+
+		static std::string iso_time(std::time_t t)
+		{
+			char buf[32];
+			std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S+00:00", std::gmtime(&t));
+			return buf;
+		}
+
+		static std::string machine(char const* field)
+		{
+#ifdef __linux__
+			utsname u;
+			if (uname(&u) != 0)
+				return "";
+			if (!strcmp(field, "node")) return u.nodename;
+			if (!strcmp(field, "machine")) return u.machine;
+			if (!strcmp(field, "system")) return u.sysname;
+			if (!strcmp(field, "release")) return u.release;
+#else
+			(void)field;
+#endif
+			return "";
+		}
+
+		void print(result_t const& r) const
+		{
+			std::cout << r.name << "\n"
+			          << "    median " << r.median() * 1e3 << " ms, " << 1 / r.median() << " calls/s, "
+			          << "latency p50 " << r.p50() * 1e3 << " ms, p99 " << r.p99() * 1e3 << " ms, "
+			          << "allocator_peak " << r.allocator_peak << " bytes";
+			for (auto& c : r.counters)
+				std::cout << ", " << c.first << " " << c.second;
+			std::cout << " (" << r.round_times.size() << " rounds of " << r.iterations << ")" << std::endl;
+		}
+	};
+
+	// ===============================  Inputs  ==================================
+
+	/* Random values, uniform in [-1, 1), of nested vectors of Float, of the
+	   given sizes from the outermost in, e.g.
+		   random<vec<vec<Float>>>(alloc, rng, { n, d }) */
+	template<class T>
+	struct random_t;
+
+	template<>
+	struct random_t<Float> {
+		static Float make(allocator *, std::mt19937_64& rng, size_t const*)
+		{
+			return std::uniform_real_distribution<Float>(-1, 1)(rng);
+		}
+	};
+
+	template<class T>
+	struct random_t<vec<T>> {
+		static vec<T> make(allocator * alloc, std::mt19937_64& rng, size_t const* sizes)
+		{
+			auto ret = vec<T>::create(alloc, Integer(sizes[0]));
+			for (Integer i = 0; i < Integer(sizes[0]); ++i)
+				ret[i] = random_t<T>::make(alloc, rng, sizes + 1);
+			return ret;
+		}
+	};
+
+	template<class T>
+	T random(allocator * alloc, std::mt19937_64& rng, std::vector<size_t> const& sizes)
+	{
+		return random_t<T>::make(alloc, rng, sizes.data());
+	}
+
+}
+}
@@ -0,0 +1,327 @@
+// Device arenas, and grid-parallel build, map and sumbuild, under KS_CUDA
+#pragma once
+
+/*
+Under KS_CUDA the definitions generated by ksc are __device__ functions.
+Each device thread which runs one needs an allocator of its own
+(see KS_DEVICE_ALLOCATOR in knossos.h), so that the definition may build
+temporary tensors, and KS_MARK/KS_RESET/KS_COPYDOWN work as they do on
+the host.
+
+A device_arena owns two regions of device memory:
+
+- The thread arenas, which are carved up afresh for each launch: each block
+  of the grid gets a region, which is split evenly between its threads,
+  thread_bytes each.  thread_arenas::thread_allocator gives a thread its
+  slice.  Together they take no more than max_threads_size, as a launch
+  has no more blocks than fit (see device_arena::blocks_for), and with
+  thread_bytes 0 nothing is allocated at all.
+
+- The results arena, a host-side allocator over device memory, in which
+  the launchers below create the tensors they return.  Host code only
+  ever creates tensors in it, and never dereferences them; KS_MARK and
+  KS_RESET on results() release them again.
+
+The launchers run the outermost loop of a build, elementwise_map or
+sumbuild as a grid-stride loop, one index per device thread at a time,
+resetting the thread's arena after each index.  The elements of the loop
+therefore can't refer to a thread arena, so the element types must be
+flat (see is_flat).  Inside a device function, build and sumbuild are the
+ordinary sequential ones of knossos.h, allocating from the thread arena.
+
+sumbuild reduces each block with warp shuffles and then shared memory,
+and then adds up the partial sums of the blocks in a second launch of a
+single block.  The order of the additions depends only on the grid size,
+so the result is deterministic.
+*/
+
+// This header is only compiled by nvcc, for which knossos.h must be
+// configured for the device
+#ifndef KS_CUDA
+#define KS_CUDA
+#endif
+
+#include "knossos.h"
+
+#ifndef KS_DEVICE_ALLOCATOR
+#error "knossos-cuda.cuh needs knossos.h to be included with KS_CUDA, and without KS_NO_ALLOCATOR"
+#endif
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace ks {
+namespace cuda {
+
+	inline void check(cudaError_t err, char const* what)
+	{
+		if (err != cudaSuccess)
+			throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(err));
+	}
+
+	inline int blocks_for(Integer n);
+
+	// The thread arenas of one launch
+	struct thread_arenas
+	{
+		unsigned char * buf;
+		size_t thread_bytes;
+
+		__device__ allocator thread_allocator() const {
+			size_t block_bytes = thread_bytes * blockDim.x;
+			return allocator(buf + blockIdx.x * block_bytes + threadIdx.x * thread_bytes, thread_bytes);
+		}
+	};
+
+	class device_arena
+	{
+		unsigned char * results_buf_;
+		allocator results_;
+		unsigned char * threads_buf_;
+		size_t threads_size_;
+		size_t thread_bytes_;
+		size_t max_threads_size_;
+
+		static unsigned char * device_alloc(size_t size) {
+			if (size == 0)
+				return nullptr;
+			void * p = nullptr;
+			check(cudaMalloc(&p, size), "Failed to allocate device arena");
+			return static_cast<unsigned char*>(p);
+		}
+
+	public:
+		static constexpr size_t default_results_size = size_t(1) << 30;
+		static constexpr size_t default_thread_bytes = size_t(1) << 14;
+		static constexpr size_t default_max_threads_size = size_t(1) << 28;
+
+		device_arena(size_t results_size = default_results_size, size_t thread_bytes = default_thread_bytes,
+			size_t max_threads_size = default_max_threads_size) :
+			results_buf_(device_alloc(results_size)),
+			results_(results_buf_, results_size),
+			threads_buf_(nullptr),
+			threads_size_(0),
+			thread_bytes_(allocator::padded_size(thread_bytes)),
+			max_threads_size_(max_threads_size)
+		{}
+
+		device_arena(device_arena const&) = delete;
+		device_arena& operator=(device_arena const&) = delete;
+
+		~device_arena() {
+			cudaFree(threads_buf_);
+			cudaFree(results_buf_);
+		}
+
+		allocator * results() { return &results_; }
+
+		size_t thread_bytes() const { return thread_bytes_; }
+
+		// These take effect from the next launch, which must not overlap
+		// the last one
+		void set_thread_bytes(size_t thread_bytes) {
+			thread_bytes_ = allocator::padded_size(thread_bytes);
+			release_threads();
+		}
+
+		void set_max_threads_size(size_t max_threads_size) {
+			max_threads_size_ = max_threads_size;
+			release_threads();
+		}
+
+		// The blocks of threads_per_block to launch over n elements: as
+		// ks::cuda::blocks_for, but no more than fit in max_threads_size
+		// (and at least one)
+		int blocks_for(Integer n, int threads_per_block) const {
+			int blocks = ks::cuda::blocks_for(n);
+			size_t block_bytes = thread_bytes_ * size_t(threads_per_block);
+			if (block_bytes != 0)
+				blocks = int(std::max<size_t>(1, std::min<size_t>(size_t(blocks), max_threads_size_ / block_bytes)));
+			return blocks;
+		}
+
+		// The thread arenas for a launch of blocks x threads_per_block.
+		// These are reused by the next launch, so each launch must have
+		// finished with them (as it has, on the default stream) before
+		// the next one starts.
+		thread_arenas for_launch(int blocks, int threads_per_block) {
+			size_t required = thread_bytes_ * size_t(blocks) * size_t(threads_per_block);
+			if (required > threads_size_) {
+				release_threads();
+				threads_buf_ = device_alloc(required);
+				threads_size_ = required;
+			}
+			return thread_arenas{ threads_buf_, thread_bytes_ };
+		}
+
+	private:
+		void release_threads() {
+			check(cudaFree(threads_buf_), "Failed to free device arena");
+			threads_buf_ = nullptr;
+			threads_size_ = 0;
+		}
+	};
+
+	constexpr int threads_per_block = 256;
+
+	// Enough blocks to fill the device a few times over.  The loops are
+	// grid-stride loops, so this bounds the memory of the thread arenas
+	// however large the range.
+	inline int max_blocks()
+	{
+		static int const blocks = []() {
+			int device = 0, sms = 0;
+			check(cudaGetDevice(&device), "Failed to get device");
+			check(cudaDeviceGetAttribute(&sms, cudaDevAttrMultiProcessorCount, device), "Failed to get device attribute");
+			return 4 * std::max(sms, 1);
+		}();
+		return blocks;
+	}
+
+	inline int blocks_for(Integer n)
+	{
+		return int(std::max<Integer>(1, std::min<Integer>((n + threads_per_block - 1) / threads_per_block, max_blocks())));
+	}
+
+	// =============================== Build ==================================
+
+	template <class T, class F, class Size>
+	__global__ void build_kernel(thread_arenas arenas, T * out, Size size, Integer n, F f)
+	{
+		constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
+		allocator alloc = arenas.thread_allocator();
+		for (Integer k = blockIdx.x * Integer(blockDim.x) + threadIdx.x; k < n; k += Integer(blockDim.x) * gridDim.x) {
+			out[k] = call_at_flat_index(&alloc, f, size, k, std::make_index_sequence<Dim>{});
+			alloc.reset();
+		}
+	}
+
+	template <class T, class F, class Size>
+	tensor<dimension_of_tensor_index_type<Size>::value, T> build(device_arena * arena, Size size, F f)
+	{
+		static_assert(is_flat<T>::value, "The elements of a device build must not refer to a thread arena");
+		constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
+		auto ret = tensor<Dim, T>::create(arena->results(), size);
+		Integer n = ret.num_elements();
+		if (n == 0)
+			return ret;
+		int blocks = arena->blocks_for(n, threads_per_block);
+		build_kernel<<<blocks, threads_per_block>>>(arena->for_launch(blocks, threads_per_block), ret.data(), size, n, f);
+		check(cudaGetLastError(), "Failed to launch build");
+		return ret;
+	}
+
+	template <class T, class U, class F>
+	__global__ void elementwise_map_kernel(thread_arenas arenas, T * out, U const * in, Integer n, F f)
+	{
+		allocator alloc = arenas.thread_allocator();
+		for (Integer k = blockIdx.x * Integer(blockDim.x) + threadIdx.x; k < n; k += Integer(blockDim.x) * gridDim.x) {
+			out[k] = f(&alloc, in[k]);
+			alloc.reset();
+		}
+	}
+
+	// f(alloc, t[i]) for each element of a tensor in device memory
+	template <class T, size_t Dim, class U, class F>
+	tensor<Dim, T> elementwise_map(device_arena * arena, tensor<Dim, U> const& t, F f)
+	{
+		static_assert(is_flat<T>::value, "The elements of a device map must not refer to a thread arena");
+		auto ret = tensor<Dim, T>::create(arena->results(), t.size());
+		Integer n = t.num_elements();
+		if (n == 0)
+			return ret;
+		int blocks = arena->blocks_for(n, threads_per_block);
+		elementwise_map_kernel<<<blocks, threads_per_block>>>(arena->for_launch(blocks, threads_per_block), ret.data(), t.data(), n, f);
+		check(cudaGetLastError(), "Failed to launch elementwise_map");
+		return ret;
+	}
+
+	// f(alloc, index(i, v)) for each element of a vector in device memory
+	template <class T, class U, class F>
+	vec<T> map(device_arena * arena, vec<U> const& v, F f)
+	{
+		return elementwise_map<T>(arena, v, f);
+	}
+
+	// =============================== Sumbuild ==================================
+
+	template <class T>
+	__device__ T warp_sum(T v)
+	{
+		for (int offset = warpSize / 2; offset > 0; offset /= 2)
+			v += __shfl_down_sync(0xffffffffu, v, offset);
+		return v;
+	}
+
+	// The sum of v over the threads of the block, in thread 0
+	template <class T>
+	__device__ T block_sum(T v)
+	{
+		__shared__ T warp_sums[32];
+		int lane = threadIdx.x % warpSize;
+		int warp = threadIdx.x / warpSize;
+		v = warp_sum(v);
+		if (lane == 0)
+			warp_sums[warp] = v;
+		__syncthreads();
+		if (warp == 0) {
+			int warps = (blockDim.x + warpSize - 1) / warpSize;
+			v = warp_sum(lane < warps ? warp_sums[lane] : T{ 0 });
+		}
+		return v;
+	}
+
+	template <class T, class F, class Size>
+	__global__ void sumbuild_kernel(thread_arenas arenas, T * block_sums, Size size, Integer n, F f)
+	{
+		constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
+		allocator alloc = arenas.thread_allocator();
+		T sum{ 0 };
+		for (Integer k = blockIdx.x * Integer(blockDim.x) + threadIdx.x; k < n; k += Integer(blockDim.x) * gridDim.x) {
+			sum += call_at_flat_index(&alloc, f, size, k, std::make_index_sequence<Dim>{});
+			alloc.reset();
+		}
+		sum = block_sum(sum);
+		if (threadIdx.x == 0)
+			block_sums[blockIdx.x] = sum;
+	}
+
+	template <class T>
+	__global__ void sum_kernel(T * values, int n)
+	{
+		T sum{ 0 };
+		for (int k = threadIdx.x; k < n; k += blockDim.x)
+			sum += values[k];
+		sum = block_sum(sum);
+		if (threadIdx.x == 0)
+			values[0] = sum;
+	}
+
+	// The sum over the given size of f(alloc, i...), for a scalar T.
+	// Waits for the result, which is returned to the host.
+	template <class T, class F, class Size>
+	T sumbuild(device_arena * arena, Size size, F f)
+	{
+		static_assert(std::is_arithmetic<T>::value, "A device sumbuild must be of scalars");
+		constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
+		Integer n = tensor_dimension<Dim>::num_elements(size);
+		if (n == 0)
+			return T{ 0 };
+		int blocks = arena->blocks_for(n, threads_per_block);
+		KS_MARK(arena->results(), mark);
+		auto block_sums = vec<T>::create(arena->results(), blocks);
+		sumbuild_kernel<<<blocks, threads_per_block>>>(arena->for_launch(blocks, threads_per_block), block_sums.data(), size, n, f);
+		check(cudaGetLastError(), "Failed to launch sumbuild");
+		sum_kernel<<<1, threads_per_block>>>(block_sums.data(), blocks);
+		check(cudaGetLastError(), "Failed to launch sumbuild");
+		T ret;
+		check(cudaMemcpy(&ret, block_sums.data(), sizeof(T), cudaMemcpyDeviceToHost), "Failed to copy sumbuild result");
+		KS_RESET(arena->results(), mark);
+		return ret;
+	}
+
+}
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "knossos-entry-points.h"
+
+#include <pybind11/pybind11.h>
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace ks {
+namespace entry_points {
+
+/*
+An asynchronous entry point converts its arguments on the calling thread,
+queues the call (see run_async), and returns an async_result straight
+away, so the caller may convert the next call's arguments while this one
+runs.  The call runs without the GIL, in a request arena of its own (see
+acquire_request_arena), so any number may be in flight at once.  Its result
+is converted to Python by the first call of async_result::result, which
+releases the GIL while it waits.
+
+Each module binds async_result as its AsyncResult, with
+  done()                  -- whether the call has finished
+  result()                -- waits for the call, and returns its result,
+                             or raises what it threw
+  add_done_callback(f)    -- calls f() when the call has finished, on the
+                             thread which ran it (with the GIL), or at once
+                             if it already has
+from which ksc.torch_frontend makes a concurrent.futures.Future.
+*/
+
+// The state of one asynchronous call, shared between the async_result and
+// the thread running the call
+struct async_state {
+  std::mutex mutex;
+  std::condition_variable finished;
+  bool done = false;
+  std::exception_ptr error;
+
+  // The request arena, which holds the arguments and the result
+  std::shared_ptr<void> arena;
+
+  // Converts the result to Python, with the GIL held
+  std::function<pybind11::object()> to_python;
+
+  // Python callables, only touched with the GIL held
+  std::vector<pybind11::object> callbacks;
+
+  // Called on the thread which ran the call, without the GIL
+  void finish(std::exception_ptr e) {
+    std::vector<pybind11::object> to_call;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      error = e;
+      done = true;
+      to_call.swap(callbacks);
+    }
+    finished.notify_all();
+    if (!to_call.empty()) {
+      pybind11::gil_scoped_acquire gil;
+      for (auto & callback : to_call) {
+        try {
+          callback();
+        } catch (pybind11::error_already_set & e) {
+          e.restore();
+          PyErr_WriteUnraisable(callback.ptr());
+        }
+      }
+      to_call.clear();
+    }
+  }
+};
+
+class async_result {
+public:
+  explicit async_result(std::shared_ptr<async_state> state) : state_(std::move(state)) { }
+
+  bool done() const {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    return state_->done;
+  }
+
+  pybind11::object result() {
+    if (!converted_) {
+      {
+        pybind11::gil_scoped_release nogil;
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->finished.wait(lock, [this]() { return state_->done; });
+      }
+      // Another Python thread may have converted it while we waited
+      if (converted_) {
+        return result_;
+      }
+      if (state_->error) {
+        std::rethrow_exception(state_->error);
+      }
+      {
+        arena_scope scope(state_->arena);
+        result_ = state_->to_python();
+      }
+      // Release the ks result, and (unless the Python result holds a lease
+      // on it) the request arena
+      state_->to_python = nullptr;
+      state_->arena.reset();
+      converted_ = true;
+    }
+    return result_;
+  }
+
+  void add_done_callback(pybind11::object callback) {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      if (!state_->done) {
+        state_->callbacks.push_back(std::move(callback));
+        return;
+      }
+    }
+    callback();
+  }
+
+private:
+  std::shared_ptr<async_state> state_;
+  pybind11::object result_;
+  bool converted_ = false;
+};
+
+// Runs convert() now, and then compute(args) on an async thread, where
+// args is what convert returned, each in a new request arena.  The result
+// is converted by to_python(ret) when it is first asked for.  convert and
+// compute must copy whatever Python objects they use, such as the torch
+// tensors whose memory the arguments refer to.
+template<typename Convert, typename Compute, typename ToPython>
+async_result call_async(Convert convert, Compute compute, ToPython to_python) {
+  using Args = decltype(convert());
+  using Ret = decltype(compute(std::declval<Args const&>()));
+
+  auto state = std::make_shared<async_state>();
+  state->arena = acquire_request_arena();
+
+  std::shared_ptr<Args> args;
+  {
+    arena_scope scope(state->arena);
+    args = std::make_shared<Args>(convert());
+  }
+
+  auto ret = std::make_shared<std::optional<Ret>>();
+  state->to_python = [ret, to_python]() { return to_python(**ret); };
+
+  run_async([state, args, ret, compute]() {
+    std::exception_ptr error;
+    try {
+      arena_scope scope(state->arena);
+      ret->emplace(compute(*args));
+    } catch (...) {
+      error = std::current_exception();
+    }
+    state->finish(error);
+  });
+  return async_result(state);
+}
+
+inline void bind_async_result(pybind11::module & m) {
+  pybind11::class_<async_result>(m, "AsyncResult", pybind11::module_local())
+    .def("done", &async_result::done)
+    .def("result", &async_result::result)
+    .def("add_done_callback", &async_result::add_done_callback);
+}
+
+}
+}
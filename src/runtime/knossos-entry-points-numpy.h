@@ -0,0 +1,117 @@
+#pragma once
+
+#include "knossos-entry-points.h"
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace ks {
+namespace entry_points {
+
+/*
+Entry points for NumPy, or anything else with the buffer protocol, which
+don't need torch.  A tensor of scalars, of any rank, is passed as a
+numpy_array: pybind11 converts it to a C-contiguous array of the right
+dtype, copying only if it isn't one already, and the ks tensor is a view
+of its memory.  A tensor which is returned is, as with torch, a view of
+the arena holding a lease on it with zero_copy_outputs, and otherwise a
+copy.  A result which lies in an argument (e.g. a slice of it) is
+copied, so that it never aliases its argument.
+Tensors of anything but scalars are not supported.
+*/
+
+template<typename T>
+using numpy_array = pybind11::array_t<T, pybind11::array::c_style | pybind11::array::forcecast>;
+
+template<size_t Dim, typename T>
+struct Converter<ks::tensor<Dim, T>, numpy_array<T>>
+{
+  using index_type = typename ks::tensor<Dim, T>::index_type;
+
+  template<size_t ...Indices>
+  static index_type size_of(numpy_array<T> const& arg, std::index_sequence<Indices...>) {
+    return index_type{to_Integer_size(arg.shape(Indices))...};
+  }
+
+  template<size_t ...Indices>
+  static std::vector<pybind11::ssize_t> shape_of(index_type const& size, std::index_sequence<Indices...>) {
+    return {ks::get_dimension<Indices>(size)...};
+  }
+
+  static Integer to_Integer_size(pybind11::ssize_t size) {
+    KS_ASSERT(size == (pybind11::ssize_t)(Integer)size && "Array too large: rebuild with KS_INDEX64");
+    return (Integer)size;
+  }
+
+  // The array is C-contiguous, so is used in place
+  static ks::tensor<Dim, T> to_ks(numpy_array<T> arg) {
+    if (arg.ndim() != (pybind11::ssize_t)Dim) {
+      throw std::invalid_argument("Expected an array of " + std::to_string(Dim) + " dimensions, not " + std::to_string(arg.ndim()));
+    }
+    to_Integer_size(arg.size());
+    return ks::tensor<Dim, T>(size_of(arg, std::make_index_sequence<Dim>{}), const_cast<T*>(arg.data()));
+  }
+
+  static numpy_array<T> from_ks(ks::tensor<Dim, T> ret) {
+    std::vector<pybind11::ssize_t> shape = shape_of(ret.size(), std::make_index_sequence<Dim>{});
+    size_t bytes = ret.num_elements() * sizeof(T);
+    if (zero_copy_outputs() && bytes != 0) {
+      if (std::shared_ptr<void> lease = lease_arena_memory(ret.data(), bytes)) {
+        auto holder = new std::shared_ptr<void>(std::move(lease));
+        pybind11::capsule base(holder, [](void * p) { delete static_cast<std::shared_ptr<void>*>(p); });
+        return numpy_array<T>(shape, ret.data(), base);
+      }
+    }
+    numpy_array<T> numpy_ret(shape);
+    std::memcpy(numpy_ret.mutable_data(), ret.data(), bytes);
+    return numpy_ret;
+  }
+};
+
+// The type by which a numpy_entry_point takes or returns a KsType
+template<typename KsType>
+struct NumpyEntryPointType
+{
+  using type = KsType;
+};
+
+template<typename ...KsTypes>
+struct NumpyEntryPointType<ks::Tuple<KsTypes...>>
+{
+  using type = std::tuple<typename NumpyEntryPointType<KsTypes>::type...>;
+};
+
+template<size_t Dim, typename KsElementType>
+struct NumpyEntryPointType<ks::tensor<Dim, KsElementType>>
+{
+  static_assert(std::is_arithmetic<KsElementType>::value, "Only tensors of scalars may be passed as arrays");
+  using type = numpy_array<KsElementType>;
+};
+
+template<typename F, typename... Ts, size_t... Indices>
+auto call_with_Tuple(F const& f, ks::Tuple<Ts...> const& args, std::index_sequence<Indices...>) {
+  return f(ks::get<Indices>(args)...);
+}
+
+// As python_entry_point (see knossos-entry-points-python.h), but passing
+// tensors as numpy_arrays.  The arguments are converted, and the result
+// converted back, with the GIL held; the call itself releases it.
+template<typename RetType, typename... ParamTypes>
+auto numpy_entry_point(RetType(*f)(ks::allocator*, ParamTypes...)) {
+  return [f](typename NumpyEntryPointType<std::decay_t<ParamTypes>>::type ...params) {
+    auto ks_params = ks::make_Tuple(convert_argument<std::decay_t<ParamTypes>>(params)...);
+    auto call = [&](auto const& ...ks_args) {
+      pybind11::gil_scoped_release nogil;
+      return f(get_allocator(), ks_args...);
+    };
+    RetType ks_ret = call_with_Tuple(call, ks_params, std::index_sequence_for<ParamTypes...>{});
+    return convert_return_value<typename NumpyEntryPointType<RetType>::type>(ks_ret);
+  };
+}
+
+}
+}
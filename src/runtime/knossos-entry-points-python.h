@@ -1,6 +1,6 @@
 #pragma once
 
-#include "knossos-entry-points.h"
+#include "knossos-entry-points-async.h"
 
 namespace ks {
 namespace entry_points {
@@ -9,8 +9,8 @@ template<typename KsElementType, typename EntryPointElementType>
 struct Converter<ks::tensor<1, KsElementType>, std::vector<EntryPointElementType>>
 {
   static ks::tensor<1, KsElementType> to_ks(std::vector<EntryPointElementType> const& arg) {
-    auto ks_arg = ks::tensor<1, KsElementType>::create(&g_alloc, arg.size());
-    for (int i = 0; i != ks_arg.size(); ++i) {
+    auto ks_arg = ks::tensor<1, KsElementType>::create(get_allocator(), arg.size());
+    for (Integer i = 0; i != ks_arg.size(); ++i) {
       ks_arg[i] = convert_argument<KsElementType>(arg[i]);
     }
     return ks_arg;
@@ -18,13 +18,16 @@ struct Converter<ks::tensor<1, KsElementType>, std::vector<EntryPointElementType
 
   static std::vector<EntryPointElementType> from_ks(ks::tensor<1, KsElementType> const& ks_ret) {
     std::vector<EntryPointElementType> ret;
-    for (int i = 0; i != ks_ret.size(); ++i) {
+    for (Integer i = 0; i != ks_ret.size(); ++i) {
       ret.push_back(convert_return_value<EntryPointElementType>(ks_ret[i]));
     }
     return ret;
   }
 };
 
+// Python entry points which pass tensors (of rank 1 only) as lists, copying
+// them element by element.  See knossos-entry-points-numpy.h for entry
+// points which pass tensors of any rank as NumPy arrays, in place.
 template<typename KsType>
 struct PurePythonEntryPointType
 {
@@ -43,14 +46,38 @@ struct PurePythonEntryPointType<ks::tensor<1, KsElementType>>
   using type = std::vector<typename PurePythonEntryPointType<KsElementType>::type>;
 };
 
+// The parameters are converted by pybind11 before the call, so the GIL is
+// released for all of it
 template<typename RetType, typename... ParamTypes>
 auto python_entry_point(RetType(*f)(ks::allocator*, ParamTypes...)) {
   return [f](typename PurePythonEntryPointType<ParamTypes>::type ...params) {
+    pybind11::gil_scoped_release nogil;
     return convert_return_value<typename PurePythonEntryPointType<RetType>::type>(
-      f(&g_alloc, convert_argument<ParamTypes>(params)...)
+      f(get_allocator(), convert_argument<ParamTypes>(params)...)
     );
   };
 }
 
+template<typename RetType, typename... ParamTypes, size_t... Indices>
+RetType apply_entry_point(RetType(*f)(ks::allocator*, ParamTypes...), ks::Tuple<std::decay_t<ParamTypes>...> const& params, std::index_sequence<Indices...>) {
+  return f(get_allocator(), ks::get<Indices>(params)...);
+}
+
+// As python_entry_point, but returning an async_result at once (see
+// knossos-entry-points-async.h)
+template<typename RetType, typename... ParamTypes>
+auto python_entry_point_async(RetType(*f)(ks::allocator*, ParamTypes...)) {
+  return [f](typename PurePythonEntryPointType<ParamTypes>::type ...params) {
+    return call_async(
+      [&]() { return ks::make_Tuple(convert_argument<std::decay_t<ParamTypes>>(params)...); },
+      [f](ks::Tuple<std::decay_t<ParamTypes>...> const& ks_params) {
+        return apply_entry_point(f, ks_params, std::index_sequence_for<ParamTypes...>{});
+      },
+      [](RetType const& ret) {
+        return pybind11::cast(convert_return_value<typename PurePythonEntryPointType<RetType>::type>(ret));
+      });
+  };
+}
+
 }
 }
\ No newline at end of file
@@ -7,62 +7,130 @@
 namespace ks {
 namespace entry_points {
 
-constexpr at::ScalarType scalar_type_of_Float = c10::CppTypeToScalarType<Float>::value;
+// The torch dtype of a tensor of T.  The 16-bit floats of knossos-half.h
+// have the same layout as torch's, so tensors of them are used in place.
+template<typename T>
+constexpr at::ScalarType scalar_type_of = c10::CppTypeToScalarType<T>::value;
 
 template<>
-struct Converter<ks::tensor<1, Float>, torch::Tensor>
+constexpr at::ScalarType scalar_type_of<ks::half> = at::ScalarType::Half;
+
+template<>
+constexpr at::ScalarType scalar_type_of<ks::bfloat16> = at::ScalarType::BFloat16;
+
+constexpr at::ScalarType scalar_type_of_Float = scalar_type_of<Float>;
+
+// Size of dimension I of a tensor size, whose type is Integer in the 1-D case
+template<size_t I>
+Integer size_in_dimension(Integer size) { return size; }
+
+template<size_t I, typename ...Ints>
+Integer size_in_dimension(ks::Tuple<Ints...> const& size) { return ks::get<I>(size); }
+
+// A torch size as an Integer, which (without KS_INDEX64) may be narrower
+inline Integer to_Integer_size(int64_t size) {
+  KS_ASSERT(size == (int64_t)(Integer)size && "Tensor too large: rebuild with KS_INDEX64");
+  return (Integer)size;
+}
+
+template<size_t Dim, typename T>
+struct Converter<ks::tensor<Dim, T>, torch::Tensor>
 {
-  static ks::tensor<1, Float> to_ks(torch::Tensor arg) {
-    KS_ASSERT(arg.sizes().size() == 1u);
-    KS_ASSERT(arg.is_contiguous());
-    KS_ASSERT(arg.scalar_type() == scalar_type_of_Float);
-    return ks::tensor<1, Float>((int)arg.size(0), arg.data_ptr<Float>());
+  using index_type = typename ks::tensor<Dim, T>::index_type;
+
+  template<size_t ...Indices>
+  static index_type size_of(torch::Tensor const& arg, std::index_sequence<Indices...>) {
+    return index_type{to_Integer_size(arg.size(Indices))...};
   }
 
-  static torch::Tensor from_ks(ks::tensor<1, Float> ret) {
-    torch::Tensor torch_ret = torch::empty(ret.size(), torch::TensorOptions().dtype(scalar_type_of_Float));
-    std::memcpy(torch_ret.data_ptr(), ret.data(), ret.size() * sizeof(Float));
-    return torch_ret;
+  template<size_t ...Indices>
+  static std::vector<int64_t> sizes_of(index_type size, std::index_sequence<Indices...>) {
+    return {size_in_dimension<Indices>(size)...};
   }
-};
 
-template<>
-struct Converter<ks::tensor<2, Float>, torch::Tensor>
-{
-  static ks::tensor<2, Float> to_ks(torch::Tensor arg) {
-    KS_ASSERT(arg.sizes().size() == 2u);
-    KS_ASSERT(arg.is_contiguous());
-    KS_ASSERT(arg.scalar_type() == scalar_type_of_Float);
-    return ks::tensor<2, Float>({(int)arg.size(0), (int)arg.size(1)}, arg.data_ptr<Float>());
+  template<size_t ...Indices>
+  static index_type strides_of(torch::Tensor const& arg, std::index_sequence<Indices...>) {
+    return index_type{to_Integer_size(arg.stride(Indices))...};
   }
 
-  static torch::Tensor from_ks(ks::tensor<2, Float> ret) {
-    auto [size0, size1] = ret.size();
-    torch::Tensor torch_ret = torch::empty({size0, size1}, torch::TensorOptions().dtype(scalar_type_of_Float));
-    std::memcpy(torch_ret.data_ptr(), ret.data(), size0 * size1 * sizeof(Float));
+  // A view of arg, which need not be contiguous
+  static ks::strided_tensor<Dim, T> to_strided(torch::Tensor const& arg) {
+    KS_ASSERT(arg.sizes().size() == Dim);
+    KS_ASSERT(arg.scalar_type() == scalar_type_of<T>);
+    to_Integer_size(arg.numel());
+    return ks::strided_tensor<Dim, T>(size_of(arg, std::make_index_sequence<Dim>{}),
+      strides_of(arg, std::make_index_sequence<Dim>{}), static_cast<T*>(arg.data_ptr()));
+  }
+
+  // A contiguous arg is used in place.  Otherwise (e.g. a transpose or
+  // a slice) its elements are gathered into the arena, which saves the
+  // caller a call to .contiguous().
+  static ks::tensor<Dim, T> to_ks(torch::Tensor arg) {
+    auto view = to_strided(arg);
+#ifdef KS_ALLOCATOR
+    return ks::to_tensor(get_allocator(), view);
+#else
+    KS_ASSERT(view.is_contiguous());
+    return ks::tensor<Dim, T>(view.size(), view.data());
+#endif
+  }
+
+  // With zero_copy_outputs, a result in the arena is handed to torch in
+  // place, holding a lease on its memory until torch frees the tensor.
+  // Anything else (e.g. a result which is a view of an argument) is copied.
+  static torch::Tensor from_ks(ks::tensor<Dim, T> ret) {
+    std::vector<int64_t> sizes = sizes_of(ret.size(), std::make_index_sequence<Dim>{});
+    auto options = torch::TensorOptions().dtype(scalar_type_of<T>);
+    size_t bytes = ret.num_elements() * sizeof(T);
+    if (zero_copy_outputs() && bytes != 0) {
+      if (std::shared_ptr<void> lease = lease_arena_memory(ret.data(), bytes)) {
+        return torch::from_blob(ret.data(), sizes, [lease](void*) { }, options);
+      }
+    }
+    torch::Tensor torch_ret = torch::empty(sizes, options);
+    std::memcpy(torch_ret.data_ptr(), ret.data(), bytes);
     return torch_ret;
   }
 };
 
-// TODO: common these? 
-template<>
-struct Converter<ks::tensor<3, Float>, torch::Tensor>
+// Functions which take a strided_tensor accept any torch tensor in place
+template<size_t Dim, typename T>
+struct Converter<ks::strided_tensor<Dim, T>, torch::Tensor>
 {
-  static ks::tensor<3, Float> to_ks(torch::Tensor arg) {
-    KS_ASSERT(arg.sizes().size() == 3u);
-    KS_ASSERT(arg.is_contiguous());
-    KS_ASSERT(arg.scalar_type() == scalar_type_of_Float);
-    ks::tensor<3, Float>::index_type size {(int)arg.size(0), (int)arg.size(1), (int)arg.size(2)};
-    return ks::tensor<3, Float>(size, arg.data_ptr<Float>());
+  static ks::strided_tensor<Dim, T> to_ks(torch::Tensor arg) {
+    return Converter<ks::tensor<Dim, T>, torch::Tensor>::to_strided(arg);
   }
 
-  static torch::Tensor from_ks(ks::tensor<3, Float> ret) {
-    auto [size0, size1, size2] = ret.size();
-    torch::Tensor torch_ret = torch::empty({size0, size1, size2}, torch::TensorOptions().dtype(scalar_type_of_Float));
-    std::memcpy(torch_ret.data_ptr(), ret.data(), size0 * size1 * size2 * sizeof(Float));
-    return torch_ret;
+  static torch::Tensor from_ks(ks::strided_tensor<Dim, T> ret) {
+    return Converter<ks::tensor<Dim, T>, torch::Tensor>::from_ks(ks::to_tensor(get_allocator(), ret));
   }
 };
 
+#ifdef KS_ALLOCATOR
+// The bag of gradients ("bog") which suffwdpass$f returns beside its
+// result, kept for sufrevpass$f.  The bog may refer to anything which the
+// forward pass allocated, so everything allocated since mark stays leased
+// from the arena (see lease_arena_memory) until the handle is destroyed.
+template<typename Bog>
+struct bog_handle
+{
+  Bog bog;
+  std::shared_ptr<void> lease;
+};
+
+// A handle on the bog, for Python to keep until the reverse pass.  Its
+// type is fixed by the generated entry points, which pass the same Bog.
+template<typename Bog>
+pybind11::capsule make_bog_capsule(ks::allocator * alloc, ks::alloc_mark_t mark, Bog const& bog) {
+  auto handle = new bog_handle<Bog>{ bog, lease_arena_memory(alloc->ptr_at(mark), alloc->mark() - mark) };
+  return pybind11::capsule(handle, [](void * p) { delete static_cast<bog_handle<Bog>*>(p); });
+}
+
+template<typename Bog>
+Bog const& bog_of_capsule(pybind11::capsule capsule) {
+  return static_cast<bog_handle<Bog>*>(capsule.get_pointer())->bog;
+}
+#endif
+
 }
 }
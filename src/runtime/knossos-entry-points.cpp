@@ -1,23 +1,244 @@
 #include "knossos-entry-points.h"
 
+// With KS_PREBUILT_RUNTIME these come from the prebuilt runtime (see knossos-prebuilt.h)
+#if !defined(KS_PREBUILT_RUNTIME) || defined(KS_RUNTIME_IMPL)
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
+
 namespace ks {
 namespace entry_points {
 
+static std::atomic<bool> g_zero_copy_outputs{ false };
+
+void set_zero_copy_outputs(bool enabled) { g_zero_copy_outputs = enabled; }
+bool zero_copy_outputs() { return g_zero_copy_outputs; }
+
+static std::atomic<bool> g_memory_planning{ false };
+
+void set_memory_planning(bool enabled) { g_memory_planning = enabled; }
+bool memory_planning() { return g_memory_planning; }
+
 #ifdef KS_ALLOCATOR
 
-ks::allocator g_alloc{ 1'000'000'000 };
+// An arena together with the ends of the regions currently leased from it.
+// Leases may be released from any thread, so lease_ends is guarded by mutex.
+struct arena_t {
+  explicit arena_t(size_t max_size) : alloc(max_size) { }
+
+  ks::allocator alloc;
+  std::mutex mutex;
+  std::multiset<size_t> lease_ends;
+
+  size_t leased_top() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lease_ends.empty() ? 0u : *lease_ends.rbegin();
+  }
+};
+
+static std::atomic<size_t> g_default_allocator_size{ ks::allocator::default_max_size };
+static thread_local std::shared_ptr<arena_t> t_arena;
+
+// The request arena of an arena_scope on this thread, if any
+static thread_local std::shared_ptr<arena_t> t_scoped_arena;
+
+ks::allocator * get_allocator() {
+  if (t_scoped_arena) {
+    return &t_scoped_arena->alloc;
+  }
+  if (!t_arena) {
+    t_arena = std::make_shared<arena_t>(g_default_allocator_size);
+  }
+  return &t_arena->alloc;
+}
+
+void reset_allocator() {
+  get_allocator();
+  t_arena->alloc.reset(t_arena->leased_top());
+}
+
+size_t allocator_top() { return t_arena ? t_arena->alloc.mark() : 0u; }
+size_t allocator_peak() { return t_arena ? t_arena->alloc.peak() : 0u; }
+
+// Replaces the calling thread's arena, so must not be called while
+// any value allocated in the old arena is still in use, other than
+// through a lease.
+void set_allocator_size(size_t max_size) { t_arena = std::make_shared<arena_t>(max_size); }
+
+void set_default_allocator_size(size_t max_size) { g_default_allocator_size = max_size; }
+
+std::shared_ptr<void> lease_arena_memory(void const* p, size_t size) {
+  std::shared_ptr<arena_t> arena = t_scoped_arena ? t_scoped_arena : t_arena;
+  if (!arena || !arena->alloc.owns(p)) {
+    return nullptr;
+  }
+  size_t end = arena->alloc.offset_of(p) + size;
+  std::multiset<size_t>::iterator it;
+  {
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    it = arena->lease_ends.insert(end);
+  }
+  return std::shared_ptr<void>(arena.get(), [arena, it](void*) {
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    arena->lease_ends.erase(it);
+  });
+}
+
+// Request arenas which are free for reuse.  Never destroyed, as a request
+// may outlive static destruction.
+//
+// A burst of calls may take many arenas at once, so the pool keeps at most
+// max_pooled_request_arenas() of them, deleting any more as they are
+// released, and each keeps no more than request_arena_retained_bytes
+// committed while it waits in the pool.
+static std::mutex & request_arena_pool_mutex() {
+  static std::mutex * mutex = new std::mutex;
+  return *mutex;
+}
+
+static std::vector<arena_t*> & request_arena_pool() {
+  static std::vector<arena_t*> * pool = new std::vector<arena_t*>;
+  return *pool;
+}
+
+static constexpr size_t request_arena_retained_bytes = ks::allocator::default_chunk_size;
+
+// Enough for each async thread to run one call while the next is converted
+static size_t max_pooled_request_arenas() { return 2 * async_threads(); }
 
-void reset_allocator() { g_alloc.reset(); }
-size_t allocator_top() { return g_alloc.mark(); }
-size_t allocator_peak() { return g_alloc.peak(); }
+std::shared_ptr<void> acquire_request_arena() {
+  arena_t * arena = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(request_arena_pool_mutex());
+    auto & pool = request_arena_pool();
+    if (!pool.empty()) {
+      arena = pool.back();
+      pool.pop_back();
+    }
+  }
+  if (!arena) {
+    arena = new arena_t(g_default_allocator_size);
+  }
+  return std::shared_ptr<arena_t>(arena, [](arena_t * arena) {
+    // Nothing is leased from the arena any more, so it resets fully
+    arena->alloc.reset();
+    arena->alloc.decommit(request_arena_retained_bytes);
+    {
+      std::lock_guard<std::mutex> lock(request_arena_pool_mutex());
+      auto & pool = request_arena_pool();
+      if (pool.size() < max_pooled_request_arenas()) {
+        pool.push_back(arena);
+        return;
+      }
+    }
+    delete arena;
+  });
+}
+
+arena_scope::arena_scope(std::shared_ptr<void> arena)
+  : prev_(std::exchange(t_scoped_arena, std::static_pointer_cast<arena_t>(std::move(arena)))) { }
+
+arena_scope::~arena_scope() { t_scoped_arena = std::static_pointer_cast<arena_t>(std::move(prev_)); }
 
 #else
 
+std::shared_ptr<void> acquire_request_arena() { return nullptr; }
+arena_scope::arena_scope(std::shared_ptr<void> arena) : prev_(std::move(arena)) { }
+arena_scope::~arena_scope() { }
+
 void reset_allocator() { }
 size_t allocator_top() { return 0u; }
 size_t allocator_peak() { return 0u; }
+void set_allocator_size(size_t) { }
+void set_default_allocator_size(size_t) { }
+std::shared_ptr<void> lease_arena_memory(void const*, size_t) { return nullptr; }
 
 #endif
 
+// The threads which run asynchronous calls.  They are started as calls
+// are queued, up to async_threads(), and are detached: like the request
+// arenas, the queue is never destroyed.
+class async_executor {
+public:
+  void run(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    if (idle_ < tasks_.size() && threads_ < g_async_threads) {
+      ++threads_;
+      std::thread([this]() { work(); }).detach();
+    }
+    ready_.notify_one();
+  }
+
+  static std::atomic<size_t> g_async_threads;
+
+private:
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      ++idle_;
+      ready_.wait(lock, [this]() { return !tasks_.empty(); });
+      --idle_;
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      task = nullptr;
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> tasks_;
+  size_t threads_ = 0;
+  size_t idle_ = 0;
+};
+
+std::atomic<size_t> async_executor::g_async_threads{ std::max(1u, std::thread::hardware_concurrency()) };
+
+void set_async_threads(size_t n) { async_executor::g_async_threads = std::max<size_t>(n, 1); }
+size_t async_threads() { return async_executor::g_async_threads; }
+
+void run_async(std::function<void()> task) {
+  static async_executor * executor = new async_executor;
+  executor->run(std::move(task));
 }
+
+#if defined(KS_PROFILE) && !defined(KS_CUDA)
+
+std::string profile_chrome_trace() {
+  std::ostringstream os;
+  ks::profile::write_chrome_trace(os);
+  return os.str();
 }
+
+std::string profile_flat() {
+  std::ostringstream os;
+  ks::profile::write_flat_profile(os);
+  return os.str();
+}
+
+void profile_reset() { ks::profile::reset(); }
+
+#else
+
+std::string profile_chrome_trace() { return std::string(); }
+std::string profile_flat() { return std::string(); }
+void profile_reset() { }
+
+#endif
+
+}
+}
+
+#endif
@@ -2,18 +2,238 @@
 
 #include "knossos.h"
 
+#include <algorithm>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace ks {
 namespace entry_points {
 
 #ifdef KS_ALLOCATOR
-extern ks::allocator g_alloc;
+// Each calling thread is given its own arena, created on first use, so that
+// compiled functions may be called concurrently from several threads.
+ks::allocator * get_allocator();
 #endif
 
+// These all act on the calling thread's arena
 void reset_allocator();
 size_t allocator_top();
 size_t allocator_peak();
+void set_allocator_size(size_t max_size);
+
+// Address space reserved for the arenas of threads which have not yet
+// called in.  Memory is only committed as each arena grows.
+void set_default_allocator_size(size_t max_size);
+
+// When enabled, tensors returned through an entry point may be exposed
+// to the caller in place, rather than copied out of the arena (see
+// lease_arena_memory).  This is off by default.
+void set_zero_copy_outputs(bool enabled);
+bool zero_copy_outputs();
+
+// Keeps the size bytes at p, in the calling thread's arena, alive until
+// the returned handle is released: until then, reset_allocator resets
+// the arena only as far as the end of the leased memory, and the arena
+// itself outlives set_allocator_size.  The handle may be released from
+// any thread.  Returns null if p is not in the arena, in which case the
+// caller must copy.
+std::shared_ptr<void> lease_arena_memory(void const* p, size_t size);
+
+// Asynchronous calls (see knossos-entry-points-async.h) each run in an
+// arena of their own, taken from a pool, rather than in a thread's arena.
+// The arena returns to the pool when the last reference to it, including
+// any lease of its memory, is released.  The pool is bounded, and keeps
+// little of each arena's memory committed, so a burst of calls does not
+// hold on to its peak.
+std::shared_ptr<void> acquire_request_arena();
+
+// While an arena_scope is alive, get_allocator and lease_arena_memory on
+// the calling thread use the given request arena.  Scopes nest.
+class arena_scope {
+public:
+  explicit arena_scope(std::shared_ptr<void> arena);
+  ~arena_scope();
+
+  arena_scope(arena_scope const&) = delete;
+  arena_scope& operator=(arena_scope const&) = delete;
+
+private:
+  std::shared_ptr<void> prev_;
+};
+
+// Runs task on one of the threads for asynchronous calls.  There are at
+// most async_threads() of them, by default one for each hardware thread.
+void run_async(std::function<void()> task);
+void set_async_threads(size_t n);
+size_t async_threads();
+
+// When enabled, each entry point plans the memory of its calls: the first
+// call with given argument shapes runs in the calling thread's arena, and
+// measures the bytes it allocates.  Later calls with the same shapes run
+// in a workspace of exactly that size, taken from the top of the arena,
+// so they allocate at the same offsets from the top every time, and
+// never grow the arena beyond the measured call.  Turning planning off
+// forgets the plans.  This is off by default.
+void set_memory_planning(bool enabled);
+bool memory_planning();
+
+// Reports from the profiler (see knossos-profile.h).  These are empty
+// unless the module was compiled with KS_PROFILE.
+std::string profile_chrome_trace();
+std::string profile_flat();
+void profile_reset();
+
+#ifdef KS_ALLOCATOR
+// Calls body(alloc, i) for each element i in [begin, end) of a batch.  The
+// arena is marked once, and reset to that mark after each element, so body
+// must store everything it needs from element i before returning.  Under
+// KS_PARALLEL the batch is shared between the threads of the pool, each
+// with its own arena, so body may be called concurrently for different i.
+template<typename Body>
+void for_each_in_batch(ks::allocator * alloc, ks::Integer begin, ks::Integer end, Body const& body) {
+  auto run = [&](ks::allocator * alloc, ks::Integer b, ks::Integer e) {
+    KS_MARK(alloc, mark);
+    for (ks::Integer i = b; i < e; ++i) {
+      body(alloc, i);
+      KS_RESET(alloc, mark);
+    }
+  };
+#ifdef KS_PARALLEL
+  bool ran = ks::get_thread_pool().try_parallel_for(end - begin,
+    [&](ks::allocator * worker_alloc, int, ks::Integer b, ks::Integer e) { run(worker_alloc, begin + b, begin + e); },
+    []() { });
+  if (ran)
+    return;
+#endif
+  run(alloc, begin, end);
+}
+
+// The sizes of every tensor in a value, in order: the shape of the value,
+// without allocating it as shape(alloc, t) would.
+template<typename T>
+struct shape_key {
+  static void append(std::vector<ks::Integer> *, T const&) { }
+};
+
+template<size_t Dim, typename T>
+struct shape_key<ks::tensor<Dim, T>> {
+  template<size_t ...Indices>
+  static void append_size(std::vector<ks::Integer> * key, ks::tensor<Dim, T> const& t, std::index_sequence<Indices...>) {
+    (key->push_back(ks::get_dimension<Indices>(t.size())), ...);
+  }
+
+  static void append(std::vector<ks::Integer> * key, ks::tensor<Dim, T> const& t) {
+    append_size(key, t, std::make_index_sequence<Dim>{});
+    if constexpr (!ks::is_flat<T>::value) {
+      auto data = t.data();
+      for (ks::Integer i = 0, ne = t.num_elements(); i != ne; ++i)
+        shape_key<T>::append(key, data[i]);
+    }
+  }
+};
+
+template<typename ...Ts>
+struct shape_key<ks::Tuple<Ts...>> {
+  template<size_t ...Indices>
+  static void append_impl(std::vector<ks::Integer> * key, ks::Tuple<Ts...> const& t, std::index_sequence<Indices...>) {
+    (shape_key<Ts>::append(key, ks::get<Indices>(t)), ...);
+  }
+
+  static void append(std::vector<ks::Integer> * key, ks::Tuple<Ts...> const& t) {
+    append_impl(key, t, std::index_sequence_for<Ts...>{});
+  }
+};
+
+// An arena over a planned number of bytes taken from another arena, which
+// throws exhausted rather than failing if a call needs more than was planned
+class workspace_allocator : public ks::allocator {
+public:
+  struct exhausted { };
+
+  workspace_allocator(ks::allocator * alloc, size_t size)
+    : ks::allocator(static_cast<unsigned char*>(alloc->allocate(size)), size, borrowed_t{}) { }
+
+protected:
+  void commit(size_t) override {
+    // The whole workspace was committed by the arena it came from, so
+    // this is only reached once it is exhausted
+    throw exhausted{};
+  }
+};
+
+// The memory plans of one entry point, on one thread (see
+// set_memory_planning).  Each generated entry point has its own.
+class memory_planner {
+public:
+  // The number of argument shapes for which plans are kept.  Beyond that,
+  // the oldest plan is forgotten, and measured again if its shapes recur.
+  static constexpr size_t max_plans = 64;
+
+  // f(alloc), where f calls the entry point's function with the given args
+  template<typename F, typename ...Args>
+  auto call(F const& f, Args const& ...args) {
+    ks::allocator * alloc = get_allocator();
+    if (!memory_planning()) {
+      forget_plans();
+      return f(alloc);
+    }
+
+    std::vector<ks::Integer> key;
+    (shape_key<Args>::append(&key, args), ...);
+    size_t top = alloc->mark();
+    auto plan = plans_.find(key);
+    if (plan != plans_.end()) {
+      // The workspace is the next plan->second bytes of the arena, which
+      // the measured call has already committed.  Like any other call,
+      // the result stays in the arena until it is reset.
+      try {
+        workspace_allocator workspace(alloc, std::max(plan->second, size_t(16)));
+        return f(&workspace);
+      } catch (workspace_allocator::exhausted const&) {
+        // Something other than the shapes of the arguments decided how
+        // much was allocated, so measure this call instead
+        alloc->reset(top);
+      }
+    }
+
+    size_t peak = alloc->peak();
+    alloc->reset_peak();
+    auto ret = f(alloc);
+    remember_plan(std::move(key), alloc->peak() - top);
+    alloc->raise_peak(peak);
+    return ret;
+  }
+
+private:
+  void remember_plan(std::vector<ks::Integer> key, size_t bytes) {
+    auto [plan, inserted] = plans_.insert_or_assign(std::move(key), bytes);
+    if (!inserted) {
+      return;
+    }
+    order_.push_back(plan);
+    if (order_.size() > max_plans) {
+      plans_.erase(order_.front());
+      order_.pop_front();
+    }
+  }
+
+  void forget_plans() {
+    if (!plans_.empty()) {
+      plans_.clear();
+      order_.clear();
+    }
+  }
+
+  typedef std::map<std::vector<ks::Integer>, size_t> plans_t;
+  plans_t plans_;
+  std::deque<plans_t::iterator> order_;  // plans_, oldest first
+};
+#endif
 
 template<typename KSType, typename EntryPointType>
 KSType convert_argument(EntryPointType arg);
@@ -0,0 +1,367 @@
+// Tensors whose sizes are known at compile time
+#pragma once
+
+/*
+fixed_tensor<T, N0, Ns...> is a tensor of dimension 1 + sizeof...(Ns),
+with size (N0, Ns...), whose elements are held by value rather than in
+the allocator.  It is intended for the small vectors and matrices (the
+3-vectors and 3x3 rotations of bundle adjustment and hand tracking) for
+which a tensor's runtime sizes and arena storage cost more than the
+elements themselves.  fixed_vec<T, N> is the 1-dimensional case.
+
+The interface mirrors that of tensor: size, num_elements, data, operator[]
+and index behave in the same way, create checks the requested size
+against the static one, and shape, zero, the tangent-space arithmetic,
+inplace_add and copydown all have fixed_tensor overloads.  The sizes are
+constants, so loops over the elements have constant trip counts, which
+the compiler can unroll.
+
+A fixed_tensor of flat elements is itself flat, so it is copied down by
+just resetting the allocator.  build_fixed and sumbuild_fixed are build
+and sumbuild over a loop of static size: build_fixed<T, N0, Ns...>(alloc, f)
+is a fixed_tensor<T, N0, Ns...>, and sumbuild_fixed<T, N0, Ns...>(alloc, f)
+adds up f(alloc, i0, i...) over the same indices.
+
+Unlike tensor, operator[] of a multi-dimensional fixed_tensor returns its
+subtensor by value, so elements are assigned through index (or data()).
+*/
+
+#include "knossos.h"
+
+namespace ks {
+
+	template <class T, int N0, int... Ns> class fixed_tensor;
+
+	// The type of an element of the outer dimension of a
+	// fixed_tensor<T, N0, Ns...>
+	template <class T, int... Ns>
+	struct fixed_tensor_row { using type = fixed_tensor<T, Ns...>; };
+
+	template <class T>
+	struct fixed_tensor_row<T> { using type = T; };
+
+	template <class T, int N0, int... Ns>
+	class fixed_tensor
+	{
+	public:
+		static constexpr size_t Dim = 1 + sizeof...(Ns);
+		static constexpr int NumElements = (N0 * ... * Ns);
+
+	private:
+		using dimension = tensor_dimension<Dim>;
+
+		T data_[NumElements] = {};
+
+	public:
+		typedef typename dimension::index_type index_type;
+		typedef T value_type;
+		typedef typename fixed_tensor_row<T, Ns...>::type row_type;
+
+		static KS_INTERFACE index_type static_size() {
+			if constexpr (Dim == 1u) {
+				return N0;
+			} else {
+				return index_type{ N0, Ns... };
+			}
+		}
+
+		KS_INTERFACE index_type size() const { return static_size(); }
+		KS_INTERFACE Integer outer_dimension() const { return N0; }
+		KS_INTERFACE Integer num_elements() const { return NumElements; }
+
+		KS_INTERFACE T* data() { return data_; }
+		KS_INTERFACE const T* data() const { return data_; }
+
+		KS_INTERFACE std::conditional_t<Dim == 1u, T&, row_type> operator[](Integer i) {
+			if constexpr (Dim == 1u) {
+				return data_[i];
+			} else {
+				return subtensor(i);
+			}
+		}
+
+		KS_INTERFACE std::conditional_t<Dim == 1u, const T&, row_type> operator[](Integer i) const {
+			if constexpr (Dim == 1u) {
+				return data_[i];
+			} else {
+				return subtensor(i);
+			}
+		}
+
+		KS_INTERFACE row_type subtensor(Integer i) const {
+			static_assert(Dim >= 2u);
+			row_type ret;
+			constexpr int inner = NumElements / N0;
+			for (int k = 0; k != inner; ++k)
+				ret.data()[k] = data_[i * inner + k];
+			return ret;
+		}
+
+		KS_INTERFACE Integer flat_index(index_type i) const {
+#ifdef KS_BOUNDS_CHECK
+			if (!dimension::index_is_in_range(i, static_size())) {
+				std::cerr << "ERROR: Accessing element " << dimension::index_to_string(i) << " of tensor of size " << dimension::index_to_string(static_size()) << std::endl;
+				abort();
+			}
+#endif
+			return dimension::flatten_index(i, static_size());
+		}
+
+		KS_INTERFACE T const& index(index_type i) const { return data_[flat_index(i)]; }
+
+		KS_INTERFACE T& index(index_type i) { return data_[flat_index(i)]; }
+
+		KS_INTERFACE void set_if_index_is_in_range(index_type i, T const& val) {
+			if (dimension::index_is_in_range(i, static_size())) {
+				data_[dimension::flatten_index(i, static_size())] = val;
+			}
+		}
+
+		// Only for the benefit of code which is generic in the tensor type:
+		// nothing is allocated.
+		static KS_INTERFACE fixed_tensor create(allocator_base *, index_type size)
+		{
+			KS_ASSERT(size == static_size());
+			return {};
+		}
+
+		KS_INTERFACE bool operator == (fixed_tensor const& other) const {
+			for (int i = 0; i != NumElements; ++i) {
+				if (data_[i] != other.data_[i]) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		KS_INTERFACE bool operator != (fixed_tensor const& other) const { return !(*this == other); }
+	};
+
+	template <class T, int N> using fixed_vec = fixed_tensor<T, N>;
+
+	template <class T, int... Ns>
+	KS_FUNCTION auto size(fixed_tensor<T, Ns...> const & t)
+	{
+		return t.size();
+	}
+
+	template <class T, int... Ns>
+	KS_FUNCTION T const &index(typename fixed_tensor<T, Ns...>::index_type i, fixed_tensor<T, Ns...> const & t)
+	{
+		return t.index(i);
+	}
+
+	template <class T, int... Ns>
+	std::ostream &operator<<(std::ostream &s, fixed_tensor<T, Ns...> const &v)
+	{
+		s << "[";
+		for (int i = 0; i < v.outer_dimension(); ++i)
+			s << (i > 0 ? ", " : "") << v[i];
+		return s << "]";
+	}
+
+	template <class T, int... Ns>
+	struct type_to_string<fixed_tensor<T, Ns...>>
+	{
+		static std::string name()
+		{
+			return "fixed_tensor<" + type_to_string<T>::name() + ((", " + std::to_string(Ns)) + ...) + ">";
+		}
+	};
+
+	template <class T, int... Ns>
+	struct is_flat<fixed_tensor<T, Ns...>> : is_flat<T> {};
+
+	// ===============================  Build  ==================================
+
+	// Call f(i0, i...) for the index of each element of a
+	// fixed_tensor<T, N0, Ns...>, in row-major order
+	template <int N0, int... Ns, class F, class... HigherDimensionIndices>
+	KS_FUNCTION void for_each_fixed_index(F const& f, HigherDimensionIndices ...higherDimensionIndices)
+	{
+		for (int i = 0; i != N0; ++i) {
+			if constexpr (sizeof...(Ns) == 0)
+				f(higherDimensionIndices..., i);
+			else
+				for_each_fixed_index<Ns...>(f, higherDimensionIndices..., i);
+		}
+	}
+
+	template <class T, int N0, int... Ns, class F>
+	KS_FUNCTION fixed_tensor<T, N0, Ns...> build_fixed(allocator * alloc, F f)
+	{
+		fixed_tensor<T, N0, Ns...> ret;
+		T* data = ret.data();
+		for_each_fixed_index<N0, Ns...>([&](auto ...i) { *data++ = T{ f(alloc, i...) }; });
+		return ret;
+	}
+
+	// The first term is copied down, and the others are added to it in
+	// place, as for sumbuild
+	template <class T, int N0, int... Ns, class F>
+	KS_FUNCTION T sumbuild_fixed(allocator * alloc, F f)
+	{
+		KS_MARK(alloc, mark);
+		T ret = KS_COPYDOWN(alloc, mark, f(alloc, 0, (Ns * 0)...));
+		KS_MARK(alloc, mark1);
+		bool first = true;
+		for_each_fixed_index<N0, Ns...>([&](auto ...i) {
+			if (first) {
+				first = false;
+				return;
+			}
+			accumulate(alloc, &ret, f, i...);
+			KS_RESET(alloc, mark1);
+		});
+		return ret;
+	}
+
+	// ===============================  Shape and zero  ==================================
+
+	template <class T, int... Ns>
+	KS_FUNCTION auto shape(allocator_base * alloc, fixed_tensor<T, Ns...> const& t) {
+		fixed_tensor<decltype(shape(alloc, std::declval<T const&>())), Ns...> s;
+		for (int i = 0; i != t.num_elements(); ++i)
+			s.data()[i] = shape(alloc, t.data()[i]);
+		return s;
+	}
+
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> zero(allocator * alloc, fixed_tensor<T, Ns...> const& val)
+	{
+		fixed_tensor<T, Ns...> ret;
+		for (int i = 0; i != ret.num_elements(); ++i)
+			ret.data()[i] = zero(alloc, val.data()[i]);
+		return ret;
+	}
+
+	template <class T, int... Ns>
+	struct make_zero_t<fixed_tensor<T, Ns...>>
+	{
+		static KS_FUNCTION fixed_tensor<T, Ns...> ofShape(allocator_base * alloc, shape_t<fixed_tensor<T, Ns...>> const& shape) {
+			fixed_tensor<T, Ns...> ret;
+			for (int i = 0; i != ret.num_elements(); ++i)
+				ret.data()[i] = make_zero_t<T>::ofShape(alloc, shape.data()[i]);
+			return ret;
+		}
+	};
+
+	// ===============================  Copydown  ==================================
+
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> inflated_deep_copy(allocator_base * alloc, fixed_tensor<T, Ns...> t)
+	{
+		if constexpr (!is_flat<T>::value) {
+			for (int i = 0; i != t.num_elements(); ++i)
+				t.data()[i] = inflated_deep_copy(alloc, t.data()[i]);
+		}
+		return t;
+	}
+
+#ifdef KS_ALLOCATOR
+	template <class T, int... Ns>
+	KS_FUNCTION size_t inflated_bytes(fixed_tensor<T, Ns...> const& t) {
+		size_t ret = 0;
+		if constexpr (!is_flat<T>::value) {
+			for (int i = 0; i != t.num_elements(); ++i)
+				ret += inflated_bytes(t.data()[i]);
+		}
+		return ret;
+	}
+
+	template <class T, int... Ns>
+	KS_FUNCTION bool memory_overlaps(const void* start, const void* end, fixed_tensor<T, Ns...> const& t) {
+		if constexpr (!is_flat<T>::value) {
+			for (int i = 0; i != t.num_elements(); ++i)
+				if (memory_overlaps(start, end, t.data()[i]))
+					return true;
+		}
+		return false;
+	}
+#endif
+
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> relocating_copy(allocator * alloc, relocation_state const& r, fixed_tensor<T, Ns...> t) {
+		if constexpr (!is_flat<T>::value) {
+			for (int i = 0; i != t.num_elements(); ++i)
+				t.data()[i] = relocating_copy(alloc, r, t.data()[i]);
+		}
+		return t;
+	}
+#endif
+
+	// ===============================  Inplace add ==================================
+
+	template <class T, int... Ns>
+	struct inplace_add_t<fixed_tensor<T, Ns...>> {
+		static KS_FUNCTION void go(fixed_tensor<T, Ns...> *t1, const fixed_tensor<T, Ns...> &t2)
+		{
+			for (int i = 0; i != t1->num_elements(); ++i)
+				inplace_add_t<T>::go(&t1->data()[i], t2.data()[i]);
+		}
+	};
+
+	template <class T, int... Ns>
+	struct inplace_add_scaled_t<fixed_tensor<T, Ns...>> {
+		static KS_FUNCTION void go(fixed_tensor<T, Ns...> *t1, Float s, const fixed_tensor<T, Ns...> &t2)
+		{
+			for (int i = 0; i != t1->num_elements(); ++i)
+				inplace_add_scaled_t<T>::go(&t1->data()[i], s, t2.data()[i]);
+		}
+	};
+
+	template <class T, int... Ns>
+	struct inplace_add_compensated_t<fixed_tensor<T, Ns...>> {
+		static KS_FUNCTION void go(fixed_tensor<T, Ns...> *t1, fixed_tensor<T, Ns...> *compensation, const fixed_tensor<T, Ns...> &t2)
+		{
+			for (int i = 0; i != t1->num_elements(); ++i)
+				inplace_add_compensated_t<T>::go(&t1->data()[i], &compensation->data()[i], t2.data()[i]);
+		}
+	};
+
+	template <class T, int... Ns>
+	KS_FUNCTION void inplace_add_at(fixed_tensor<T, Ns...> * t, typename fixed_tensor<T, Ns...>::index_type i, T const& val)
+	{
+		inplace_add(&t->index(i), val);
+	}
+
+	// ============================  Tangent-space arithmetic ================================
+
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> ts_add(allocator * alloc, fixed_tensor<T, Ns...> const& a, fixed_tensor<T, Ns...> const& b)
+	{
+		fixed_tensor<T, Ns...> ret;
+		for (int i = 0; i != ret.num_elements(); ++i)
+			ret.data()[i] = ts_add(alloc, a.data()[i], b.data()[i]);
+		return ret;
+	}
+
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> ts_scale(allocator * alloc, Float val, fixed_tensor<T, Ns...> const& t)
+	{
+		fixed_tensor<T, Ns...> ret;
+		for (int i = 0; i != ret.num_elements(); ++i)
+			ret.data()[i] = ts_scale(alloc, val, t.data()[i]);
+		return ret;
+	}
+
+	template <class T, int... Ns>
+	KS_FUNCTION fixed_tensor<T, Ns...> ts_neg(allocator * alloc, fixed_tensor<T, Ns...> const& t)
+	{
+		fixed_tensor<T, Ns...> ret;
+		for (int i = 0; i != ret.num_elements(); ++i)
+			ret.data()[i] = ts_neg(alloc, t.data()[i]);
+		return ret;
+	}
+
+	template <class T1, class T2, int... Ns>
+	inline KS_FUNCTION Float ts_dot(fixed_tensor<T1, Ns...> const& t1, fixed_tensor<T2, Ns...> const& t2)
+	{
+		Float ret = 0;
+		for (int i = 0; i != t1.num_elements(); ++i)
+			ret += ts_dot(t1.data()[i], t2.data()[i]);
+		return ret;
+	}
+
+} // namespace ks
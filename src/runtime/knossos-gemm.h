@@ -0,0 +1,238 @@
+// Matrix-matrix and matrix-vector products on row-major data
+#pragma once
+
+/*
+gemm computes C = op(A) * op(B), and gemv y = op(A) * x, where op(X) is
+X or its transpose, as needed by matmul and its reverse pass.  All the
+matrices are row-major, with row strides lda, ldb, ldc.
+
+The default implementation is cache-blocked in the usual way (see Goto &
+van de Geijn, "Anatomy of high-performance matrix multiplication"):
+blocks of op(A) and op(B) are packed into contiguous panels, taken from
+the allocator and released on return, and each gemm_mr x gemm_nr tile of
+C is computed by the vectorized simd::gemm_micro.
+
+Define KS_USE_CBLAS to call cblas_sgemm and cblas_sgemv instead (the
+program must then be linked against a BLAS library).  Under KS_CUDA the
+plain triple loop is used.
+
+The kernels are for Float.  Other element types (the 16-bit floats of
+knossos-half.h) are accumulated in Float: gemm converts them to Float
+copies, in the allocator, and gemv converts them as it goes.
+*/
+
+#include "knossos.h"
+
+#ifdef KS_USE_CBLAS
+#include <cblas.h>
+#endif
+
+namespace ks {
+namespace gemm {
+
+#if defined(KS_CUDA)
+	template <class T>
+	KS_FUNCTION inline void gemm(allocator *, bool transA, bool transB, Integer M, Integer N, Integer K,
+		T const* A, Integer lda, T const* B, Integer ldb, T* C, Integer ldc)
+	{
+		for (Integer i = 0; i != M; ++i)
+			for (Integer j = 0; j != N; ++j) {
+				Float tot = 0;
+				for (Integer k = 0; k != K; ++k)
+					tot += (transA ? A[k * lda + i] : A[i * lda + k]) * (transB ? B[j * ldb + k] : B[k * ldb + j]);
+				C[i * ldc + j] = tot;
+			}
+	}
+
+	// op(A) is M x N
+	template <class T>
+	KS_FUNCTION inline void gemv(bool transA, Integer M, Integer N, T const* A, Integer lda, T const* x, T* y)
+	{
+		for (Integer i = 0; i != M; ++i) {
+			Float tot = 0;
+			for (Integer j = 0; j != N; ++j)
+				tot += (transA ? A[j * lda + i] : A[i * lda + j]) * x[j];
+			y[i] = tot;
+		}
+	}
+
+#elif defined(KS_USE_CBLAS)
+	inline void gemm(allocator *, bool transA, bool transB, Integer M, Integer N, Integer K,
+		Float const* A, Integer lda, Float const* B, Integer ldb, Float* C, Integer ldc)
+	{
+		if (M == 0 || N == 0)
+			return;
+		if (K == 0) {
+			for (Integer i = 0; i != M; ++i)
+				std::fill(C + i * ldc, C + i * ldc + N, Float(0));
+			return;
+		}
+		cblas_sgemm(CblasRowMajor, transA ? CblasTrans : CblasNoTrans, transB ? CblasTrans : CblasNoTrans,
+			M, N, K, 1.0f, A, lda, B, ldb, 0.0f, C, ldc);
+	}
+
+	// op(A) is M x N
+	inline void gemv(bool transA, Integer M, Integer N, Float const* A, Integer lda, Float const* x, Float* y)
+	{
+		if (N == 0) {
+			std::fill(y, y + M, Float(0));
+			return;
+		}
+		if (M == 0)
+			return;
+		if (transA)
+			cblas_sgemv(CblasRowMajor, CblasTrans, N, M, 1.0f, A, lda, x, 1, 0.0f, y, 1);
+		else
+			cblas_sgemv(CblasRowMajor, CblasNoTrans, M, N, 1.0f, A, lda, x, 1, 0.0f, y, 1);
+	}
+
+#else
+	// Block sizes: a kc x nc block of op(B) should fit in L3, an mc x kc
+	// block of op(A) in L2, and a kc x gemm_nr panel of op(B) in L1.
+	constexpr int mc = 16 * simd::gemm_mr;
+	constexpr int kc = 256;
+	constexpr int nc = 256 * simd::gemm_nr;
+
+	// Pack rows [i0, i0 + m) and columns [p0, p0 + k) of op(A) into panels
+	// of gemm_mr rows, stored column by column and padded with zeros
+	inline void pack_a(bool transA, Float const* A, Integer lda, Integer i0, int m, Integer p0, int k, Float* out)
+	{
+		constexpr int mr = simd::gemm_mr;
+		for (int ir = 0; ir < m; ir += mr) {
+			int rows = std::min(mr, m - ir);
+			for (int p = 0; p != k; ++p) {
+				for (int i = 0; i != rows; ++i) {
+					Integer row = i0 + ir + i, col = p0 + p;
+					out[i] = transA ? A[col * lda + row] : A[row * lda + col];
+				}
+				for (int i = rows; i != mr; ++i)
+					out[i] = 0;
+				out += mr;
+			}
+		}
+	}
+
+	// Pack rows [p0, p0 + k) and columns [j0, j0 + n) of op(B) into panels
+	// of gemm_nr columns, stored row by row and padded with zeros
+	inline void pack_b(bool transB, Float const* B, Integer ldb, Integer p0, int k, Integer j0, int n, Float* out)
+	{
+		constexpr int nr = simd::gemm_nr;
+		for (int jr = 0; jr < n; jr += nr) {
+			int cols = std::min(nr, n - jr);
+			for (int p = 0; p != k; ++p) {
+				Integer row = p0 + p;
+				if (!transB) {
+					std::memcpy(out, B + row * ldb + j0 + jr, cols * sizeof(Float));
+				} else {
+					for (int j = 0; j != cols; ++j)
+						out[j] = B[(j0 + jr + j) * ldb + row];
+				}
+				for (int j = cols; j != nr; ++j)
+					out[j] = 0;
+				out += nr;
+			}
+		}
+	}
+
+	inline void gemm(allocator * alloc, bool transA, bool transB, Integer M, Integer N, Integer K,
+		Float const* A, Integer lda, Float const* B, Integer ldb, Float* C, Integer ldc)
+	{
+		constexpr int mr = simd::gemm_mr;
+		constexpr int nr = simd::gemm_nr;
+
+		if (K == 0) {
+			for (Integer i = 0; i != M; ++i)
+				std::fill(C + i * ldc, C + i * ldc + N, Float(0));
+			return;
+		}
+
+		auto micro = simd::get_kernels().gemm_micro;
+		KS_MARK(alloc, mark);
+		// The panels need be no bigger than the blocks of this product,
+		// rounded up to whole micro-panels
+		Integer panelM = (std::min<Integer>(M, mc) + mr - 1) / mr * mr;
+		Integer panelN = (std::min<Integer>(N, nc) + nr - 1) / nr * nr;
+		Integer panelK = std::min<Integer>(K, kc);
+		Float* packedA = static_cast<Float*>(alloc->allocate(sizeof(Float) * panelM * panelK));
+		Float* packedB = static_cast<Float*>(alloc->allocate(sizeof(Float) * panelK * panelN));
+
+		for (Integer jc = 0; jc < N; jc += nc) {
+			int n = (int)std::min<Integer>(nc, N - jc);
+			for (Integer pc = 0; pc < K; pc += kc) {
+				int k = (int)std::min<Integer>(kc, K - pc);
+				pack_b(transB, B, ldb, pc, k, jc, n, packedB);
+				for (Integer ic = 0; ic < M; ic += mc) {
+					int m = (int)std::min<Integer>(mc, M - ic);
+					pack_a(transA, A, lda, ic, m, pc, k, packedA);
+					for (int jr = 0; jr < n; jr += nr)
+						for (int ir = 0; ir < m; ir += mr)
+							micro(k, packedA + ir * k, packedB + jr * k,
+								C + (ic + ir) * ldc + jc + jr, ldc,
+								std::min(mr, m - ir), std::min(nr, n - jr), pc != 0);
+				}
+			}
+		}
+		KS_RESET(alloc, mark);
+	}
+
+	// op(A) is M x N
+	inline void gemv(bool transA, Integer M, Integer N, Float const* A, Integer lda, Float const* x, Float* y)
+	{
+		if (!transA) {
+			for (Integer i = 0; i != M; ++i)
+				y[i] = simd::dot(A + i * lda, x, N);
+		} else {
+			// y = sum_j x[j] * (row j of A), which reads A contiguously
+			std::fill(y, y + M, Float(0));
+			for (Integer j = 0; j != N; ++j)
+				simd::axpy(y, x[j], A + j * lda, M);
+		}
+	}
+#endif
+
+#if !defined(KS_CUDA)
+	// Copy the rows x cols matrix at src, with row stride ld, to dst with
+	// row stride cols, converting its elements to To
+	template <class To, class From>
+	void convert_matrix(Integer rows, Integer cols, From const* src, Integer ld, To* dst)
+	{
+		for (Integer i = 0; i != rows; ++i)
+			for (Integer j = 0; j != cols; ++j)
+				dst[i * cols + j] = To(src[i * ld + j]);
+	}
+
+	// The same, for other element types (e.g. half): the operands are
+	// converted to Float, and the product rounded back to T.
+	template <class T>
+	void gemm(allocator * alloc, bool transA, bool transB, Integer M, Integer N, Integer K,
+		T const* A, Integer lda, T const* B, Integer ldb, T* C, Integer ldc)
+	{
+		Integer rowsA = transA ? K : M, colsA = transA ? M : K;
+		Integer rowsB = transB ? N : K, colsB = transB ? K : N;
+		KS_MARK(alloc, mark);
+		Float* fA = static_cast<Float*>(alloc->allocate(sizeof(Float) * rowsA * colsA));
+		Float* fB = static_cast<Float*>(alloc->allocate(sizeof(Float) * rowsB * colsB));
+		Float* fC = static_cast<Float*>(alloc->allocate(sizeof(Float) * M * N));
+		convert_matrix(rowsA, colsA, A, lda, fA);
+		convert_matrix(rowsB, colsB, B, ldb, fB);
+		gemm(alloc, transA, transB, M, N, K, fA, colsA, fB, colsB, fC, N);
+		for (Integer i = 0; i != M; ++i)
+			for (Integer j = 0; j != N; ++j)
+				C[i * ldc + j] = T(fC[i * N + j]);
+		KS_RESET(alloc, mark);
+	}
+
+	template <class T>
+	void gemv(bool transA, Integer M, Integer N, T const* A, Integer lda, T const* x, T* y)
+	{
+		for (Integer i = 0; i != M; ++i) {
+			Float tot = 0;
+			for (Integer j = 0; j != N; ++j)
+				tot += Float(transA ? A[j * lda + i] : A[i * lda + j]) * Float(x[j]);
+			y[i] = T(tot);
+		}
+	}
+#endif
+
+}
+}
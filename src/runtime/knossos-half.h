@@ -0,0 +1,148 @@
+// Reduced-precision floating point: half and bfloat16
+#pragma once
+
+/*
+half (IEEE binary16) and bfloat16 (the top 16 bits of a float) are
+storage types: a tensor<Dim, half> takes half the memory, and half the
+bandwidth, of a tensor<Dim, Float>.  Arithmetic on them is done in Float,
+to which they convert implicitly, and the result is rounded (to nearest,
+ties to even) back to 16 bits when it is stored.  So the generic
+tensor code in knossos.h (ts_add, ts_scale, inplace_add, build, ...)
+works on them unchanged.
+
+Reductions accumulate in accumulator_t<T>, which is Float for both
+types: sum converts each element as it is added, ts_dot already returns
+Float, and gemm and gemv convert their operands to Float and use the
+Float kernels.  Only the final result is rounded to 16 bits.
+
+The torch entry points map half to torch.float16 and bfloat16 to
+torch.bfloat16, whose bit layouts they share.
+*/
+
+#include "knossos.h"
+
+namespace ks {
+
+	namespace half_detail {
+		inline KS_FUNCTION uint32_t float_bits(float f) { uint32_t u; std::memcpy(&u, &f, sizeof u); return u; }
+		inline KS_FUNCTION float bits_float(uint32_t u) { float f; std::memcpy(&f, &u, sizeof f); return f; }
+
+		// After F. Giesen, "float->half variants", half_float_to_half_fast3_rtne
+		inline KS_FUNCTION uint16_t float_to_half(float f)
+		{
+			uint32_t u = float_bits(f);
+			uint32_t sign = u & 0x80000000u;
+			u ^= sign;
+
+			uint16_t ret;
+			if (u >= (143u << 23)) {
+				// Too large for a half, or inf or NaN
+				ret = u > (255u << 23) ? 0x7e00 : 0x7c00;
+			} else if (u < (113u << 23)) {
+				// Subnormal or zero: let the FPU round, by adding 0.5
+				uint32_t denorm_magic = 126u << 23;
+				ret = (uint16_t)(float_bits(bits_float(u) + bits_float(denorm_magic)) - denorm_magic);
+			} else {
+				uint32_t mant_odd = (u >> 13) & 1;
+				u += 0xc8000fffu + mant_odd;  // Rebias the exponent, and round
+				ret = (uint16_t)(u >> 13);
+			}
+			return ret | (uint16_t)(sign >> 16);
+		}
+
+		inline KS_FUNCTION float half_to_float(uint16_t h)
+		{
+			uint32_t shifted_exp = 0x7c00u << 13;
+			uint32_t u = (h & 0x7fffu) << 13;
+			uint32_t exp = shifted_exp & u;
+			u += (127u - 15u) << 23;
+			if (exp == shifted_exp) {
+				u += (128u - 16u) << 23;  // Inf or NaN
+			} else if (exp == 0) {
+				u += 1u << 23;            // Zero or subnormal
+				u = float_bits(bits_float(u) - bits_float(113u << 23));
+			}
+			return bits_float(u | ((h & 0x8000u) << 16));
+		}
+
+		inline KS_FUNCTION uint16_t float_to_bfloat16(float f)
+		{
+			uint32_t u = float_bits(f);
+			if ((u & 0x7fffffffu) > 0x7f800000u)
+				return (uint16_t)((u >> 16) | 0x40);  // Keep NaNs quiet
+			u += 0x7fffu + ((u >> 16) & 1);
+			return (uint16_t)(u >> 16);
+		}
+
+		inline KS_FUNCTION float bfloat16_to_float(uint16_t b)
+		{
+			return bits_float((uint32_t)b << 16);
+		}
+	}
+
+	struct half
+	{
+		uint16_t bits;
+
+		half() = default;
+		KS_FUNCTION half(float f) : bits(half_detail::float_to_half(f)) {}
+
+		KS_FUNCTION operator float() const { return half_detail::half_to_float(bits); }
+
+		KS_FUNCTION half& operator+=(float f) { return *this = half(float(*this) + f); }
+		KS_FUNCTION half& operator-=(float f) { return *this = half(float(*this) - f); }
+		KS_FUNCTION half& operator*=(float f) { return *this = half(float(*this) * f); }
+		KS_FUNCTION half& operator/=(float f) { return *this = half(float(*this) / f); }
+	};
+
+	struct bfloat16
+	{
+		uint16_t bits;
+
+		bfloat16() = default;
+		KS_FUNCTION bfloat16(float f) : bits(half_detail::float_to_bfloat16(f)) {}
+
+		KS_FUNCTION operator float() const { return half_detail::bfloat16_to_float(bits); }
+
+		KS_FUNCTION bfloat16& operator+=(float f) { return *this = bfloat16(float(*this) + f); }
+		KS_FUNCTION bfloat16& operator-=(float f) { return *this = bfloat16(float(*this) - f); }
+		KS_FUNCTION bfloat16& operator*=(float f) { return *this = bfloat16(float(*this) * f); }
+		KS_FUNCTION bfloat16& operator/=(float f) { return *this = bfloat16(float(*this) / f); }
+	};
+
+	static_assert(sizeof(half) == 2 && sizeof(bfloat16) == 2);
+
+	template <> struct accumulator<half> { typedef Float type; };
+	template <> struct accumulator<bfloat16> { typedef Float type; };
+
+	template <> struct is_flat<half> : std::true_type {};
+	template <> struct is_flat<bfloat16> : std::true_type {};
+
+	template <>
+	struct type_to_string<half>
+	{
+		static std::string name() { return "half"; }
+	};
+
+	template <>
+	struct type_to_string<bfloat16>
+	{
+		static std::string name() { return "bfloat16"; }
+	};
+
+	inline KS_FUNCTION Tuple<> shape(allocator_base *, half const&) { return {}; }
+	inline KS_FUNCTION Tuple<> shape(allocator_base *, bfloat16 const&) { return {}; }
+
+	template <>
+	inline KS_FUNCTION half zero(allocator *, half const& val)
+	{
+		return 0.0f;
+	}
+
+	template <>
+	inline KS_FUNCTION bfloat16 zero(allocator *, bfloat16 const& val)
+	{
+		return 0.0f;
+	}
+
+} // namespace ks
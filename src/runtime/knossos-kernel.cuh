@@ -3,6 +3,10 @@
 #include <cuda.h>
 #include <cuda_runtime.h>
 
+#include <type_traits>
+
+#include "knossos-cuda.cuh"
+
 using ks_float = float;
 
 #define CHECK_SCALAR_TYPE(x) TORCH_CHECK(x.scalar_type() == at::ScalarType::Float, #x " must use ks floating-point type")
@@ -10,94 +14,76 @@ using ks_float = float;
 #define CHECK_CONTIGUOUS(x) TORCH_CHECK(x.is_contiguous(), #x " must be contiguous")
 #define CHECK_INPUT(x) CHECK_CUDA(x); CHECK_CONTIGUOUS(x)
 
-template<typename scalar_t> using tensor_accessor_1 =
-    torch::PackedTensorAccessor32<scalar_t,1,torch::RestrictPtrTraits>;
-template<typename scalar_t> using tensor_accessor_2 =
-    torch::PackedTensorAccessor32<scalar_t,2,torch::RestrictPtrTraits>;
+// The bytes of arena which each device thread of map_gpu and map2_gpu has
+// for the temporaries of f, unless f says otherwise: a functor which never
+// allocates should declare
+//   static constexpr size_t thread_bytes = 0;
+// and is then launched without any thread arenas.
+//
+// KS_CUDA_MAP_MAX_THREADS_SIZE bounds the thread arenas of a launch in
+// total: a launch has no more blocks than fit.
+#ifndef KS_CUDA_MAP_THREAD_BYTES
+#define KS_CUDA_MAP_THREAD_BYTES 1024
+#endif
+
+#ifndef KS_CUDA_MAP_MAX_THREADS_SIZE
+#define KS_CUDA_MAP_MAX_THREADS_SIZE (size_t(1) << 26)
+#endif
+
+template<typename F, typename = void>
+struct map_thread_bytes : std::integral_constant<size_t, KS_CUDA_MAP_THREAD_BYTES> {};
 
-template <typename scalar_t, typename F>
-__global__ void map_kernel_1(
-    tensor_accessor_1<scalar_t> output,
-    const tensor_accessor_1<scalar_t> input,
-    F f) {
-  const int i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < input.size(0))
-    output[i] = f(input[i]);
-}
-
-template <typename scalar_t, typename F>
-__global__ void map_kernel_2(
-    tensor_accessor_2<scalar_t> output,
-    const tensor_accessor_2<scalar_t> input,
-    F f) {
-  const int n = blockIdx.y;
-  const int i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < input.size(1))
-    output[n][i] = f(input[n][i]);
+template<typename F>
+struct map_thread_bytes<F, std::void_t<decltype(F::thread_bytes)>> : std::integral_constant<size_t, F::thread_bytes> {};
+
+// The arena of the device threads of map_gpu and map2_gpu, for functors
+// which need ThreadBytes each.  Their results are torch tensors, so it
+// needs no results arena of its own.
+template<size_t ThreadBytes>
+ks::cuda::device_arena * get_device_arena() {
+  static ks::cuda::device_arena arena(0, ThreadBytes, KS_CUDA_MAP_MAX_THREADS_SIZE);
+  return &arena;
 }
 
+// The inputs are contiguous, so each is mapped as a flat array, whatever
+// its rank.  f is called with the allocator of the device thread.
 template<typename F>
 torch::Tensor map_gpu(
     torch::Tensor input,
     F f) {
   CHECK_INPUT(input);
 
-  auto output = torch::zeros_like(input);
-
-  switch (input.sizes().size()) {
-    case 1: {
-      const auto input_size = input.size(0);
-
-      // TODO: find out how PyTorch chooses these parameters
-      const int threads = 1024;
-      const int blocks = (input_size + threads - 1) / threads;
-
-      map_kernel_1<ks_float><<<blocks, threads>>>(
-          output.packed_accessor32<ks_float,1,torch::RestrictPtrTraits>(),
-          input.packed_accessor32<ks_float,1,torch::RestrictPtrTraits>(),
-          f);
-      break;
-    }
-    case 2: {
-      const auto input_size_0 = input.size(0);
-      const auto input_size_1 = input.size(1);
-
-      const int threads = 1024;
-      const dim3 blocks((input_size_1 + threads - 1) / threads, input_size_0);
-
-      map_kernel_2<ks_float><<<blocks, threads>>>(
-          output.packed_accessor32<ks_float,2,torch::RestrictPtrTraits>(),
-          input.packed_accessor32<ks_float,2,torch::RestrictPtrTraits>(),
-          f);
-      break;
-    }
-    default:
-      TORCH_CHECK(false, "Unsupported tensor rank");
-  }
+  auto output = torch::empty_like(input);
+  const ks::Integer n = input.numel();
+  if (n == 0)
+    return output;
+
+  auto * arena = get_device_arena<map_thread_bytes<F>::value>();
+  const int threads = ks::cuda::threads_per_block;
+  const int blocks = arena->blocks_for(n, threads);
+  ks::cuda::elementwise_map_kernel<<<blocks, threads>>>(
+      arena->for_launch(blocks, threads),
+      output.data_ptr<ks_float>(),
+      input.data_ptr<ks_float>(),
+      n,
+      f);
+  ks::cuda::check(cudaGetLastError(), "Failed to launch map_gpu");
   return output;
 }
 
 template <typename scalar_t, typename F>
-__global__ void map2_kernel_1(
-    tensor_accessor_1<scalar_t> output,
-    const tensor_accessor_1<scalar_t> input1,
-    const tensor_accessor_1<scalar_t> input2,
-    F f) {
-  const int i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < input1.size(0))
-    output[i] = f(input1[i], input2[i]);
-}
-
-template <typename scalar_t, typename F>
-__global__ void map2_kernel_2(
-    tensor_accessor_2<scalar_t> output,
-    const tensor_accessor_2<scalar_t> input1,
-    const tensor_accessor_2<scalar_t> input2,
+__global__ void map2_kernel(
+    ks::cuda::thread_arenas arenas,
+    scalar_t * output,
+    const scalar_t * input1,
+    const scalar_t * input2,
+    ks::Integer n,
     F f) {
-  const int n = blockIdx.y;
-  const int i = blockIdx.x * blockDim.x + threadIdx.x;
-  if (i < input1.size(1))
-    output[n][i] = f(input1[n][i], input2[n][i]);
+  ks::allocator alloc = arenas.thread_allocator();
+  for (ks::Integer i = blockIdx.x * ks::Integer(blockDim.x) + threadIdx.x; i < n; i += ks::Integer(blockDim.x) * gridDim.x) {
+    output[i] = f(&alloc, input1[i], input2[i]);
+    alloc.reset();
+  }
 }
 
 template<typename F>
@@ -107,39 +93,23 @@ torch::Tensor map2_gpu(
     F f) {
   CHECK_INPUT(input1);
   CHECK_INPUT(input2);
-
-  auto output = torch::zeros_like(input1);
-  switch (input1.sizes().size()) {
-    case 1: {
-      auto input_size = input1.size(0);
-
-      // TODO: find out how PyTorch chooses these parameters
-      const int threads = 1024;
-      const int blocks = (input_size + threads - 1) / threads;
-
-      map2_kernel_1<ks_float><<<blocks, threads>>>(
-          output.packed_accessor32<ks_float,1,torch::RestrictPtrTraits>(),
-          input1.packed_accessor32<ks_float,1,torch::RestrictPtrTraits>(),
-          input2.packed_accessor32<ks_float,1,torch::RestrictPtrTraits>(),
-          f);
-      break;
-    }
-    case 2: {
-      auto input_size_0 = input1.size(0);
-      auto input_size_1 = input1.size(1);
-
-      const int threads = 1024;
-      const dim3 blocks((input_size_1 + threads - 1) / threads, input_size_0);
-
-      map2_kernel_2<ks_float><<<blocks, threads>>>(
-          output.packed_accessor32<ks_float,2,torch::RestrictPtrTraits>(),
-          input1.packed_accessor32<ks_float,2,torch::RestrictPtrTraits>(),
-          input2.packed_accessor32<ks_float,2,torch::RestrictPtrTraits>(),
-          f);
-      break;
-    }
-    default:
-      TORCH_CHECK(false, "Unsupported tensor rank");
-  }
+  TORCH_CHECK(input1.sizes() == input2.sizes(), "input1 and input2 must have the same size");
+
+  auto output = torch::empty_like(input1);
+  const ks::Integer n = input1.numel();
+  if (n == 0)
+    return output;
+
+  auto * arena = get_device_arena<map_thread_bytes<F>::value>();
+  const int threads = ks::cuda::threads_per_block;
+  const int blocks = arena->blocks_for(n, threads);
+  map2_kernel<ks_float><<<blocks, threads>>>(
+      arena->for_launch(blocks, threads),
+      output.data_ptr<ks_float>(),
+      input1.data_ptr<ks_float>(),
+      input2.data_ptr<ks_float>(),
+      n,
+      f);
+  ks::cuda::check(cudaGetLastError(), "Failed to launch map2_gpu");
   return output;
 }
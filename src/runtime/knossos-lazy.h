@@ -0,0 +1,267 @@
+// Lazy elementwise expressions over tensors
+#pragma once
+
+/*
+An elementwise expression describes a tensor without computing it: it has
+a size(), like a tensor, and at(alloc, k) computes its k'th element in
+row-major order.  Expressions are made from tensors by
+  lazy::leaf(t)
+and combined, without allocating, by
+  lazy::add(a, b), lazy::scale(s, a), lazy::neg(a)
+  lazy::map(f, a)             -- f(alloc, x), as in ks::map
+  lazy::elementwise_map(a, f) -- f(x), as in ks::elementwise_map
+  lazy::pow(a, i)
+Each of these also accepts a tensor in place of an expression.
+
+An expression is consumed, in a single pass over its leaves, by
+  lazy::evaluate(alloc, e) -- the tensor of its elements
+  lazy::sum(alloc, e)      -- as ks::sum, in the default_sum_order
+  lazy::dot(alloc, a, b)   -- as ks::ts_dot
+so that a chain such as ts_add(ts_scale(s, x), ts_neg(y)) is one loop,
+and writes no intermediate tensors.  ksc generates these for nested
+calls of the tangent-space arithmetic, map and sum on tensors (see the
+Note [Lazy elementwise expressions] in Cgen.hs).
+
+An expression refers to the data of its leaves, so is only valid as long
+as they are.  The elements are computed by the ordinary ts_add etc. of
+their types, so at() allocates from alloc only if they do, e.g. for
+tensors of tensors; evaluate and sum reset alloc after each element
+whose type is flat.
+*/
+
+#include "knossos.h"
+
+namespace ks {
+namespace lazy {
+
+	template <size_t Dim, class T>
+	class leaf_expr
+	{
+	public:
+		typedef typename tensor_dimension<Dim>::index_type index_type;
+		typedef T value_type;
+		static constexpr size_t dimension = Dim;
+
+	private:
+		index_type size_;
+		T const* data_;
+
+	public:
+		KS_INTERFACE explicit leaf_expr(tensor<Dim, T> const& t) : size_(t.size()), data_(t.data()) {}
+
+		KS_INTERFACE index_type size() const { return size_; }
+		KS_INTERFACE T const& at(allocator *, Integer k) const { return data_[k]; }
+	};
+
+	template <class E>
+	struct is_expr : std::false_type {};
+
+	template <size_t Dim, class T>
+	struct is_expr<leaf_expr<Dim, T>> : std::true_type {};
+
+	template <size_t Dim, class T>
+	KS_INTERFACE leaf_expr<Dim, T> leaf(tensor<Dim, T> const& t) { return leaf_expr<Dim, T>(t); }
+
+	template <class E, class = std::enable_if_t<is_expr<E>::value>>
+	KS_INTERFACE E const& leaf(E const& e) { return e; }
+
+	template <class E>
+	using leaf_t = std::decay_t<decltype(leaf(std::declval<E const&>()))>;
+
+	template <class E>
+	KS_INTERFACE Integer num_elements(E const& e) { return tensor_dimension<E::dimension>::num_elements(e.size()); }
+
+	// ============================== Nodes ===================================
+
+	template <class A, class B>
+	class add_expr
+	{
+		A a_;
+		B b_;
+
+	public:
+		typedef typename A::index_type index_type;
+		typedef typename A::value_type value_type;
+		static constexpr size_t dimension = A::dimension;
+
+		KS_INTERFACE add_expr(A const& a, B const& b) : a_(a), b_(b) {
+			KS_ASSERT(a.size() == b.size());
+		}
+
+		KS_INTERFACE index_type size() const { return a_.size(); }
+		KS_INTERFACE value_type at(allocator * alloc, Integer k) const { return ts_add(alloc, a_.at(alloc, k), b_.at(alloc, k)); }
+	};
+
+	template <class A>
+	class scale_expr
+	{
+		Float s_;
+		A a_;
+
+	public:
+		typedef typename A::index_type index_type;
+		typedef typename A::value_type value_type;
+		static constexpr size_t dimension = A::dimension;
+
+		KS_INTERFACE scale_expr(Float s, A const& a) : s_(s), a_(a) {}
+
+		KS_INTERFACE index_type size() const { return a_.size(); }
+		KS_INTERFACE value_type at(allocator * alloc, Integer k) const { return ts_scale(alloc, s_, a_.at(alloc, k)); }
+	};
+
+	template <class A>
+	class neg_expr
+	{
+		A a_;
+
+	public:
+		typedef typename A::index_type index_type;
+		typedef typename A::value_type value_type;
+		static constexpr size_t dimension = A::dimension;
+
+		KS_INTERFACE explicit neg_expr(A const& a) : a_(a) {}
+
+		KS_INTERFACE index_type size() const { return a_.size(); }
+		KS_INTERFACE value_type at(allocator * alloc, Integer k) const { return ts_neg(alloc, a_.at(alloc, k)); }
+	};
+
+	// f(alloc, x) for each element x of a
+	template <class F, class A>
+	class map_expr
+	{
+		F f_;
+		A a_;
+
+	public:
+		typedef typename A::index_type index_type;
+		typedef decltype(applyWithAllocator(std::declval<allocator*>(), std::declval<F const&>(), std::declval<typename A::value_type>())) value_type;
+		static constexpr size_t dimension = A::dimension;
+
+		KS_INTERFACE map_expr(F const& f, A const& a) : f_(f), a_(a) {}
+
+		KS_INTERFACE index_type size() const { return a_.size(); }
+		KS_INTERFACE value_type at(allocator * alloc, Integer k) const { return applyWithAllocator(alloc, f_, a_.at(alloc, k)); }
+	};
+
+	// f(x) for each element x of a
+	template <class A, class F>
+	class elementwise_map_expr
+	{
+		A a_;
+		F f_;
+
+	public:
+		typedef typename A::index_type index_type;
+		typedef decltype(std::declval<F const&>()(std::declval<typename A::value_type>())) value_type;
+		static constexpr size_t dimension = A::dimension;
+
+		KS_INTERFACE elementwise_map_expr(A const& a, F const& f) : a_(a), f_(f) {}
+
+		KS_INTERFACE index_type size() const { return a_.size(); }
+		KS_INTERFACE value_type at(allocator * alloc, Integer k) const { return f_(a_.at(alloc, k)); }
+	};
+
+	template <class A, class B>
+	struct is_expr<add_expr<A, B>> : std::true_type {};
+	template <class A>
+	struct is_expr<scale_expr<A>> : std::true_type {};
+	template <class A>
+	struct is_expr<neg_expr<A>> : std::true_type {};
+	template <class F, class A>
+	struct is_expr<map_expr<F, A>> : std::true_type {};
+	template <class A, class F>
+	struct is_expr<elementwise_map_expr<A, F>> : std::true_type {};
+
+	template <class A, class B>
+	KS_INTERFACE add_expr<leaf_t<A>, leaf_t<B>> add(A const& a, B const& b) { return { leaf(a), leaf(b) }; }
+
+	template <class A>
+	KS_INTERFACE scale_expr<leaf_t<A>> scale(Float s, A const& a) { return { s, leaf(a) }; }
+
+	template <class A>
+	KS_INTERFACE neg_expr<leaf_t<A>> neg(A const& a) { return neg_expr<leaf_t<A>>(leaf(a)); }
+
+	template <class F, class A>
+	KS_INTERFACE map_expr<F, leaf_t<A>> map(F const& f, A const& a) { return { f, leaf(a) }; }
+
+	template <class A, class F>
+	KS_INTERFACE elementwise_map_expr<leaf_t<A>, F> elementwise_map(A const& a, F const& f) { return { leaf(a), f }; }
+
+	struct pow_fn
+	{
+		Integer i;
+
+		template <class T>
+		KS_INTERFACE T operator()(T const& v) const { return std::pow(v, i); }
+	};
+
+	template <class A>
+	KS_INTERFACE elementwise_map_expr<leaf_t<A>, pow_fn> pow(A const& a, Integer i) { return { leaf(a), pow_fn{ i } }; }
+
+	// =========================== Consumers ==================================
+
+	// The tensor of the elements of e, computed in one pass
+	template <class E>
+	KS_FUNCTION auto evaluate(allocator * alloc, E const& e)
+	{
+		auto const& x = leaf(e);
+		typedef typename leaf_t<E>::value_type T;
+		auto ret = tensor<leaf_t<E>::dimension, T>::create(alloc, x.size());
+		auto retdata = ret.data();
+		for_each_block(alloc, ret.num_elements(), &ret, [&](allocator * alloc, Integer begin, Integer end) {
+			for (Integer i = begin; i != end; ++i) {
+				if constexpr (is_flat<T>::value) {
+					KS_MARK(alloc, mark);
+					retdata[i] = x.at(alloc, i);
+					KS_RESET(alloc, mark);
+				} else {
+					retdata[i] = x.at(alloc, i);
+				}
+			}
+		});
+		return ret;
+	}
+
+	// The sum of the elements of e, as ks::sum(alloc, evaluate(alloc, e))
+	template <class E>
+	KS_FUNCTION auto sum(allocator * alloc, E const& e)
+	{
+		auto const& x = leaf(e);
+		typedef typename leaf_t<E>::value_type T;
+		typedef accumulator_t<T> Acc;
+		Integer ne = num_elements(x);
+		KS_ASSERT(ne > 0);
+#ifdef KS_ALLOCATOR
+		if constexpr (is_flat<T>::value) {
+			return T(sum_in_order<Acc>(alloc, ne, [&x](allocator * alloc, Integer k) {
+				KS_MARK(alloc, mark);
+				Acc ret = Acc(x.at(alloc, k));
+				KS_RESET(alloc, mark);
+				return ret;
+			}));
+		}
+#endif
+		Acc ret = Acc(x.at(alloc, 0));
+		for (Integer i = 1; i < ne; ++i)
+			ret = ts_add(alloc, ret, Acc(x.at(alloc, i)));
+		return T(ret);
+	}
+
+	// ts_dot(evaluate(alloc, a), evaluate(alloc, b))
+	template <class A, class B>
+	KS_FUNCTION Float dot(allocator * alloc, A const& a, B const& b)
+	{
+		auto const& x = leaf(a);
+		auto const& y = leaf(b);
+		KS_ASSERT(x.size() == y.size());
+		Float ret = 0;
+		for (Integer i = 0, ne = num_elements(x); i < ne; ++i) {
+			KS_MARK(alloc, mark);
+			ret += ts_dot(x.at(alloc, i), y.at(alloc, i));
+			KS_RESET(alloc, mark);
+		}
+		return ret;
+	}
+
+}
+}
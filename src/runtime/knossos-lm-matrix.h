@@ -0,0 +1,571 @@
+// Dense and sparse materialization of linear maps
+#pragma once
+
+/*
+A linear map (an LM::* value) is normally applied lazily: each lmApply
+walks its structure, and LM::Build calls its functor again for every
+row.  When the same map is applied to many vectors, it can instead be
+materialized once, as a matrix acting on the Floats of its argument:
+
+  auto J = LM::materialize_sparse(alloc, lm, x);   // CSR
+  auto J = LM::materialize_dense(alloc, lm, x);    // row-major
+  ... lmApply(alloc, J, dx) ...
+
+x is any value of type From; only its shape (the sizes of its tensors) is
+used.  The results are themselves linear maps, with the same From and To
+types as lm, and they do not refer to the allocator, so they may outlive
+any reset of it.
+
+The Floats of a value are numbered in the order in which they appear in
+memory for an array-of-structures layout: the components of a Tuple in
+turn, and the elements of a tensor in row-major order.  Integers and Bools
+have no Floats (they are rebuilt as zero, as tangents never contain them).
+
+The sparsity pattern is taken from the structure of the map: Zero
+contributes no entries, One and Scale contribute a diagonal, and HCat,
+VCat, Build and BuildT place the entries of their components in the
+corresponding blocks.  Compose multiplies the sparse matrices of its
+components.  Any other map is materialized one column at a time, by
+applying it to each basis vector in turn.  In each case entries which are
+exactly zero (such as the off-diagonal Scales of a deltaVec) are dropped.
+*/
+
+#include "knossos.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace ks
+{
+	namespace LM
+	{
+		// ---------------- Flattening ------------------
+
+		// The shape of a value, enough to rebuild it from its Floats
+		struct flat_layout
+		{
+			std::vector<Integer> sizes;   // the size of each tensor, in the order they are visited
+			Integer count = 0;            // the number of Floats
+		};
+
+		// These are mutually recursive, and found by ordinary lookup (the
+		// arguments are in namespace ks, not ks::LM), so declare them first
+		template <class T> void record_layout(flat_layout *, T const&);
+		template <class... Ts> void record_layout(flat_layout *, Tuple<Ts...> const&);
+		template <size_t Dim, class T> void record_layout(flat_layout *, tensor<Dim, T> const&);
+		template <class T> void flatten(Float **, T const&);
+		template <class... Ts> void flatten(Float **, Tuple<Ts...> const&);
+		template <size_t Dim, class T> void flatten(Float **, tensor<Dim, T> const&);
+
+		inline void record_size(flat_layout * layout, Integer size) { layout->sizes.push_back(size); }
+
+		template <class... Ints, size_t... Indices>
+		void record_size_Tupleimpl(flat_layout * layout, Tuple<Ints...> const& size, std::index_sequence<Indices...>)
+		{
+			(record_size(layout, ks::get<Indices>(size)), ...);
+		}
+
+		template <class... Ints>
+		void record_size(flat_layout * layout, Tuple<Ints...> const& size)
+		{
+			record_size_Tupleimpl(layout, size, std::index_sequence_for<Ints...>{});
+		}
+
+		template <class T>
+		void record_layout(flat_layout *, T const&) {}
+
+		inline void record_layout(flat_layout * layout, Float const&) { ++layout->count; }
+
+		template <class... Ts, size_t... Indices>
+		void record_layout_Tupleimpl(flat_layout * layout, Tuple<Ts...> const& t, std::index_sequence<Indices...>)
+		{
+			(record_layout(layout, ks::get<Indices>(t)), ...);
+		}
+
+		template <class... Ts>
+		void record_layout(flat_layout * layout, Tuple<Ts...> const& t)
+		{
+			record_layout_Tupleimpl(layout, t, std::index_sequence_for<Ts...>{});
+		}
+
+		template <size_t Dim, class T>
+		void record_layout(flat_layout * layout, tensor<Dim, T> const& t)
+		{
+			record_size(layout, t.size());
+			auto data = t.data();
+			for (Integer i = 0, ne = t.num_elements(); i != ne; ++i)
+				record_layout(layout, data[i]);
+		}
+
+		template <class T>
+		flat_layout layout_of(T const& val)
+		{
+			flat_layout ret;
+			record_layout(&ret, val);
+			return ret;
+		}
+
+		// Write the Floats of val to *out, advancing *out
+		template <class T>
+		void flatten(Float **, T const&) {}
+
+		inline void flatten(Float ** out, Float const& val) { *(*out)++ = val; }
+
+		template <class... Ts, size_t... Indices>
+		void flatten_Tupleimpl(Float ** out, Tuple<Ts...> const& t, std::index_sequence<Indices...>)
+		{
+			(flatten(out, ks::get<Indices>(t)), ...);
+		}
+
+		template <class... Ts>
+		void flatten(Float ** out, Tuple<Ts...> const& t)
+		{
+			flatten_Tupleimpl(out, t, std::index_sequence_for<Ts...>{});
+		}
+
+		template <size_t Dim, class T>
+		void flatten(Float ** out, tensor<Dim, T> const& t)
+		{
+			auto data = t.data();
+			for (Integer i = 0, ne = t.num_elements(); i != ne; ++i)
+				flatten(out, data[i]);
+		}
+
+		// Rebuild a value from its sizes and Floats, advancing both
+		template <class T>
+		struct unflatten_t
+		{
+			static T go(allocator *, Integer const **, Float const **) { return T{}; }
+		};
+
+		template <>
+		struct unflatten_t<Float>
+		{
+			static Float go(allocator *, Integer const **, Float const ** in) { return *(*in)++; }
+		};
+
+		template <class... Ts>
+		struct unflatten_t<Tuple<Ts...>>
+		{
+			static Tuple<Ts...> go(allocator * alloc, Integer const ** sizes, Float const ** in)
+			{
+				// Braced initialization, so that the elements are read in order
+				return Tuple<Ts...>{ unflatten_t<Ts>::go(alloc, sizes, in)... };
+			}
+		};
+
+		template <size_t Dim, class T>
+		struct unflatten_t<tensor<Dim, T>>
+		{
+			template <size_t... Indices>
+			static typename tensor<Dim, T>::index_type read_size(Integer const ** sizes, std::index_sequence<Indices...>)
+			{
+				Integer const * s = *sizes;
+				*sizes += Dim;
+				if constexpr (Dim == 1)
+					return s[0];
+				else
+					return ks::make_Tuple(s[Indices]...);
+			}
+
+			static tensor<Dim, T> go(allocator * alloc, Integer const ** sizes, Float const ** in)
+			{
+				auto ret = tensor<Dim, T>::create(alloc, read_size(sizes, std::make_index_sequence<Dim>{}));
+				auto data = ret.data();
+				for (Integer i = 0, ne = ret.num_elements(); i != ne; ++i)
+					data[i] = unflatten_t<T>::go(alloc, sizes, in);
+				return ret;
+			}
+		};
+
+		template <class T>
+		T unflatten(allocator * alloc, flat_layout const& layout, Float const * in)
+		{
+			Integer const * sizes = layout.sizes.data();
+			return unflatten_t<T>::go(alloc, &sizes, &in);
+		}
+
+		template <class T>
+		Integer flat_count(T const& val) { return layout_of(val).count; }
+
+		// ---------------- Matrix entries ------------------
+
+		struct matrix_entries
+		{
+			std::vector<Integer> row;
+			std::vector<Integer> col;
+			std::vector<Float> val;
+
+			void add(Integer r, Integer c, Float v)
+			{
+				if (v == 0)
+					return;
+				row.push_back(r);
+				col.push_back(c);
+				val.push_back(v);
+			}
+		};
+
+		/* Add the entries of lm, whose argument has the shape of x, to *entries,
+		   offset by (r0, c0).  Returns the number of rows of lm.
+
+		   This is the fallback for maps with no structure to exploit: apply lm
+		   to each basis vector in turn, each giving one column. */
+		template <class L>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, L const& lm, typename L::From const& x, Integer r0, Integer c0)
+		{
+			typedef typename L::From From;
+			KS_MARK(alloc, mark);
+			flat_layout from = layout_of(x);
+			Integer rows = flat_count(typename L::To{ lm.Apply(alloc, x) });
+			KS_RESET(alloc, mark);
+			std::vector<Float> basis(from.count, Float(0));
+			std::vector<Float> column(rows);
+			for (Integer c = 0; c != from.count; ++c) {
+				basis[c] = 1;
+				Float * out = column.data();
+				flatten(&out, typename L::To{ lm.Apply(alloc, unflatten<From>(alloc, from, basis.data())) });
+				KS_ASSERT(out == column.data() + rows);
+				for (Integer r = 0; r != rows; ++r)
+					entries->add(r0 + r, c0 + c, column[r]);
+				basis[c] = 0;
+				KS_RESET(alloc, mark);
+			}
+			return rows;
+		}
+
+		template <class T>
+		Integer add_entries(allocator *, matrix_entries * entries, One<T> const&, T const& x, Integer r0, Integer c0)
+		{
+			Integer n = flat_count(x);
+			for (Integer i = 0; i != n; ++i)
+				entries->add(r0 + i, c0 + i, 1);
+			return n;
+		}
+
+		template <class From, class To>
+		Integer add_entries(allocator *, matrix_entries *, Zero<From, To> const&, From const&, Integer, Integer)
+		{
+			// As for Zero::Apply, the result has the shape of To{}
+			return flat_count(To{});
+		}
+
+		inline Integer add_entries(allocator *, matrix_entries * entries, Scale const& lm, Float const&, Integer r0, Integer c0)
+		{
+			entries->add(r0, c0, lm.val);
+			return 1;
+		}
+
+		template <class T>
+		Integer add_entries(allocator *, matrix_entries * entries, ScaleR<T> const& lm, Float const&, Integer r0, Integer c0)
+		{
+			std::vector<Float> column(flat_count(lm.val));
+			Float * out = column.data();
+			flatten(&out, lm.val);
+			for (Integer r = 0, rows = (Integer)column.size(); r != rows; ++r)
+				entries->add(r0 + r, c0, column[r]);
+			return (Integer)column.size();
+		}
+
+		template <class LM1, class LM2>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, Add<LM1, LM2> const& lm, typename LM1::From const& x, Integer r0, Integer c0)
+		{
+			// Follow the simplification of Add (see knossos-lm.h)
+			constexpr simplified how = add_simplification<LM1, LM2>();
+			if constexpr (how == simplified::first) {
+				return add_entries(alloc, entries, lm.lm1, x, r0, c0);
+			} else if constexpr (how == simplified::second) {
+				return add_entries(alloc, entries, lm.lm2, x, r0, c0);
+			} else if constexpr (how == simplified::scale) {
+				return add_entries(alloc, entries, lm.scale, x, r0, c0);
+			} else {
+				Integer rows1 = add_entries(alloc, entries, lm.lm1, x, r0, c0);
+				Integer rows2 = add_entries(alloc, entries, lm.lm2, x, r0, c0);
+				return std::max(rows1, rows2);
+			}
+		}
+
+		template <class... LMs, size_t... Indices>
+		Integer add_entries_HCat(allocator * alloc, matrix_entries * entries, HCat<LMs...> const& lm, typename HCat<LMs...>::From const& x, Integer r0, Integer c0, std::index_sequence<Indices...>)
+		{
+			Integer rows = 0;
+			Integer c = c0;
+			((rows = std::max(rows, add_entries(alloc, entries, ks::get<Indices>(lm.lms),
+					typename LMs::From{ ks::get<Indices>(x) }, r0, c)),
+			  c += flat_count(ks::get<Indices>(x))), ...);
+			return rows;
+		}
+
+		template <class... LMs>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, HCat<LMs...> const& lm, typename HCat<LMs...>::From const& x, Integer r0, Integer c0)
+		{
+			return add_entries_HCat(alloc, entries, lm, x, r0, c0, std::index_sequence_for<LMs...>{});
+		}
+
+		template <class... LMs, size_t... Indices>
+		Integer add_entries_VCat(allocator * alloc, matrix_entries * entries, VCat<LMs...> const& lm, typename VCat<LMs...>::From const& x, Integer r0, Integer c0, std::index_sequence<Indices...>)
+		{
+			Integer r = r0;
+			((r += add_entries(alloc, entries, ks::get<Indices>(lm.lms), x, r, c0)), ...);
+			return r - r0;
+		}
+
+		template <class... LMs>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, VCat<LMs...> const& lm, typename VCat<LMs...>::From const& x, Integer r0, Integer c0)
+		{
+			return add_entries_VCat(alloc, entries, lm, x, r0, c0, std::index_sequence_for<LMs...>{});
+		}
+
+		template <class Lbc, class Lab>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, Compose<Lbc, Lab> const& lm, typename Lab::From const& x, Integer r0, Integer c0)
+		{
+			// Follow the simplification of Compose (see knossos-lm.h)
+			constexpr simplified how = compose_simplification<Lbc, Lab>();
+			if constexpr (how == simplified::zero) {
+				return add_entries(alloc, entries, Zero<typename Lab::From, typename Lbc::To>{}, x, r0, c0);
+			} else if constexpr (how == simplified::first) {
+				return add_entries(alloc, entries, lm.bc, x, r0, c0);
+			} else if constexpr (how == simplified::second) {
+				return add_entries(alloc, entries, lm.ab, x, r0, c0);
+			} else if constexpr (how == simplified::scale) {
+				return add_entries(alloc, entries, lm.scale, x, r0, c0);
+			} else {
+				KS_MARK(alloc, mark);
+				auto y = lm.ab.Apply(alloc, x);
+
+				matrix_entries ab;
+				Integer brows = add_entries(alloc, &ab, lm.ab, x, 0, 0);
+				// The entries of ab, by row
+				std::vector<Integer> start(brows + 1, 0);
+				for (Integer r : ab.row)
+					++start[r + 1];
+				for (Integer r = 0; r != brows; ++r)
+					start[r + 1] += start[r];
+				std::vector<Integer> next(start.begin(), start.end() - 1);
+				std::vector<Integer> order(ab.row.size());
+				for (Integer e = 0, ne = (Integer)ab.row.size(); e != ne; ++e)
+					order[next[ab.row[e]]++] = e;
+
+				matrix_entries bc;
+				Integer rows = add_entries(alloc, &bc, lm.bc, typename Lbc::From{ y }, 0, 0);
+				KS_RESET(alloc, mark);
+
+				for (Integer e = 0, ne = (Integer)bc.row.size(); e != ne; ++e) {
+					Integer k = bc.col[e];
+					for (Integer p = start[k]; p != start[k + 1]; ++p)
+						entries->add(r0 + bc.row[e], c0 + ab.col[order[p]], bc.val[e] * ab.val[order[p]]);
+				}
+				return rows;
+			}
+		}
+
+		template <class Functor>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, Build<Functor> const& lm, typename Build<Functor>::From const& x, Integer r0, Integer c0)
+		{
+			Integer r = r0;
+			for (Integer i = 0; i != lm.n; ++i)
+				r += add_entries(alloc, entries, lm.f(i), x, r, c0);
+			return r - r0;
+		}
+
+		template <class Functor>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, BuildT<Functor> const& lm, typename BuildT<Functor>::From const& x, Integer r0, Integer c0)
+		{
+			KS_ASSERT(lm.n == x.size());
+			Integer rows = 0;
+			Integer c = c0;
+			for (Integer i = 0; i != lm.n; ++i) {
+				rows = std::max(rows, add_entries(alloc, entries, lm.f(i), x[i], r0, c));
+				c += flat_count(x[i]);
+			}
+			return rows;
+		}
+
+		template <class L1, class L2>
+		Integer add_entries(allocator * alloc, matrix_entries * entries, Variant<L1, L2> const& lm, typename L1::From const& x, Integer r0, Integer c0)
+		{
+			if (lm.v.index() == 0)
+				return add_entries(alloc, entries, std::get<0>(lm.v), x, r0, c0);
+			return add_entries(alloc, entries, std::get<1>(lm.v), x, r0, c0);
+		}
+
+		// ---------------- Materialized maps ------------------
+
+		struct matrix_shape
+		{
+			flat_layout from;
+			flat_layout to;
+
+			Integer rows() const { return to.count; }
+			Integer cols() const { return from.count; }
+		};
+
+		// Compressed sparse row storage, with the entries of each row in
+		// increasing order of column
+		struct csr_matrix
+		{
+			matrix_shape shape;
+			std::vector<Integer> row_start;
+			std::vector<Integer> col;
+			std::vector<Float> val;
+		};
+
+		// Row-major storage
+		struct dense_matrix
+		{
+			matrix_shape shape;
+			std::vector<Float> val;
+		};
+
+		template <class L>
+		matrix_shape shape_of(allocator * alloc, L const& lm, typename L::From const& x)
+		{
+			KS_MARK(alloc, mark);
+			matrix_shape ret{ layout_of(x), layout_of(typename L::To{ lm.Apply(alloc, x) }) };
+			KS_RESET(alloc, mark);
+			return ret;
+		}
+
+		template <class L>
+		matrix_entries entries_of(allocator * alloc, L const& lm, typename L::From const& x, matrix_shape const& shape)
+		{
+			matrix_entries ret;
+			Integer rows = add_entries(alloc, &ret, lm, x, 0, 0);
+			KS_ASSERT(rows == shape.rows());
+			return ret;
+		}
+
+		// Apply a materialized map with the given shape, where mul(x, y)
+		// sets y to the product of the matrix with x
+		template <class To, class From, class Mul>
+		To apply_matrix(allocator * alloc, matrix_shape const& shape, From const& f, Mul mul)
+		{
+			KS_MARK(alloc, mark);
+			Float * x = static_cast<Float*>(alloc->allocate(sizeof(Float) * shape.cols()));
+			Float * y = static_cast<Float*>(alloc->allocate(sizeof(Float) * shape.rows()));
+			Float * out = x;
+			flatten(&out, f);
+			KS_ASSERT(out == x + shape.cols());
+			mul(x, y);
+			To ret = unflatten<To>(alloc, shape.to, y);
+			return KS_COPYDOWN(alloc, mark, ret);
+		}
+
+		template <class From_t, class To_t>
+		struct CSR
+		{
+			typedef From_t From;
+			typedef To_t To;
+
+			std::shared_ptr<csr_matrix const> m;
+
+			Integer rows() const { return m->shape.rows(); }
+			Integer cols() const { return m->shape.cols(); }
+			Integer nnz() const { return (Integer)m->val.size(); }
+
+			To Apply(allocator * alloc, From const& f) const
+			{
+				csr_matrix const& a = *m;
+				return apply_matrix<To>(alloc, a.shape, f, [&a](Float const * x, Float * y) {
+					for (Integer r = 0, rows = a.shape.rows(); r != rows; ++r) {
+						Float tot = 0;
+						for (Integer p = a.row_start[r]; p != a.row_start[r + 1]; ++p)
+							tot += a.val[p] * x[a.col[p]];
+						y[r] = tot;
+					}
+				});
+			}
+		};
+
+		template <class From, class To>
+		std::ostream &operator<<(std::ostream &s, CSR<From, To> const &t)
+		{
+			return s << "CSR" <<
+				"(" << t.rows() << "x" << t.cols() << ", nnz=" << t.nnz() << ")";
+		}
+
+		template <class From_t, class To_t>
+		struct Dense
+		{
+			typedef From_t From;
+			typedef To_t To;
+
+			std::shared_ptr<dense_matrix const> m;
+
+			Integer rows() const { return m->shape.rows(); }
+			Integer cols() const { return m->shape.cols(); }
+
+			To Apply(allocator * alloc, From const& f) const
+			{
+				dense_matrix const& a = *m;
+				return apply_matrix<To>(alloc, a.shape, f, [&a](Float const * x, Float * y) {
+					Integer cols = a.shape.cols();
+					for (Integer r = 0, rows = a.shape.rows(); r != rows; ++r)
+						y[r] = simd::dot(a.val.data() + (size_t)r * cols, x, cols);
+				});
+			}
+		};
+
+		template <class From, class To>
+		std::ostream &operator<<(std::ostream &s, Dense<From, To> const &t)
+		{
+			return s << "Dense" <<
+				"(" << t.rows() << "x" << t.cols() << ")";
+		}
+
+		template <class L>
+		CSR<typename L::From, typename L::To> materialize_sparse(allocator * alloc, L const& lm, typename L::From const& x)
+		{
+			auto ret = std::make_shared<csr_matrix>();
+			ret->shape = shape_of(alloc, lm, x);
+			matrix_entries entries = entries_of(alloc, lm, x, ret->shape);
+
+			// Sort the entries by row, then by column, adding any duplicates
+			Integer rows = ret->shape.rows();
+			std::vector<Integer> order(entries.row.size());
+			for (Integer e = 0, ne = (Integer)order.size(); e != ne; ++e)
+				order[e] = e;
+			std::sort(order.begin(), order.end(), [&entries](Integer a, Integer b) {
+				return entries.row[a] != entries.row[b] ? entries.row[a] < entries.row[b] : entries.col[a] < entries.col[b];
+			});
+			ret->row_start.assign(rows + 1, 0);
+			Integer last = -1;
+			for (Integer e : order) {
+				Integer r = entries.row[e], c = entries.col[e];
+				KS_ASSERT(r < rows && c < ret->shape.cols());
+				if (!ret->col.empty() && last == r && ret->col.back() == c) {
+					ret->val.back() += entries.val[e];
+				} else {
+					ret->col.push_back(c);
+					ret->val.push_back(entries.val[e]);
+					++ret->row_start[r + 1];
+					last = r;
+				}
+			}
+			for (Integer r = 0; r != rows; ++r)
+				ret->row_start[r + 1] += ret->row_start[r];
+			return CSR<typename L::From, typename L::To>{ ret };
+		}
+
+		template <class L>
+		Dense<typename L::From, typename L::To> materialize_dense(allocator * alloc, L const& lm, typename L::From const& x)
+		{
+			auto ret = std::make_shared<dense_matrix>();
+			ret->shape = shape_of(alloc, lm, x);
+			matrix_entries entries = entries_of(alloc, lm, x, ret->shape);
+
+			Integer cols = ret->shape.cols();
+			ret->val.assign((size_t)ret->shape.rows() * cols, Float(0));
+			for (size_t e = 0; e != entries.row.size(); ++e) {
+				KS_ASSERT(entries.row[e] < ret->shape.rows() && entries.col[e] < cols);
+				ret->val[(size_t)entries.row[e] * cols + entries.col[e]] += entries.val[e];
+			}
+			return Dense<typename L::From, typename L::To>{ ret };
+		}
+
+	} // namespace LM
+
+	DECLARE_TYPE_TO_STRING2(LM::CSR, From, To);
+	DECLARE_TYPE_TO_STRING2(LM::Dense, From, To);
+} // namespace ks
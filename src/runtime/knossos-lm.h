@@ -86,12 +86,118 @@ namespace ks
 				"(" << t.val << ")";
 		}
 
+		// ---------------- Simplification ------------------
+
+		/*
+		Compose and Add of the structural maps are simplified by their
+		types, when the template is instantiated, rather than when the map
+		is applied:
+		  Compose<Zero, L>, Compose<L, Zero>  -- hold nothing, and give zero
+		  Compose<One, L>, Compose<L, One>    -- hold only L
+		  Compose<Scale, Scale>               -- holds the product of the scales
+		  Add<Zero, L>, Add<L, Zero>          -- hold only L
+		  Add<Scale, Scale>                   -- holds the sum of the scales
+		where a Compose or Add which simplifies to a Scale counts as one.
+		The names of the types are unchanged, so ksc need not know about
+		this, and mk still takes both operands.  So
+		for example the D$ of a chain of scalar functions is a single
+		multiply, however many Composes ksc generates for it.
+		*/
+		template <class L>
+		struct is_zero : std::false_type {};
+
+		template <class From, class To>
+		struct is_zero<Zero<From, To>> : std::true_type {};
+
+		template <class L>
+		struct is_one : std::false_type {};
+
+		template <class T>
+		struct is_one<One<T>> : std::true_type {};
+
+		// Scale, or a Compose or Add which simplifies to one
+		template <class L>
+		struct is_scale : std::is_same<L, Scale> {};
+
+		inline Float scale_value(Scale const& s) { return s.val; }
+
+		enum class simplified { none, zero, first, second, scale };
+
+		// What survives of Compose<Lbc, Lab>, in the order of the table above
+		template <class Lbc, class Lab>
+		constexpr simplified compose_simplification()
+		{
+			if (is_zero<Lbc>::value || is_zero<Lab>::value) return simplified::zero;
+			if (is_one<Lbc>::value) return simplified::second;
+			if (is_one<Lab>::value) return simplified::first;
+			if (is_scale<Lbc>::value && is_scale<Lab>::value) return simplified::scale;
+			return simplified::none;
+		}
+
+		template <class LM1, class LM2>
+		constexpr simplified add_simplification()
+		{
+			if (is_zero<LM1>::value) return simplified::second;
+			if (is_zero<LM2>::value) return simplified::first;
+			if (is_scale<LM1>::value && is_scale<LM2>::value) return simplified::scale;
+			return simplified::none;
+		}
+
 		// ---------------- Add ------------------
+		template <class LM1, class LM2, simplified = add_simplification<LM1, LM2>()>
+		struct Add_impl {
+			LM1 lm1;
+			LM2 lm2;
+
+			Add_impl() = default;
+			Add_impl(LM1 lm1, LM2 lm2) : lm1(lm1), lm2(lm2) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const { return ts_add(alloc, lm1.Apply(alloc, f), lm2.Apply(alloc, f)); }
+
+			std::ostream & print(std::ostream &s) const { return s << "Add(" << lm1 << "," << lm2 << ")"; }
+		};
+
 		template <class LM1, class LM2>
-		struct Add {
+		struct Add_impl<LM1, LM2, simplified::first> {
 			LM1 lm1;
+
+			Add_impl() = default;
+			Add_impl(LM1 lm1, LM2) : lm1(lm1) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const { return lm1.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << lm1; }
+		};
+
+		template <class LM1, class LM2>
+		struct Add_impl<LM1, LM2, simplified::second> {
 			LM2 lm2;
 
+			Add_impl() = default;
+			Add_impl(LM1, LM2 lm2) : lm2(lm2) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const { return lm2.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << lm2; }
+		};
+
+		template <class LM1, class LM2>
+		struct Add_impl<LM1, LM2, simplified::scale> {
+			Scale scale;
+
+			Add_impl() = default;
+			Add_impl(LM1 lm1, LM2 lm2) : scale{ scale_value(lm1) + scale_value(lm2) } {}
+
+			Float Apply(allocator * alloc, Float f) const { return scale.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << scale; }
+		};
+
+		template <class LM1, class LM2>
+		struct Add : Add_impl<LM1, LM2> {
 			typedef typename LM1::From From1;
 			typedef typename LM1::To To1;
 
@@ -104,17 +210,32 @@ namespace ks
 			typedef From1 From;
 			typedef To1 To;
 
-			static Add mk(LM1 lm1, LM2 lm2) { return Add{ lm1, lm2 }; }
+			using Add_impl<LM1, LM2>::Add_impl;
+			Add() = default;
 
-			To Apply(allocator * alloc, From f) const { return ts_add(alloc, lm1.Apply(alloc, f), lm2.Apply(alloc, f)); }
+			static Add mk(LM1 lm1, LM2 lm2) { return Add(lm1, lm2); }
+
+			To Apply(allocator * alloc, From f) const { return To{ Add_impl<LM1, LM2>::Apply(alloc, f) }; }
 		};
 
+		template <class LM1, class LM2>
+		struct is_scale<Add<LM1, LM2>> : std::bool_constant<
+			add_simplification<LM1, LM2>() == simplified::scale ||
+			(add_simplification<LM1, LM2>() == simplified::first && is_scale<LM1>::value) ||
+			(add_simplification<LM1, LM2>() == simplified::second && is_scale<LM2>::value)> {};
+
+		template <class LM1, class LM2, simplified how>
+		Float scale_value(Add_impl<LM1, LM2, how> const& a)
+		{
+			if constexpr (how == simplified::scale) return a.scale.val;
+			else if constexpr (how == simplified::first) return scale_value(a.lm1);
+			else return scale_value(a.lm2);
+		}
+
 		template <class T1, class T2>
 		std::ostream &operator<<(std::ostream &s, Add<T1, T2> const &t)
 		{
-			return s << "Add" <<
-				//"<" << type_to_string<T1>::name() << "," << type_to_string<T2>::name() << ">" <<
-				"(" << t.lm1 << "," << t.lm2 << ")";
+			return t.print(s);
 		}
 
 		// ---------------- HCat ------------------
@@ -170,11 +291,15 @@ namespace ks
 			template <size_t i>
 			To Apply_aux(allocator * alloc, To accum, From const& f) const {
 				typedef typename std::tuple_element<i, Tup>::type T0;
-				To ai = std::get<i>(lms).Apply(alloc, typename T0::From{ std::get<i>(f) });
+				// A Zero block adds nothing, so isn't applied
+				if constexpr (!is_zero<T0>::value) {
+					To ai = ks::get<i>(lms).Apply(alloc, typename T0::From{ ks::get<i>(f) });
+					accum = ts_add(alloc, accum, ai);
+				}
 				if constexpr (i + 1 < n)
-					return Apply_aux<i + 1>(alloc, ts_add(alloc, accum, ai), f);
+					return Apply_aux<i + 1>(alloc, accum, f);
 				else
-					return ts_add(alloc, accum, ai);
+					return accum;
 			}
 		};
 
@@ -242,8 +367,8 @@ namespace ks
 			{
 				typedef typename std::tuple_element<i, Tup>::type LM;
 				typedef typename LM::To type;
-				type ai = std::get<i>(lms).Apply(alloc, f);
-				std::get<i>(*ret) = type{ ai };
+				type ai = ks::get<i>(lms).Apply(alloc, f);
+				ks::get<i>(*ret) = type{ ai };
 				if constexpr (i + 1 < n) {
 					Apply_aux<i + 1>(alloc, f, ret);
 				}
@@ -273,12 +398,80 @@ namespace ks
 		}
 
 		// ---------------- Compose ------------------
+		template <class Lbc, class Lab, simplified = compose_simplification<Lbc, Lab>()>
+		struct Compose_impl
+		{
+			Lbc bc;
+			Lab ab;
+
+			Compose_impl() = default;
+			Compose_impl(Lbc bc, Lab ab) : bc(bc), ab(ab) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const {
+				auto g = ab.Apply(alloc, f);
+				return bc.Apply(alloc, g);
+			}
+
+			std::ostream & print(std::ostream &s) const { return s << "Compose(" << bc << "," << ab << ")"; }
+		};
+
 		template <class Lbc, class Lab>
-		struct Compose
+		struct Compose_impl<Lbc, Lab, simplified::zero>
+		{
+			Compose_impl() = default;
+			Compose_impl(Lbc, Lab) {}
+
+			template <class From>
+			typename Lbc::To Apply(allocator *, From) const { return typename Lbc::To{}; }  // As Zero::Apply
+
+			std::ostream & print(std::ostream &s) const { return s << "Zero"; }
+		};
+
+		template <class Lbc, class Lab>
+		struct Compose_impl<Lbc, Lab, simplified::first>
 		{
 			Lbc bc;
+
+			Compose_impl() = default;
+			Compose_impl(Lbc bc, Lab) : bc(bc) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const { return bc.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << bc; }
+		};
+
+		template <class Lbc, class Lab>
+		struct Compose_impl<Lbc, Lab, simplified::second>
+		{
 			Lab ab;
 
+			Compose_impl() = default;
+			Compose_impl(Lbc, Lab ab) : ab(ab) {}
+
+			template <class From>
+			auto Apply(allocator * alloc, From f) const { return ab.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << ab; }
+		};
+
+		template <class Lbc, class Lab>
+		struct Compose_impl<Lbc, Lab, simplified::scale>
+		{
+			Scale scale;
+
+			Compose_impl() = default;
+			Compose_impl(Lbc bc, Lab ab) : scale{ scale_value(bc) * scale_value(ab) } {}
+
+			Float Apply(allocator * alloc, Float f) const { return scale.Apply(alloc, f); }
+
+			std::ostream & print(std::ostream &s) const { return s << scale; }
+		};
+
+		template <class Lbc, class Lab>
+		struct Compose : Compose_impl<Lbc, Lab>
+		{
 			typedef typename Lbc::From B1;
 			typedef typename Lbc::To C;
 
@@ -290,20 +483,32 @@ namespace ks
 			typedef A From;
 			typedef C To;
 
-			static Compose mk(Lbc bc, Lab ab) { return Compose{ bc, ab }; }
+			using Compose_impl<Lbc, Lab>::Compose_impl;
+			Compose() = default;
 
-			To Apply(allocator * alloc, From f) const {
-				auto g = ab.Apply(alloc, f);
-				return bc.Apply(alloc, g);
-			}
+			static Compose mk(Lbc bc, Lab ab) { return Compose(bc, ab); }
+
+			To Apply(allocator * alloc, From f) const { return To{ Compose_impl<Lbc, Lab>::Apply(alloc, f) }; }
 		};
 
+		template <class Lbc, class Lab>
+		struct is_scale<Compose<Lbc, Lab>> : std::bool_constant<
+			compose_simplification<Lbc, Lab>() == simplified::scale ||
+			(compose_simplification<Lbc, Lab>() == simplified::first && is_scale<Lbc>::value) ||
+			(compose_simplification<Lbc, Lab>() == simplified::second && is_scale<Lab>::value)> {};
+
+		template <class Lbc, class Lab, simplified how>
+		Float scale_value(Compose_impl<Lbc, Lab, how> const& c)
+		{
+			if constexpr (how == simplified::scale) return c.scale.val;
+			else if constexpr (how == simplified::first) return scale_value(c.bc);
+			else return scale_value(c.ab);
+		}
+
 		template <class T1, class T2>
 		std::ostream &operator<<(std::ostream &s, Compose<T1, T2> const &t)
 		{
-			return s << "Compose" <<
-				//"<" << type_to_string<T1>::name() << "," << type_to_string<T2>::name() << ">" <<
-				"(" << t.bc << "," << t.ab << ")";
+			return t.print(s);
 		}
 
 		// ---------------- SelFun ------------------
@@ -313,9 +518,9 @@ namespace ks
 			typedef Tuple From;
 			typedef Ti To;
 
-			int index;
+			Integer index;
 
-			static SelFun mk(int index, int n) { return SelFun{ index }; }
+			static SelFun mk(Integer index, Integer n) { return SelFun{ index }; }
 
 			To Apply(allocator *, From f) const { return std::get(f, index); }
 		};
@@ -333,26 +538,26 @@ namespace ks
 		template <typename Functor>
 		struct Build
 		{
-			typedef typename std::invoke_result<Functor, int>::type L;
+			typedef typename std::invoke_result<Functor, Integer>::type L;
 
 			typedef typename L::To LTo;
 
 			typedef typename L::From From;
 			typedef vec<LTo> To;
 
-			int n;
-			Functor/*std::function<L(int)>*/ f;
+			Integer n;
+			Functor/*std::function<L(Integer)>*/ f;
 
 			template <class Functor2>
-			static Build mk(int n, Functor2 f) {
+			static Build mk(Integer n, Functor2 f) {
 				KS_ASSERT(n != 0);
 				return Build{ n, f };
 			}
 
 			To Apply(allocator * alloc, From x) const
 			{
-				Functor/*std::function<L(int)>*/ f1 = f;
-				return build<LTo>(alloc, n, [x, f1](allocator * alloc, int i) {
+				Functor/*std::function<L(Integer)>*/ f1 = f;
+				return build<LTo>(alloc, n, [x, f1](allocator * alloc, Integer i) {
 					auto lm = f1(i);
 					return lmApply(alloc, lm, x);
 				});
@@ -371,17 +576,18 @@ namespace ks
 		template <typename Functor>
 		struct BuildT
 		{
-			typedef typename std::invoke_result<Functor, int>::type L;
+			typedef typename std::invoke_result<Functor, Integer>::type L;
 
 			typedef typename L::From LFrom;
 
 			typedef vec<typename L::From> From;
 			typedef typename L::To To;
 
-			int n;
-			Functor /*std::function<L(int)>*/ f;
+			Integer n = 0;
+			Functor /*std::function<L(Integer)>*/ f;
 
-			BuildT() : n{ 0 }
+#ifdef KS_TRACK_OBJECTS
+			BuildT()
 			{
 				KS_ENTER; //  std::cerr << std::string(3 + indent++, '.') << "[build() " << this << "]\n";
 			}
@@ -400,8 +606,18 @@ namespace ks
 				return *this;
 			}
 
+			~BuildT()
+			{
+				KS_LEAVE;
+				//std::cerr << std::string(3+ --indent, '.') << "[~build " << this << "]\n";
+			}
+#else
+			// Trivially copyable, if the functor is
+			BuildT() = default;
+#endif
+
 			template <class Functor2>
-			BuildT(int n, Functor2 f) :
+			BuildT(Integer n, Functor2 f) :
 				n(n),
 				f(f)
 			{
@@ -409,22 +625,16 @@ namespace ks
 				//std::cerr << std::string(3+indent++, '.') << "[build " << this << "]\n";
 			}
 
-			~BuildT()
-			{
-				KS_LEAVE;
-				//std::cerr << std::string(3+ --indent, '.') << "[~build " << this << "]\n";
-			}
-
 			template <class Functor2>
-			static BuildT mk(int n, Functor2 f) { return BuildT{ n, f }; }
+			static BuildT mk(Integer n, Functor2 f) { return BuildT{ n, f }; }
 
 			To Apply(allocator * alloc, From x) const
 			{
 				if (n != x.size())
 					std::cerr << "BuildT:" << n << " != " << x.size() << std::endl;
-				ASSERT(n == x.size());        // TODO: copying arrays here -- should not need to..
-				std::function<L(int)> f_local = f;  // TODO: use sumbuild
-				return sumbuild<LFrom>(alloc, n, [f_local,x](allocator * alloc, int i) { return lmApply(alloc, f_local(i), x[i]); });
+				KS_ASSERT(n == x.size());        // TODO: copying arrays here -- should not need to..
+				std::function<L(Integer)> f_local = f;  // TODO: use sumbuild
+				return sumbuild<LFrom>(alloc, n, [f_local,x](allocator * alloc, Integer i) { return lmApply(alloc, f_local(i), x[i]); });
 			}
 		};
 
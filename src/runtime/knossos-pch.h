@@ -0,0 +1,10 @@
+// The headers which every module built by ksc.compile.build_py_module_from_cpp
+// includes, which it precompiles once for each toolchain and set of flags.
+// This is passed to the compiler with -include, so needs no include guard.
+
+#include "knossos.h"
+#include "prelude.h"
+#include "knossos-entry-points.h"
+
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
@@ -0,0 +1,37 @@
+// Instantiations of the runtime which are compiled once, into the prebuilt runtime object
+#pragma once
+
+/*
+With KS_PREBUILT_RUNTIME, a generated module does not compile the
+runtime's non-template definitions (knossos.cpp and
+knossos-entry-points.cpp, which it includes at its end), nor the
+instantiations listed here, which are declared extern.  Instead they
+come from knossos-runtime.cpp, which ksc.compile builds once for each
+toolchain and set of flags and links into every module, alongside a
+precompiled knossos-pch.h.
+
+The list is the tensor<1..3, Float> operations that nearly every
+module uses.  A module which uses an operation not listed here
+instantiates it as usual.
+*/
+
+#include "knossos.h"
+
+#define KS_PREBUILT_INSTANTIATIONS_OF_DIM(X, Dim) \
+	X(tensor<Dim, Float> ts_add(allocator *, tensor<Dim, Float> const&, tensor<Dim, Float> const&)) \
+	X(tensor<Dim, Float> ts_scale(allocator *, Float, tensor<Dim, Float> const&)) \
+	X(tensor<Dim, Float> ts_neg(allocator *, tensor<Dim, Float>)) \
+	X(Float sum(allocator *, tensor<Dim, Float> const&))
+
+#define KS_PREBUILT_INSTANTIATIONS(X) \
+	KS_PREBUILT_INSTANTIATIONS_OF_DIM(X, 1) \
+	KS_PREBUILT_INSTANTIATIONS_OF_DIM(X, 2) \
+	KS_PREBUILT_INSTANTIATIONS_OF_DIM(X, 3)
+
+#if !defined(KS_CUDA)
+namespace ks {
+#define KS_EXTERN_TEMPLATE(...) extern template __VA_ARGS__;
+	KS_PREBUILT_INSTANTIATIONS(KS_EXTERN_TEMPLATE)
+#undef KS_EXTERN_TEMPLATE
+} // namespace ks
+#endif
@@ -0,0 +1,209 @@
+// Scoped profiling of generated functions
+#pragma once
+
+/*
+When compiled with KS_PROFILE, every KS_DEF function generated by ksc
+opens a KS_PROFILE_SCOPE, which records
+  - its start time and duration, in nanoseconds (steady_clock);
+  - its exclusive ("self") time, i.e. excluding nested scopes;
+  - the number of bytes allocated, by this or nested scopes, through
+    allocator_base::allocate.
+
+Each thread appends to its own event log, which is lock-free: the log is
+a fixed table of blocks which never move, and the number of events is
+published with a release store, so that the log can be read (by
+write_chrome_trace or write_flat_profile) while other threads are still
+recording.  A thread stops recording, counting the events it drops, once
+its log holds max_events (KS_PROFILE_MAX_BLOCKS blocks of block_events).
+
+reset() hides each log's events at once, and asks its thread to start
+again from the beginning of the log; the thread does so at its next
+event, under the log's mutex, which readers also hold, so no event is
+overwritten while it is being read.  So max_events limits the events
+between resets, rather than over the life of the thread.
+
+Without KS_PROFILE (or under KS_CUDA), KS_PROFILE_SCOPE expands to nothing.
+*/
+
+#if defined(KS_PROFILE) && !defined(KS_CUDA)
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+#ifndef KS_PROFILE_MAX_BLOCKS
+#define KS_PROFILE_MAX_BLOCKS 4096
+#endif
+
+namespace ks {
+namespace profile {
+
+	struct event_t {
+		char const* name;
+		uint64_t start_ns;
+		uint64_t duration_ns;
+		uint64_t self_ns;
+		uint64_t bytes;
+		uint32_t depth;
+	};
+
+	class scope_t;
+
+	class thread_log_t
+	{
+	public:
+		static constexpr size_t block_events = 4096;
+		static constexpr size_t max_blocks = KS_PROFILE_MAX_BLOCKS;
+		static constexpr size_t max_events = block_events * max_blocks;
+
+		explicit thread_log_t(uint32_t thread_id) : thread_id_(thread_id) { }
+		~thread_log_t()
+		{
+			for (auto& b : blocks_)
+				delete[] b.load(std::memory_order_relaxed);
+		}
+
+		// Only to be called by the owning thread
+		void append(event_t const& e)
+		{
+			if (restart_.load(std::memory_order_acquire))
+				restart();
+			size_t n = count_.load(std::memory_order_relaxed);
+			if (n == max_events) {
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			std::atomic<event_t*>& block = blocks_[n / block_events];
+			event_t* data = block.load(std::memory_order_relaxed);
+			if (!data) {
+				data = new event_t[block_events];
+				block.store(data, std::memory_order_release);
+			}
+			data[n % block_events] = e;
+			count_.store(n + 1, std::memory_order_release);
+		}
+
+		// May be called from any thread
+		template<class F>
+		void for_each_event(F f) const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			size_t n = count_.load(std::memory_order_acquire);
+			for (size_t i = first_.load(std::memory_order_relaxed); i < n; ++i)
+				f(blocks_[i / block_events].load(std::memory_order_acquire)[i % block_events]);
+		}
+
+		// Forget the events recorded so far.  May be called from any
+		// thread: the owning thread reuses the log from its next event.
+		void clear()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			first_.store(count_.load(std::memory_order_acquire), std::memory_order_relaxed);
+			dropped_.store(0, std::memory_order_relaxed);
+			restart_.store(true, std::memory_order_release);
+		}
+
+		uint32_t thread_id() const { return thread_id_; }
+		size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+		uint64_t bytes_allocated = 0;   // Running total, for the owning thread
+		scope_t* current = nullptr;     // Innermost open scope
+		uint32_t depth = 0;
+
+	private:
+		// Called by the owning thread, so no event is being appended
+		void restart()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			restart_.store(false, std::memory_order_relaxed);
+			first_.store(0, std::memory_order_relaxed);
+			count_.store(0, std::memory_order_release);
+		}
+
+		uint32_t thread_id_;
+		std::atomic<event_t*> blocks_[max_blocks] = {};
+		std::atomic<size_t> count_{ 0 };
+		std::atomic<size_t> first_{ 0 };
+		std::atomic<size_t> dropped_{ 0 };
+		std::atomic<bool> restart_{ false };
+		mutable std::mutex mutex_;
+	};
+
+	// The calling thread's log, created and registered on first use
+	thread_log_t& this_thread_log();
+
+	inline uint64_t now_ns()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	inline void note_allocation(size_t bytes)
+	{
+		this_thread_log().bytes_allocated += bytes;
+	}
+
+	class scope_t
+	{
+	public:
+		explicit scope_t(char const* name) :
+			log_(this_thread_log()),
+			name_(name),
+			parent_(log_.current),
+			bytes0_(log_.bytes_allocated)
+		{
+			log_.current = this;
+			++log_.depth;
+			start_ns_ = now_ns();
+		}
+
+		~scope_t()
+		{
+			uint64_t duration = now_ns() - start_ns_;
+			if (parent_)
+				parent_->child_ns_ += duration;
+			log_.current = parent_;
+			--log_.depth;
+			log_.append(event_t{ name_, start_ns_, duration, duration - child_ns_,
+				log_.bytes_allocated - bytes0_, log_.depth });
+		}
+
+		scope_t(scope_t const&) = delete;
+		scope_t& operator=(scope_t const&) = delete;
+
+	private:
+		thread_log_t& log_;
+		char const* name_;
+		scope_t* parent_;
+		uint64_t bytes0_;
+		uint64_t start_ns_ = 0;
+		uint64_t child_ns_ = 0;
+	};
+
+	// Events from all threads, in the Chrome trace event format
+	// (load into chrome://tracing or https://ui.perfetto.dev)
+	void write_chrome_trace(std::ostream& os);
+
+	// Per-function totals over all threads, sorted by exclusive time
+	void write_flat_profile(std::ostream& os);
+
+	// Forget all events recorded so far
+	void reset();
+
+}
+}
+
+#define KS_PROFILE_CONCAT_(a, b) a##b
+#define KS_PROFILE_CONCAT(a, b) KS_PROFILE_CONCAT_(a, b)
+#define KS_PROFILE_SCOPE(name) ks::profile::scope_t KS_PROFILE_CONCAT(ks_profile_scope_, __LINE__)(name);
+#define KS_PROFILE_ALLOCATION(bytes) ks::profile::note_allocation(bytes);
+
+#else
+
+#define KS_PROFILE_SCOPE(name)
+#define KS_PROFILE_ALLOCATION(bytes)
+
+#endif
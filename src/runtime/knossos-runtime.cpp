@@ -0,0 +1,14 @@
+// The prebuilt runtime: see knossos-prebuilt.h
+#define KS_RUNTIME_IMPL
+
+#include "knossos-prebuilt.h"
+#include "knossos-entry-points.h"
+
+#include "knossos.cpp"
+#include "knossos-entry-points.cpp"
+
+namespace ks {
+#define KS_INSTANTIATE(...) template __VA_ARGS__;
+	KS_PREBUILT_INSTANTIATIONS(KS_INSTANTIATE)
+#undef KS_INSTANTIATE
+} // namespace ks
@@ -0,0 +1,507 @@
+// Vectorized kernels for arithmetic on contiguous arrays of Float
+#pragma once
+
+/*
+The tangent-space operations in knossos.h (ts_add, ts_scale, ts_neg,
+ts_dot, inplace_add and inplace_add_scaled) call these kernels for
+tensor<Dim, Float>.  The matrix products in knossos-gemm.h are built on
+gemm_micro.
+
+The instruction set is chosen at run time, the first time a kernel is
+called:
+- x86 (GCC or Clang): AVX-512F if present, otherwise AVX2+FMA, otherwise
+  a scalar loop;
+- AArch64: NEON, which is always present.
+Define KS_NO_SIMD to use the scalar loops everywhere.
+
+Tensors are only 16-byte aligned by the allocator, so the x86 kernels use
+unaligned loads and stores; these are no slower than aligned ones when
+the data does happen to be aligned.
+
+Note that ts_dot accumulates in several lanes, so its rounding differs
+from a left-to-right sum, and may differ between instruction sets.
+*/
+
+#include "knossos-types.h"
+
+#if !defined(KS_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define KS_SIMD_X86
+#include <immintrin.h>
+#elif !defined(KS_NO_SIMD) && defined(__aarch64__)
+#define KS_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+namespace ks {
+namespace simd {
+
+	// Below this many elements, the kernels are not worth an indirect call
+	constexpr int min_elements = 16;
+
+	// Size of the tile of C computed by gemm_micro
+	constexpr int gemm_mr = 6;
+	constexpr int gemm_nr = 16;
+
+	struct kernels_t {
+		char const* name;
+		void (*add)(Float* out, Float const* a, Float const* b, Integer n);           // out = a + b
+		void (*scale)(Float* out, Float s, Float const* a, Integer n);               // out = s * a
+		void (*neg)(Float* out, Float const* a, Integer n);                          // out = -a
+		Float (*dot)(Float const* a, Float const* b, Integer n);                     // sum(a * b)
+		void (*inplace_add)(Float* acc, Float const* a, Integer n);                  // acc += a
+		void (*axpy)(Float* acc, Float s, Float const* a, Integer n);                // acc += s * a
+		// c[0..mr, 0..nr) (+)= a * b, where a is a packed gemm_mr x kc panel
+		// (column by column) and b a packed kc x gemm_nr panel (row by row)
+		void (*gemm_micro)(int kc, Float const* a, Float const* b, Float* c, int ldc, int mr, int nr, bool accumulate);
+	};
+
+	// The kernels for the CPU we are running on
+	kernels_t const& get_kernels();
+
+	// ---------------- Scalar ------------------
+
+	inline void add_scalar(Float* out, Float const* a, Float const* b, Integer n)
+	{
+		for (Integer i = 0; i != n; ++i)
+			out[i] = a[i] + b[i];
+	}
+
+	inline void scale_scalar(Float* out, Float s, Float const* a, Integer n)
+	{
+		for (Integer i = 0; i != n; ++i)
+			out[i] = s * a[i];
+	}
+
+	inline void neg_scalar(Float* out, Float const* a, Integer n)
+	{
+		for (Integer i = 0; i != n; ++i)
+			out[i] = -a[i];
+	}
+
+	inline Float dot_scalar(Float const* a, Float const* b, Integer n)
+	{
+		Float ret = 0;
+		for (Integer i = 0; i != n; ++i)
+			ret += a[i] * b[i];
+		return ret;
+	}
+
+	inline void inplace_add_scalar(Float* acc, Float const* a, Integer n)
+	{
+		for (Integer i = 0; i != n; ++i)
+			acc[i] += a[i];
+	}
+
+	inline void axpy_scalar(Float* acc, Float s, Float const* a, Integer n)
+	{
+		for (Integer i = 0; i != n; ++i)
+			acc[i] += s * a[i];
+	}
+
+	/* Written so that the compiler keeps the accumulators in registers and
+	   vectorizes along a row; the instruction set is whatever the caller was
+	   compiled for, so it is instantiated once per target below. */
+#if defined(__GNUC__) || defined(__clang__)
+	__attribute__((always_inline))
+#endif
+	inline void gemm_micro_generic(int kc, Float const* a, Float const* b, Float* c, int ldc, int mr, int nr, bool accumulate)
+	{
+		Float acc[gemm_mr][gemm_nr] = {};
+		for (int p = 0; p != kc; ++p) {
+			Float const* ap = a + p * gemm_mr;
+			Float const* bp = b + p * gemm_nr;
+			for (int i = 0; i != gemm_mr; ++i)
+				for (int j = 0; j != gemm_nr; ++j)
+					acc[i][j] += ap[i] * bp[j];
+		}
+		for (int i = 0; i != mr; ++i) {
+			Float* crow = c + i * ldc;
+			if (accumulate)
+				for (int j = 0; j != nr; ++j)
+					crow[j] += acc[i][j];
+			else
+				for (int j = 0; j != nr; ++j)
+					crow[j] = acc[i][j];
+		}
+	}
+
+	inline void gemm_micro_scalar(int kc, Float const* a, Float const* b, Float* c, int ldc, int mr, int nr, bool accumulate)
+	{
+		gemm_micro_generic(kc, a, b, c, ldc, mr, nr, accumulate);
+	}
+
+	inline kernels_t const& scalar_kernels()
+	{
+		static const kernels_t k{ "scalar", add_scalar, scale_scalar, neg_scalar, dot_scalar, inplace_add_scalar, axpy_scalar, gemm_micro_scalar };
+		return k;
+	}
+
+#ifdef KS_SIMD_X86
+	// ---------------- AVX2 ------------------
+#define KS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+
+	KS_TARGET_AVX2 inline void add_avx2(Float* out, Float const* a, Float const* b, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8)
+			_mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+		for (; i != n; ++i)
+			out[i] = a[i] + b[i];
+	}
+
+	KS_TARGET_AVX2 inline void scale_avx2(Float* out, Float s, Float const* a, Integer n)
+	{
+		__m256 vs = _mm256_set1_ps(s);
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8)
+			_mm256_storeu_ps(out + i, _mm256_mul_ps(vs, _mm256_loadu_ps(a + i)));
+		for (; i != n; ++i)
+			out[i] = s * a[i];
+	}
+
+	KS_TARGET_AVX2 inline void neg_avx2(Float* out, Float const* a, Integer n)
+	{
+		__m256 sign = _mm256_set1_ps(-0.0f);
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8)
+			_mm256_storeu_ps(out + i, _mm256_xor_ps(sign, _mm256_loadu_ps(a + i)));
+		for (; i != n; ++i)
+			out[i] = -a[i];
+	}
+
+	KS_TARGET_AVX2 inline Float dot_avx2(Float const* a, Float const* b, Integer n)
+	{
+		// Two accumulators, to hide the latency of the FMA
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16) {
+			acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+			acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+		}
+		for (; i + 8 <= n; i += 8)
+			acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+		__m256 acc = _mm256_add_ps(acc0, acc1);
+		__m128 sum4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+		__m128 sum2 = _mm_add_ps(sum4, _mm_movehl_ps(sum4, sum4));
+		__m128 sum1 = _mm_add_ss(sum2, _mm_shuffle_ps(sum2, sum2, 1));
+		Float ret = _mm_cvtss_f32(sum1);
+		for (; i != n; ++i)
+			ret += a[i] * b[i];
+		return ret;
+	}
+
+	KS_TARGET_AVX2 inline void inplace_add_avx2(Float* acc, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8)
+			_mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_loadu_ps(a + i)));
+		for (; i != n; ++i)
+			acc[i] += a[i];
+	}
+
+	KS_TARGET_AVX2 inline void axpy_avx2(Float* acc, Float s, Float const* a, Integer n)
+	{
+		__m256 vs = _mm256_set1_ps(s);
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8)
+			_mm256_storeu_ps(acc + i, _mm256_fmadd_ps(vs, _mm256_loadu_ps(a + i), _mm256_loadu_ps(acc + i)));
+		for (; i != n; ++i)
+			acc[i] += s * a[i];
+	}
+
+	KS_TARGET_AVX2 inline void gemm_micro_avx2(int kc, Float const* a, Float const* b, Float* c, int ldc, int mr, int nr, bool accumulate)
+	{
+		static_assert(gemm_mr == 6 && gemm_nr == 16);
+		// 12 accumulators, leaving 4 registers for the operands
+		__m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+		__m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+		__m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+		__m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+		__m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+		__m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+		for (int p = 0; p != kc; ++p, a += gemm_mr, b += gemm_nr) {
+			__m256 b0 = _mm256_loadu_ps(b);
+			__m256 b1 = _mm256_loadu_ps(b + 8);
+			__m256 ai;
+			ai = _mm256_broadcast_ss(a + 0); c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+			ai = _mm256_broadcast_ss(a + 1); c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+			ai = _mm256_broadcast_ss(a + 2); c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+			ai = _mm256_broadcast_ss(a + 3); c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+			ai = _mm256_broadcast_ss(a + 4); c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+			ai = _mm256_broadcast_ss(a + 5); c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+		}
+		__m256 acc[gemm_mr][2] = { { c00, c01 }, { c10, c11 }, { c20, c21 }, { c30, c31 }, { c40, c41 }, { c50, c51 } };
+		if (mr == gemm_mr && nr == gemm_nr) {
+			for (int i = 0; i != gemm_mr; ++i, c += ldc) {
+				if (accumulate) {
+					acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(c));
+					acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(c + 8));
+				}
+				_mm256_storeu_ps(c, acc[i][0]);
+				_mm256_storeu_ps(c + 8, acc[i][1]);
+			}
+		} else {
+			// Edge tile
+			alignas(32) Float tile[gemm_mr][gemm_nr];
+			for (int i = 0; i != gemm_mr; ++i) {
+				_mm256_store_ps(tile[i], acc[i][0]);
+				_mm256_store_ps(tile[i] + 8, acc[i][1]);
+			}
+			for (int i = 0; i != mr; ++i, c += ldc)
+				for (int j = 0; j != nr; ++j)
+					c[j] = accumulate ? c[j] + tile[i][j] : tile[i][j];
+		}
+	}
+
+#undef KS_TARGET_AVX2
+
+	// ---------------- AVX-512 ------------------
+#define KS_TARGET_AVX512 __attribute__((target("avx512f")))
+
+	KS_TARGET_AVX512 inline void add_avx512(Float* out, Float const* a, Float const* b, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16)
+			_mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+		if (i != n) {
+			__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+			_mm512_mask_storeu_ps(out + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)));
+		}
+	}
+
+	KS_TARGET_AVX512 inline void scale_avx512(Float* out, Float s, Float const* a, Integer n)
+	{
+		__m512 vs = _mm512_set1_ps(s);
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16)
+			_mm512_storeu_ps(out + i, _mm512_mul_ps(vs, _mm512_loadu_ps(a + i)));
+		if (i != n) {
+			__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+			_mm512_mask_storeu_ps(out + i, m, _mm512_mul_ps(vs, _mm512_maskz_loadu_ps(m, a + i)));
+		}
+	}
+
+	KS_TARGET_AVX512 inline void neg_avx512(Float* out, Float const* a, Integer n)
+	{
+		__m512i sign = _mm512_set1_epi32(int(0x80000000u));
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16)
+			_mm512_storeu_ps(out + i, _mm512_castsi512_ps(_mm512_xor_si512(sign, _mm512_castps_si512(_mm512_loadu_ps(a + i)))));
+		for (; i != n; ++i)
+			out[i] = -a[i];
+	}
+
+	KS_TARGET_AVX512 inline Float dot_avx512(Float const* a, Float const* b, Integer n)
+	{
+		__m512 acc0 = _mm512_setzero_ps();
+		__m512 acc1 = _mm512_setzero_ps();
+		Integer i = 0;
+		for (; i + 32 <= n; i += 32) {
+			acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+			acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+		}
+		for (; i + 16 <= n; i += 16)
+			acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+		if (i != n) {
+			__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+			acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+		}
+		alignas(64) Float lanes[16];
+		_mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+		Float ret = 0;
+		for (Float lane : lanes)
+			ret += lane;
+		return ret;
+	}
+
+	KS_TARGET_AVX512 inline void inplace_add_avx512(Float* acc, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16)
+			_mm512_storeu_ps(acc + i, _mm512_add_ps(_mm512_loadu_ps(acc + i), _mm512_loadu_ps(a + i)));
+		if (i != n) {
+			__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+			_mm512_mask_storeu_ps(acc + i, m, _mm512_add_ps(_mm512_maskz_loadu_ps(m, acc + i), _mm512_maskz_loadu_ps(m, a + i)));
+		}
+	}
+
+	KS_TARGET_AVX512 inline void axpy_avx512(Float* acc, Float s, Float const* a, Integer n)
+	{
+		__m512 vs = _mm512_set1_ps(s);
+		Integer i = 0;
+		for (; i + 16 <= n; i += 16)
+			_mm512_storeu_ps(acc + i, _mm512_fmadd_ps(vs, _mm512_loadu_ps(a + i), _mm512_loadu_ps(acc + i)));
+		if (i != n) {
+			__mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+			_mm512_mask_storeu_ps(acc + i, m, _mm512_fmadd_ps(vs, _mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, acc + i)));
+		}
+	}
+
+	KS_TARGET_AVX512 inline void gemm_micro_avx512(int kc, Float const* a, Float const* b, Float* c, int ldc, int mr, int nr, bool accumulate)
+	{
+		static_assert(gemm_mr == 6 && gemm_nr == 16);
+		__m512 c0 = _mm512_setzero_ps(), c1 = _mm512_setzero_ps(), c2 = _mm512_setzero_ps();
+		__m512 c3 = _mm512_setzero_ps(), c4 = _mm512_setzero_ps(), c5 = _mm512_setzero_ps();
+		for (int p = 0; p != kc; ++p, a += gemm_mr, b += gemm_nr) {
+			__m512 b0 = _mm512_loadu_ps(b);
+			c0 = _mm512_fmadd_ps(_mm512_set1_ps(a[0]), b0, c0);
+			c1 = _mm512_fmadd_ps(_mm512_set1_ps(a[1]), b0, c1);
+			c2 = _mm512_fmadd_ps(_mm512_set1_ps(a[2]), b0, c2);
+			c3 = _mm512_fmadd_ps(_mm512_set1_ps(a[3]), b0, c3);
+			c4 = _mm512_fmadd_ps(_mm512_set1_ps(a[4]), b0, c4);
+			c5 = _mm512_fmadd_ps(_mm512_set1_ps(a[5]), b0, c5);
+		}
+		__m512 acc[gemm_mr] = { c0, c1, c2, c3, c4, c5 };
+		__mmask16 m = (__mmask16)((1u << nr) - 1);
+		for (int i = 0; i != mr; ++i, c += ldc) {
+			if (accumulate)
+				acc[i] = _mm512_add_ps(acc[i], _mm512_maskz_loadu_ps(m, c));
+			_mm512_mask_storeu_ps(c, m, acc[i]);
+		}
+	}
+
+#undef KS_TARGET_AVX512
+
+	inline kernels_t const& select_kernels()
+	{
+		static const kernels_t avx512{ "avx512", add_avx512, scale_avx512, neg_avx512, dot_avx512, inplace_add_avx512, axpy_avx512, gemm_micro_avx512 };
+		static const kernels_t avx2{ "avx2", add_avx2, scale_avx2, neg_avx2, dot_avx2, inplace_add_avx2, axpy_avx2, gemm_micro_avx2 };
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return avx512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+			return avx2;
+		return scalar_kernels();
+	}
+
+#elif defined(KS_SIMD_NEON)
+	// ---------------- NEON ------------------
+
+	inline void add_neon(Float* out, Float const* a, Float const* b, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 4 <= n; i += 4)
+			vst1q_f32(out + i, vaddq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+		for (; i != n; ++i)
+			out[i] = a[i] + b[i];
+	}
+
+	inline void scale_neon(Float* out, Float s, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 4 <= n; i += 4)
+			vst1q_f32(out + i, vmulq_n_f32(vld1q_f32(a + i), s));
+		for (; i != n; ++i)
+			out[i] = s * a[i];
+	}
+
+	inline void neg_neon(Float* out, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 4 <= n; i += 4)
+			vst1q_f32(out + i, vnegq_f32(vld1q_f32(a + i)));
+		for (; i != n; ++i)
+			out[i] = -a[i];
+	}
+
+	inline Float dot_neon(Float const* a, Float const* b, Integer n)
+	{
+		float32x4_t acc0 = vdupq_n_f32(0);
+		float32x4_t acc1 = vdupq_n_f32(0);
+		Integer i = 0;
+		for (; i + 8 <= n; i += 8) {
+			acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+			acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+		}
+		for (; i + 4 <= n; i += 4)
+			acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+		Float ret = vaddvq_f32(vaddq_f32(acc0, acc1));
+		for (; i != n; ++i)
+			ret += a[i] * b[i];
+		return ret;
+	}
+
+	inline void inplace_add_neon(Float* acc, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 4 <= n; i += 4)
+			vst1q_f32(acc + i, vaddq_f32(vld1q_f32(acc + i), vld1q_f32(a + i)));
+		for (; i != n; ++i)
+			acc[i] += a[i];
+	}
+
+	inline void axpy_neon(Float* acc, Float s, Float const* a, Integer n)
+	{
+		Integer i = 0;
+		for (; i + 4 <= n; i += 4)
+			vst1q_f32(acc + i, vfmaq_n_f32(vld1q_f32(acc + i), vld1q_f32(a + i), s));
+		for (; i != n; ++i)
+			acc[i] += s * a[i];
+	}
+
+	inline kernels_t const& select_kernels()
+	{
+		static const kernels_t neon{ "neon", add_neon, scale_neon, neg_neon, dot_neon, inplace_add_neon, axpy_neon, gemm_micro_scalar };
+		return neon;
+	}
+
+#else
+	inline kernels_t const& select_kernels()
+	{
+		return scalar_kernels();
+	}
+#endif
+
+	// ---------------- Entry points ------------------
+	// Short arrays are handled inline, longer ones by the selected kernel
+
+	inline void add(Float* out, Float const* a, Float const* b, Integer n)
+	{
+		if (n < min_elements)
+			add_scalar(out, a, b, n);
+		else
+			get_kernels().add(out, a, b, n);
+	}
+
+	inline void scale(Float* out, Float s, Float const* a, Integer n)
+	{
+		if (n < min_elements)
+			scale_scalar(out, s, a, n);
+		else
+			get_kernels().scale(out, s, a, n);
+	}
+
+	inline void neg(Float* out, Float const* a, Integer n)
+	{
+		if (n < min_elements)
+			neg_scalar(out, a, n);
+		else
+			get_kernels().neg(out, a, n);
+	}
+
+	inline Float dot(Float const* a, Float const* b, Integer n)
+	{
+		if (n < min_elements)
+			return dot_scalar(a, b, n);
+		return get_kernels().dot(a, b, n);
+	}
+
+	inline void inplace_add(Float* acc, Float const* a, Integer n)
+	{
+		if (n < min_elements)
+			inplace_add_scalar(acc, a, n);
+		else
+			get_kernels().inplace_add(acc, a, n);
+	}
+
+	inline void axpy(Float* acc, Float s, Float const* a, Integer n)
+	{
+		if (n < min_elements)
+			axpy_scalar(acc, s, a, n);
+		else
+			get_kernels().axpy(acc, s, a, n);
+	}
+
+}
+}
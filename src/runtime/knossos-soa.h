@@ -0,0 +1,444 @@
+// Structure-of-arrays storage for tensors of tuples
+#pragma once
+
+/*
+With KS_SOA, a tensor<Dim, Tuple<Ts...>> is stored as one tensor<Dim, Ts>
+per field of the tuple (its "columns"), rather than as an array of Tuple
+structs.  Indexing keeps its meaning:
+  - the const operator[] and index return the element by value;
+  - the non-const ones return an soa_ref, which reads the element from,
+    and assigns it to, the columns;
+  - data() returns an soa_pointer (or, if const, an soa_const_pointer),
+    so that loops written against the data() of an array of T work
+    unchanged.
+
+Everything which depends only on the layout (unzip, zero, shape, the
+tangent-space arithmetic, inplace_add and the copydown machinery) acts
+column by column: unzip just returns the columns, and arithmetic on
+Float columns uses the vectorized kernels.  As far as memory is concerned,
+a tensor of tuples behaves exactly like the tuple of its columns.  This
+includes the "bog" tensors of suffwdpass_map/sufrevpass_map, whose
+elements are tuples.
+*/
+
+#include "knossos.h"
+
+namespace ks {
+
+	template <class... Ts> class soa_pointer;
+	template <class... Ts> class soa_const_pointer;
+	template <class... Ts> class soa_ref;
+
+	// The type returned by tensor<Dim, T>::data()
+	template <class T>
+	struct element_pointer
+	{
+		using type = T*;
+		using const_type = T const*;
+	};
+
+	template <class... Ts>
+	struct element_pointer<Tuple<Ts...>>
+	{
+		using type = soa_pointer<Ts...>;
+		using const_type = soa_const_pointer<Ts...>;
+	};
+
+	template <class... Ts>
+	class soa_pointer
+	{
+	public:
+		typedef Tuple<typename element_pointer<Ts>::type...> columns_type;
+
+		KS_INTERFACE soa_pointer() : columns_{} {}
+		KS_INTERFACE explicit soa_pointer(columns_type columns) : columns_(columns) {}
+
+		KS_INTERFACE columns_type const& columns() const { return columns_; }
+
+		KS_INTERFACE soa_ref<Ts...> operator*() const { return soa_ref<Ts...>(*this); }
+		KS_INTERFACE soa_ref<Ts...> operator[](Integer i) const { return soa_ref<Ts...>(*this + i); }
+
+		KS_INTERFACE soa_pointer operator+(Integer n) const {
+			return soa_pointer(transform_Tuple(columns_, [n](auto p) { return p + n; }));
+		}
+		KS_INTERFACE soa_pointer& operator++() { return *this = *this + 1; }
+		KS_INTERFACE soa_pointer operator++(int) { soa_pointer ret = *this; ++*this; return ret; }
+
+	private:
+		columns_type columns_;
+	};
+
+	template <class T>
+	KS_INTERFACE T const* to_const_pointer(T* p) { return p; }
+
+	template <class... Ts>
+	KS_INTERFACE soa_const_pointer<Ts...> to_const_pointer(soa_pointer<Ts...> p) { return p; }
+
+	template <class... Ts>
+	class soa_const_pointer
+	{
+		template <size_t... Indices>
+		KS_INTERFACE Tuple<Ts...> read(Integer i, std::index_sequence<Indices...>) const {
+			return ks::make_Tuple(Ts(ks::get<Indices>(columns_)[i])...);
+		}
+
+	public:
+		typedef Tuple<typename element_pointer<Ts>::const_type...> columns_type;
+
+		KS_INTERFACE soa_const_pointer() : columns_{} {}
+		KS_INTERFACE explicit soa_const_pointer(columns_type columns) : columns_(columns) {}
+		KS_INTERFACE soa_const_pointer(soa_pointer<Ts...> p) :
+			columns_(transform_Tuple(p.columns(), [](auto q) { return to_const_pointer(q); })) {}
+
+		KS_INTERFACE columns_type const& columns() const { return columns_; }
+
+		KS_INTERFACE Tuple<Ts...> operator*() const { return (*this)[0]; }
+		KS_INTERFACE Tuple<Ts...> operator[](Integer i) const { return read(i, std::index_sequence_for<Ts...>{}); }
+
+		KS_INTERFACE soa_const_pointer operator+(Integer n) const {
+			return soa_const_pointer(transform_Tuple(columns_, [n](auto p) { return p + n; }));
+		}
+		KS_INTERFACE soa_const_pointer& operator++() { return *this = *this + 1; }
+		KS_INTERFACE soa_const_pointer operator++(int) { soa_const_pointer ret = *this; ++*this; return ret; }
+
+	private:
+		columns_type columns_;
+	};
+
+	// A reference to one element of a tensor of tuples
+	template <class... Ts>
+	class soa_ref
+	{
+		soa_pointer<Ts...> p_;
+
+		template <size_t... Indices>
+		KS_INTERFACE void store(Tuple<Ts...> const& val, std::index_sequence<Indices...>) const {
+			((ks::get<Indices>(p_.columns())[0] = ks::get<Indices>(val)), ...);
+		}
+
+	public:
+		KS_INTERFACE explicit soa_ref(soa_pointer<Ts...> p) : p_(p) {}
+
+		KS_INTERFACE operator Tuple<Ts...>() const { return soa_const_pointer<Ts...>(p_)[0]; }
+
+		KS_INTERFACE soa_ref const& operator=(Tuple<Ts...> const& val) const {
+			store(val, std::index_sequence_for<Ts...>{});
+			return *this;
+		}
+		KS_INTERFACE soa_ref const& operator=(soa_ref const& other) const {
+			return *this = Tuple<Ts...>(other);
+		}
+
+		// A reference to field I: a T& or, for a nested tuple, an soa_ref
+		template <size_t I>
+		KS_INTERFACE decltype(auto) get() const { return ks::get<I>(p_.columns())[0]; }
+	};
+
+	template <size_t I, class... Ts>
+	KS_INTERFACE decltype(auto) get(soa_ref<Ts...> const& r) { return r.template get<I>(); }
+
+	template <class... Ts>
+	std::ostream &operator<<(std::ostream &s, soa_ref<Ts...> const &r)
+	{
+		return s << Tuple<Ts...>(r);
+	}
+
+	template <size_t Dim, class... Ts>
+	class tensor<Dim, Tuple<Ts...>>
+	{
+		using dimension = tensor_dimension<Dim>;
+
+	public:
+		typedef typename dimension::index_type index_type;
+		typedef Tuple<Ts...> value_type;
+		typedef Tuple<tensor<Dim, Ts>...> columns_type;
+
+	private:
+		index_type size_;
+		columns_type columns_;
+
+		template <size_t... Indices>
+		static KS_INTERFACE columns_type columns_from(index_type size, soa_pointer<Ts...> data, std::index_sequence<Indices...>) {
+			return ks::make_Tuple(tensor<Dim, Ts>(size, ks::get<Indices>(data.columns()))...);
+		}
+
+		template <size_t... Indices>
+		KS_INTERFACE soa_pointer<Ts...> data_impl(std::index_sequence<Indices...>) {
+			return soa_pointer<Ts...>(ks::make_Tuple(ks::get<Indices>(columns_).data()...));
+		}
+
+		template <size_t... Indices>
+		KS_INTERFACE soa_const_pointer<Ts...> data_impl(std::index_sequence<Indices...>) const {
+			return soa_const_pointer<Ts...>(ks::make_Tuple(ks::get<Indices>(columns_).data()...));
+		}
+
+		template <size_t... Indices>
+		KS_INTERFACE tensor<Dim-1, value_type> subtensor_impl(Integer i, std::index_sequence<Indices...>) const {
+			return tensor<Dim-1, value_type>(tensor_dimension<Dim-1>::tail(size_),
+				ks::make_Tuple(ks::get<Indices>(columns_).subtensor(i)...));
+		}
+
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
+		template <size_t... Indices>
+		static KS_INTERFACE columns_type create_columns(allocator_base * alloc, index_type size, std::index_sequence<Indices...>) {
+			return ks::make_Tuple(tensor<Dim, Ts>::create(alloc, size)...);
+		}
+#endif
+
+	public:
+		KS_INTERFACE tensor() : size_{}, columns_{} {}
+		KS_INTERFACE tensor(index_type size, columns_type columns) : size_(size), columns_(columns) {}
+		KS_INTERFACE tensor(index_type size, soa_pointer<Ts...> data) :
+			size_(size), columns_(columns_from(size, data, std::index_sequence_for<Ts...>{})) {}
+
+		KS_INTERFACE index_type size() const { return size_; }
+		KS_INTERFACE Integer outer_dimension() const { return get_dimension<0>(size_); }
+		KS_INTERFACE Integer num_elements() const { return dimension::num_elements(size_); }
+
+		KS_INTERFACE columns_type const& columns() const { return columns_; }
+		KS_INTERFACE columns_type& columns() { return columns_; }
+
+		template <size_t I>
+		KS_INTERFACE auto const& column() const { return ks::get<I>(columns_); }
+
+		KS_INTERFACE soa_pointer<Ts...> data() { return data_impl(std::index_sequence_for<Ts...>{}); }
+		KS_INTERFACE soa_const_pointer<Ts...> data() const { return data_impl(std::index_sequence_for<Ts...>{}); }
+
+		KS_INTERFACE std::conditional_t<Dim == 1u, soa_ref<Ts...>, tensor<Dim-1, value_type>> operator[](Integer i) {
+			if constexpr (Dim == 1u) {
+				return data()[i];
+			} else {
+				return subtensor(i);
+			}
+		}
+
+		KS_INTERFACE std::conditional_t<Dim == 1u, value_type, tensor<Dim-1, value_type>> operator[](Integer i) const {
+			if constexpr (Dim == 1u) {
+				return data()[i];
+			} else {
+				return subtensor(i);
+			}
+		}
+
+		KS_INTERFACE tensor<Dim-1, value_type> subtensor(Integer i) const {
+			static_assert(Dim >= 2u);
+			return subtensor_impl(i, std::index_sequence_for<Ts...>{});
+		}
+
+		KS_INTERFACE Integer flat_index(index_type i) const {
+#ifdef KS_BOUNDS_CHECK
+			if (!dimension::index_is_in_range(i, size_)) {
+				std::cerr << "ERROR: Accessing element " << dimension::index_to_string(i) << " of tensor of size " << dimension::index_to_string(size_) << std::endl;
+				abort();
+			}
+#endif
+			return dimension::flatten_index(i, size_);
+		}
+
+		KS_INTERFACE value_type index(index_type i) const { return data()[flat_index(i)]; }
+
+		KS_INTERFACE soa_ref<Ts...> index(index_type i) { return data()[flat_index(i)]; }
+
+		KS_INTERFACE void set_if_index_is_in_range(index_type i, value_type const& val) {
+			if (dimension::index_is_in_range(i, size_)) {
+				data()[dimension::flatten_index(i, size_)] = val;
+			}
+		}
+
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
+		static KS_INTERFACE tensor create(allocator_base * alloc, index_type size)
+		{
+			return tensor(size, create_columns(alloc, size, std::index_sequence_for<Ts...>{}));
+		}
+#else
+		static KS_INTERFACE tensor create(allocator_base *, index_type)
+		{
+			KS_ASSERT(false && "Allocation not supported");
+			return {};
+		}
+#endif
+
+		KS_INTERFACE bool operator == (tensor const& other) const {
+			return size() == other.size() && columns_ == other.columns_;
+		}
+
+		KS_INTERFACE bool operator != (tensor const& other) const { return !(*this == other); }
+	};
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION Tuple<Ts...> index(typename tensor<Dim, Tuple<Ts...>>::index_type i, tensor<Dim, Tuple<Ts...>> const & t)
+	{
+		return t.index(i);
+	}
+
+	// Build a tensor of tuples from f applied to each column of t in turn
+	template <size_t Dim, class... Ts, class F, size_t... Indices>
+	KS_FUNCTION auto transform_columns_impl(tensor<Dim, Tuple<Ts...>> const& t, F f, std::index_sequence<Indices...>)
+	{
+		auto columns = ks::make_Tuple(f(t.template column<Indices>())...);
+		using value_type = Tuple<typename decltype(f(t.template column<Indices>()))::value_type...>;
+		return tensor<Dim, value_type>(t.size(), columns);
+	}
+
+	template <size_t Dim, class... Ts, class F>
+	KS_FUNCTION auto transform_columns(tensor<Dim, Tuple<Ts...>> const& t, F f)
+	{
+		return transform_columns_impl(t, f, std::index_sequence_for<Ts...>{});
+	}
+
+	// As transform_columns, for f applied to corresponding columns of t1 and t2
+	template <size_t Dim, class... Ts, class... Us, class F, size_t... Indices>
+	KS_FUNCTION auto transform_columns2_impl(tensor<Dim, Tuple<Ts...>> const& t1, tensor<Dim, Tuple<Us...>> const& t2, F f, std::index_sequence<Indices...>)
+	{
+		auto columns = ks::make_Tuple(f(t1.template column<Indices>(), t2.template column<Indices>())...);
+		using value_type = Tuple<typename decltype(f(t1.template column<Indices>(), t2.template column<Indices>()))::value_type...>;
+		return tensor<Dim, value_type>(t1.size(), columns);
+	}
+
+	template <size_t Dim, class... Ts, class... Us, class F>
+	KS_FUNCTION auto transform_columns2(tensor<Dim, Tuple<Ts...>> const& t1, tensor<Dim, Tuple<Us...>> const& t2, F f)
+	{
+		return transform_columns2_impl(t1, t2, f, std::index_sequence_for<Ts...>{});
+	}
+
+	// Call f(column1, column2) for corresponding columns of *t1 and t2
+	template <size_t Dim, class... Ts, class... Us, class F, size_t... Indices>
+	KS_FUNCTION void for_each_column_impl(tensor<Dim, Tuple<Ts...>> * t1, tensor<Dim, Tuple<Us...>> const& t2, F f, std::index_sequence<Indices...>)
+	{
+		(f(&ks::get<Indices>(t1->columns()), t2.template column<Indices>()), ...);
+	}
+
+	template <size_t Dim, class... Ts, class... Us, class F>
+	KS_FUNCTION void for_each_column(tensor<Dim, Tuple<Ts...>> * t1, tensor<Dim, Tuple<Us...>> const& t2, F f)
+	{
+		for_each_column_impl(t1, t2, f, std::index_sequence_for<Ts...>{});
+	}
+
+	// ===============================  Layout  ==================================
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION auto shape(allocator_base * alloc, tensor<Dim, Tuple<Ts...>> const& t)
+	{
+		return transform_columns(t, [alloc](auto const& c) { return shape(alloc, c); });
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> inflated_deep_copy(allocator_base * alloc, tensor<Dim, Tuple<Ts...>> t)
+	{
+		return transform_columns(t, [alloc](auto const& c) { return inflated_deep_copy(alloc, c); });
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> zero(allocator * alloc, tensor<Dim, Tuple<Ts...>> const& val)
+	{
+		return transform_columns(val, [alloc](auto const& c) { return zero(alloc, c); });
+	}
+
+	template<size_t Dim, typename ...Ts>
+	struct make_zero_t<tensor<Dim, Tuple<Ts...>>>
+	{
+		template<size_t ...Indices>
+		static KS_FUNCTION tensor<Dim, Tuple<Ts...>> ofShapeImpl(allocator_base * alloc, shape_t<tensor<Dim, Tuple<Ts...>>> const& shape, std::index_sequence<Indices...>) {
+			return tensor<Dim, Tuple<Ts...>>(shape.size(),
+				ks::make_Tuple(make_zero_t<tensor<Dim, Ts>>::ofShape(alloc, shape.template column<Indices>())...));
+		}
+
+		static KS_FUNCTION tensor<Dim, Tuple<Ts...>> ofShape(allocator_base * alloc, shape_t<tensor<Dim, Tuple<Ts...>>> const& shape) {
+			return ofShapeImpl(alloc, shape, std::index_sequence_for<Ts...>{});
+		}
+	};
+
+#ifdef KS_ALLOCATOR
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION size_t inflated_bytes(tensor<Dim, Tuple<Ts...>> const& t) {
+		return inflated_bytes(t.columns());
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION bool memory_overlaps(const void* start, const void* end, tensor<Dim, Tuple<Ts...>> const& t) {
+		return memory_overlaps(start, end, t.columns());
+	}
+#endif
+
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> relocating_copy(allocator * alloc, relocation_state const& r, tensor<Dim, Tuple<Ts...>> const& t) {
+		return tensor<Dim, Tuple<Ts...>>(t.size(), relocating_copy(alloc, r, t.columns()));
+	}
+#endif
+
+	// ===============================  Arithmetic  ==================================
+
+	template <size_t Dim, class... Ts>
+	struct inplace_add_t<tensor<Dim, Tuple<Ts...>>> {
+		static KS_FUNCTION void go(tensor<Dim, Tuple<Ts...>> *t1, const tensor<Dim, Tuple<Ts...>> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			for_each_column(t1, t2, [](auto* c1, auto const& c2) { inplace_add(c1, c2); });
+		}
+	};
+
+	template <size_t Dim, class... Ts>
+	struct inplace_add_scaled_t<tensor<Dim, Tuple<Ts...>>> {
+		static KS_FUNCTION void go(tensor<Dim, Tuple<Ts...>> *t1, Float s, const tensor<Dim, Tuple<Ts...>> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			for_each_column(t1, t2, [s](auto* c1, auto const& c2) { inplace_add_scaled(c1, s, c2); });
+		}
+	};
+
+	template <size_t Dim, class... Ts>
+	struct inplace_add_compensated_t<tensor<Dim, Tuple<Ts...>>> {
+		template <size_t... Indices>
+		static KS_FUNCTION void go_impl(tensor<Dim, Tuple<Ts...>> *t1, tensor<Dim, Tuple<Ts...>> *compensation, const tensor<Dim, Tuple<Ts...>> &t2, std::index_sequence<Indices...>)
+		{
+			((inplace_add_compensated(&ks::get<Indices>(t1->columns()), &ks::get<Indices>(compensation->columns()), t2.template column<Indices>())), ...);
+		}
+
+		static KS_FUNCTION void go(tensor<Dim, Tuple<Ts...>> *t1, tensor<Dim, Tuple<Ts...>> *compensation, const tensor<Dim, Tuple<Ts...>> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			KS_ASSERT(compensation->size() == t2.size());
+			go_impl(t1, compensation, t2, std::index_sequence_for<Ts...>{});
+		}
+	};
+
+	template <size_t Dim, class... Ts, size_t... Indices>
+	KS_FUNCTION void inplace_add_at_impl(tensor<Dim, Tuple<Ts...>> * t, typename tensor<Dim, Tuple<Ts...>>::index_type i, Tuple<Ts...> const& val, std::index_sequence<Indices...>)
+	{
+		(inplace_add_at(&ks::get<Indices>(t->columns()), i, ks::get<Indices>(val)), ...);
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION void inplace_add_at(tensor<Dim, Tuple<Ts...>> * t, typename tensor<Dim, Tuple<Ts...>>::index_type i, Tuple<Ts...> const& val)
+	{
+		inplace_add_at_impl(t, i, val, std::index_sequence_for<Ts...>{});
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> ts_add(allocator * alloc, tensor<Dim, Tuple<Ts...>> const& a, tensor<Dim, Tuple<Ts...>> const& b)
+	{
+		KS_ASSERT(a.size() == b.size());
+		return transform_columns2(a, b, [alloc](auto const& c1, auto const& c2) { return ts_add(alloc, c1, c2); });
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> ts_scale(allocator * alloc, Float val, tensor<Dim, Tuple<Ts...>> const& t)
+	{
+		return transform_columns(t, [alloc, val](auto const& c) { return ts_scale(alloc, val, c); });
+	}
+
+	template <size_t Dim, class... Ts>
+	KS_FUNCTION tensor<Dim, Tuple<Ts...>> ts_neg(allocator * alloc, tensor<Dim, Tuple<Ts...>> t)
+	{
+		return transform_columns(t, [alloc](auto const& c) { return ts_neg(alloc, c); });
+	}
+
+	template <size_t Dim, class... Ts, class... Us>
+	inline KS_FUNCTION Float ts_dot(tensor<Dim, Tuple<Ts...>> t1, tensor<Dim, Tuple<Us...>> t2)
+	{
+		KS_ASSERT(t1.size() == t2.size());
+		return ts_dot(t1.columns(), t2.columns());
+	}
+
+}
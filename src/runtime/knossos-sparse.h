@@ -0,0 +1,215 @@
+// Sparse one-hot and diagonal tensors
+#pragma once
+
+/*
+deltaVec(n, i, v) is a tensor which is zero except at index i, and
+diag(n, n, f) a matrix which is zero except on its diagonal.  Reverse-mode
+code makes these constantly (e.g. from index), and then adds them to
+something dense, so materializing them writes O(n) (or O(n^2)) zeros
+which are immediately read back.
+
+Instead, a deltaVec or diag which is directly an operand of one of the
+functions below is made sparse, by
+  sparse_deltaVec(alloc, n, i, v) -- a delta_tensor
+  sparse_diag(alloc, n, n, f)     -- a diag_tensor
+and these functions handle it in time proportional to its nonzero
+entries:
+  ts_scale(alloc, s, d), ts_neg(alloc, d) -- a delta_tensor again
+  ts_add(alloc, t, d), ts_add(alloc, d, t)
+                                -- a deep copy of t, with d added in
+  inplace_add(&t, d)            -- adds the nonzero entry of d to t
+  ts_dot(t, d), ts_dot(d, t), sum(alloc, d)
+  sumbuild_deltaVec(alloc, n, m, g)
+                                -- sumbuild(n, i -> deltaVec(m, g(i)))
+where d is a delta_tensor (or, for ts_add, a diag_tensor) and t is a
+dense tensor.  densify(alloc, d) materializes d where it is forced to be
+dense.  ksc generates these for directly nested calls (see the
+Note [Sparse deltaVec and diag] in Cgen.hs), so a sparse tensor is never
+stored (or copied down), and never outlives the expression which made it.
+
+As for deltaVec, an index which is out of range contributes nothing.
+*/
+
+#include "knossos.h"
+
+namespace ks {
+
+	// A tensor of the given size which is zero except at index
+	template <size_t Dim, class T>
+	struct delta_tensor
+	{
+		typedef typename tensor_dimension<Dim>::index_type index_type;
+
+		index_type size;
+		index_type index;
+		T value;
+
+		KS_INTERFACE bool has_value() const { return tensor_dimension<Dim>::index_is_in_range(index, size); }
+	};
+
+	// A size x size matrix whose diagonal is f(alloc, i)
+	template <class T, class F>
+	struct diag_tensor
+	{
+		Integer size;
+		F f;
+
+		KS_INTERFACE T at(allocator * alloc, Integer i) const { return applyWithAllocator(alloc, f, i); }
+	};
+
+	template <class SizeType, class T>
+	KS_FUNCTION delta_tensor<dimension_of_tensor_index_type<SizeType>::value, T> sparse_deltaVec(allocator *, SizeType size, SizeType index, T val)
+	{
+		return { size, index, val };
+	}
+
+	template <class F>
+	KS_FUNCTION auto sparse_diag(allocator *, Integer rows, Integer cols, F f)
+	{
+		KS_ASSERT(rows == cols);
+		typedef decltype(applyWithAllocator(std::declval<allocator*>(), f, Integer{})) T;
+		return diag_tensor<T, F>{ rows, f };
+	}
+
+	// ============================== Densify ===================================
+
+	template <size_t Dim, class T>
+	KS_FUNCTION tensor<Dim, T> densify(allocator * alloc, delta_tensor<Dim, T> const& d)
+	{
+		return deltaVec(alloc, d.size, d.index, d.value);
+	}
+
+	template <class T, class F>
+	KS_FUNCTION vec<vec<T>> densify(allocator * alloc, diag_tensor<T, F> const& d)
+	{
+		return diag(alloc, d.size, d.size, d.f);
+	}
+
+	// ============================ Accumulation ================================
+
+	template <size_t Dim, class T>
+	KS_FUNCTION void inplace_add(tensor<Dim, T> * t, delta_tensor<Dim, T> const& d)
+	{
+		KS_ASSERT(t->size() == d.size);
+		if (d.has_value())
+			inplace_add_at(t, d.index, d.value);
+	}
+
+	template <class T, class F>
+	KS_FUNCTION void inplace_add(allocator * alloc, vec<vec<T>> * t, diag_tensor<T, F> const& d)
+	{
+		// As in accumulate_elements, a flat element resets the allocator itself
+		KS_ASSERT(t->size() == d.size);
+		KS_MARK(alloc, mark);
+		for (Integer i = 0; i != d.size; ++i) {
+			vec<T> & row = (*t)[i];
+			KS_ASSERT(row.size() == d.size);
+			inplace_add(&row[i], d.at(alloc, i));
+			if constexpr (!is_flat<T>::value) {
+				KS_RESET(alloc, mark);
+			}
+		}
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION void inplace_add(allocator *, tensor<Dim, T> * t, delta_tensor<Dim, T> const& d)
+	{
+		inplace_add(t, d);
+	}
+
+	// ============================ Arithmetic ==================================
+
+	template <size_t Dim, class T>
+	KS_FUNCTION delta_tensor<Dim, T> ts_scale(allocator * alloc, Float s, delta_tensor<Dim, T> const& d)
+	{
+		return { d.size, d.index, ts_scale(alloc, s, d.value) };
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION delta_tensor<Dim, T> ts_neg(allocator * alloc, delta_tensor<Dim, T> const& d)
+	{
+		return { d.size, d.index, ts_neg(alloc, d.value) };
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION tensor<Dim, T> ts_add(allocator * alloc, tensor<Dim, T> const& t, delta_tensor<Dim, T> const& d)
+	{
+		auto ret = inflated_deep_copy(alloc, t);
+		inplace_add(&ret, d);
+		return ret;
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION tensor<Dim, T> ts_add(allocator * alloc, delta_tensor<Dim, T> const& d, tensor<Dim, T> const& t)
+	{
+		return ts_add(alloc, t, d);
+	}
+
+	template <class T, class F>
+	KS_FUNCTION vec<vec<T>> ts_add(allocator * alloc, vec<vec<T>> const& t, diag_tensor<T, F> const& d)
+	{
+		auto ret = inflated_deep_copy(alloc, t);
+		inplace_add(alloc, &ret, d);
+		return ret;
+	}
+
+	template <class T, class F>
+	KS_FUNCTION vec<vec<T>> ts_add(allocator * alloc, diag_tensor<T, F> const& d, vec<vec<T>> const& t)
+	{
+		return ts_add(alloc, t, d);
+	}
+
+	template <size_t Dim, class T1, class T2>
+	KS_FUNCTION Float ts_dot(tensor<Dim, T1> const& t, delta_tensor<Dim, T2> const& d)
+	{
+		KS_ASSERT(t.size() == d.size);
+		return d.has_value() ? ts_dot(t.index(d.index), d.value) : Float(0);
+	}
+
+	template <size_t Dim, class T1, class T2>
+	KS_FUNCTION Float ts_dot(delta_tensor<Dim, T1> const& d, tensor<Dim, T2> const& t)
+	{
+		KS_ASSERT(t.size() == d.size);
+		return d.has_value() ? ts_dot(d.value, t.index(d.index)) : Float(0);
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION T sum(allocator * alloc, delta_tensor<Dim, T> const& d)
+	{
+		return d.has_value() ? d.value : zero(alloc, d.value);
+	}
+
+	// ============================== Sumbuild ==================================
+
+	/* The body of sumbuild(n, i -> deltaVec(size, g(i))), where g returns
+	   the index and value of the nonzero element.  Like build_body it
+	   is called (e.g. for the first term) to make the dense tensor, but is
+	   otherwise accumulated by adding the one element. */
+	template <class T, class Size, class G>
+	struct deltaVec_body
+	{
+		Size size;
+		G g;
+
+		template <class ...Indices>
+		KS_FUNCTION tensor<dimension_of_tensor_index_type<Size>::value, T> operator()(allocator * alloc, Indices ...i) const {
+			auto iv = g(alloc, i...);
+			return deltaVec(alloc, size, ks::get<0>(iv), ks::get<1>(iv));
+		}
+	};
+
+	template <size_t Dim, class T, class Size, class G, class ...Indices>
+	KS_FUNCTION void accumulate(allocator * alloc, tensor<Dim, T> * result, deltaVec_body<T, Size, G> const& f, Indices ...i)
+	{
+		auto iv = f.g(alloc, i...);
+		inplace_add(result, sparse_deltaVec(alloc, f.size, ks::get<0>(iv), ks::get<1>(iv)));
+	}
+
+	template <class T, class Size, class DeltaSize, class G>
+	KS_FUNCTION tensor<dimension_of_tensor_index_type<DeltaSize>::value, T> sumbuild_deltaVec(allocator * alloc, Size size, DeltaSize deltaSize, G g)
+	{
+		using Result = tensor<dimension_of_tensor_index_type<DeltaSize>::value, T>;
+		return sumbuild<Result>(alloc, size, deltaVec_body<T, DeltaSize, G>{ deltaSize, g });
+	}
+
+}
@@ -0,0 +1,219 @@
+// Strided views of tensor data
+#pragma once
+
+/*
+A strided_tensor<Dim, T> is a view of elements which need not be
+contiguous: element (i0, i1, ...) is at data()[i0 * s0 + i1 * s1 + ...],
+where (s0, s1, ...) are its strides, counted in elements.  A tensor is
+the special case of row-major strides, and a view of one is made by
+  strided_tensor<Dim, T>(t)
+
+Views are made without copying by
+  - subtensor(i) / operator[](i), which fix the outermost index;
+  - slice(begin, end), which restricts the outermost dimension;
+  - transpose<I, J>(), which swaps two dimensions.
+A view refers to the memory of whatever it was made from, and is only
+valid as long as that is.
+
+for_each_element(t, f) calls f on each element, in row-major order.  Its
+innermost loop is specialized for the case in which the last stride is 1,
+so that it runs over contiguous memory.  to_tensor(alloc, t) returns t as
+a tensor: the same memory if t is already contiguous, and otherwise a
+copy in the allocator.
+*/
+
+#include "knossos.h"
+
+namespace ks {
+
+	template <size_t Dim, class T>
+	class strided_tensor
+	{
+		using dimension = tensor_dimension<Dim>;
+
+	public:
+		typedef typename dimension::index_type index_type;
+		typedef T value_type;
+
+	private:
+		index_type size_;
+		index_type strides_;
+		T* data_;
+
+		template <size_t... Indices>
+		static KS_INTERFACE index_type row_major_strides(index_type const& size, std::index_sequence<Indices...>) {
+			if constexpr (Dim == 1u) {
+				return 1;
+			} else {
+				Integer s[Dim] = { get_dimension<Indices>(size)... };
+				Integer strides[Dim];
+				Integer stride = 1;
+				for (size_t d = Dim; d-- > 0; ) {
+					strides[d] = stride;
+					stride *= s[d];
+				}
+				return index_type{ strides[Indices]... };
+			}
+		}
+
+		template <size_t... Indices>
+		KS_INTERFACE Integer offset_impl(index_type const& i, std::index_sequence<Indices...>) const {
+			return (Integer(0) + ... + (get_dimension<Indices>(i) * get_dimension<Indices>(strides_)));
+		}
+
+		template <size_t... Indices>
+		KS_INTERFACE strided_tensor<Dim - 1, T> subtensor_impl(Integer i, std::index_sequence<Indices...>) const {
+			typedef typename strided_tensor<Dim - 1, T>::index_type tail_type;
+			if constexpr (Dim == 2u) {
+				return strided_tensor<Dim - 1, T>(get_dimension<1>(size_), get_dimension<1>(strides_),
+					data_ + i * get_dimension<0>(strides_));
+			} else {
+				return strided_tensor<Dim - 1, T>(tail_type{ get_dimension<Indices + 1>(size_)... },
+					tail_type{ get_dimension<Indices + 1>(strides_)... }, data_ + i * get_dimension<0>(strides_));
+			}
+		}
+
+	public:
+		KS_INTERFACE strided_tensor() : size_{}, strides_{}, data_{ nullptr } {}
+		KS_INTERFACE strided_tensor(index_type size, index_type strides, T * data) : size_(size), strides_(strides), data_(data) {}
+
+		// A view of all of t
+		KS_INTERFACE explicit strided_tensor(tensor<Dim, T> const& t) :
+			size_(t.size()),
+			strides_(row_major_strides(t.size())),
+			data_(const_cast<T*>(t.data()))
+		{}
+
+		static KS_INTERFACE index_type row_major_strides(index_type const& size) {
+			return row_major_strides(size, std::make_index_sequence<Dim>{});
+		}
+
+		KS_INTERFACE index_type size() const { return size_; }
+		KS_INTERFACE index_type strides() const { return strides_; }
+		KS_INTERFACE Integer outer_dimension() const { return get_dimension<0>(size_); }
+		KS_INTERFACE Integer num_elements() const { return dimension::num_elements(size_); }
+
+		KS_INTERFACE T* data() const { return data_; }
+
+		KS_INTERFACE bool is_contiguous() const {
+			return num_elements() == 0 || strides_ == row_major_strides(size_);
+		}
+
+		KS_INTERFACE Integer offset(index_type i) const {
+#ifdef KS_BOUNDS_CHECK
+			if (!dimension::index_is_in_range(i, size_)) {
+				std::cerr << "ERROR: Accessing element " << dimension::index_to_string(i) << " of tensor of size " << dimension::index_to_string(size_) << std::endl;
+				abort();
+			}
+#endif
+			if constexpr (Dim == 1u) {
+				return i * strides_;
+			} else {
+				return offset_impl(i, std::make_index_sequence<Dim>{});
+			}
+		}
+
+		KS_INTERFACE T& index(index_type i) const { return data_[offset(i)]; }
+
+		KS_INTERFACE std::conditional_t<Dim == 1u, T&, strided_tensor<Dim - 1, T>> operator[](Integer i) const {
+			if constexpr (Dim == 1u) {
+				return index(i);
+			} else {
+				return subtensor(i);
+			}
+		}
+
+		KS_INTERFACE strided_tensor<Dim - 1, T> subtensor(Integer i) const {
+			static_assert(Dim >= 2u);
+			return subtensor_impl(i, std::make_index_sequence<Dim - 1>{});
+		}
+
+		// Elements [begin, end) of the outermost dimension
+		KS_INTERFACE strided_tensor slice(Integer begin, Integer end) const {
+			KS_ASSERT(0 <= begin && begin <= end && end <= outer_dimension());
+			index_type size = size_;
+			get_dimension<0>(size) = end - begin;
+			return strided_tensor(size, strides_, data_ + begin * get_dimension<0>(strides_));
+		}
+
+		// The same elements, with dimensions I and J swapped
+		template <size_t I, size_t J>
+		KS_INTERFACE strided_tensor transpose() const {
+			static_assert(I < Dim && J < Dim);
+			index_type size = size_, strides = strides_;
+			std::swap(get_dimension<I>(size), get_dimension<J>(size));
+			std::swap(get_dimension<I>(strides), get_dimension<J>(strides));
+			return strided_tensor(size, strides, data_);
+		}
+
+		KS_INTERFACE strided_tensor transpose() const {
+			static_assert(Dim == 2u);
+			return transpose<0, 1>();
+		}
+	};
+
+	template <size_t Dim, class T>
+	KS_FUNCTION auto size(strided_tensor<Dim, T> const & t)
+	{
+		return t.size();
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION T const &index(typename strided_tensor<Dim, T>::index_type i, strided_tensor<Dim, T> const & t)
+	{
+		return t.index(i);
+	}
+
+	// Call f(element) for each element of t, in row-major order
+	template <size_t Dim, class T, class F>
+	KS_FUNCTION void for_each_element(strided_tensor<Dim, T> const& t, F f)
+	{
+		if constexpr (Dim == 1u) {
+			T* data = t.data();
+			Integer n = t.size(), stride = t.strides();
+			if (stride == 1) {
+				for (Integer i = 0; i != n; ++i)
+					f(data[i]);
+			} else {
+				for (Integer i = 0; i != n; ++i)
+					f(data[i * stride]);
+			}
+		} else {
+			for (Integer i = 0, n = t.outer_dimension(); i != n; ++i)
+				for_each_element(t.subtensor(i), f);
+		}
+	}
+
+#ifdef KS_ALLOCATOR
+	// t as a tensor: a copy, unless its elements are already contiguous
+	template <size_t Dim, class T>
+	KS_FUNCTION tensor<Dim, T> to_tensor(allocator * alloc, strided_tensor<Dim, T> const& t)
+	{
+		if (t.is_contiguous())
+			return tensor<Dim, T>(t.size(), t.data());
+		auto ret = tensor<Dim, T>::create(alloc, t.size());
+		auto retdata = ret.data();
+		for_each_element(t, [&retdata](T const& elem) { *retdata++ = elem; });
+		return ret;
+	}
+#endif
+
+	template <size_t Dim, class T>
+	std::ostream &operator<<(std::ostream &s, strided_tensor<Dim, T> const &v)
+	{
+		s << "[";
+		for (Integer i = 0; i < v.outer_dimension(); ++i)
+			s << (i > 0 ? ", " : "") << v[i];
+		return s << "]";
+	}
+
+	template <size_t Dim, typename T>
+	struct type_to_string<strided_tensor<Dim, T>>
+	{
+		static std::string name()
+		{
+			return "strided_tensor<" + std::to_string(Dim) + ", " + type_to_string<T>::name() + ">";
+		}
+	};
+
+} // namespace ks
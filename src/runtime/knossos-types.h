@@ -1,11 +1,20 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace ks {
 
 typedef float Float;
+
+// Integer is also the type of tensor sizes and indices.  It is 32 bits
+// unless KS_INDEX64 is defined, which allows tensors of 2^31 elements
+// or more.
+#ifdef KS_INDEX64
+typedef int64_t Integer;
+#else
 typedef int Integer;
+#endif
 typedef bool Bool;
 typedef std::string String;
 
@@ -1,10 +1,241 @@
 
 #include "knossos.h"
 
+// With KS_PREBUILT_RUNTIME these come from the prebuilt runtime (see knossos-prebuilt.h)
+#if !defined(KS_PREBUILT_RUNTIME) || defined(KS_RUNTIME_IMPL)
+
+#ifdef KS_ALLOCATOR
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#if defined(KS_PROFILE) && !defined(KS_CUDA)
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <vector>
+#endif
+
 namespace ks {
 	int log_indent = 8;
 	bool do_log = false;
+#ifdef KS_TRACK_OBJECTS
 	std::set<void*> objects;
+#endif
+
+	simd::kernels_t const& simd::get_kernels()
+	{
+		static simd::kernels_t const& kernels = simd::select_kernels();
+		return kernels;
+	}
+
+#ifdef KS_ALLOCATOR
+	unsigned char* allocator::reserve(size_t max_size)
+	{
+#ifdef _WIN32
+		void* p = VirtualAlloc(nullptr, max_size, MEM_RESERVE, PAGE_NOACCESS);
+		KS_ASSERT(p != nullptr && "Failed to reserve allocator address space");
+#else
+		void* p = mmap(nullptr, max_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		KS_ASSERT(p != MAP_FAILED && "Failed to reserve allocator address space");
+#endif
+		return static_cast<unsigned char*>(p);
+	}
+
+	void allocator::commit(size_t required)
+	{
+		KS_ASSERT(required <= max_size() && "Allocator exhausted");
+		size_t from = committed();
+		size_t to = ((required + chunk_size_ - 1) / chunk_size_) * chunk_size_;
+		if (to > max_size())
+			to = max_size();
+		unsigned char* start = static_cast<unsigned char*>(ptr_at(from));
+#ifdef _WIN32
+		bool ok = VirtualAlloc(start, to - from, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+		bool ok = mprotect(start, to - from, PROT_READ | PROT_WRITE) == 0;
+#endif
+		KS_ASSERT(ok && "Failed to commit allocator memory");
+		set_committed(to);
+	}
+
+	void allocator::decommit(size_t keep)
+	{
+		KS_ASSERT(owned_ && mark() <= keep);
+		reset_peak();
+		size_t from = ((keep + chunk_size_ - 1) / chunk_size_) * chunk_size_;
+		if (from >= committed())
+			return;
+		unsigned char* start = static_cast<unsigned char*>(ptr_at(from));
+#ifdef _WIN32
+		bool ok = VirtualFree(start, committed() - from, MEM_DECOMMIT) != 0;
+#else
+		bool ok = mmap(start, committed() - from, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED;
+#endif
+		KS_ASSERT(ok && "Failed to decommit allocator memory");
+		set_committed(from);
+	}
+
+	allocator::~allocator()
+	{
+		if (!owned_)
+			return;
+#ifdef _WIN32
+		VirtualFree(ptr_at(0), 0, MEM_RELEASE);
+#else
+		munmap(ptr_at(0), max_size());
+#endif
+	}
+
+	// The checkpoint arenas of this thread, by depth of nesting of RFold
+	static thread_local std::vector<std::unique_ptr<allocator>> t_fold_checkpoints;
+	static thread_local size_t t_fold_depth = 0;
+
+	fold_checkpoint_scope::fold_checkpoint_scope()
+	{
+		if (t_fold_depth == t_fold_checkpoints.size())
+			t_fold_checkpoints.push_back(std::make_unique<allocator>());
+		arena_ = t_fold_checkpoints[t_fold_depth++].get();
+	}
+
+	fold_checkpoint_scope::~fold_checkpoint_scope()
+	{
+		arena_->reset();
+		--t_fold_depth;
+	}
+#endif
+
+#ifdef KS_PARALLEL
+	thread_local bool t_in_parallel_region = false;
+
+	thread_pool& get_thread_pool()
+	{
+		static thread_pool pool(thread_pool::default_num_threads());
+		return pool;
+	}
+#endif
+
+#if defined(KS_PROFILE) && !defined(KS_CUDA)
+	namespace profile {
+		// Logs are never freed, so that events from threads which have
+		// exited can still be reported
+		static std::mutex g_logs_mutex;
+		static std::vector<thread_log_t*> g_logs;
+
+		thread_log_t& this_thread_log()
+		{
+			static thread_local thread_log_t* t_log = nullptr;
+			if (!t_log) {
+				std::lock_guard<std::mutex> lock(g_logs_mutex);
+				t_log = new thread_log_t((uint32_t)g_logs.size());
+				g_logs.push_back(t_log);
+			}
+			return *t_log;
+		}
+
+		static std::vector<thread_log_t*> all_logs()
+		{
+			std::lock_guard<std::mutex> lock(g_logs_mutex);
+			return g_logs;
+		}
+
+		static void write_json_string(std::ostream& os, char const* s)
+		{
+			os << '"';
+			for (; *s; ++s) {
+				if (*s == '"' || *s == '\\')
+					os << '\\' << *s;
+				else if ((unsigned char)*s < 0x20)
+					os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)*s << std::dec << std::setfill(' ');
+				else
+					os << *s;
+			}
+			os << '"';
+		}
+
+		void write_chrome_trace(std::ostream& os)
+		{
+			auto logs = all_logs();
+			uint64_t t0 = ~uint64_t(0);
+			for (auto log : logs)
+				log->for_each_event([&](event_t const& e) { t0 = std::min(t0, e.start_ns); });
+
+			std::ios_base::fmtflags flags = os.flags();
+			std::streamsize precision = os.precision();
+			os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+			bool first = true;
+			os << std::fixed << std::setprecision(3);
+			for (auto log : logs) {
+				log->for_each_event([&](event_t const& e) {
+					os << (first ? "\n" : ",\n") << "{\"name\":";
+					write_json_string(os, e.name);
+					os << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << log->thread_id()
+					   << ",\"ts\":" << (e.start_ns - t0) / 1e3
+					   << ",\"dur\":" << e.duration_ns / 1e3
+					   << ",\"args\":{\"self_us\":" << e.self_ns / 1e3
+					   << ",\"bytes\":" << e.bytes << "}}";
+					first = false;
+				});
+			}
+			os << "\n]}\n";
+			os.flags(flags);
+			os.precision(precision);
+		}
+
+		void write_flat_profile(std::ostream& os)
+		{
+			struct stats_t { uint64_t calls = 0, inclusive_ns = 0, exclusive_ns = 0, bytes = 0; };
+			std::map<std::string, stats_t> by_name;
+			size_t dropped = 0;
+			for (auto log : all_logs()) {
+				log->for_each_event([&](event_t const& e) {
+					stats_t& s = by_name[e.name];
+					++s.calls;
+					s.inclusive_ns += e.duration_ns;
+					s.exclusive_ns += e.self_ns;
+					s.bytes += e.bytes;
+				});
+				dropped += log->dropped();
+			}
+
+			std::vector<std::pair<std::string, stats_t>> rows(by_name.begin(), by_name.end());
+			std::sort(rows.begin(), rows.end(), [](auto const& a, auto const& b) {
+				return a.second.exclusive_ns > b.second.exclusive_ns;
+			});
+
+			std::ios_base::fmtflags flags = os.flags();
+			std::streamsize precision = os.precision();
+			os << std::setw(12) << "calls" << std::setw(14) << "incl ms" << std::setw(14) << "excl ms"
+			   << std::setw(16) << "bytes" << "  function\n";
+			os << std::fixed << std::setprecision(3);
+			for (auto const& [name, s] : rows)
+				os << std::setw(12) << s.calls
+				   << std::setw(14) << s.inclusive_ns / 1e6
+				   << std::setw(14) << s.exclusive_ns / 1e6
+				   << std::setw(16) << s.bytes << "  " << name << "\n";
+			if (dropped)
+				os << "(" << dropped << " calls not recorded: event log full)\n";
+			os.flags(flags);
+			os.precision(precision);
+		}
+
+		void reset()
+		{
+			for (auto log : all_logs())
+				log->clear();
+		}
+	}
+#endif
 
 	struct timer_t {
 		typedef std::chrono::high_resolution_clock clock_t;
@@ -73,3 +304,5 @@ namespace ks {
 	};
 
 };
+
+#endif
@@ -6,6 +6,7 @@ Contents:
 - Tuple
 - Utils
 - Allocator
+- Thread pool
 - Tensor class
 - Shape
 - Inflated deep copy
@@ -28,10 +29,26 @@ Contents:
 #include <random>
 #include <cmath>
 #include <cstring>
+#include <cstdint>
 #include <string>
 #include <chrono>
 
 #include "knossos-types.h"
+#include "knossos-profile.h"
+#if !defined(KS_CUDA)
+#include "knossos-simd.h"
+#endif
+
+#ifdef KS_PARALLEL
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
 
 /*
 Each C++ function is annotated with one of the following macros:
@@ -57,9 +74,12 @@ Each C++ function is annotated with one of the following macros:
 
 #if !defined(KS_CUDA) && !defined(KS_NO_ALLOCATOR)
 #define KS_ALLOCATOR
+#elif defined(KS_CUDA) && !defined(KS_NO_ALLOCATOR)
+// Device threads allocate from a device_arena (see knossos-cuda.cuh)
+#define KS_DEVICE_ALLOCATOR
 #endif
 
-#ifdef KS_ALLOCATOR
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
 #define KS_MARK(alloc, markvar) ks::alloc_mark_t markvar = (alloc)->mark();
 #define KS_RESET(alloc, markvar) (alloc)->reset(markvar);
 #define KS_COPYDOWN(alloc, markvar, expr) ks::copydown(alloc, markvar, expr)
@@ -69,6 +89,10 @@ Each C++ function is annotated with one of the following macros:
 #define KS_COPYDOWN(alloc, markvar, expr) (expr)
 #endif
 
+#if defined(KS_PARALLEL) && !defined(KS_ALLOCATOR)
+#error "KS_PARALLEL requires allocator support"
+#endif
+
 #define xKS_BOUNDS_CHECK
 
 #define COMMENT(x)
@@ -97,11 +121,20 @@ namespace ks {
 	extern bool do_log;
 #define KS_LOG(msg, n) if (!do_log) ; else { std::cerr << std::string((n), ' ') << msg << ":" << __FUNCTION__ << " " << this << std::endl; }
 
+	// Objects which use KS_ENTER/KS_LEAVE are recorded in `objects` only
+	// when compiled with KS_TRACK_OBJECTS.  Otherwise the macros are empty,
+	// and the special members which use them are defaulted.
+#ifdef KS_TRACK_OBJECTS
 	extern std::set<void*> objects;
 #define KS_FIND (objects.find(this) != objects.end())
 #define KS_ENTER { objects.insert(this); KS_LOG("ctor", log_indent++); }
 #define KS_NOTE { KS_LOG("note " << (KS_FIND ? (void*)this : (void*)0), log_indent); }
 #define KS_LEAVE { KS_LOG("dtor " << KS_FIND, --log_indent);  objects.erase(this); }
+#else
+#define KS_ENTER {}
+#define KS_NOTE {}
+#define KS_LEAVE {}
+#endif
 
 	// ===============================  Tuple  ==================================
 
@@ -375,24 +408,41 @@ namespace ks {
 		unsigned char* buf_;
 		size_t top_;
 		size_t peak_;
-	
+		size_t committed_;
+
+	protected:
+		// Called when the top of the arena moves past the committed region.
+		// A flat buffer is committed in full, so reaching here means it is exhausted.
+		virtual void commit(size_t required)
+		{
+			KS_ASSERT(required <= max_size_ && "Allocator exhausted");
+		}
+
+		void set_committed(size_t committed) { committed_ = committed; }
+
 	public:
-		allocator_base(unsigned char * buf, size_t max_size, size_t peak = 0) :
+		allocator_base(unsigned char * buf, size_t max_size, size_t peak = 0, size_t committed = ~size_t(0)) :
 			max_size_(max_size),
 			buf_(buf),
 			top_(0),
-			peak_(peak)
+			peak_(peak),
+			committed_(committed < max_size ? committed : max_size)
 		{}
 
+		virtual ~allocator_base() {}
+
 		void* allocate(size_t size)
 		{
-			KS_ASSERT(size < 1000 * 1000000);
+			KS_PROFILE_ALLOCATION(size);
 			void* ret = buf_ + top_;
-			top_ += padded_size(size);
-			if (top_ > peak_) {
-				peak_ = top_;
-				KS_ASSERT(top_ < max_size_);
-			}
+			size_t top = top_ + padded_size(size);
+			// Commit before moving the top or the peak, so that if commit
+			// throws, the arena is as it was
+			if (top > committed_)
+				commit(top);
+			top_ = top;
+			if (top > peak_)
+				peak_ = top;
 			return ret;
 		}
 
@@ -404,25 +454,86 @@ namespace ks {
 
 		void* ptr_at(size_t m) const { return buf_ + m; }
 
+		// Whether p points into this arena, and if so its offset from the start
+		bool owns(void const* p) const
+		{
+			auto u = reinterpret_cast<uintptr_t>(p), b = reinterpret_cast<uintptr_t>(buf_);
+			return u >= b && u < b + max_size_;
+		}
+
+		size_t offset_of(void const* p) const { return static_cast<unsigned char const*>(p) - buf_; }
+
 		void reset(size_t top = 0)
 		{
 			top_ = top;
 		}
 
 		size_t peak() const { return peak_; }
+
+		// Start measuring the peak again from the current top.  Memory up to
+		// the old peak stays committed, so this does not affect commit().
+		void reset_peak() { peak_ = top_; }
+
+		// Restore a peak saved before reset_peak, if it was the higher
+		void raise_peak(size_t peak) { if (peak > peak_) peak_ = peak; }
+
+		size_t max_size() const { return max_size_; }
+
+		size_t committed() const { return committed_; }
 	};
 
 	typedef size_t alloc_mark_t;
 
+	/* An arena which reserves max_size bytes of address space up front,
+	   but only commits memory chunk_size bytes at a time, as the top
+	   of the arena first reaches each chunk.  The reserved range is
+	   contiguous, so marks remain plain offsets and copydown can
+	   compare pointers across chunk boundaries exactly as it would
+	   for a flat buffer. */
 	class allocator : public allocator_base
 	{
+		size_t chunk_size_;
+		bool owned_;
+
+		// The calls to the system which reserve, commit and release address
+		// space are in knossos.cpp, so that its headers (<windows.h> in
+		// particular) don't reach the code which includes this one
+		static unsigned char* reserve(size_t max_size);
+
+	protected:
+		void commit(size_t required) override;
+
 	public:
-		allocator(size_t max_size) :
-			allocator_base(new unsigned char[max_size], max_size)
+		// 64GB of address space by default: nothing is committed until it is used.
+		static constexpr size_t default_max_size = sizeof(void*) >= 8 ? (size_t(1) << 36) : (size_t(1) << 30);
+		static constexpr size_t default_chunk_size = size_t(1) << 24;
+
+		allocator(size_t max_size = default_max_size, size_t chunk_size = default_chunk_size) :
+			allocator_base(reserve(max_size), max_size, 0, 0),
+			chunk_size_(chunk_size),
+			owned_(true)
+		{}
+
+		allocator(allocator const&) = delete;
+		allocator& operator=(allocator const&) = delete;
+
+		/* Return to the system the committed memory beyond the first keep
+		   bytes (rounded up to a whole chunk), which must lie above the
+		   top.  The peak is measured again from the top, as by reset_peak. */
+		void decommit(size_t keep);
+
+		~allocator();
+
+	protected:
+		// An arena over size bytes at buf, allocated from another arena,
+		// and so already committed.  It neither reserves nor releases them.
+		struct borrowed_t {};
+
+		allocator(unsigned char * buf, size_t size, borrowed_t) :
+			allocator_base(buf, size, 0, size),
+			chunk_size_(size),
+			owned_(false)
 		{}
-		~allocator() {
-			delete[] static_cast<unsigned char*>(ptr_at(0));
-		}
 	};
 
 	class allocator_ref : public allocator_base
@@ -437,12 +548,279 @@ namespace ks {
 		}
 	};
 
+#elif defined(KS_DEVICE_ALLOCATOR)
+
+	/* The allocator of a device thread: a bump allocator over the thread's
+	   slice of a device_arena (see knossos-cuda.cuh).  Its buffer is fixed
+	   when the kernel is launched, so there is nothing to commit, and the
+	   peak is not tracked. */
+	class allocator_base {
+		unsigned char* buf_;
+		size_t max_size_;
+		size_t top_;
+
+	public:
+		KS_INTERFACE allocator_base(unsigned char * buf, size_t max_size) :
+			buf_(buf),
+			max_size_(max_size),
+			top_(0)
+		{}
+
+		KS_INTERFACE void* allocate(size_t size)
+		{
+			void* ret = buf_ + top_;
+			top_ += padded_size(size);
+			KS_ASSERT(top_ <= max_size_ && "Device allocator exhausted");
+			return ret;
+		}
+
+		static KS_INTERFACE size_t padded_size(size_t size) { return ((size + 15) / 16) * 16; }
+
+		KS_INTERFACE size_t mark() const { return top_; }
+
+		KS_INTERFACE void* top_ptr() const { return buf_ + top_; }
+
+		KS_INTERFACE void* ptr_at(size_t m) const { return buf_ + m; }
+
+		KS_INTERFACE void reset(size_t top = 0) { top_ = top; }
+
+		KS_INTERFACE size_t max_size() const { return max_size_; }
+	};
+
+	using allocator = allocator_base;
+
+	typedef size_t alloc_mark_t;
+
 #else
 	// No allocator support - just provide a forward declaration for use in function signatures
 	struct allocator_base;
 	using allocator = allocator_base;
 #endif
 
+	// ===============================  Thread pool  ==================================
+#ifdef KS_PARALLEL
+	/* A pool of worker threads used to run the outer dimension of build,
+	   sumbuild and map in parallel.
+
+	   A parallel loop over [0, n) starts with the range split evenly between
+	   the workers (the calling thread acting as worker 0).  Each worker takes
+	   small blocks from the front of its own range, and when that is empty
+	   steals the back half of the largest remaining range.
+
+	   Each worker has its own arena, used for everything allocated by the loop
+	   body.  The arenas are reset when the next loop starts, so the caller
+	   must copy anything it needs out of them in the "finish" step.
+	*/
+	extern thread_local bool t_in_parallel_region;
+
+	class thread_pool
+	{
+		struct range_t {
+			std::mutex mutex;
+			Integer begin = 0;
+			Integer end = 0;
+		};
+
+		typedef std::function<void(allocator *, int worker, Integer begin, Integer end)> body_t;
+
+		std::vector<std::thread> threads_;
+		std::vector<std::unique_ptr<allocator>> arenas_;
+		std::unique_ptr<range_t[]> ranges_;
+
+		std::mutex run_mutex_;   // held by the thread currently running a loop
+		std::mutex mutex_;       // protects the fields below
+		std::condition_variable wake_;
+		std::condition_variable done_;
+		body_t const* body_ = nullptr;
+		size_t generation_ = 0;
+		int busy_ = 0;
+		Integer grain_ = 1;
+		bool stopping_ = false;
+		std::exception_ptr error_;
+
+	public:
+		explicit thread_pool(int num_threads) :
+			ranges_(new range_t[num_threads > 0 ? num_threads : 1])
+		{
+			if (num_threads < 1)
+				num_threads = 1;
+			for (int w = 0; w != num_threads; ++w)
+				arenas_.emplace_back(new allocator());
+			for (int w = 1; w != num_threads; ++w)
+				threads_.emplace_back([this, w]() { worker_main(w); });
+		}
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stopping_ = true;
+			}
+			wake_.notify_all();
+			for (auto& t : threads_)
+				t.join();
+		}
+
+		thread_pool(thread_pool const&) = delete;
+		thread_pool& operator=(thread_pool const&) = delete;
+
+		int num_threads() const { return (int)arenas_.size(); }
+
+		// KS_NUM_THREADS if set, otherwise the number of hardware threads
+		static int default_num_threads()
+		{
+			if (char const* env = std::getenv("KS_NUM_THREADS"))
+				if (int n = std::atoi(env); n > 0)
+					return n;
+			unsigned n = std::thread::hardware_concurrency();
+			return n > 0 ? (int)n : 1;
+		}
+
+		/* Run body(worker_alloc, worker, begin, end) over disjoint blocks
+		   covering [0, n), then finish() on the calling thread while the
+		   worker arenas are still intact.
+
+		   Returns false, having called neither, if the loop should instead be
+		   run serially: because it is too short, because we are already
+		   inside a parallel loop, or because another thread is using the pool.
+		*/
+		template<class Body, class Finish>
+		bool try_parallel_for(Integer n, Body const& body, Finish const& finish)
+		{
+			if (n < 2 || num_threads() < 2 || t_in_parallel_region)
+				return false;
+			std::unique_lock<std::mutex> run_lock(run_mutex_, std::try_to_lock);
+			if (!run_lock.owns_lock())
+				return false;
+
+			body_t job = body;
+			start(n, &job);
+			t_in_parallel_region = true;
+			work(0);
+			t_in_parallel_region = false;
+			wait();
+
+			if (error_) {
+				std::exception_ptr error = error_;
+				error_ = nullptr;
+				std::rethrow_exception(error);
+			}
+			finish();
+			return true;
+		}
+
+	private:
+		void start(Integer n, body_t const* job)
+		{
+			int nw = num_threads();
+			for (int w = 0; w != nw; ++w) {
+				arenas_[w]->reset();
+				ranges_[w].begin = Integer((long long)n * w / nw);
+				ranges_[w].end = Integer((long long)n * (w + 1) / nw);
+			}
+			// Blocks small enough to balance load, but large enough to keep
+			// the cost of locking negligible.
+			grain_ = std::max<Integer>(1, n / (nw * 16));
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				body_ = job;
+				busy_ = nw - 1;
+				++generation_;
+			}
+			wake_.notify_all();
+		}
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			done_.wait(lock, [this]() { return busy_ == 0; });
+			body_ = nullptr;
+		}
+
+		// Take the next block for this worker, stealing if necessary
+		bool take(int worker, Integer* begin, Integer* end)
+		{
+			range_t& own = ranges_[worker];
+			for (;;) {
+				{
+					std::lock_guard<std::mutex> lock(own.mutex);
+					if (own.begin != own.end) {
+						*begin = own.begin;
+						*end = std::min(own.begin + grain_, own.end);
+						own.begin = *end;
+						return true;
+					}
+				}
+
+				int victim = -1;
+				Integer most = 0;
+				for (int w = 0, nw = num_threads(); w != nw; ++w) {
+					std::lock_guard<std::mutex> lock(ranges_[w].mutex);
+					Integer remaining = ranges_[w].end - ranges_[w].begin;
+					if (remaining > most) {
+						victim = w;
+						most = remaining;
+					}
+				}
+				if (victim < 0)
+					return false;
+
+				Integer stolen_begin, stolen_end;
+				{
+					std::lock_guard<std::mutex> lock(ranges_[victim].mutex);
+					range_t& r = ranges_[victim];
+					if (r.begin == r.end)
+						continue;  // Someone else got there first
+					stolen_end = r.end;
+					stolen_begin = r.end - (r.end - r.begin + 1) / 2;
+					r.end = stolen_begin;
+				}
+				std::lock_guard<std::mutex> lock(own.mutex);
+				own.begin = stolen_begin;
+				own.end = stolen_end;
+			}
+		}
+
+		void work(int worker)
+		{
+			Integer begin, end;
+			while (take(worker, &begin, &end)) {
+				try {
+					(*body_)(arenas_[worker].get(), worker, begin, end);
+				} catch (...) {
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (!error_)
+						error_ = std::current_exception();
+				}
+			}
+		}
+
+		void worker_main(int worker)
+		{
+			t_in_parallel_region = true;
+			size_t seen = 0;
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					wake_.wait(lock, [&]() { return stopping_ || generation_ != seen; });
+					if (stopping_)
+						return;
+					seen = generation_;
+				}
+				work(worker);
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (--busy_ == 0)
+						done_.notify_all();
+				}
+			}
+		}
+	};
+
+	// The pool shared by all compiled functions, created on first use
+	thread_pool& get_thread_pool();
+#endif
+
 	template<class Functor, class X, size_t ...Indices>
 	auto applyWithAllocatorImpl(allocator * alloc, Functor f, const X & x, std::index_sequence<Indices...>)
 	{
@@ -463,14 +841,14 @@ namespace ks {
 
 	// ===============================  Tensor class ==================================
 
-	/* Helper struct used to create the type Tuple<int, int, ...>
+	/* Helper struct used to create the type Tuple<Integer, Integer, ...>
 	   Note the following alternative is rejected by nvcc:
-	      template<size_t Dummy> using Int_t = int;
+	      template<size_t Dummy> using Int_t = Integer;
 	*/
 	template<size_t Dummy>
 	struct Int_t
 	{
-		using type = int;
+		using type = Integer;
 	};
 
 	template<typename T> struct tensor_dimension_base;
@@ -480,7 +858,7 @@ namespace ks {
 	{
 		using index_type = ks::Tuple<typename Int_t<Indices>::type...>;
 
-		static KS_INTERFACE int num_elements(index_type const& size) {
+		static KS_INTERFACE Integer num_elements(index_type const& size) {
 			return (1 * ... * ks::get<Indices>(size));
 		}
 
@@ -511,7 +889,7 @@ namespace ks {
 		static KS_INTERFACE index_type tail(const HigherIndexType & i) { return ks::tail(i); }
 
 		template<typename IndexType>
-		static KS_INTERFACE int flatten_index_recursive(IndexType const& index, IndexType const& tensor_size) {
+		static KS_INTERFACE Integer flatten_index_recursive(IndexType const& index, IndexType const& tensor_size) {
 			/* flatten_index({i1, i2, i3}, {s1, s2, s3})
 			           = i3 + s3 * i2 + s3 * s2 * i1
 			           = i3 + s3 * (i2 + s2 * i1)
@@ -522,21 +900,21 @@ namespace ks {
 					tensor_dimension<Dim - 1u>::flatten_index_recursive(index, tensor_size);
 		}
 
-		static KS_INTERFACE int flatten_index(index_type index, index_type tensor_size) {
+		static KS_INTERFACE Integer flatten_index(index_type index, index_type tensor_size) {
 			return flatten_index_recursive(index, tensor_size);
 		}
 	};
 
 	// Dimension 1 is a special case because we don't use 1-Tuples, so
-	// the index_type is a plain int.
+	// the index_type is a plain Integer.
 	template<>
 	struct tensor_dimension<1>
 	{
-		using index_type = int;
+		using index_type = Integer;
 
-		static KS_INTERFACE int tail(ks::Tuple<int, int> higherIndexType) { return ks::get<1>(higherIndexType); }
+		static KS_INTERFACE Integer tail(ks::Tuple<Integer, Integer> higherIndexType) { return ks::get<1>(higherIndexType); }
 
-		static KS_INTERFACE int num_elements(index_type size) { return size; }
+		static KS_INTERFACE Integer num_elements(index_type size) { return size; }
 
 #ifdef KS_BOUNDS_CHECK
 		static std::string index_to_string(index_type i) { return std::to_string(i); }
@@ -547,30 +925,37 @@ namespace ks {
 		}
 
 		template<typename IndexType>
-		static KS_INTERFACE int flatten_index_recursive(IndexType const& index, IndexType const& /*tensor_size*/) {
+		static KS_INTERFACE Integer flatten_index_recursive(IndexType const& index, IndexType const& /*tensor_size*/) {
 			return ks::get<0>(index);
 		}
 
-		static KS_INTERFACE int flatten_index(index_type index, index_type tensor_size) {
+		static KS_INTERFACE Integer flatten_index(index_type index, index_type tensor_size) {
 			return index;
 		}
 	};
 
 	template<typename T> struct dimension_of_tensor_index_type : std::tuple_size<T> {};
 	template<> struct dimension_of_tensor_index_type<int> : std::integral_constant<size_t, 1u> {};
+#ifdef KS_INDEX64
+	template<> struct dimension_of_tensor_index_type<Integer> : std::integral_constant<size_t, 1u> {};
+#endif
 
 	// Get the ith dimension of a tensor index object:
-	//   get_dimension<I>(Tuple<int, ..., int> t) = get<I>(t)
-	//   get_dimension<0>(int t) = t
+	//   get_dimension<I>(Tuple<Integer, ..., Integer> t) = get<I>(t)
+	//   get_dimension<0>(Integer t) = t
 	template<size_t I, typename TupleType>
-	KS_INTERFACE int get_dimension(TupleType const& t) { return ks::get<I>(t); }
+	KS_INTERFACE Integer get_dimension(TupleType const& t) { return ks::get<I>(t); }
 	template<size_t I>
-	KS_INTERFACE int get_dimension(int val) { static_assert(I == 0); return val; }
+	KS_INTERFACE Integer get_dimension(Integer val) { static_assert(I == 0); return val; }
+#ifdef KS_INDEX64
+	template<size_t I>
+	KS_INTERFACE Integer get_dimension(int val) { static_assert(I == 0); return val; }
+#endif
 
 	template<size_t I, typename TupleType>
-	KS_INTERFACE int& get_dimension(TupleType& t) { return ks::get<I>(t); }
+	KS_INTERFACE Integer& get_dimension(TupleType& t) { return ks::get<I>(t); }
 	template<size_t I>
-	KS_INTERFACE int& get_dimension(int& val) { static_assert(I == 0); return val; }
+	KS_INTERFACE Integer& get_dimension(Integer& val) { static_assert(I == 0); return val; }
 
 	template <size_t Dim, class T>
 	class tensor
@@ -593,13 +978,13 @@ namespace ks {
 		}
 
 		KS_INTERFACE index_type size() const { return size_; }
-		KS_INTERFACE int outer_dimension() const { return get_dimension<0>(size_); }
-		KS_INTERFACE int num_elements() const { return dimension::num_elements(size_); }
+		KS_INTERFACE Integer outer_dimension() const { return get_dimension<0>(size_); }
+		KS_INTERFACE Integer num_elements() const { return dimension::num_elements(size_); }
 
 		KS_INTERFACE T* data() { return data_; }
 		KS_INTERFACE const T* data() const { return data_; }
 
-		KS_INTERFACE std::conditional_t<Dim == 1u, T&, tensor<Dim-1, T>> operator[](int i) {
+		KS_INTERFACE std::conditional_t<Dim == 1u, T&, tensor<Dim-1, T>> operator[](Integer i) {
 			if constexpr (Dim == 1u) {
 				return data_[i];
 			} else {
@@ -607,7 +992,7 @@ namespace ks {
 			}
 		}
 
-		KS_INTERFACE std::conditional_t<Dim == 1u, const T&, tensor<Dim-1, T>> operator[](int i) const {
+		KS_INTERFACE std::conditional_t<Dim == 1u, const T&, tensor<Dim-1, T>> operator[](Integer i) const {
 			if constexpr (Dim == 1u) {
 				return data_[i];
 			} else {
@@ -615,20 +1000,24 @@ namespace ks {
 			}
 		}
 
-		KS_INTERFACE tensor<Dim-1, T> subtensor(int i) const {
+		KS_INTERFACE tensor<Dim-1, T> subtensor(Integer i) const {
 			static_assert(Dim >= 2u);
 			auto sz = tensor_dimension<Dim-1>::tail(size_);
 			return tensor<Dim-1, T>(sz, data_ + i * tensor_dimension<Dim-1>::num_elements(sz));
 		}
 
-		KS_INTERFACE T& index_aux(index_type i) {
+		KS_INTERFACE Integer flat_index(index_type i) const {
 #ifdef KS_BOUNDS_CHECK
 			if (!dimension::index_is_in_range(i, size_)) {
 				std::cerr << "ERROR: Accessing element " << dimension::index_to_string(i) << " of tensor of size " << dimension::index_to_string(size_) << std::endl;
 				abort();
 			}
 #endif
-			return data_[dimension::flatten_index(i, size_)];
+			return dimension::flatten_index(i, size_);
+		}
+
+		KS_INTERFACE T& index_aux(index_type i) {
+			return data_[flat_index(i)];
 		}
 
 		KS_INTERFACE T const& index(index_type i) const {
@@ -645,7 +1034,7 @@ namespace ks {
 			}
 		}
 
-#ifdef KS_ALLOCATOR
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
 		static KS_INTERFACE tensor<Dim, T> create(allocator_base * alloc, index_type size)
 		{
 			void *storage = alloc->allocate(bytes_required(size));
@@ -663,7 +1052,7 @@ namespace ks {
 			if (size() != other.size()) {
 				return false;
 			}
-			for (int i = 0, ne = num_elements(); i != ne; ++i) {
+			for (Integer i = 0, ne = num_elements(); i != ne; ++i) {
 				if (data_[i] != other.data_[i]) {
 					return false;
 				}
@@ -692,7 +1081,7 @@ namespace ks {
 	std::ostream &operator<<(std::ostream &s, ks::tensor<Dim, T> const &v)
 	{
 		s << "[";
-		for (int i = 0; i < v.outer_dimension(); ++i)
+		for (Integer i = 0; i < v.outer_dimension(); ++i)
 			s << (i > 0 ? ", " : "") << v[i];
 		return s << "]";
 	}
@@ -716,10 +1105,10 @@ namespace ks {
 
 	template<size_t Dim, class T>
 	KS_FUNCTION auto shape(allocator_base * alloc, tensor<Dim, T> const& t) {
-		const T* indata = t.data();
-		auto s = tensor<Dim, decltype(shape(alloc, *indata))>::create(alloc, t.size());
-		auto* outdata = s.data();
-		for (int ii = 0, ne = t.num_elements(); ii != ne; ++ii) {
+		auto indata = t.data();
+		auto s = tensor<Dim, decltype(shape(alloc, std::declval<T const&>()))>::create(alloc, t.size());
+		auto outdata = s.data();
+		for (Integer ii = 0, ne = t.num_elements(); ii != ne; ++ii) {
 			outdata[ii] = shape(alloc, indata[ii]);
 		}
 		return s;
@@ -746,6 +1135,14 @@ namespace ks {
 
 	// ===============================  Inflated deep copy  ==================================
 
+	// True if values of type T never refer to allocated memory, so that
+	// they survive a reset of the allocator which created them
+	template <class T>
+	struct is_flat : std::integral_constant<bool, std::is_arithmetic<T>::value> {};
+
+	template <class... Ts>
+	struct is_flat<Tuple<Ts...>> : std::integral_constant<bool, (is_flat<Ts>::value && ...)> {};
+
 	template <class T>
 	KS_FUNCTION T inflated_deep_copy(allocator_base *, T z)
 	{
@@ -763,9 +1160,9 @@ namespace ks {
 	{
 		auto ret = tensor<Dim, T>::create(alloc, t.size());
 
-		const T* indata = t.data();
-		T* outdata = ret.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i)
+		auto indata = std::as_const(t).data();
+		auto outdata = ret.data();
+		for (Integer i = 0, ne = t.num_elements(); i != ne; ++i)
 			outdata[i] = inflated_deep_copy(alloc, indata[i]);
 		return ret;
 	}
@@ -789,10 +1186,10 @@ namespace ks {
 
 	template<size_t Dim, class T>
 	KS_FUNCTION size_t inflated_bytes(tensor<Dim, T> const& t) {
-		int ne = t.num_elements();
+		Integer ne = t.num_elements();
 		size_t ret = allocator::padded_size(sizeof(T) * ne);
 		const T* tdata = t.data();
-		for (int i = 0; i != ne; ++i) {
+		for (Integer i = 0; i != ne; ++i) {
 			ret += inflated_bytes(tdata[i]);
 		}
 		return ret;
@@ -816,152 +1213,115 @@ namespace ks {
 
 	template<size_t Dim, class T>
 	KS_FUNCTION bool memory_overlaps(const void* start, const void* end, tensor<Dim, T> const& t) {
-		int num_elements = t.num_elements();
+		Integer num_elements = t.num_elements();
 		const T* tdata = t.data();
-		for (int i = 0; i != num_elements; ++i) {
+		for (Integer i = 0; i != num_elements; ++i) {
 			if (memory_overlaps(start, end, tdata[i])) {
 				return true;
 			}
 		}
 		return tdata < end && tdata + num_elements > start;
 	}
+#endif // KS_ALLOCATOR
 
-	struct prepare_copydown_state
-	{
-		unsigned char * subobjectDestination;   // destination of the next tensor subobject
-		                                        // (updated whenever we encounter a tensor during iteration over subobjects)
-		unsigned char * const startOfDestination;   // destination of first tensor in the iteration sequence
-		allocator * alloc;
-	};
+#if defined(KS_ALLOCATOR) || defined(KS_DEVICE_ALLOCATOR)
+	/* Copydown is chosen at compile time according to the type of the value.
 
-	template<class T>
-	KS_FUNCTION void prepare_copydown_inplace(prepare_copydown_state *, T *) {
-		/* There's nothing to do unless T has a tensor subobject. */
-	}
+	   A flat value (see is_flat) refers to no memory, so copying it down
+	   is just a reset of the allocator.
 
-	template<class TupleT, size_t... Indices>
-	KS_FUNCTION void prepare_copydown_inplace_Tupleimpl(prepare_copydown_state * dest, TupleT * t, std::index_sequence<Indices...>) {
-		((prepare_copydown_inplace(dest, &ks::get<Indices>(*t))), ...);
-	}
+	   A tensor of flat elements is a single allocation, which is moved
+	   to the mark with one memmove.
 
-	template<class... Types>
-	KS_FUNCTION void prepare_copydown_inplace(prepare_copydown_state * dest, Tuple<Types...> * t) {
-		prepare_copydown_inplace_Tupleimpl(dest, t, std::index_sequence_for<Types...>{});
-	}
+	   Anything else is relocated in a single pass: it is deep-copied into
+	   scratch space above the top of the arena, but with every pointer
+	   adjusted as if the copy started at the mark, and the scratch block is
+	   then moved down to the mark with one memmove.  Since every allocation
+	   is padded in the same way, the copy has the same layout wherever it
+	   starts.
 
-	template<size_t Dim, class T>
-	KS_FUNCTION void prepare_copydown_inplace(prepare_copydown_state * dest, tensor<Dim, T> * t) {
-		/* Note that this function modifies *v in-place. That's OK
-		   provided that *v lives either
-		   - on the stack; or
-		   - in the allocator's buffer *after* dest->startOfDestination,
-		   because in the latter case, all of this memory will be overwritten
-		   by the copydown anyway, or freed when the allocator is reset.
-		   We'll make sure that this function is never called with an argument
-		   that lives in the allocator's buffer before dest->startOfDestination.
-		   */
-		void * sourceData = t->data();
-		if (sourceData < dest->startOfDestination) {
-			/* This data lives before the copydown location in the buffer.
-			   We assume that this means it can't contain any pointers to
-			   data after the copydown location, so we don't need to move
-			   any of the data belonging to subobjects of *v.
-			   That's fortunate, because we wouldn't be allowed to modify
-			   objects before the copydown location even if we wanted to. */
-			KS_ASSERT(!memory_overlaps(dest->startOfDestination, dest->subobjectDestination, *t));
-			dest->subobjectDestination += inflated_bytes(*t);
-		} else {
-			int num_elements = t->num_elements();
-			if (sourceData < dest->subobjectDestination) {
-				/* This source overlaps the desination of another subobject that comes
-				   earlier in the iteration order. We need to move it out of the way. */
-				if (dest->alloc->top_ptr() < dest->subobjectDestination) {
-					/* Make sure we're not about to copy to a place which is still
-					   in the way! */
-					dest->alloc->allocate(dest->subobjectDestination - (unsigned char*)dest->alloc->top_ptr());
-				}
-				*t = tensor<Dim, T>::create(dest->alloc, t->size());
-				std::memcpy(t->data(), sourceData, num_elements * (int)sizeof(T));
-			}
-			dest->subobjectDestination += allocator::padded_size(sizeof(T) * num_elements);
-			T* tdata = t->data();
-			for (int i = 0; i != num_elements; ++i) {
-				prepare_copydown_inplace(dest, &(tdata[i]));
-			}
-		}
+	   In each case everything reachable from the value is copied, even
+	   tensor data which lives before the mark: the caller may update the
+	   result in place (as sumbuild does its first term), so it must not
+	   alias an argument.
+
+	   The same code serves the host arena and the device arena of
+	   KS_DEVICE_ALLOCATOR.  A device thread's scratch space is the rest
+	   of its slice, above the top.
+	*/
+
+	// memmove, which device code lacks.  Memory is only ever moved
+	// down, so a forward copy is safe even where the ranges overlap.
+	inline KS_FUNCTION void move_bytes_down(void * dest, void const * source, size_t n)
+	{
+#ifdef KS_CUDA
+		auto d = static_cast<unsigned char*>(dest);
+		auto s = static_cast<unsigned char const*>(source);
+		for (size_t i = 0; i != n; ++i)
+			d[i] = s[i];
+#else
+		std::memmove(dest, source, n);
+#endif
 	}
 
-	/* Copy some of the data referred to by val if necessary,
-	   returning a modified version of val which meets the
-	   precondition for copydown_by_memmove below.
+	template <class T>
+	struct is_flat_tensor : std::false_type {};
+
+	template <size_t Dim, class T>
+	struct is_flat_tensor<tensor<Dim, T>> : std::integral_constant<bool,
+		is_flat<T>::value && std::is_pointer<decltype(std::declval<tensor<Dim, T>&>().data())>::value> {};
 
-	   This function works by calculating where the eventual
-	   destination will be for the data of each tensor subobject.
-	   This involves replicating the sequence of allocations
-	   that will take place, but without actually calling
-	   an allocator.
+	struct relocation_state
+	{
+		unsigned char * mark;      // the destination of the copy
+		std::ptrdiff_t offset;     // from the scratch copy to its destination
+	};
 
-	   Assumes that "mark" is not in the middle of an allocation
-	   (see comment for copydown_by_memmove). */
 	template<class T>
-	KS_FUNCTION T prepare_copydown(allocator * alloc, alloc_mark_t mark, T val) {
-		unsigned char * start = static_cast<unsigned char*>(alloc->ptr_at(mark));
-		prepare_copydown_state dest{ start, start, alloc };
-		prepare_copydown_inplace(&dest, &val);
+	KS_FUNCTION T relocating_copy(allocator *, relocation_state const&, T const& val) {
+		/* There's nothing to do unless T has a tensor subobject. */
 		return val;
 	}
 
-	template<class T>
-	KS_FUNCTION void copydown_by_memmove_inplace(allocator *, T *) { }
-
-	template<class TupleType, size_t... Indices>
-	KS_FUNCTION void copydown_by_memmove_inplace_Tuple(allocator * alloc, TupleType * t, std::index_sequence<Indices...>) {
-		((copydown_by_memmove_inplace(alloc, &ks::get<Indices>(*t))), ...);
-	}
 	template<class... Types>
-	KS_FUNCTION void copydown_by_memmove_inplace(allocator * alloc, Tuple<Types...> * t) {
-		copydown_by_memmove_inplace_Tuple(alloc, t, std::index_sequence_for<Types...>{});
+	KS_FUNCTION Tuple<Types...> relocating_copy(allocator * alloc, relocation_state const& r, Tuple<Types...> const& t) {
+		return transform_Tuple(t, [alloc, &r](auto const& elem) { return relocating_copy(alloc, r, elem); });
 	}
 
 	template<size_t Dim, class T>
-	KS_FUNCTION void copydown_by_memmove_inplace(allocator * alloc, tensor<Dim, T> * t) {
-		int num_elements = t->num_elements();
-		T* oldData = t->data();
-		*t = tensor<Dim, T>::create(alloc, t->size());
-		std::memmove(t->data(), oldData, sizeof(T) * static_cast<size_t>(num_elements));
-		T* newData = t->data();
-		for (int i = 0; i != num_elements; ++i) {
-			copydown_by_memmove_inplace(alloc, &(newData[i]));
-		}
-	}
-
-	/* Perform a copydown by iterating over the subobjects of val;
-	   for each subobject which is a tensor, copy its data to the
-	   desired position using memmove.
-
-	   Precondition: for each tensor<T> subobject t, there must be no
-	   overlap between the intervals
-	     [t.data(), t.data() + t.num_elements()*sizeof(T)) and
-	     [alloc->ptr_at(mark), newvdata)
-	   where newvdata is the intended new value of t.data() after
-	   copydown.
-	   (If this condition was not satisfied, then v's data would
-	   be overwritten before we got the chance to move it, because
-	   the interval [alloc->ptr_at(mark), newvdata) contains
-	   the destinations of subobjects which come before v in the
-	   iteration order.)
-
-	   If we assume that "mark" is always at the boundary of an
-	   allocation, not in the middle of one, then the precondition
-	   reduces to ensuring that t.data() is not in the interval
-	   [alloc->ptr_at(mark), newvdata).
-	   */
+	KS_FUNCTION tensor<Dim, T> relocating_copy(allocator * alloc, relocation_state const& r, tensor<Dim, T> const& t) {
+		T const* source = t.data();
+		auto ret = tensor<Dim, T>::create(alloc, t.size());
+		T* dest = ret.data();
+		Integer num_elements = t.num_elements();
+		if constexpr (is_flat<T>::value) {
+			move_bytes_down(dest, source, sizeof(T) * static_cast<size_t>(num_elements));
+		} else {
+			for (Integer i = 0; i != num_elements; ++i)
+				dest[i] = relocating_copy(alloc, r, source[i]);
+		}
+		return tensor<Dim, T>(t.size(), reinterpret_cast<T*>(reinterpret_cast<unsigned char*>(dest) + r.offset));
+	}
+
 	template<class T>
-	KS_FUNCTION T copydown_by_memmove(allocator * alloc, alloc_mark_t mark, T val)
+	KS_FUNCTION T copydown_nonflat(allocator * alloc, alloc_mark_t mark, T const& val)
 	{
-		alloc->reset(mark);
-		copydown_by_memmove_inplace(alloc, &val);
-		return val;
+		unsigned char * start = static_cast<unsigned char*>(alloc->ptr_at(mark));
+		if constexpr (is_flat_tensor<T>::value) {
+			auto source = val.data();
+			alloc->reset(mark);
+			T ret = T::create(alloc, val.size());
+			move_bytes_down(ret.data(), source, sizeof(*source) * static_cast<size_t>(val.num_elements()));
+			return ret;
+		} else {
+			unsigned char * scratch = static_cast<unsigned char*>(alloc->top_ptr());
+			relocation_state r{ start, start - scratch };
+			T ret = relocating_copy(alloc, r, val);
+			size_t size = static_cast<unsigned char*>(alloc->top_ptr()) - scratch;
+			move_bytes_down(start, scratch, size);
+			alloc->reset(mark + size);
+			return ret;
+		}
 	}
 
 	/* Make a deep copy of the given object such that its allocations
@@ -975,24 +1335,28 @@ namespace ks {
 	template<class T>
 	KS_FUNCTION T copydown(allocator * alloc, alloc_mark_t mark, T const& val)
 	{
-#ifdef CHECK_COPYDOWN_CORRECTNESS   // performs a (slow!) check that the result of a copydown is equal to the original
-		alloc_mark_t originalTop = alloc->mark();
-		alloc->allocate(inflated_bytes(val));  // ensure that safe_copy does not overlap any temporary allocations that might be made during copydown
-		T safe_copy = inflated_deep_copy(alloc, val);
-		alloc->reset(originalTop);
+		if constexpr (is_flat<T>::value) {
+			alloc->reset(mark);
+			return val;
+		} else {
+#if defined(CHECK_COPYDOWN_CORRECTNESS) && defined(KS_ALLOCATOR)   // performs a (slow!) check that the result of a copydown is equal to the original
+			alloc_mark_t originalTop = alloc->mark();
+			alloc->allocate(inflated_bytes(val));  // ensure that safe_copy does not overlap any temporary allocations that might be made during copydown
+			T safe_copy = inflated_deep_copy(alloc, val);
+			alloc->reset(originalTop);
 #endif
-		T modified_val = prepare_copydown(alloc, mark, val);
-		T ret = copydown_by_memmove(alloc, mark, modified_val);
-#ifdef CHECK_COPYDOWN_CORRECTNESS
-		if (ret != safe_copy) {
-			std::cerr << "Detected an incorrect copydown" << std::endl;
-			abort();
-		}
+			T ret = copydown_nonflat(alloc, mark, val);
+#if defined(CHECK_COPYDOWN_CORRECTNESS) && defined(KS_ALLOCATOR)
+			if (ret != safe_copy) {
+				std::cerr << "Detected an incorrect copydown" << std::endl;
+				abort();
+			}
 #endif
-		return ret;
+			return ret;
+		}
 	}
 
-#endif // KS_ALLOCATOR
+#endif
 
 	// ===============================  Zero  ==================================
 	// Return a zero value with the same shape as the input value
@@ -1025,9 +1389,9 @@ namespace ks {
 	KS_FUNCTION tensor<Dim, T> zero(allocator * alloc, tensor<Dim, T> const& val)
 	{
 		auto ret = tensor<Dim, T>::create(alloc, val.size());
-		T* retdata = ret.data();
-		const T* indata = val.data();
-		for (int i = 0; i != ret.num_elements(); ++i) {
+		auto retdata = ret.data();
+		auto indata = val.data();
+		for (Integer i = 0; i != ret.num_elements(); ++i) {
 			retdata[i] = zero(alloc, indata[i]);
 		}
 		return ret;
@@ -1057,9 +1421,9 @@ namespace ks {
 	{
 		static KS_FUNCTION tensor<Dim, T> ofShape(allocator_base * alloc, shape_t<tensor<Dim, T>> const& shape) {
 			auto ret = tensor<Dim, T>::create(alloc, shape.size());
-			T* retdata = ret.data();
-			const shape_t<T>* shapedata = shape.data();
-			for(int j = 0, ne = ret.num_elements(); j != ne; ++j)
+			auto retdata = ret.data();
+			auto shapedata = shape.data();
+			for(Integer j = 0, ne = ret.num_elements(); j != ne; ++j)
 				retdata[j] = make_zero_t<T>::ofShape(alloc, shapedata[j]);
 			return ret;
 		}
@@ -1113,59 +1477,197 @@ namespace ks {
 			KS_ASSERT(t1->size() == t2.size());
 			T* t1data = t1->data();
 			const T* t2data = t2.data();
-			for (int i = 0, n = t1->num_elements(); i < n; ++i)
+			for (Integer i = 0, n = t1->num_elements(); i < n; ++i)
 				ks::inplace_add_t<T>::go(&t1data[i], t2data[i]);
 		}
 	};
 
-	// ============================  Tangent-space arithmetic ================================
-
-	template <class T1, class T2>
-	KS_FUNCTION T1 ts_add(allocator *, T1 t1, T2 t2) { return t1 + t2; }
-
-	template <class T1>
-	KS_FUNCTION T1 ts_add(allocator *, T1 t1, Tuple<> t2) { return t1; }
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	struct inplace_add_t<tensor<Dim, Float>> {
+		static void go(tensor<Dim, Float> *t1, const tensor<Dim, Float> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			simd::inplace_add(t1->data(), t2.data(), t1->num_elements());
+		}
+	};
+#endif
 
-	template<class T1, class T2, size_t ...Indices>
-	KS_FUNCTION auto ts_add_Tuple(allocator * alloc, T1 const& t1, T2 const& t2, std::index_sequence<Indices...>)
+	// Add val to element i of *t
+	template <size_t Dim, class T>
+	KS_FUNCTION void inplace_add_at(tensor<Dim, T> * t, typename tensor<Dim, T>::index_type i, T const& val)
 	{
-		return ks::make_Tuple(ts_add(alloc, ks::get<Indices>(t1), ks::get<Indices>(t2))...);
+		inplace_add(&t->index(i), val);
 	}
 
-	template <class T0, class... Ts, class U0, class... Us>
-	KS_FUNCTION auto ts_add(allocator * alloc, Tuple<T0, Ts...> t1, Tuple<U0, Us...> t2)
+	/* Fused version of inplace_add(t1, ts_scale(alloc, s, t2)) which does not
+	   materialize the scaled value. */
+	template <class T>
+	struct inplace_add_scaled_t {
+		static KS_FUNCTION void go(T *t1, Float s, const T &t2) { *t1 += s * t2; }
+	};
+
+	template <class T>
+	KS_FUNCTION void inplace_add_scaled(T* t1, Float s, T const& t2)
 	{
-		return ts_add_Tuple(alloc, t1, t2, std::index_sequence_for<T0, Ts...>{});
+		inplace_add_scaled_t<T>::go(t1, s, t2);
 	}
 
+	template <class... Ts>
+	struct inplace_add_scaled_t<Tuple<Ts...>> {
+		template <size_t... Indices>
+		static KS_FUNCTION void go_impl(Tuple<Ts...> *t1, Float s, const Tuple<Ts...> &t2, std::index_sequence<Indices...>)
+		{
+			((inplace_add_scaled(&ks::get<Indices>(*t1), s, ks::get<Indices>(t2))), ...);
+		}
+
+		static KS_FUNCTION void go(Tuple<Ts...> *t1, Float s, const Tuple<Ts...> &t2)
+		{
+			go_impl(t1, s, t2, std::index_sequence_for<Ts...>{});
+		}
+	};
+
 	template <size_t Dim, class T>
-	KS_FUNCTION tensor<Dim, T> ts_add(allocator * alloc, tensor<Dim, T> const& a, tensor<Dim, T> const& b)
-	{
-		KS_ASSERT(a.size() == b.size());
-		auto ret = tensor<Dim, T>::create(alloc, a.size());
-		const T* adata = a.data();
-		const T* bdata = b.data();
-		T* retdata = ret.data();
+	struct inplace_add_scaled_t<tensor<Dim, T>> {
+		static KS_FUNCTION void go(tensor<Dim, T> *t1, Float s, const tensor<Dim, T> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			T* t1data = t1->data();
+			const T* t2data = t2.data();
+			for (Integer i = 0, n = t1->num_elements(); i < n; ++i)
+				ks::inplace_add_scaled_t<T>::go(&t1data[i], s, t2data[i]);
+		}
+	};
 
-		for (int i = 0, ne = a.num_elements(); i != ne; ++i)
-			retdata[i] = ts_add(alloc, adata[i], bdata[i]);
-		return ret;
-	}
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	struct inplace_add_scaled_t<tensor<Dim, Float>> {
+		static void go(tensor<Dim, Float> *t1, Float s, const tensor<Dim, Float> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			simd::axpy(t1->data(), s, t2.data(), t1->num_elements());
+		}
+	};
+#endif
 
+	/* Kahan-compensated version of inplace_add: *compensation holds the
+	   low-order part lost from *t1 by previous additions, and has the same
+	   shape as *t1.  Elements which are not floating point are simply added. */
 	template <class T>
-	KS_FUNCTION T ts_scale(allocator *, Float s, T const& t)
-	{
-		return s * t;
-	}
+	struct inplace_add_compensated_t {
+		static KS_FUNCTION void go(T *t1, T *, const T &t2) { inplace_add(t1, t2); }
+	};
 
-	template <class... Us>
-	KS_FUNCTION auto ts_scale(allocator * alloc, Float s, Tuple<Us...> const& t)
+	template <class T>
+	KS_FUNCTION void inplace_add_compensated(T* t1, T* compensation, T const& t2)
 	{
-		return transform_Tuple(t, [alloc, s](auto const& elem) { return ts_scale(alloc, s, elem); });
+		inplace_add_compensated_t<T>::go(t1, compensation, t2);
 	}
 
-	// TODO: this should not be called.  Delete when confirmed.
-	// inline
+	template <class T>
+	struct inplace_add_compensated_floating_t {
+		static KS_FUNCTION void go(T *t1, T *compensation, const T &t2)
+		{
+			T y = t2 - *compensation;
+			T t = *t1 + y;
+			*compensation = (t - *t1) - y;
+			*t1 = t;
+		}
+	};
+
+	template <>
+	struct inplace_add_compensated_t<float> : inplace_add_compensated_floating_t<float> {};
+
+	template <>
+	struct inplace_add_compensated_t<double> : inplace_add_compensated_floating_t<double> {};
+
+	template <class... Ts>
+	struct inplace_add_compensated_t<Tuple<Ts...>> {
+		template <size_t... Indices>
+		static KS_FUNCTION void go_impl(Tuple<Ts...> *t1, Tuple<Ts...> *compensation, const Tuple<Ts...> &t2, std::index_sequence<Indices...>)
+		{
+			((inplace_add_compensated(&ks::get<Indices>(*t1), &ks::get<Indices>(*compensation), ks::get<Indices>(t2))), ...);
+		}
+
+		static KS_FUNCTION void go(Tuple<Ts...> *t1, Tuple<Ts...> *compensation, const Tuple<Ts...> &t2)
+		{
+			go_impl(t1, compensation, t2, std::index_sequence_for<Ts...>{});
+		}
+	};
+
+	template <size_t Dim, class T>
+	struct inplace_add_compensated_t<tensor<Dim, T>> {
+		static KS_FUNCTION void go(tensor<Dim, T> *t1, tensor<Dim, T> *compensation, const tensor<Dim, T> &t2)
+		{
+			KS_ASSERT(t1->size() == t2.size());
+			KS_ASSERT(compensation->size() == t2.size());
+			T* t1data = t1->data();
+			T* cdata = compensation->data();
+			const T* t2data = t2.data();
+			for (Integer i = 0, n = t1->num_elements(); i < n; ++i)
+				ks::inplace_add_compensated_t<T>::go(&t1data[i], &cdata[i], t2data[i]);
+		}
+	};
+
+	// ============================  Tangent-space arithmetic ================================
+
+	template <class T1, class T2>
+	KS_FUNCTION T1 ts_add(allocator *, T1 t1, T2 t2) { return t1 + t2; }
+
+	template <class T1>
+	KS_FUNCTION T1 ts_add(allocator *, T1 t1, Tuple<> t2) { return t1; }
+
+	template<class T1, class T2, size_t ...Indices>
+	KS_FUNCTION auto ts_add_Tuple(allocator * alloc, T1 const& t1, T2 const& t2, std::index_sequence<Indices...>)
+	{
+		return ks::make_Tuple(ts_add(alloc, ks::get<Indices>(t1), ks::get<Indices>(t2))...);
+	}
+
+	template <class T0, class... Ts, class U0, class... Us>
+	KS_FUNCTION auto ts_add(allocator * alloc, Tuple<T0, Ts...> t1, Tuple<U0, Us...> t2)
+	{
+		return ts_add_Tuple(alloc, t1, t2, std::index_sequence_for<T0, Ts...>{});
+	}
+
+	template <size_t Dim, class T>
+	KS_FUNCTION tensor<Dim, T> ts_add(allocator * alloc, tensor<Dim, T> const& a, tensor<Dim, T> const& b)
+	{
+		KS_ASSERT(a.size() == b.size());
+		auto ret = tensor<Dim, T>::create(alloc, a.size());
+		auto adata = a.data();
+		auto bdata = b.data();
+		auto retdata = ret.data();
+
+		for (Integer i = 0, ne = a.num_elements(); i != ne; ++i)
+			retdata[i] = ts_add(alloc, adata[i], bdata[i]);
+		return ret;
+	}
+
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	tensor<Dim, Float> ts_add(allocator * alloc, tensor<Dim, Float> const& a, tensor<Dim, Float> const& b)
+	{
+		KS_ASSERT(a.size() == b.size());
+		auto ret = tensor<Dim, Float>::create(alloc, a.size());
+		simd::add(ret.data(), a.data(), b.data(), a.num_elements());
+		return ret;
+	}
+#endif
+
+	template <class T>
+	KS_FUNCTION T ts_scale(allocator *, Float s, T const& t)
+	{
+		return s * t;
+	}
+
+	template <class... Us>
+	KS_FUNCTION auto ts_scale(allocator * alloc, Float s, Tuple<Us...> const& t)
+	{
+		return transform_Tuple(t, [alloc, s](auto const& elem) { return ts_scale(alloc, s, elem); });
+	}
+
+	// TODO: this should not be called.  Delete when confirmed.
+	// inline
 	// 	int ts_scale(allocator *, int const& t1, int const& t2)
 	// {
 	// 	return t1 * t2;
@@ -1175,13 +1677,23 @@ namespace ks {
 	KS_FUNCTION tensor<Dim, T> ts_scale(allocator * alloc, Float val, tensor<Dim, T> const& t)
 	{
 		auto ret = tensor<Dim, T>::create(alloc, t.size());
-		T* retdata = ret.data();
-		T const* tdata = t.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i)
+		auto retdata = ret.data();
+		auto tdata = t.data();
+		for (Integer i = 0, ne = t.num_elements(); i != ne; ++i)
 			retdata[i] = ts_scale(alloc, val, tdata[i]);
 		return ret;
 	}
 
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	tensor<Dim, Float> ts_scale(allocator * alloc, Float val, tensor<Dim, Float> const& t)
+	{
+		auto ret = tensor<Dim, Float>::create(alloc, t.size());
+		simd::scale(ret.data(), val, t.data(), t.num_elements());
+		return ret;
+	}
+#endif
+
 	// TODO: this should not be called.  Delete when confirmed.
 	//inline Integer ts_neg(allocator *, Integer d) { return -d; }
 
@@ -1194,22 +1706,65 @@ namespace ks {
 
 	template <size_t Dim, class T>
 	KS_FUNCTION tensor<Dim, T> ts_neg(allocator * alloc, tensor<Dim, T> t) {
-		tensor<Dim, T> ret(alloc, t.size());
-		const T* indata = t.data();
-		T* outdata = ret.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i) {
+		auto ret = tensor<Dim, T>::create(alloc, t.size());
+		auto indata = std::as_const(t).data();
+		auto outdata = ret.data();
+		for (Integer i = 0, ne = t.num_elements(); i != ne; ++i) {
 			outdata[i] = ts_neg(alloc, indata[i]);
 		}
+		return ret;
+	}
+
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	tensor<Dim, Float> ts_neg(allocator * alloc, tensor<Dim, Float> t) {
+		auto ret = tensor<Dim, Float>::create(alloc, t.size());
+		simd::neg(ret.data(), t.data(), t.num_elements());
+		return ret;
 	}
+#endif
 
 	// =============================== Build ==================================
+
+	/* Call body(alloc, begin, end) over blocks covering [0, n), where the
+	   body writes its results into the elements of *ret.
+
+	   Under KS_PARALLEL the blocks are shared between the threads of the
+	   pool, each passing its own arena to the body; any results referring to
+	   those arenas are then deep-copied into alloc.
+	*/
+	template <size_t Dim, class T, class Body>
+	KS_FUNCTION void for_each_block(allocator * alloc, Integer n, tensor<Dim, T> * ret, Body body)
+	{
+#ifdef KS_PARALLEL
+		bool ran = get_thread_pool().try_parallel_for(n,
+			[&](allocator * worker_alloc, int, Integer begin, Integer end) {
+				body(worker_alloc, begin, end);
+			},
+			[&]() {
+				if constexpr (!is_flat<T>::value) {
+					auto data = ret->data();
+					auto indata = std::as_const(*ret).data();
+					for (Integer i = 0, ne = ret->num_elements(); i != ne; ++i)
+						data[i] = inflated_deep_copy(alloc, indata[i]);
+				}
+			});
+		if (ran)
+			return;
+#endif
+		body(alloc, 0, n);
+	}
+
 	template <class T, class F>
 	KS_FUNCTION vec<T> build(allocator * alloc, Integer size, F f)
 	{
 		vec<T> ret = vec<T>::create(alloc, size);
+		auto retdata = ret.data();
 
-		for (int i = 0; i < size; ++i)
-			ret[i] = T{ f(alloc, i) };
+		for_each_block(alloc, size, &ret, [&](allocator * alloc, Integer begin, Integer end) {
+			for (Integer i = begin; i < end; ++i)
+				retdata[i] = T{ f(alloc, i) };
+		});
 		return ret;
 	}
 
@@ -1218,10 +1773,10 @@ namespace ks {
 	{
 		static_assert(Dim >= 2u);
 
-		template<class T, class F, class Size, class ...HigherDimensionIndices>
-		static KS_FUNCTION void do_build(allocator * alloc, Size const& size, T** data, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
-			for (int i = 0; i != thisDimension; ++i) {
+		template<class Pointer, class F, class Size, class ...HigherDimensionIndices>
+		static KS_FUNCTION void do_build(allocator * alloc, Size const& size, Pointer* data, F f, HigherDimensionIndices ...higherDimensionIndices) {
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
+			for (Integer i = 0; i != thisDimension; ++i) {
 				build_t<Dim - 1u>::do_build(alloc, size, data, f, higherDimensionIndices..., i);
 			}
 		}
@@ -1230,10 +1785,10 @@ namespace ks {
 	template<>
 	struct build_t<1>
 	{
-		template<class T, class F, class Size, class ...HigherDimensionIndices>
-		static KS_FUNCTION void do_build(allocator * alloc, Size const& size, T** data, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
-			for (int i = 0; i != thisDimension; ++i) {
+		template<class Pointer, class F, class Size, class ...HigherDimensionIndices>
+		static KS_FUNCTION void do_build(allocator * alloc, Size const& size, Pointer* data, F f, HigherDimensionIndices ...higherDimensionIndices) {
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
+			for (Integer i = 0; i != thisDimension; ++i) {
 				*(*data)++ = f(alloc, higherDimensionIndices..., i);
 			}
 		}
@@ -1244,16 +1799,299 @@ namespace ks {
 	{
 		constexpr auto Dim = sizeof...(SizeTypes);
 		tensor<Dim, T> ret = tensor<Dim, T>::create(alloc, size);
-		T* retData = ret.data();
-		build_t<Dim>::do_build(alloc, size, &retData, f);
+		auto retData = ret.data();
+		Integer outer = ks::get<0>(size);
+		Integer ne = ret.num_elements();
+		Integer innerElements = outer == 0 ? 0 : ne / outer;
+
+		// Split the outermost dimension into blocks
+		for_each_block(alloc, outer, &ret, [&](allocator * alloc, Integer begin, Integer end) {
+			auto data = retData + begin * innerElements;
+			for (Integer i = begin; i != end; ++i) {
+				if constexpr (Dim == 1)
+					*data++ = f(alloc, i);
+				else
+					build_t<Dim - 1u>::do_build(alloc, size, &data, f, i);
+			}
+		});
 		return ret;
 	}
 
+	// =============================== Accumulation ==================================
+
+	/* The loops which add up the terms of a sumbuild call
+	     accumulate(alloc, &ret, f, i...)
+	   to add the term f(alloc, i...) to ret.  By default this materializes
+	   the term and adds it with inplace_add, but a body may overload
+	   accumulate to add itself into ret directly.
+
+	   build_body is such a body, for a sumbuild of builds
+	     sumbuild(n, i -> build(m, j -> g(i, j)))
+	   where g(alloc, i) returns the function j -> g(i, j).  Each g(i, j)
+	   is added straight into element j of ret, so no temporary tensor is
+	   created for each i.  Calling a build_body (as is done for the first
+	   term) builds the tensor in the usual way. */
+	template <class T, class F, class ...Indices>
+	KS_FUNCTION void accumulate(allocator * alloc, T * result, F const& f, Indices ...i)
+	{
+		inplace_add(result, f(alloc, i...));
+	}
+
+	template <class T, class InnerSize, class G>
+	struct build_body
+	{
+		InnerSize size;
+		G g;
+
+		template <class ...Indices>
+		KS_FUNCTION tensor<dimension_of_tensor_index_type<InnerSize>::value, T> operator()(allocator * alloc, Indices ...i) const {
+			return build<T>(alloc, size, g(alloc, i...));
+		}
+	};
+
+	KS_FUNCTION inline Integer make_index(Integer i) { return i; }
+
+	template <class ...Indices>
+	KS_FUNCTION Tuple<Indices...> make_index(Indices ...i) { return ks::make_Tuple(i...); }
+
+	// (*result)[j] += h(alloc, j) for each index j of a tensor of the given size.
+	// A flat element can't refer to the allocator, so h resets it itself
+	// (see Note [Allocator usage of function calls] in Cgen.hs).
+	template <size_t Dim, class T, class H, class Size, class ...HigherDimensionIndices>
+	KS_FUNCTION void accumulate_elements(allocator * alloc, tensor<Dim, T> * result, Size const& size, H const& h, HigherDimensionIndices ...higherDimensionIndices)
+	{
+		Integer thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(size);
+		KS_MARK(alloc, mark);
+		for (Integer i = 0; i != thisDimension; ++i) {
+			if constexpr (sizeof...(HigherDimensionIndices) + 1 == Dim) {
+				inplace_add_at(result, make_index(higherDimensionIndices..., i), h(alloc, higherDimensionIndices..., i));
+				if constexpr (!is_flat<T>::value) {
+					KS_RESET(alloc, mark);
+				}
+			} else {
+				accumulate_elements(alloc, result, size, h, higherDimensionIndices..., i);
+			}
+		}
+	}
+
+	template <size_t Dim, class T, class InnerSize, class G, class ...Indices>
+	KS_FUNCTION void accumulate(allocator * alloc, tensor<Dim, T> * result, build_body<T, InnerSize, G> const& f, Indices ...i)
+	{
+		KS_ASSERT(result->size() == f.size);
+		accumulate_elements(alloc, result, f.size, f.g(alloc, i...));
+	}
+
+	// =============================== Summation order ==================================
+
+	/* The order in which sumbuild and sum add up their terms is chosen at
+	   compile time:
+	   - by default, strictly left to right (and, under KS_PARALLEL, in
+	     whatever order the work-stealing scheduler happens to produce);
+	   - KS_SUM_PAIRWISE: left to right within blocks of KS_SUM_PAIRWISE_BLOCK
+	     terms, then the block sums are added in a balanced binary tree;
+	   - KS_SUM_KAHAN: left to right, with Kahan compensation applied to each
+	     floating-point element;
+	   - KS_SUM_BLOCKED: as for KS_SUM_PAIRWISE, but with blocks of
+	     KS_SUM_BLOCK_SIZE terms which, under KS_PARALLEL, are shared between
+	     the threads of the pool.  The block boundaries and the tree do not
+	     depend on the number of threads, so the result is bit-identical
+	     however many threads run (including none).
+
+	   A multi-dimensional sumbuild is treated as a single loop over its
+	   iteration space in row-major order.
+	*/
+	enum class sum_order { sequential, pairwise, kahan, blocked };
+
+#if (defined(KS_SUM_PAIRWISE) + defined(KS_SUM_KAHAN) + defined(KS_SUM_BLOCKED)) > 1
+#error "At most one of KS_SUM_PAIRWISE, KS_SUM_KAHAN and KS_SUM_BLOCKED may be defined"
+#endif
+
+#if defined(KS_SUM_PAIRWISE)
+	constexpr sum_order default_sum_order = sum_order::pairwise;
+#elif defined(KS_SUM_KAHAN)
+	constexpr sum_order default_sum_order = sum_order::kahan;
+#elif defined(KS_SUM_BLOCKED)
+	constexpr sum_order default_sum_order = sum_order::blocked;
+#else
+	constexpr sum_order default_sum_order = sum_order::sequential;
+#endif
+
+	// The type in which sum adds up elements of type T.  This is T itself,
+	// except for the 16-bit floats of knossos-half.h, which are summed in Float.
+	template <class T>
+	struct accumulator { typedef T type; };
+
+	template <class T>
+	using accumulator_t = typename accumulator<T>::type;
+
+#ifndef KS_SUM_PAIRWISE_BLOCK
+#define KS_SUM_PAIRWISE_BLOCK 16
+#endif
+
+#ifndef KS_SUM_BLOCK_SIZE
+#define KS_SUM_BLOCK_SIZE 1024
+#endif
+
+#ifdef KS_ALLOCATOR
+	// elem(alloc, k) for k in [begin, end), added left to right.
+	// The result is copied down to the allocator position on entry.
+	template <class T, class Elem>
+	KS_FUNCTION T sum_sequential(allocator * alloc, Integer begin, Integer end, Elem const& elem)
+	{
+		KS_MARK(alloc, mark0);
+		T ret = KS_COPYDOWN(alloc, mark0, elem(alloc, begin));
+		KS_MARK(alloc, mark1);
+		for (Integer k = begin + 1; k != end; ++k) {
+			accumulate(alloc, &ret, elem, k);
+			KS_RESET(alloc, mark1);
+		}
+		return ret;
+	}
+
+	template <class T, class Elem>
+	KS_FUNCTION T sum_kahan(allocator * alloc, Integer begin, Integer end, Elem const& elem)
+	{
+		KS_MARK(alloc, mark0);
+		T ret = KS_COPYDOWN(alloc, mark0, elem(alloc, begin));
+		T compensation = zero(alloc, ret);
+		KS_MARK(alloc, mark1);
+		for (Integer k = begin + 1; k != end; ++k) {
+			inplace_add_compensated(&ret, &compensation, elem(alloc, k));
+			KS_RESET(alloc, mark1);
+		}
+		return ret;
+	}
+
+	/* Sum each block of [0, n) left to right, then add the block sums in a
+	   balanced binary tree: adjacent pairs of blocks, then adjacent pairs of
+	   pairs, and so on.  The partial sums are kept on a stack, merged as in
+	   a binary counter, so at most one per bit of Integer is live at once. */
+	template <class T, class Elem>
+	KS_FUNCTION T sum_blocked(allocator * alloc, Integer n, Integer block, Elem const& elem)
+	{
+		struct partial_t { T value; int level; alloc_mark_t end; };
+		partial_t stack[8 * sizeof(Integer)];
+		int depth = 0;
+		auto merge_top = [&]() {
+			partial_t& lhs = stack[depth - 2];
+			inplace_add(&lhs.value, stack[depth - 1].value);
+			++lhs.level;
+			KS_RESET(alloc, lhs.end);
+			--depth;
+		};
+		for (Integer begin = 0; begin < n; begin += block) {
+			T blockSum = sum_sequential<T>(alloc, begin, std::min(n - begin, block) + begin, elem);
+			stack[depth++] = partial_t{ blockSum, 0, alloc->mark() };
+			while (depth >= 2 && stack[depth - 1].level == stack[depth - 2].level)
+				merge_top();
+		}
+		while (depth >= 2)
+			merge_top();
+		return stack[0].value;
+	}
+
+#ifdef KS_PARALLEL
+	/* As sum_blocked, but with the blocks shared between the threads of the
+	   pool.  The block sums are added in the same tree as sum_blocked, so
+	   the results are identical.
+
+	   Returns false if the pool chose not to run the loop in parallel. */
+	template <class T, class Elem>
+	bool parallel_sum_blocked(allocator * alloc, T* result, Integer n, Integer block, Elem const& elem)
+	{
+		Integer numBlocks = (n - 1) / block + 1;
+		std::vector<T> sums(numBlocks);
+
+		auto body = [&](allocator * worker_alloc, int, Integer begin, Integer end) {
+			for (Integer b = begin; b != end; ++b)
+				sums[b] = sum_sequential<T>(worker_alloc, b * block, std::min(n - b * block, block) + b * block, elem);
+		};
+
+		auto finish = [&]() {
+			for (Integer stride = 1; stride < numBlocks; stride *= 2)
+				for (Integer j = 0; j + stride < numBlocks; j += 2 * stride)
+					inplace_add(&sums[j], sums[j + stride]);
+			*result = inflated_deep_copy(alloc, sums[0]);
+		};
+
+		return get_thread_pool().try_parallel_for(numBlocks, body, finish);
+	}
+#endif
+
+	// Sum elem(alloc, k) for k in [0, n), in the order given by default_sum_order
+	template <class T, class Elem>
+	KS_FUNCTION T sum_in_order(allocator * alloc, Integer n, Elem const& elem)
+	{
+		KS_ASSERT(n > 0);
+		if constexpr (default_sum_order == sum_order::kahan) {
+			return sum_kahan<T>(alloc, 0, n, elem);
+		} else if constexpr (default_sum_order == sum_order::pairwise) {
+			return sum_blocked<T>(alloc, n, KS_SUM_PAIRWISE_BLOCK, elem);
+		} else if constexpr (default_sum_order == sum_order::blocked) {
+#ifdef KS_PARALLEL
+			T ret;
+			if (parallel_sum_blocked<T>(alloc, &ret, n, KS_SUM_BLOCK_SIZE, elem))
+				return ret;
+#endif
+			return sum_blocked<T>(alloc, n, KS_SUM_BLOCK_SIZE, elem);
+		} else {
+			return sum_sequential<T>(alloc, 0, n, elem);
+		}
+	}
+#endif
+
+	template <class Size, size_t... Indices>
+	KS_FUNCTION Integer flat_size(Size const& size, std::index_sequence<Indices...>)
+	{
+		return (1 * ... * get_dimension<Indices>(size));
+	}
+
+	// Call f(alloc, i0, i1, ...) where (i0, i1, ...) is the k'th index in
+	// row-major order of a loop with the given size
+	template <class F, class Size, size_t... Indices>
+	KS_FUNCTION auto call_at_flat_index(allocator * alloc, F const& f, Size const& size, Integer k, std::index_sequence<Indices...>)
+	{
+		constexpr size_t Dim = sizeof...(Indices);
+		Integer dims[Dim] = { get_dimension<Indices>(size)... };
+		Integer index[Dim];
+		for (size_t d = Dim; d-- > 0; ) {
+			index[d] = k % dims[d];
+			k /= dims[d];
+		}
+		return f(alloc, index[Indices]...);
+	}
+
+#ifdef KS_ALLOCATOR
+	// The k'th term, in row-major order, of a sumbuild with the given size
+	// and body.  It is accumulated by accumulating the body, so that any
+	// overload of accumulate for the body still applies.
+	template <class F, class Size>
+	struct flat_index_body
+	{
+		static constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
+
+		F const& f;
+		Size const& size;
+
+		KS_FUNCTION auto operator()(allocator * alloc, Integer k) const {
+			return call_at_flat_index(alloc, f, size, k, std::make_index_sequence<Dim>{});
+		}
+	};
+
+	template <class T, class F, class Size>
+	KS_FUNCTION void accumulate(allocator * alloc, T * result, flat_index_body<F, Size> const& elem, Integer k)
+	{
+		call_at_flat_index(alloc, [&](allocator * alloc, auto ...i) { accumulate(alloc, result, elem.f, i...); },
+			elem.size, k, std::make_index_sequence<flat_index_body<F, Size>::Dim>{});
+	}
+#endif
+
 	// =============================== Sumbuild ==================================
 
 	/* A sumbuild is implemented by deep-copying the result of the
 	   first iteration (using a copydown), then accumulating
-	   subsequent iterations into this result using inplace_add.
+	   subsequent iterations into this result using inplace_add
+	   (or, for bodies such as build_body, using accumulate).
 
 		   e.g. for a 2-dimensional sumbuild, size {4, 3}, there is
 	   the following sequence of calls to f (ignoring the allocator
@@ -1283,18 +2121,18 @@ namespace ks {
 
 		template<class T, class F, class Size, class ...HigherDimensionIndices>
 		static KS_FUNCTION T do_sumbuild(allocator * alloc, Size const& size, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
 			KS_ASSERT(thisDimension > 0);
 			T ret = sumbuild_t<Dim - 1>::template do_sumbuild<T>(alloc, size, f, higherDimensionIndices..., 0);
-			for (int i = 1; i != thisDimension; ++i)
+			for (Integer i = 1; i != thisDimension; ++i)
 				sumbuild_t<Dim - 1>::inplace_sumbuild(alloc, &ret, size, f, higherDimensionIndices..., i);
 			return ret;
 		}
 
 		template<class T, class F, class Size, class ...HigherDimensionIndices>
 		static KS_FUNCTION void inplace_sumbuild(allocator * alloc, T* result, Size const& size, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
-			for (int i = 0; i != thisDimension; ++i)
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(size);
+			for (Integer i = 0; i != thisDimension; ++i)
 				sumbuild_t<Dim - 1>::inplace_sumbuild(alloc, result, size, f, higherDimensionIndices..., i);
 		}
 	};
@@ -1304,13 +2142,13 @@ namespace ks {
 	{
 		template<class T, class F, class Size, class ...HigherDimensionIndices>
 		static KS_FUNCTION T do_sumbuild(allocator * alloc, Size const& size, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(size);
+			Integer thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(size);
 			KS_ASSERT(thisDimension > 0);
 			KS_MARK(alloc, mark0);
 			T ret = KS_COPYDOWN(alloc, mark0, f(alloc, higherDimensionIndices..., 0));
 			KS_MARK(alloc, mark1);
-			for (int i = 1; i != thisDimension; ++i) {
-				inplace_add(&ret, f(alloc, higherDimensionIndices..., i));
+			for (Integer i = 1; i != thisDimension; ++i) {
+				accumulate(alloc, &ret, f, higherDimensionIndices..., i);
 				KS_RESET(alloc, mark1);
 			}
 			return ret;
@@ -1318,20 +2156,96 @@ namespace ks {
 
 		template<class T, class F, class Size, class ...HigherDimensionIndices>
 		static KS_FUNCTION void inplace_sumbuild(allocator * alloc, T* result, Size const& size, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(size);
+			Integer thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(size);
 			KS_MARK(alloc, mark);
-			for (int i = 0; i != thisDimension; ++i) {
-				inplace_add(result, f(alloc, higherDimensionIndices..., i));
+			for (Integer i = 0; i != thisDimension; ++i) {
+				accumulate(alloc, result, f, higherDimensionIndices..., i);
 				KS_RESET(alloc, mark);
 			}
 		}
 	};
 
+#ifdef KS_PARALLEL
+	/* Parallel version of sumbuild, which splits the outermost dimension.
+	   Each worker accumulates a partial sum in its own arena (in the same way
+	   as the serial version); the partial sums are then added pairwise, and
+	   the total copied into alloc.
+
+	   Returns false if the pool chose not to run the loop in parallel.
+	*/
+	template <class T, size_t Dim, class F, class Size>
+	bool parallel_sumbuild(allocator * alloc, T* result, Size const& size, F f)
+	{
+		thread_pool& pool = get_thread_pool();
+		Integer outer = get_dimension<0>(size);
+		KS_ASSERT(outer > 0);
+		std::vector<T> partial(pool.num_threads());
+		std::vector<char> has_partial(pool.num_threads(), 0);
+
+		auto body = [&](allocator * worker_alloc, int worker, Integer begin, Integer end) {
+			for (Integer i = begin; i != end; ++i) {
+				if constexpr (Dim == 1) {
+					KS_MARK(worker_alloc, mark);
+					if (!has_partial[worker]) {
+						partial[worker] = KS_COPYDOWN(worker_alloc, mark, f(worker_alloc, i));
+						has_partial[worker] = 1;
+					} else {
+						accumulate(worker_alloc, &partial[worker], f, i);
+						KS_RESET(worker_alloc, mark);
+					}
+				} else {
+					if (!has_partial[worker]) {
+						partial[worker] = sumbuild_t<Dim - 1>::template do_sumbuild<T>(worker_alloc, size, f, i);
+						has_partial[worker] = 1;
+					} else {
+						sumbuild_t<Dim - 1>::inplace_sumbuild(worker_alloc, &partial[worker], size, f, i);
+					}
+				}
+			}
+		};
+
+		auto finish = [&]() {
+			std::vector<T*> sums;
+			for (size_t w = 0; w != partial.size(); ++w)
+				if (has_partial[w])
+					sums.push_back(&partial[w]);
+			for (size_t stride = 1; stride < sums.size(); stride *= 2)
+				for (size_t j = 0; j + stride < sums.size(); j += 2 * stride)
+					inplace_add(sums[j], *sums[j + stride]);
+			*result = inflated_deep_copy(alloc, *sums[0]);
+		};
+
+		return pool.try_parallel_for(outer, body, finish);
+	}
+#endif
+
 	template <class T, class F, class Size>
 	KS_FUNCTION T sumbuild(allocator * alloc, Size size, F f)
 	{
 		constexpr size_t Dim = dimension_of_tensor_index_type<Size>::value;
-		return sumbuild_t<Dim>::template do_sumbuild<T>(alloc, size, f);
+#ifdef KS_ALLOCATOR
+		if constexpr (default_sum_order != sum_order::sequential) {
+			constexpr auto indices = std::make_index_sequence<Dim>{};
+			return sum_in_order<T>(alloc, flat_size(size, indices), flat_index_body<F, Size>{ f, size });
+		} else
+#endif
+		{
+#ifdef KS_PARALLEL
+			T ret;
+			if (parallel_sumbuild<T, Dim>(alloc, &ret, size, f))
+				return ret;
+#endif
+			return sumbuild_t<Dim>::template do_sumbuild<T>(alloc, size, f);
+		}
+	}
+
+	// sumbuild(size, i -> build(innerSize, j -> f(i)(j))), without building
+	// a temporary tensor for each i; see build_body
+	template <class T, class F, class Size, class InnerSize>
+	KS_FUNCTION tensor<dimension_of_tensor_index_type<InnerSize>::value, T> sumbuild_build(allocator * alloc, Size size, InnerSize innerSize, F f)
+	{
+		using Result = tensor<dimension_of_tensor_index_type<InnerSize>::value, T>;
+		return sumbuild<Result>(alloc, size, build_body<T, InnerSize, F>{ innerSize, f });
 	}
 
 	// Elementwise map
@@ -1339,15 +2253,125 @@ namespace ks {
 	KS_FUNCTION tensor<Dim, T> elementwise_map(allocator * alloc, tensor<Dim, T> const& t, F f)
 	{
 		auto ret = tensor<Dim, T>::create(alloc, t.size());
-		T const* tdata = t.data();
-		T* retdata = ret.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i)
-			retdata[i] = f(tdata[i]);
+		auto tdata = t.data();
+		auto retdata = ret.data();
+		Integer ne = t.num_elements();
+		for_each_block(alloc, ne, &ret, [&](allocator *, Integer begin, Integer end) {
+			for (Integer i = begin; i != end; ++i)
+				retdata[i] = f(tdata[i]);
+		});
 		return ret;
 	}
 	
 	// =============================== BuildFromSparse ==================================
 
+#ifdef KS_PARALLEL
+	/* The terms of a parallel buildFromSparse into a tensor of flat elements,
+	   sorted by the range of the tensor they belong to.  There is one bucket
+	   for each (worker, range) pair, so that the terms can be collected
+	   without locking, and each range then added up by a single thread. */
+	template <size_t Dim, class T>
+	struct sparse_buckets
+	{
+		typedef Tuple<typename tensor<Dim, T>::index_type, T> term_type;
+
+		tensor<Dim, T> * acc;
+		int num_workers;
+		int num_ranges;
+		Integer range_size;
+		std::vector<std::vector<term_type>> buckets;   // [worker * num_ranges + range]
+
+		sparse_buckets(tensor<Dim, T> * acc, int num_workers, int num_ranges) :
+			acc(acc),
+			num_workers(num_workers),
+			num_ranges(num_ranges),
+			range_size(std::max<Integer>(1, (acc->num_elements() + num_ranges - 1) / num_ranges)),
+			buckets(num_workers * num_ranges)
+		{}
+
+		void add(int worker, term_type const& term) {
+			Integer range = acc->flat_index(ks::get<0>(term)) / range_size;
+			buckets[worker * num_ranges + range].push_back(term);
+		}
+
+		void add_range_to_result(Integer range) {
+			for (int w = 0; w != num_workers; ++w)
+				for (term_type const& term : buckets[w * num_ranges + range])
+					inplace_add_at(acc, ks::get<0>(term), ks::get<1>(term));
+		}
+	};
+
+	// The accumulator through which one worker adds its terms to the buckets
+	template <size_t Dim, class T>
+	struct sparse_bucket_writer
+	{
+		sparse_buckets<Dim, T> * buckets;
+		int worker;
+	};
+
+	// A tuple of results has a tuple of buckets, and of writers
+	template <size_t Dim, class T>
+	sparse_buckets<Dim, T> make_sparse_buckets(tensor<Dim, T> * acc, int num_workers, int num_ranges) {
+		return sparse_buckets<Dim, T>(acc, num_workers, num_ranges);
+	}
+
+	template <class... Ts, size_t... Indices>
+	auto make_sparse_buckets_Tupleimpl(Tuple<Ts...> * acc, int num_workers, int num_ranges, std::index_sequence<Indices...>) {
+		return make_Tuple(make_sparse_buckets(&ks::get<Indices>(*acc), num_workers, num_ranges)...);
+	}
+	template <class... Ts>
+	auto make_sparse_buckets(Tuple<Ts...> * acc, int num_workers, int num_ranges) {
+		return make_sparse_buckets_Tupleimpl(acc, num_workers, num_ranges, std::index_sequence_for<Ts...>{});
+	}
+
+	template <size_t Dim, class T>
+	sparse_bucket_writer<Dim, T> sparse_writer(sparse_buckets<Dim, T> * buckets, int worker) {
+		return sparse_bucket_writer<Dim, T>{ buckets, worker };
+	}
+
+	template <class... Ts, size_t... Indices>
+	auto sparse_writer_Tupleimpl(Tuple<Ts...> * buckets, int worker, std::index_sequence<Indices...>) {
+		return make_Tuple(sparse_writer(&ks::get<Indices>(*buckets), worker)...);
+	}
+	template <class... Ts>
+	auto sparse_writer(Tuple<Ts...> * buckets, int worker) {
+		return sparse_writer_Tupleimpl(buckets, worker, std::index_sequence_for<Ts...>{});
+	}
+
+	template <size_t Dim, class T>
+	void add_range_to_result(sparse_buckets<Dim, T> * buckets, Integer range) {
+		buckets->add_range_to_result(range);
+	}
+
+	template <class... Ts, size_t... Indices>
+	void add_range_to_result_Tupleimpl(Tuple<Ts...> * buckets, Integer range, std::index_sequence<Indices...>) {
+		(add_range_to_result(&ks::get<Indices>(*buckets), range), ...);
+	}
+	template <class... Ts>
+	void add_range_to_result(Tuple<Ts...> * buckets, Integer range) {
+		add_range_to_result_Tupleimpl(buckets, range, std::index_sequence_for<Ts...>{});
+	}
+
+	// Results which can be accumulated through sparse_buckets
+	template <class T>
+	struct is_sparse_bucketable : is_flat_tensor<T> {};
+
+	template <class... Ts>
+	struct is_sparse_bucketable<Tuple<Ts...>> : std::integral_constant<bool, (is_flat_tensor<Ts>::value && ...)> {};
+
+	template <size_t Dim, class T>
+	Integer sparse_num_elements(tensor<Dim, T> const& t) { return t.num_elements(); }
+
+	template <class... Ts, size_t... Indices>
+	Integer sparse_num_elements_Tupleimpl(Tuple<Ts...> const& t, std::index_sequence<Indices...>) {
+		return (0 + ... + sparse_num_elements(ks::get<Indices>(t)));
+	}
+	template <class... Ts>
+	Integer sparse_num_elements(Tuple<Ts...> const& t) {
+		return sparse_num_elements_Tupleimpl(t, std::index_sequence_for<Ts...>{});
+	}
+#endif
+
 	template<size_t Dim>
 	struct buildFromSparse_t
 	{
@@ -1355,15 +2379,15 @@ namespace ks {
 
 		template<class T, class F, class LoopSize, class ...HigherDimensionIndices>
 		static KS_FUNCTION void do_buildFromSparse(allocator * alloc, T* acc, LoopSize const& loopSize, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(loopSize);
-			for (int i = 0; i != thisDimension; ++i)
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(loopSize);
+			for (Integer i = 0; i != thisDimension; ++i)
 				buildFromSparse_t<Dim - 1>::do_buildFromSparse(alloc, acc, loopSize, f, higherDimensionIndices..., i);
 		}
 
 		template<class T, class F, class LoopSize, class ...HigherDimensionIndices>
 		static KS_FUNCTION void do_buildFromSparseTupled(allocator * alloc, T* acc, LoopSize const& loopSize, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(loopSize);
-			for (int i = 0; i != thisDimension; ++i)
+			Integer thisDimension = ks::get<sizeof...(HigherDimensionIndices)>(loopSize);
+			for (Integer i = 0; i != thisDimension; ++i)
 				buildFromSparse_t<Dim - 1>::do_buildFromSparseTupled(alloc, acc, loopSize, f, higherDimensionIndices..., i);
 		}
 	};
@@ -1373,19 +2397,27 @@ namespace ks {
 	{
 		template<size_t Dim, class T, class LambdaResultElementT>
 		static KS_FUNCTION void buildFromSparse_addOneIteration(tensor<Dim, T>* accElement, LambdaResultElementT const& lambdaResultElement) {
-			inplace_add(&(accElement->index(ks::get<0>(lambdaResultElement))), ks::get<1>(lambdaResultElement));
+			inplace_add_at(accElement, ks::get<0>(lambdaResultElement), ks::get<1>(lambdaResultElement));
 		}
 
+#ifdef KS_PARALLEL
+		template<size_t Dim, class T, class LambdaResultElementT>
+		static void buildFromSparse_addOneIteration(sparse_bucket_writer<Dim, T>* accElement, LambdaResultElementT const& lambdaResultElement) {
+			accElement->buckets->add(accElement->worker,
+				typename sparse_buckets<Dim, T>::term_type{ ks::get<0>(lambdaResultElement), ks::get<1>(lambdaResultElement) });
+		}
+#endif
+
 		template<class T, class LambdaResultT, size_t ...Indices>
 		static KS_FUNCTION void buildFromSparseTupled_addOneIteration(T* acc, LambdaResultT const& lambdaResult, std::index_sequence<Indices...>) {
 			(buildFromSparse_addOneIteration(&ks::get<Indices>(*acc), ks::get<Indices>(lambdaResult)), ...);
 		}
 
-		template<size_t Dim, class T, class F, class LoopSize, class ...HigherDimensionIndices>
-		static KS_FUNCTION void do_buildFromSparse(allocator * alloc, tensor<Dim, T>* acc, LoopSize const& loopSize, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(loopSize);
+		template<class Acc, class F, class LoopSize, class ...HigherDimensionIndices>
+		static KS_FUNCTION void do_buildFromSparse(allocator * alloc, Acc* acc, LoopSize const& loopSize, F f, HigherDimensionIndices ...higherDimensionIndices) {
+			Integer thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(loopSize);
 			KS_MARK(alloc, mark);
-			for (int i = 0; i != thisDimension; ++i) {
+			for (Integer i = 0; i != thisDimension; ++i) {
 				buildFromSparse_addOneIteration(acc, f(alloc, higherDimensionIndices..., i));
 				KS_RESET(alloc, mark);
 			}
@@ -1393,20 +2425,115 @@ namespace ks {
 
 		template<class ...Ts, class F, class LoopSize, class ...HigherDimensionIndices>
 		static KS_FUNCTION void do_buildFromSparseTupled(allocator * alloc, Tuple<Ts...>* acc, LoopSize const& loopSize, F f, HigherDimensionIndices ...higherDimensionIndices) {
-			int thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(loopSize);
+			Integer thisDimension = get_dimension<sizeof...(HigherDimensionIndices)>(loopSize);
 			KS_MARK(alloc, mark);
-			for (int i = 0; i != thisDimension; ++i) {
+			for (Integer i = 0; i != thisDimension; ++i) {
 				buildFromSparseTupled_addOneIteration(acc, f(alloc, higherDimensionIndices..., i), std::index_sequence_for<Ts...>{});
 				KS_RESET(alloc, mark);
 			}
 		}
 	};
 
+#ifdef KS_PARALLEL
+	/* Parallel version of buildFromSparse (or, if Tupled, of
+	   buildFromSparseTupled), which splits the outermost dimension of the
+	   loop.  *result must be zero on entry.
+
+	   If *result is small compared with the number of terms, each worker
+	   adds its terms into its own zeroed copy of *result, in its own arena,
+	   and the copies are then added into *result.
+
+	   Otherwise, if *result is made of tensors of flat elements, each worker
+	   sorts its terms into sparse_buckets, one for each of num_threads()
+	   contiguous ranges of each tensor.  A second parallel loop then adds
+	   up each range, so that no two threads write to the same range, and
+	   there are no copies of *result to zero and add up.
+
+	   Returns false if the pool chose not to run the loop in parallel.
+	*/
+	template <bool Tupled, size_t Dim, class Acc, class F, class LoopSize>
+	void buildFromSparse_outer_iteration(allocator * alloc, Acc * acc, LoopSize const& loopSize, F f, Integer i)
+	{
+		if constexpr (Dim == 1) {
+			KS_MARK(alloc, mark);
+			if constexpr (Tupled) {
+				buildFromSparse_t<1>::buildFromSparseTupled_addOneIteration(acc, f(alloc, i),
+					std::make_index_sequence<std::tuple_size<Acc>::value>{});
+			} else {
+				buildFromSparse_t<1>::buildFromSparse_addOneIteration(acc, f(alloc, i));
+			}
+			KS_RESET(alloc, mark);
+		} else if constexpr (Tupled) {
+			buildFromSparse_t<Dim - 1>::do_buildFromSparseTupled(alloc, acc, loopSize, f, i);
+		} else {
+			buildFromSparse_t<Dim - 1>::do_buildFromSparse(alloc, acc, loopSize, f, i);
+		}
+	}
+
+	template <bool Tupled, size_t Dim, class T, class F, class LoopSize>
+	bool parallel_buildFromSparse(allocator * alloc, T * result, LoopSize const& loopSize, F f)
+	{
+		thread_pool& pool = get_thread_pool();
+		int nw = pool.num_threads();
+		Integer outer = get_dimension<0>(loopSize);
+		Integer numTerms = flat_size(loopSize, std::make_index_sequence<Dim>{});
+
+		if constexpr (is_sparse_bucketable<T>::value) {
+			if ((long long)sparse_num_elements(*result) * nw > numTerms) {
+				auto buckets = make_sparse_buckets(result, nw, nw);
+				typedef decltype(sparse_writer(&buckets, 0)) Writer;
+				std::vector<Writer> writers;
+				for (int w = 0; w != nw; ++w)
+					writers.push_back(sparse_writer(&buckets, w));
+
+				auto body = [&](allocator * worker_alloc, int worker, Integer begin, Integer end) {
+					for (Integer i = begin; i != end; ++i)
+						buildFromSparse_outer_iteration<Tupled, Dim>(worker_alloc, &writers[worker], loopSize, f, i);
+				};
+				if (!pool.try_parallel_for(outer, body, []() {}))
+					return false;
+
+				auto addRanges = [&](allocator *, int, Integer begin, Integer end) {
+					for (Integer r = begin; r != end; ++r)
+						add_range_to_result(&buckets, r);
+				};
+				if (!pool.try_parallel_for(nw, addRanges, []() {}))
+					addRanges(alloc, 0, 0, nw);
+				return true;
+			}
+		}
+
+		std::vector<T> partial(nw);
+		std::vector<char> has_partial(nw, 0);
+
+		auto body = [&](allocator * worker_alloc, int worker, Integer begin, Integer end) {
+			if (!has_partial[worker]) {
+				partial[worker] = zero(worker_alloc, *result);
+				has_partial[worker] = 1;
+			}
+			for (Integer i = begin; i != end; ++i)
+				buildFromSparse_outer_iteration<Tupled, Dim>(worker_alloc, &partial[worker], loopSize, f, i);
+		};
+
+		auto finish = [&]() {
+			for (int w = 0; w != nw; ++w)
+				if (has_partial[w])
+					inplace_add(result, partial[w]);
+		};
+
+		return pool.try_parallel_for(outer, body, finish);
+	}
+#endif
+
 	template<class ResultType, class ResultShape, class F, class LoopSize>
 	KS_FUNCTION auto buildFromSparse(allocator * alloc, ResultShape const& resultShapes, LoopSize loopSize, F f)
 	{
 		constexpr size_t Dim = dimension_of_tensor_index_type<LoopSize>::value;
 		auto result = zeroOfShape<ResultType>(alloc, resultShapes);
+#ifdef KS_PARALLEL
+		if (parallel_buildFromSparse<false, Dim>(alloc, &result, loopSize, f))
+			return result;
+#endif
 		buildFromSparse_t<Dim>::do_buildFromSparse(alloc, &result, loopSize, f);
 		return result;
 	}
@@ -1416,6 +2543,10 @@ namespace ks {
 	{
 		constexpr size_t Dim = dimension_of_tensor_index_type<LoopSize>::value;
 		auto result = zeroOfShape<ResultType>(alloc, resultShapes);
+#ifdef KS_PARALLEL
+		if (parallel_buildFromSparse<true, Dim>(alloc, &result, loopSize, f))
+			return result;
+#endif
 		buildFromSparse_t<Dim>::do_buildFromSparseTupled(alloc, &result, loopSize, f);
 		return result;
 	}
@@ -1430,10 +2561,13 @@ namespace ks {
 	{
 		using T = decltype(applyWithAllocator(alloc, f, S{}));
 		auto ret = tensor<Dim, T>::create(alloc, t.size());
-		S const* tdata = t.data();
-		T* retdata = ret.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i)
-			retdata[i] = applyWithAllocator(alloc, f, tdata[i]);
+		auto tdata = std::as_const(t).data();
+		auto retdata = ret.data();
+		Integer ne = t.num_elements();
+		for_each_block(alloc, ne, &ret, [&](allocator * alloc, Integer begin, Integer end) {
+			for (Integer i = begin; i != end; ++i)
+				retdata[i] = applyWithAllocator(alloc, f, tdata[i]);
+		});
 		return ret;
 	}
 
@@ -1446,11 +2580,14 @@ namespace ks {
                 // FIXME: assert they are the same size
                 using T = decltype(applyWithAllocator(alloc, f, make_Tuple(S{}, S_{})));
 		auto ret = tensor<Dim, T>::create(alloc, s.size());
-		S const* sdata = s.data();
-		S_ const* s_data = s_.data();
-		T* retdata = ret.data();
-		for (int i = 0, ne = s.num_elements(); i != ne; ++i)
-			retdata[i] = applyWithAllocator(alloc, f, make_Tuple(sdata[i], s_data[i]));
+		auto sdata = std::as_const(s).data();
+		auto s_data = std::as_const(s_).data();
+		auto retdata = ret.data();
+		Integer ne = s.num_elements();
+		for_each_block(alloc, ne, &ret, [&](allocator * alloc, Integer begin, Integer end) {
+			for (Integer i = begin; i != end; ++i)
+				retdata[i] = applyWithAllocator(alloc, f, make_Tuple(sdata[i], s_data[i]));
+		});
 		return ret;
 	}
 
@@ -1468,11 +2605,11 @@ namespace ks {
 		auto bog = tensor<Dim, B>::create(alloc, v_size);
 		auto ret = tensor<Dim, T>::create(alloc, v_size);
 
-		S const* vdata = v.data();
-		B* bogdata = bog.data();
-		T* retdata = ret.data();
+		auto vdata = std::as_const(v).data();
+		auto bogdata = bog.data();
+		auto retdata = ret.data();
 
-		for (int i = 0, ne = v.num_elements(); i != ne; ++i) {
+		for (Integer i = 0, ne = v.num_elements(); i != ne; ++i) {
 			auto [r, b] = applyWithAllocator(alloc, f, vdata[i]);
 			retdata[i] = r;
 			bogdata[i] = b;
@@ -1493,11 +2630,11 @@ namespace ks {
 		auto dds = tensor<Dim, dS>::create(alloc, ddt_size);
 		dE ddenv = ddenv_zero;
 
-		dT const* ddtdata = ddt.data();
-		B const* bogdata = bog.data();
-		dS* ddsdata = dds.data();
+		auto ddtdata = std::as_const(ddt).data();
+		auto bogdata = std::as_const(bog).data();
+		auto ddsdata = dds.data();
 
-		for (int i = 0, ne = ddt.num_elements(); i != ne; ++i) {
+		for (Integer i = 0, ne = ddt.num_elements(); i != ne; ++i) {
 			Tuple<dS, dE> f_call = f_(alloc, ddtdata[i], bogdata[i]);
 			auto [f_call_dds, f_call_ddenv] = f_call;
 
@@ -1516,27 +2653,152 @@ namespace ks {
 	{
 		A acc = z;
 
-		for (int i = 0; i < v.size(); i++) {
-			acc = f(alloc, acc, v[i]);
+		for (Integer i = 0; i < v.size(); i++) {
+			acc = f(alloc, acc, std::as_const(v)[i]);
 		}
 
 		return acc;
 	}
 
+	/* RFold is the reverse pass of fold: it needs the accumulator before
+	   each step, in reverse order.  By default every accumulator of the
+	   forward pass is kept.
+
+	   With KS_FOLD_CHECKPOINTS=s (s > 0), at most s accumulators are
+	   kept at once, and the rest are recomputed from the nearest one
+	   (binomial checkpointing, as in Griewank's treeverse/revolve).  With
+	   s checkpoints and t recomputations of each step, a fold of up to
+	   C(s + t, s) steps can be reversed, so t grows only slowly with the
+	   length of the vector.
+
+	   The checkpoints and the recomputed accumulators live in an arena
+	   of their own, which is used as a stack: each recomputed step is
+	   copied down onto the checkpoint it started from, and a checkpoint
+	   is released as soon as the part of the fold after it is reversed.
+	   The arena is kept by the thread (see fold_checkpoint_scope), so
+	   its address space is reserved once, not on every call.
+
+	   The gradient (dScope and dAcc) is kept at the top of the caller's
+	   arena.  Each step of the reverse sweep copies its dT down onto the
+	   previous gradient, and its new gradient after that, so only the
+	   dTs accumulate, rather than every step's copy of dScope.
+	*/
+#ifndef KS_FOLD_CHECKPOINTS
+#define KS_FOLD_CHECKPOINTS 0
+#endif
+
+#ifdef KS_ALLOCATOR
+	// C(s + t, s): the longest fold which can be reversed with
+	// s checkpoints and t recomputations of each step
+	// (saturating once it reaches limit).
+	inline size_t fold_binomial_steps(size_t s, size_t t, size_t limit)
+	{
+		size_t b = 1;
+		for (size_t k = 1; k <= s && b < limit; ++k)
+			b = b * (t + k) / k;
+		return b;
+	}
+
+	/* The arena for the checkpoints of an RFold.  Each thread keeps one
+	   arena for each level of RFolds nested on it, and a scope takes the
+	   next one, resetting it when it ends. */
+	class fold_checkpoint_scope
+	{
+	public:
+		fold_checkpoint_scope();
+		~fold_checkpoint_scope();
+
+		fold_checkpoint_scope(fold_checkpoint_scope const&) = delete;
+		fold_checkpoint_scope& operator=(fold_checkpoint_scope const&) = delete;
+
+		allocator * arena() const { return arena_; }
+
+	private:
+		allocator * arena_;
+	};
+
+	template <class T, class F, class F_, class A, class dS, class dA, class dT>
+	struct checkpointed_RFold
+	{
+		typedef Tuple<dS, dA> gradient_t;
+
+		allocator * alloc;
+		allocator * checkpoints;
+		F const& f;
+		F_ const& f_;
+		vec<T> const& v;
+		vec<dT>& dv;
+		alloc_mark_t grad_mark;   // The gradient lies between here and the top of alloc
+
+		// One step of the reverse sweep, with acc the accumulator before step i,
+		// and grad the gradient at grad_mark.  dv[i] and the new gradient are
+		// deep copied before being copied down over grad, as they may refer to
+		// grad or to acc, which lives in the checkpoint arena.
+		gradient_t reverse_step(Integer i, A const& acc, gradient_t const& grad)
+		{
+			Tuple<dS, Tuple<dA, dT>> f_call = f_(alloc, make_Tuple(acc, std::as_const(v)[i]), ks::get<1>(grad));
+			auto dt = inflated_deep_copy(alloc, ks::get<1>(ks::get<1>(f_call)));
+			auto step = inflated_deep_copy(alloc, make_Tuple(ts_add(alloc, ks::get<0>(grad), ks::get<0>(f_call)), ks::get<0>(ks::get<1>(f_call))));
+			dv[i] = KS_COPYDOWN(alloc, grad_mark, dt);
+			grad_mark = alloc->mark();
+			return KS_COPYDOWN(alloc, grad_mark, step);
+		}
+
+		// Reverse steps [begin, end), where acc is the accumulator before step begin,
+		// using at most s more checkpoints and t recomputations of each step.
+		gradient_t reverse(Integer begin, Integer end, A const& acc, size_t s, size_t t, gradient_t grad)
+		{
+			if (end - begin == 1)
+				return reverse_step(begin, acc, grad);
+
+			// Steps [begin, mid) are left for t - 1 recomputations,
+			// and steps [mid, end) for s - 1 checkpoints.
+			size_t length = end - begin;
+			size_t tail = std::min(fold_binomial_steps(s - 1, t, length), length - 1);
+			Integer mid = end - (Integer)tail;
+
+			KS_MARK(checkpoints, mark);
+			A acc_mid = acc;
+			for (Integer i = begin; i < mid; ++i)
+				acc_mid = KS_COPYDOWN(checkpoints, mark, f(checkpoints, acc_mid, std::as_const(v)[i]));
+
+			grad = reverse(mid, end, acc_mid, s - 1, t, grad);
+			KS_RESET(checkpoints, mark);
+			return reverse(begin, mid, acc, s, t - 1, grad);
+		}
+	};
+#endif
+
 	template <class T, class F, class F_, class A, class dS, class dA, class dT>
 	KS_FUNCTION Tuple<dS, Tuple<dA, vec<dT>>> RFold(allocator * alloc, const dT &dummy, dS s_zero, F f, F_ f_, A acc, vec<T> v, dA dr) {
+#ifdef KS_ALLOCATOR
+		if constexpr (KS_FOLD_CHECKPOINTS > 0) {
+			auto dv = vec<dT>::create(alloc, v.size());
+			if (v.size() == 0)
+				return make_Tuple(s_zero, make_Tuple(dr, dv));
+
+			size_t s = KS_FOLD_CHECKPOINTS, n = v.size(), t = 0;
+			while (fold_binomial_steps(s, t, n) < n)
+				++t;
+
+			fold_checkpoint_scope checkpoints;
+			checkpointed_RFold<T, F, F_, A, dS, dA, dT> r{ alloc, checkpoints.arena(), f, f_, v, dv, alloc->mark() };
+			auto grad = r.reverse(0, v.size(), acc, s, t, make_Tuple(s_zero, dr));
+			return make_Tuple(ks::get<0>(grad), make_Tuple(ks::get<1>(grad), dv));
+		}
+#endif
 		auto forward_pass = std::vector<A>(v.size());
 
-		for (int i = 0; i < v.size(); i++) {
+		for (Integer i = 0; i < v.size(); i++) {
 			forward_pass[i] = acc;
-			acc = f(alloc, acc, v[i]);
+			acc = f(alloc, acc, std::as_const(v)[i]);
 		}
 
 		dS dScope = s_zero;
 		auto dv = vec<dT>::create(alloc, v.size());
 
-		for (int i = v.size() - 1; i >= 0; i--) {
-			Tuple<dS, Tuple<dA, dT>> f_call = f_(alloc, make_Tuple(forward_pass[i], v[i]), dr);
+		for (Integer i = v.size() - 1; i >= 0; i--) {
+			Tuple<dS, Tuple<dA, dT>> f_call = f_(alloc, make_Tuple(forward_pass[i], std::as_const(v)[i]), dr);
 
 			dS  f_call_dScope = ks::get<0>(f_call);
 			dA f_call_dacc   = ks::get<0>(ks::get<1>(f_call));
@@ -1550,20 +2812,20 @@ namespace ks {
 		return make_Tuple(dScope, make_Tuple(dr, dv));
 	}
 
-	// Probably should implement this as a loop
-	template <class T, class F, class F_, class A, class dA, class dT>
-	KS_FUNCTION dA FFold_recursive(allocator * alloc, Integer i, F f, A acc, vec<T> v, F_ f_, dA dacc, vec<dT> dv) {
-		if (i == v.size()) {
-			return dacc;
-		} else {
-			dA fwd_f = f_(alloc, make_Tuple(acc, v[i]), make_Tuple(dacc, dv[i]));
-			return FFold_recursive(alloc, i + 1, f, f(alloc, acc, v[i]), v, f_, fwd_f, dv);
-		}
-	}
-
+	// The forward pass of fold, carrying the accumulator and its tangent
+	// together.  Each step is copied down, so only the latest pair is kept.
 	template <class T, class F, class F_, class A, class dA, class dT>
 	KS_FUNCTION dA FFold(allocator * alloc, F f, A acc, vec<T> v, F_ f_, dA dacc, vec<dT> dv) {
-		return FFold_recursive(alloc, 0, f, acc, v, f_, dacc, dv);
+		KS_MARK(alloc, mark);
+		for (Integer i = 0; i < v.size(); i++) {
+			auto step = make_Tuple(
+				f(alloc, acc, std::as_const(v)[i]),
+				f_(alloc, make_Tuple(acc, std::as_const(v)[i]), make_Tuple(dacc, std::as_const(dv)[i])));
+			step = KS_COPYDOWN(alloc, mark, step);
+			acc = ks::get<0>(step);
+			dacc = ks::get<1>(step);
+		}
+		return dacc;
 	}
 
 	// ===============================  Primitives  ==================================
@@ -1574,7 +2836,7 @@ namespace ks {
 		constexpr int num_args = 1 + static_cast<int>(sizeof...(args));
 		T arr[num_args] = {arg0, args...};
 		auto ret = tensor<1, T>::create(alloc, num_args);
-		T* retdata = ret.data();
+		auto retdata = ret.data();
 		for (int i = 0; i != num_args; ++i) {
 			retdata[i] = arr[i];
 		}
@@ -1592,8 +2854,8 @@ namespace ks {
 	{
 		constexpr size_t Dim = dimension_of_tensor_index_type<SizeType>::value;
 		auto ret = tensor<Dim, T>::create(alloc, size);
-		T* retdata = ret.data();
-		for(int j = 0, ne = ret.num_elements(); j != ne; ++j)
+		auto retdata = ret.data();
+		for(Integer j = 0, ne = ret.num_elements(); j != ne; ++j)
 			retdata[j] = val;
 		return ret;
 	}
@@ -1608,12 +2870,12 @@ namespace ks {
 	}
 
 	template <class F>
-	KS_FUNCTION auto diag(allocator * alloc, int rows, int cols, F f)
+	KS_FUNCTION auto diag(allocator * alloc, Integer rows, Integer cols, F f)
 	{
 		KS_ASSERT(rows == cols);
-		typedef decltype(f(int{})) T;
-		return build<vec<T>>(alloc, rows, [cols,f](allocator * alloc, int i) { 
-					return deltaVec(alloc, cols, i, f(i)); 
+		typedef decltype(applyWithAllocator(alloc, f, Integer{})) T;
+		return build<vec<T>>(alloc, rows, [cols,f](allocator * alloc, Integer i) {
+					return deltaVec(alloc, cols, i, applyWithAllocator(alloc, f, i));
 		});
 	}
 
@@ -1621,15 +2883,20 @@ namespace ks {
 	template <size_t Dim, class T>
 	KS_FUNCTION T sum(allocator * alloc, tensor<Dim, T> const& t)
 	{
-		int ne = t.num_elements();
+		Integer ne = t.num_elements();
 		KS_ASSERT(ne > 0);
 
-		const T* indata = t.data();
+		typedef accumulator_t<T> Acc;
+		auto indata = t.data();
+#ifdef KS_ALLOCATOR
+		if constexpr (default_sum_order != sum_order::sequential)
+			return T(sum_in_order<Acc>(alloc, ne, [indata](allocator *, Integer k) { return Acc(indata[k]); }));
+#endif
 		if (ne == 1) return indata[0];
-		T ret = ts_add(alloc, indata[0], indata[1]);
-		for (int i = 2; i < ne; ++i)
-			ret = ts_add(alloc, ret, indata[i]);
-		return ret;
+		Acc ret = ts_add(alloc, Acc(indata[0]), Acc(indata[1]));
+		for (Integer i = 2; i < ne; ++i)
+			ret = ts_add(alloc, ret, Acc(indata[i]));
+		return T(ret);
 	}
 
 	template <class T>
@@ -1650,7 +2917,7 @@ namespace ks {
 		auto ret = tensor<Dim, std::tuple_element_t<I, TupleType>>::create(alloc, t.size());
 		const TupleType* indata = t.data();
 		auto* outdata = ret.data();
-		for (int i = 0, ne = t.num_elements(); i != ne; ++i)
+		for (Integer i = 0, ne = t.num_elements(); i != ne; ++i)
 		{
 			outdata[i] = ks::get<I>(indata[i]);
 		}
@@ -1664,7 +2931,12 @@ namespace ks {
 	template <size_t Dim, class... Types>
 	KS_FUNCTION auto unzip(allocator * alloc, tensor<Dim, Tuple<Types...>> const& t)
 	{
+#ifdef KS_SOA
+		// The columns of a tensor of tuples are already separate tensors
+		return t.columns();
+#else
 		return unzip_impl(alloc, t, std::index_sequence_for<Types...>{});
+#endif
 	}
 
 	// ========================= Trace primitive ===============
@@ -1747,9 +3019,9 @@ namespace ks {
 
 		KS_ASSERT(t1.size() == t2.size());
 
-		const T1* t1data = t1.data();
-		const T2* t2data = t2.data();
-		for (int i = 0, ne = t1.num_elements(); i < ne; i++)
+		auto t1data = std::as_const(t1).data();
+		auto t2data = std::as_const(t2).data();
+		for (Integer i = 0, ne = t1.num_elements(); i < ne; i++)
 		{
 			ret += ts_dot(t1data[i], t2data[i]);
 		}
@@ -1757,6 +3029,15 @@ namespace ks {
 		return ret;
 	}
 
+#if !defined(KS_CUDA)
+	template <size_t Dim>
+	inline Float ts_dot(tensor<Dim, Float> t1, tensor<Dim, Float> t2)
+	{
+		KS_ASSERT(t1.size() == t2.size());
+		return simd::dot(t1.data(), t2.data(), t1.num_elements());
+	}
+#endif
+
 	// ===============================  Derivative check  ================================
   //  Check derivatives:
   // 
@@ -1791,4 +3072,22 @@ namespace ks {
 	}
 } // namespace ks
 
+#ifdef KS_SOA
+#include "knossos-soa.h"
+#endif
+
+#include "knossos-half.h"
+#include "knossos-fixed.h"
+#include "knossos-strided.h"
+#include "knossos-lazy.h"
+#include "knossos-sparse.h"
+
 #include "knossos-lm.h"
+#if !defined(KS_CUDA)
+// Materialized linear maps are built on the host (with knossos-simd.h)
+#include "knossos-lm-matrix.h"
+#endif
+
+#ifdef KS_PREBUILT_RUNTIME
+#include "knossos-prebuilt.h"
+#endif
@@ -1,63 +1,79 @@
 
 #include "knossos.h"
+#include "knossos-gemm.h"
 
 #include <cmath>
 
 namespace ks {
 
-inline KS_FUNCTION tensor<1, Float>
-aten$8$8matmul$aT2fT1f(allocator * alloc, tensor<2,Float> const& M, tensor<1,Float> const& v)
+// The matrix products are for T = Float, or one of the 16-bit floats of
+// knossos-half.h, which gemm accumulates in Float.
+template <class T>
+inline KS_FUNCTION tensor<1, T>
+aten$8$8matmul$aT2fT1f(allocator * alloc, tensor<2,T> const& M, tensor<1,T> const& v)
 {
 	auto [r,c] = size(M);
 	KS_ASSERT(c == size(v));
-	auto ret = tensor<1,Float>::create(alloc, r);
-	for(int i = 0; i < r; ++i)
-		ret[i] = ts_dot(M[i], v);
+	auto ret = tensor<1,T>::create(alloc, r);
+	gemm::gemv(false, r, c, M.data(), c, v.data(), ret.data());
 	return ret;
 }
 
-inline KS_FUNCTION tensor<2, Float>
-aten$8$8matmul$aT2fT2f(allocator * alloc, tensor<2,Float> const& A, tensor<2,Float> const& B)
+template <class T>
+inline KS_FUNCTION tensor<2, T>
+aten$8$8matmul$aT2fT2f(allocator * alloc, tensor<2,T> const& A, tensor<2,T> const& B)
 {
 	auto [r,K] = size(A);
 	auto [K_,c] = size(B);
 	KS_ASSERT(K == K_);
-	auto ret = tensor<2,Float>::create(alloc, make_Tuple(r, c));
-	for(int i = 0; i < r; ++i)
-		for(int j = 0; j < c; ++j) {
-			Float tot = 0;
-		  for(int k = 0; k < K; ++k)
-				tot += A[i][k] * B[k][j];
-			ret[i][j] = tot;
-		}
+	auto ret = tensor<2,T>::create(alloc, make_Tuple(r, c));
+	gemm::gemm(alloc, false, false, r, c, K, A.data(), K, B.data(), c, ret.data(), c);
 	return ret;
 }
 
-inline KS_FUNCTION Tuple<tensor<2,Float>,tensor<1,Float>>
-rev$aten$8$8matmul$aT2fT1f(allocator * alloc, Tuple<tensor<2,Float>, tensor<1,Float>> const& M_v, tensor<1,Float> const& dr)
+template <class T>
+inline KS_FUNCTION Tuple<tensor<2,T>,tensor<1,T>>
+rev$aten$8$8matmul$aT2fT1f(allocator * alloc, Tuple<tensor<2,T>, tensor<1,T>> const& M_v, tensor<1,T> const& dr)
 {
 	auto [M, v] = M_v;
 	auto [r, c] = size(M);
 	KS_ASSERT(c == size(v));
 
-	auto retM = tensor<2,Float>::create(alloc, size(M));
-	for(int i = 0; i < r; ++i)
+	auto retM = tensor<2,T>::create(alloc, size(M));
+	for(Integer i = 0; i < r; ++i)
 		retM[i] = ts_scale(alloc, dr[i], v);
 
-	auto retv = tensor<1,Float>::create(alloc, c);
-	for(int i = 0; i < c; ++i) {
-		Float retvi = 0; // TODO: Accumulator types
-		for(int j = 0; j < r; ++j)
-			retvi += M[j][i] * dr[j];
-		retv[i] = retvi;
-	}
+	// retv = M^T * dr
+	auto retv = tensor<1,T>::create(alloc, c);
+	gemm::gemv(true, c, r, M.data(), c, dr.data(), retv.data());
 
 	return {retM,retv};
 }
 
+// dR = A*dB + dA*B
+// [dA, dB] = [dR * B^T, A^T * dR]
+template <class T>
+inline KS_FUNCTION Tuple<tensor<2,T>,tensor<2,T>>
+rev$aten$8$8matmul$aT2fT2f(allocator * alloc, Tuple<tensor<2,T>, tensor<2,T>> const& A_B, tensor<2,T> const& dR)
+{
+	auto [A, B] = A_B;
+	auto [r, K] = size(A);
+	auto [K_, c] = size(B);
+	KS_ASSERT(K == K_);
+	KS_ASSERT(size(dR) == make_Tuple(r, c));
+
+	auto dA = tensor<2,T>::create(alloc, size(A));
+	gemm::gemm(alloc, false, true, r, K, c, dR.data(), c, B.data(), c, dA.data(), K);
+
+	auto dB = tensor<2,T>::create(alloc, size(B));
+	gemm::gemm(alloc, true, false, K, c, r, A.data(), K, dR.data(), c, dB.data(), c);
+
+	return {dA,dB};
+}
+
 template <size_t Dim, class T>
 inline KS_FUNCTION tensor<Dim, T>
-aten$8$8pow$aT2fi(allocator * alloc, tensor<Dim,T> const& a, int const& i)
+aten$8$8pow$aT2fi(allocator * alloc, tensor<Dim,T> const& a, Integer const& i)
 {
 	return elementwise_map(alloc, a, [i](T const& v) { return std::pow(v, i); });
 }
@@ -77,9 +93,9 @@ typedef tensor<1, Float> Vec;
 (edef shape$rev$aten::cat (Tuple (Tensor 1 (Tensor 2 (Tuple))) (Tuple)) ((Tuple (Tensor 1 Mat) Integer) Mat))
 */
 inline KS_FUNCTION Mat
-aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, int dim)
+aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, Integer dim)
 {
-	int n = size(As);
+	Integer n = size(As);
 	if (n == 0)
 		return Mat{};
 
@@ -87,7 +103,7 @@ aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, int dim)
 		constexpr int Dim = 1;
 		// TODO: Make a nice "concatenate" for ks tensors
 		auto sz_out = size(As[0]);
-		for(int ai = 1; ai < n; ++ai) {
+		for(Integer ai = 1; ai < n; ++ai) {
 			auto sz = size(As[ai]);
 			KS_ASSERT(get_dimension<1-Dim>(sz_out) == get_dimension<1-Dim>(sz));
 			get_dimension<Dim>(sz_out) += get_dimension<Dim>(sz);
@@ -96,11 +112,11 @@ aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, int dim)
 		Mat retM = Mat::create(alloc, sz_out);
 		
 		Mat::index_type offset = {0,0};
-		for(int ai = 0; ai < n; ++ai) {
+		for(Integer ai = 0; ai < n; ++ai) {
 			auto const& A = As[ai];
 			auto sz = size(A);
-			for(int i = 0; i < get_dimension<0>(sz); ++i)
-				for(int j = 0; j < get_dimension<1>(sz); ++j) {
+			for(Integer i = 0; i < get_dimension<0>(sz); ++i)
+				for(Integer j = 0; j < get_dimension<1>(sz); ++j) {
 					auto out_i = get_dimension<0>(offset) + i;
 					auto out_j = get_dimension<1>(offset) + j;
 					retM[out_i][out_j] = A[i][j];
@@ -114,30 +130,30 @@ aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, int dim)
 	KS_ASSERT(false)
 }
 
-inline KS_FUNCTION Tuple<int, int>
-shape$aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, int dim)
+inline KS_FUNCTION Tuple<Integer, Integer>
+shape$aten$8$8cat$aT1T2fi(allocator * alloc, tensor<1, Mat> const& As, Integer dim)
 {
 	KS_ASSERT(false)
 }
 
 inline KS_FUNCTION Tuple<tensor<1, Mat>,Tuple<>>
-rev$aten$8$8cat$aT1T2fi(allocator * alloc, Tuple<tensor<1, Mat>, int> const& arg, Mat const& dret)
+rev$aten$8$8cat$aT1T2fi(allocator * alloc, Tuple<tensor<1, Mat>, Integer> const& arg, Mat const& dret)
 {
 	auto [As, dim] = arg;
-	int n = size(As);
+	Integer n = size(As);
 
 	auto retM = tensor<1, Mat>::create(alloc, n);
 	
 	if (dim == 1) {
 		constexpr int Dim = 1;
 		Mat::index_type offset = {0,0};
-		for(int ai = 0; ai < n; ++ai) {
+		for(Integer ai = 0; ai < n; ++ai) {
 			auto const& A = As[ai];
 			auto sz = size(A);
 			retM[ai] = Mat::create(alloc, sz);
 			Mat& Mi = retM[ai];
-			for(int i = 0; i < get_dimension<0>(sz); ++i)
-				for(int j = 0; j < get_dimension<1>(sz); ++j) {
+			for(Integer i = 0; i < get_dimension<0>(sz); ++i)
+				for(Integer j = 0; j < get_dimension<1>(sz); ++j) {
 					auto out_i = get_dimension<0>(offset) + i;
 					auto out_j = get_dimension<1>(offset) + j;
 					Mi[i][j] = dret[out_i][out_j];
@@ -151,8 +167,8 @@ rev$aten$8$8cat$aT1T2fi(allocator * alloc, Tuple<tensor<1, Mat>, int> const& arg
 	KS_ASSERT(false)
 }
 
-inline KS_FUNCTION Tuple<tensor<1, Tuple<int, int>>,Tuple<>>
-shape$rev$aten$8$8cat$aT1T2fi(allocator * alloc, Tuple<tensor<1, Mat>, int> const& arg, Mat const& dret)
+inline KS_FUNCTION Tuple<tensor<1, Tuple<Integer, Integer>>,Tuple<>>
+shape$rev$aten$8$8cat$aT1T2fi(allocator * alloc, Tuple<tensor<1, Mat>, Integer> const& arg, Mat const& dret)
 {
 	KS_ASSERT(false)
 }
@@ -175,8 +191,8 @@ addA1bt$aT2fT1f(allocator * alloc, Mat const& A, Vec const& b)
 	KS_ASSERT(N == size(b));
 	
 	Mat retM = Mat::create(alloc, size(A));
-	for(int i = 0; i < M; ++i)
-		for(int j = 0; j < N; ++j)
+	for(Integer i = 0; i < M; ++i)
+		for(Integer j = 0; j < N; ++j)
 			retM[i][j] = A[i][j] + b[j];
 
 	return retM;
@@ -192,14 +208,14 @@ rev$addA1bt$aT2fT1f(allocator * alloc, Tuple<Mat, Vec> const& args, Mat const& d
 	auto [M, N] = size(dret);
 	
 	Mat retdA = Mat::create(alloc, size(dret));
-	for(int i = 0; i < M; ++i)
-		for(int j = 0; j < N; ++j)
+	for(Integer i = 0; i < M; ++i)
+		for(Integer j = 0; j < N; ++j)
 			retdA[i][j] = dret[i][j];
 
 	Vec retdb = Vec::create(alloc, N);
-	for(int j = 0; j < N; ++j) {
+	for(Integer j = 0; j < N; ++j) {
 		Float tot = 0; // TODO: Accumulator types
-		for(int i = 0; i < M; ++i)
+		for(Integer i = 0; i < M; ++i)
 			tot += retdA[i][j];
 		retdb[j] = tot;
 	}
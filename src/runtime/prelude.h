@@ -86,9 +86,9 @@ inline KS_FUNCTION Float dot$aT1fT1f(allocator *, tensor<1, Float> const& a, ten
 
 inline KS_FUNCTION tensor<1, Float> mul$aT2fT1f(allocator * alloc, tensor<2, Float> const& M, tensor<1, Float> const& v)
 {
-	int r = M.outer_dimension();
+	Integer r = M.outer_dimension();
 	auto ret = tensor<1, Float>::create(alloc, r);
-	for(int i = 0; i < r; ++i)
+	for(Integer i = 0; i < r; ++i)
 		ret[i] = ts_dot(M[i], v);
 	return ret;
 }
@@ -97,23 +97,20 @@ inline KS_FUNCTION Tuple<tensor<2, Float>,tensor<1, Float>>
 rev$mul$aT2fT1f(allocator * alloc, Tuple<tensor<2, Float>, tensor<1, Float>> const& M_v, tensor<1, Float> const& dr)
 {
 	auto [M, v] = M_v;
-	int r = M.outer_dimension();
-	int c = size(v);
+	Integer r = M.outer_dimension();
+	Integer c = size(v);
 	auto retM = tensor<2, Float>::create(alloc, size(M));
-	for(int i = 0; i < r; ++i) {
+	for(Integer i = 0; i < r; ++i) {
 		// Inlined retM[i].assign(ts_scale(dr[i], v))
 		tensor<1, Float> retrow = retM[i];
-		for (int j = 0; j < c; ++j)
+		for (Integer j = 0; j < c; ++j)
 			retrow[j] = dr[i] * v[j];
 	}
 
-	auto retv = tensor<1, Float>::create(alloc, c);
-	for(int i = 0; i < c; ++i) {
-		Float retvi = 0;
-		for(int j = 0; j < r; ++j)
-			retvi += M.index(ks::make_Tuple(j, i)) * dr[j];
-		retv[i] = retvi;
-	}
+	// retv = sum_j dr[j] * M[j], accumulated a row at a time
+	auto retv = constVec(alloc, c, Float(0));
+	for(Integer j = 0; j < r; ++j)
+		inplace_add_scaled(&retv, dr[j], M[j]);
 
 	return ks::make_Tuple(retM,retv);
 }
@@ -123,7 +120,7 @@ inline KS_FUNCTION size_t imax$aT1f(allocator *, tensor<1, Float> const &v)
     KS_ASSERT(size(v) > 0);
     size_t imax = 0;
     Float vmax = v[imax];
-    for (int i = 1; i < size(v); ++i)
+    for (Integer i = 1; i < size(v); ++i)
         if (v[i] > vmax)
         {
             vmax = v[i];
@@ -0,0 +1,29 @@
+// An arena which runs out of address space part-way through a call must
+// be left usable: this exhausts one, resets it, and writes to a smaller
+// allocation which crosses chunks that were never committed.
+#pragma once
+
+#include "knossos.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace ks {
+
+	inline Bool allocator_reuse_after_exhaustion$aii(allocator *, Integer reserved_mb, Integer chunk_mb)
+	{
+		size_t const mb = size_t(1) << 20;
+		allocator arena(size_t(reserved_mb) * mb, size_t(chunk_mb) * mb);
+		try {
+			arena.allocate(2 * size_t(reserved_mb) * mb);
+			return false;
+		} catch (std::runtime_error const&) {
+		}
+		arena.reset();
+		size_t bytes = size_t(reserved_mb) * mb / 2;
+		auto p = static_cast<unsigned char*>(arena.allocate(bytes));
+		std::memset(p, 1, bytes);
+		return arena.committed() >= bytes && arena.peak() == bytes;
+	}
+
+}
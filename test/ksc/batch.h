@@ -0,0 +1,22 @@
+#pragma once
+
+#include "knossos-entry-points.h"
+
+namespace ks {
+
+	/* The sum of each f(i), for i < n, computed by for_each_in_batch as a
+	   vmap entry point would, and whether the caller's arena is back at
+	   its mark afterwards. */
+	template<class F>
+	Tuple<vec<Float>, bool> batch_sums$al$diT1f$bi(allocator * alloc, F f, Integer n)
+	{
+		auto ret = vec<Float>::create(alloc, n);
+		Float* ret_ptr = ret.data();
+		auto before = alloc->mark();
+		entry_points::for_each_in_batch(alloc, 0, n, [&](allocator * alloc, Integer i) {
+			ret_ptr[i] = sum(alloc, f(alloc, i));
+		});
+		return make_Tuple(ret, alloc->mark() == before);
+	}
+
+}
@@ -0,0 +1,59 @@
+// Each edef takes and returns vecs, converted to and from fixed_vecs by
+// the helpers below, so that fixed.ks can compare it with plain ks.
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	template <int N>
+	fixed_vec<Float, N> fixed_from_vec(allocator * alloc, vec<Float> const& v, Integer offset = 0)
+	{
+		KS_ASSERT(v.size() >= offset + N);
+		return build_fixed<Float, N>(alloc, [&v, offset](allocator *, Integer i) { return v[offset + i]; });
+	}
+
+	template <int N>
+	vec<Float> vec_from_fixed(allocator * alloc, fixed_vec<Float, N> const& v)
+	{
+		return build<Float>(alloc, N, [&v](allocator *, Integer i) { return v[i]; });
+	}
+
+	// m (a 3x3 matrix, by rows) times x
+	inline vec<Float> fixed_matvec$aT1fT1f(allocator * alloc, vec<Float> m, vec<Float> x)
+	{
+		auto M = build_fixed<Float, 3, 3>(alloc, [&m](allocator *, Integer i, Integer j) { return m[3 * i + j]; });
+		auto X = fixed_from_vec<3>(alloc, x);
+		auto Y = build_fixed<Float, 3>(alloc, [&](allocator * alloc, Integer i) {
+			return sumbuild_fixed<Float, 3>(alloc, [&](allocator *, Integer j) { return M.index(make_Tuple(i, j)) * X[j]; });
+		});
+		return vec_from_fixed(alloc, Y);
+	}
+
+	// The elements of x - 2y + x, followed by the dot product of x and y
+	inline vec<Float> fixed_arith$aT1fT1f(allocator * alloc, vec<Float> x, vec<Float> y)
+	{
+		auto X = fixed_from_vec<3>(alloc, x);
+		auto Y = fixed_from_vec<3>(alloc, y);
+		auto Z = ts_add(alloc, X, ts_scale(alloc, 2.0, ts_neg(alloc, Y)));
+		inplace_add(&Z, X);
+		Float dot = ts_dot(X, Y);
+		return build<Float>(alloc, 4, [&](allocator *, Integer i) { return i < 3 ? Z[i] : dot; });
+	}
+
+	// The sum of the rows of xs (n 3-vectors, by rows), made into a vec of
+	// fixed_vecs above some garbage, and copied down over it
+	inline vec<Float> fixed_copydown$aT1f(allocator * alloc, vec<Float> xs)
+	{
+		Integer n = xs.size() / 3;
+		KS_MARK(alloc, mark);
+		alloc->allocate(4096);
+		auto rows = build<fixed_vec<Float, 3>>(alloc, n, [&xs](allocator * alloc, Integer i) {
+			return fixed_from_vec<3>(alloc, xs, 3 * i);
+		});
+		rows = KS_COPYDOWN(alloc, mark, rows);
+		auto total = sumbuild<fixed_vec<Float, 3>>(alloc, n, [&rows](allocator *, Integer i) { return rows[i]; });
+		return vec_from_fixed(alloc, total);
+	}
+
+}
@@ -0,0 +1,50 @@
+// Each edef takes and returns vecs of Float, converted to and from vecs
+// of half or bfloat16, so the rounding shows in what half.ks compares.
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	template <class T>
+	vec<T> vec_to(allocator * alloc, vec<Float> const& v)
+	{
+		return build<T>(alloc, v.size(), [&v](allocator *, Integer i) { return T(v[i]); });
+	}
+
+	template <class T>
+	vec<Float> vec_from(allocator * alloc, vec<T> const& v)
+	{
+		return build<Float>(alloc, v.size(), [&v](allocator *, Integer i) { return Float(v[i]); });
+	}
+
+	// v rounded to half or bfloat16, and back
+	inline vec<Float> half_round_trip$aT1f(allocator * alloc, vec<Float> v)
+	{
+		return vec_from(alloc, vec_to<half>(alloc, v));
+	}
+
+	inline vec<Float> bfloat16_round_trip$aT1f(allocator * alloc, vec<Float> v)
+	{
+		return vec_from(alloc, vec_to<bfloat16>(alloc, v));
+	}
+
+	// The sum of v stored as half or bfloat16, accumulated in Float
+	inline Float half_sum$aT1f(allocator * alloc, vec<Float> v)
+	{
+		return sum(alloc, vec_to<half>(alloc, v));
+	}
+
+	inline Float bfloat16_sum$aT1f(allocator * alloc, vec<Float> v)
+	{
+		return sum(alloc, vec_to<bfloat16>(alloc, v));
+	}
+
+	// The generic tensor code on halves: a + 2b, and the dot product of a and b
+	inline Tuple<vec<Float>, Float> half_arith$aT1fT1f(allocator * alloc, vec<Float> a, vec<Float> b)
+	{
+		auto ha = vec_to<half>(alloc, a), hb = vec_to<half>(alloc, b);
+		return make_Tuple(vec_from(alloc, ts_add(alloc, ha, ts_scale(alloc, 2.0, hb))), ts_dot(ha, hb));
+	}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	/* Whether lm, applied to df, gives the same result as its sparse and
+	   dense materializations at x.  The maps made below from s, and the
+	   df they are applied to, have integer values, so the results are
+	   exact whatever the order of summation. */
+	template<class L>
+	bool lm_matrix_agrees(allocator * alloc, L const& lm, typename L::From const& x, typename L::From const& df)
+	{
+		auto expected = LM::lmApply(alloc, lm, df);
+		auto sparse = LM::materialize_sparse(alloc, lm, x);
+		auto dense = LM::materialize_dense(alloc, lm, x);
+		return LM::lmApply(alloc, sparse, df) == expected
+			&& LM::lmApply(alloc, dense, df) == expected;
+	}
+
+	// The map df -> s[i] * df for each i, for Build and BuildT
+	inline auto lm_scales(vec<Float> s)
+	{
+		return [s](Integer i) { return LM::Scale::mk(s[i]); };
+	}
+
+	// (dv, dy) -> sum_i s[i] * dv[i] + dy
+	inline bool lm_hcat_agrees$aT1fT1f(allocator * alloc, vec<Float> s, vec<Float> dx)
+	{
+		auto f = lm_scales(s);
+		auto lm = LM::HCat<LM::BuildT<decltype(f)>, LM::One<Float>>::mk(
+			LM::BuildT<decltype(f)>::mk(s.size(), f), LM::One<Float>::mk(0.0));
+		return lm_matrix_agrees(alloc, lm, make_Tuple(s, s[0]), make_Tuple(dx, dx[0]));
+	}
+
+	// dy -> (dy, s * dy)
+	inline bool lm_vcat_agrees$aT1fT1f(allocator * alloc, vec<Float> s, vec<Float> dx)
+	{
+		auto f = lm_scales(s);
+		auto lm = LM::VCat<LM::One<Float>, LM::Build<decltype(f)>>::mk(
+			LM::One<Float>::mk(0.0), LM::Build<decltype(f)>::mk(s.size(), f));
+		return lm_matrix_agrees(alloc, lm, s[0], dx[0]);
+	}
+
+	// dy -> sum_i s[i] * (s[i] * dy)
+	inline bool lm_compose_agrees$aT1fT1f(allocator * alloc, vec<Float> s, vec<Float> dx)
+	{
+		auto f = lm_scales(s);
+		LM::BuildT<decltype(f)> bc = LM::BuildT<decltype(f)>::mk(s.size(), f);
+		LM::Build<decltype(f)> ab = LM::Build<decltype(f)>::mk(s.size(), f);
+		auto lm = LM::Compose<decltype(bc), decltype(ab)>::mk(bc, ab);
+		return lm_matrix_agrees(alloc, lm, s[0], dx[0]);
+	}
+
+	// (dy, dz) -> build i (s[i] * dy - dz)
+	inline bool lm_build_agrees$aT1fT1f(allocator * alloc, vec<Float> s, vec<Float> dx)
+	{
+		auto f = [s](Integer i) {
+			return LM::HCat<LM::Scale, LM::Scale>::mk(LM::Scale::mk(s[i]), LM::Scale::mk(-1.0));
+		};
+		auto lm = LM::Build<decltype(f)>::mk(s.size(), f);
+		return lm_matrix_agrees(alloc, lm, make_Tuple(s[0], s[1]), make_Tuple(dx[0], dx[1]));
+	}
+
+	// dv -> sum_i i * s[i] * dv[i]
+	inline bool lm_buildT_agrees$aT1fT1f(allocator * alloc, vec<Float> s, vec<Float> dx)
+	{
+		auto f = [s](Integer i) { return LM::Scale::mk(Float(i) * s[i]); };
+		auto lm = LM::BuildT<decltype(f)>::mk(s.size(), f);
+		return lm_matrix_agrees(alloc, lm, s, dx);
+	}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	/* Each check below applies a Compose or Add, which simplifies by the
+	   types of its operands (see knossos-lm.h), and compares the result
+	   with applying its operands in turn, as the unsimplified map would.
+	   It also checks that the map holds only what survives. */
+
+	template <class Lbc, class Lab>
+	bool lm_compose_agrees(allocator * alloc, Lbc const& bc, Lab const& ab, typename Lab::From const& x)
+	{
+		auto lm = LM::Compose<Lbc, Lab>::mk(bc, ab);
+		return LM::lmApply(alloc, lm, x) == LM::lmApply(alloc, bc, LM::lmApply(alloc, ab, x));
+	}
+
+	template <class LM1, class LM2>
+	bool lm_add_agrees(allocator * alloc, LM1 const& lm1, LM2 const& lm2, typename LM1::From const& x)
+	{
+		auto lm = LM::Add<LM1, LM2>::mk(lm1, lm2);
+		return LM::lmApply(alloc, lm, x) == ts_add(alloc, LM::lmApply(alloc, lm1, x), LM::lmApply(alloc, lm2, x));
+	}
+
+	// A map which is not simplified, from Float to (Vec Float)
+	inline auto lm_unsimplified(Float a)
+	{
+		auto f = [a](Integer i) { return LM::Scale::mk(a * Float(i)); };
+		return LM::Build<decltype(f)>::mk(3, f);
+	}
+
+	inline bool lm_zero_collapses$aff(allocator * alloc, Float a, Float x)
+	{
+		typedef LM::Zero<Float, Float> Z;
+		Z z = Z::mk(0.0, 0.0);
+		LM::Scale s = LM::Scale::mk(a);
+		static_assert(std::is_empty<LM::Compose<Z, LM::Scale>>::value);
+		static_assert(std::is_empty<LM::Compose<LM::Scale, Z>>::value);
+		static_assert(sizeof(LM::Add<Z, LM::Scale>) == sizeof(LM::Scale));
+		static_assert(sizeof(LM::Add<LM::Scale, Z>) == sizeof(LM::Scale));
+		return lm_compose_agrees(alloc, z, s, x)
+			&& lm_compose_agrees(alloc, s, z, x)
+			&& lm_add_agrees(alloc, z, s, x)
+			&& lm_add_agrees(alloc, s, z, x)
+			&& LM::lmApply(alloc, LM::Compose<Z, LM::Scale>::mk(z, s), x) == 0;
+	}
+
+	inline bool lm_one_collapses$aff(allocator * alloc, Float a, Float x)
+	{
+		typedef LM::One<Float> I;
+		I one = I::mk(0.0);
+		LM::Scale s = LM::Scale::mk(a);
+		auto b = lm_unsimplified(a);
+		static_assert(sizeof(LM::Compose<I, LM::Scale>) == sizeof(LM::Scale));
+		static_assert(sizeof(LM::Compose<LM::Scale, I>) == sizeof(LM::Scale));
+		static_assert(sizeof(LM::Compose<decltype(b), I>) == sizeof(b));
+		return lm_compose_agrees(alloc, one, s, x)
+			&& lm_compose_agrees(alloc, s, one, x)
+			&& lm_compose_agrees(alloc, b, one, x)
+			&& LM::lmApply(alloc, LM::Compose<I, LM::Scale>::mk(one, s), x) == a * x;
+	}
+
+	inline bool lm_scale_collapses$afff(allocator * alloc, Float a, Float b, Float x)
+	{
+		typedef LM::Compose<LM::Scale, LM::Scale> SS;
+		typedef LM::Add<LM::Scale, LM::Scale> SplusS;
+		typedef LM::Compose<SS, SplusS> Chain;
+		static_assert(sizeof(SS) == sizeof(LM::Scale) && LM::is_scale<SS>::value);
+		static_assert(sizeof(SplusS) == sizeof(LM::Scale) && LM::is_scale<SplusS>::value);
+		static_assert(sizeof(Chain) == sizeof(LM::Scale) && LM::is_scale<Chain>::value);
+		LM::Scale sa = LM::Scale::mk(a), sb = LM::Scale::mk(b);
+		SS ss = SS::mk(sa, sb);
+		SplusS splus = SplusS::mk(sa, sb);
+		return lm_compose_agrees(alloc, sa, sb, x)
+			&& lm_add_agrees(alloc, sa, sb, x)
+			&& lm_compose_agrees(alloc, ss, splus, x)
+			&& LM::lmApply(alloc, Chain::mk(ss, splus), x) == a * b * (a + b) * x;
+	}
+
+}
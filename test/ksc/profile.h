@@ -0,0 +1,29 @@
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	/* Call f(i) for i < n, then reset the profile, and call f(i) for
+	   i < m.  Returns the number of events the calling thread recorded
+	   and dropped since the reset.  Without KS_PROFILE nothing is
+	   recorded, so it returns what a profile would. */
+	template<class F>
+	Tuple<Integer, Integer> profile_events$al$dii$bii(allocator * alloc, F f, Integer n, Integer m)
+	{
+		for (Integer i = 0; i != n; ++i)
+			f(alloc, i);
+#if defined(KS_PROFILE) && !defined(KS_CUDA)
+		profile::reset();
+		for (Integer i = 0; i != m; ++i)
+			f(alloc, i);
+		profile::thread_log_t& log = profile::this_thread_log();
+		Integer events = 0;
+		log.for_each_event([&](profile::event_t const&) { ++events; });
+		return make_Tuple(events, Integer(log.dropped()));
+#else
+		return make_Tuple(m, Integer(0));
+#endif
+	}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "knossos.h"
+
+namespace ks {
+
+	// Rows [begin, end) of t: contiguous, so the same memory
+	inline tensor<2, Float> strided_rows$aT2fii(allocator * alloc, tensor<2, Float> t, Integer begin, Integer end)
+	{
+		auto rows = strided_tensor<2, Float>(t).slice(begin, end);
+		KS_ASSERT(rows.is_contiguous());
+		return to_tensor(alloc, rows);
+	}
+
+	// Columns [begin, end) of t, as rows
+	inline tensor<2, Float> strided_columns$aT2fii(allocator * alloc, tensor<2, Float> t, Integer begin, Integer end)
+	{
+		auto columns = strided_tensor<2, Float>(t).transpose().slice(begin, end);
+		KS_ASSERT(!columns.is_contiguous());
+		return to_tensor(alloc, columns);
+	}
+
+	// Column j of t
+	inline vec<Float> strided_column$aT2fi(allocator * alloc, tensor<2, Float> t, Integer j)
+	{
+		return to_tensor(alloc, strided_tensor<2, Float>(t).transpose()[j]);
+	}
+
+	// The sum of the elements of column j of t, weighted by their row index
+	inline Float strided_weighted_column_sum$aT2fi(allocator *, tensor<2, Float> t, Integer j)
+	{
+		auto column = strided_tensor<2, Float>(t).transpose()[j];
+		Float tot = 0, i = 0;
+		for_each_element(column, [&](Float x) { tot += i * x; i += 1; });
+		return tot;
+	}
+
+}
@@ -1,4 +1,7 @@
 import numpy as np
+from ksc.compile import build_py_module_from_ks
+from ksc.expr import make_structured_name
+from ksc.type import Type
 from ksc.utils import translate_and_import
 
 
@@ -12,3 +15,31 @@ def test_vec_vec_add():
     y = np.array([-1, 2, 0, -3, 5, 6])
     expected_output = [-1, 3, 2, 0, 9, 11]
     assert py_out.test(x, y) == expected_output
+
+
+def test_numpy_entry_point():
+    ks_str = """(def add2 (Tensor 2 Float) ((x : Tensor 2 Float) (y : Tensor 2 Float))
+  (ts_add x y))
+(def first (Tensor 2 Float) ((x : Tensor 2 Float) (y : Tensor 2 Float))
+  x)"""
+    arg_type = Type.Tuple(Type.Tensor(2, Type.Float), Type.Tensor(2, Type.Float))
+    py_mod = build_py_module_from_ks(
+        ks_str,
+        [
+            ("add2", make_structured_name(("add2", arg_type))),
+            ("first", make_structured_name(("first", arg_type))),
+        ],
+    )
+    x = np.arange(6, dtype=np.float32).reshape(2, 3)
+    y = np.ones((2, 3), dtype=np.float32)
+
+    assert (py_mod.add2(x, y) == x + y).all()
+
+    # Arguments of another dtype, or not contiguous, are converted
+    z = np.arange(12, dtype=np.float64).reshape(2, 6)[:, ::2]
+    assert (py_mod.add2(z, y) == z + y).all()
+
+    # A result in an argument's buffer is copied, not a view of it
+    ans = py_mod.first(x, y)
+    assert not np.shares_memory(ans, x)
+    assert (ans == x).all()
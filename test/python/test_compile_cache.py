@@ -0,0 +1,47 @@
+import subprocess
+
+from ksc import compile
+
+
+def fake_ksc(monkeypatch, tmp_path):
+    """
+    Point the compile cache at tmp_path and replace ksc by a stub which
+    records its calls and writes a one-line .kso and .cpp
+    """
+    monkeypatch.setenv("KSC_COMPILE_CACHE_DIR", str(tmp_path))
+    monkeypatch.setattr(compile, "use_compile_cache", True)
+    calls = []
+
+    def run(cmd, **kwargs):
+        calls.append(cmd)
+        kso = cmd[cmd.index("--ks-output-file") + 1]
+        cpp = cmd[cmd.index("--cpp-output-file") + 1]
+        with open(kso, "w") as f:
+            f.write("(edef f Float (Float))\n")
+        with open(cpp, "w") as f:
+            f.write(f"// generated for call {len(calls)}\n")
+        return subprocess.CompletedProcess(cmd, 0, b"", b"")
+
+    monkeypatch.setattr(compile.subprocess, "run", run)
+    return calls
+
+
+def test_generate_cpp_from_ks_cached(monkeypatch, tmp_path):
+    calls = fake_ksc(monkeypatch, tmp_path)
+    ks_str = "(def g Float (x : Float) x)"
+
+    cpp1, decls1 = compile.generate_cpp_from_ks(ks_str, ["g"], [], ["prelude.h"])
+    cpp2, decls2 = compile.generate_cpp_from_ks(ks_str, ["g"], [], ["prelude.h"])
+    assert len(calls) == 1
+    assert cpp1 == cpp2
+    assert [str(d) for d in decls1] == [str(d) for d in decls2]
+
+
+def test_generate_cpp_from_ks_cache_key(monkeypatch, tmp_path):
+    calls = fake_ksc(monkeypatch, tmp_path)
+    ks_str = "(def g Float (x : Float) x)"
+
+    compile.generate_cpp_from_ks(ks_str, ["g"], [], ["prelude.h"])
+    compile.generate_cpp_from_ks(ks_str + " ", ["g"], [], ["prelude.h"])
+    compile.generate_cpp_from_ks(ks_str, ["g"], [], ["prelude-aten.h"])
+    assert len(calls) == 3
@@ -0,0 +1,65 @@
+import os
+
+import pytest
+
+from ksc import utils
+
+torch = pytest.importorskip("torch")
+cpp_extension = pytest.importorskip("torch.utils.cpp_extension")
+
+pytestmark = pytest.mark.skipif(
+    not torch.cuda.is_available(), reason="CUDA is not available"
+)
+
+# Each device thread builds a vec of vecs in its own arena, and sums it
+# with the sequential sumbuild of knossos.h, which copies its first term
+# down and then adds the rest into it in place.  The result is 1 where
+# the sum is right and the input is left unchanged.
+cuda_source = """
+#include "knossos-cuda.cuh"
+
+using namespace ks;
+
+struct copydown_body
+{
+    __device__ Float operator()(allocator * alloc, Integer k) const {
+        auto xs = build<vec<Float>>(alloc, 3, [k](allocator * alloc, Integer i) {
+            return build<Float>(alloc, 4, [k, i](allocator *, Integer j) { return Float(k + 10 * i + j); });
+        });
+        auto s = sumbuild<vec<Float>>(alloc, 3, [&xs](allocator *, Integer i) { return xs[i]; });
+        auto t = sumbuild<Tuple<vec<Float>, Integer>>(alloc, 3, [&xs](allocator *, Integer i) { return make_Tuple(xs[i], i); });
+        bool ok = get<1>(t) == 3;
+        for (Integer j = 0; j != 4; ++j)
+            ok = ok && xs[0][j] == Float(k + j) && s[j] == Float(3 * (k + j) + 30) && get<0>(t)[j] == s[j];
+        return ok ? 1.0f : 0.0f;
+    }
+};
+
+torch::Tensor sumbuild_leaves_input(int64_t n) {
+    static cuda::device_arena arena;
+    KS_MARK(arena.results(), mark);
+    auto ok = cuda::build<Float>(&arena, Integer(n), copydown_body{});
+    auto ret = torch::empty({n}, torch::dtype(torch::kFloat32).device(torch::kCUDA));
+    cuda::check(cudaMemcpy(ret.data_ptr<float>(), ok.data(), n * sizeof(Float), cudaMemcpyDeviceToDevice), "Failed to copy result");
+    KS_RESET(arena.results(), mark);
+    return ret;
+}
+"""
+
+cpp_source = "torch::Tensor sumbuild_leaves_input(int64_t n);"
+
+
+def test_device_sumbuild_leaves_input_unchanged():
+    _, ksc_runtime_dir = utils.get_ksc_paths()
+    build_directory = utils.get_ksc_build_dir() + "/torch_extensions/cuda_runtime"
+    os.makedirs(build_directory, exist_ok=True)
+    module = cpp_extension.load_inline(
+        "ks_cuda_runtime_test",
+        cpp_sources=[cpp_source],
+        cuda_sources=[cuda_source],
+        functions=["sumbuild_leaves_input"],
+        build_directory=build_directory,
+        extra_include_paths=[ksc_runtime_dir],
+        extra_cuda_cflags=["-std=c++17"],
+    )
+    assert torch.all(module.sumbuild_leaves_input(1000) == 1.0)
@@ -0,0 +1,37 @@
+import os
+
+import pytest
+
+from ksc.type import Type
+from ksc import mlir_jit
+
+pytestmark = pytest.mark.skipif(
+    not os.path.exists(mlir_jit._default_library_path()),
+    reason="libKscMlirJit has not been built",
+)
+
+
+def test_mlir_jit_scalars(tmp_path):
+    ks_str = """
+(def twice Integer (x : Integer) (add x x))
+(def poly Float ((x : Float) (n : Integer))
+  (fold (lam (acc_i : (Tuple Float Integer))
+             (let (acc (get$1$2 acc_i))
+               (add (mul acc x) 1.0)))
+        0.0
+        (build n (lam (i : Integer) i))))
+"""
+    for _ in range(2):  # The second JIT reads the object code from the cache
+        jit = mlir_jit.MlirJit(opt_level=2, cache_dir=str(tmp_path))
+        jit.add_source(ks_str)
+        assert jit.function("twice", [Type.Integer], Type.Integer)(21) == 42
+        poly = jit.function("poly", [Type.Float, Type.Integer], Type.Float)
+        assert poly(2.0, 3) == 7.0  # 1 + 2 + 4
+        assert len(list(tmp_path.iterdir())) == 1
+
+
+def test_mlir_jit_errors():
+    jit = mlir_jit.MlirJit(opt_level=0)
+    jit.add_source("(def f Integer (x : Integer) x)")
+    with pytest.raises(mlir_jit.MlirJitError):
+        jit.function("g", [Type.Integer], Type.Integer)
@@ -1,6 +1,7 @@
 import pytest
 
 import math
+import threading
 import torch
 import numpy
 
@@ -147,6 +148,100 @@ def test_far():
     assert pytest.approx(ks_ans, 1e-5) == ans.item()
 
 
+def test_allocator_is_per_thread():
+    x = torch.randn(2, 3)
+    y = torch.randn(2, 5)
+
+    far._reset_allocator(x, y)
+    far._entry(x, y)
+    py_mod = far.ensure_compiled((x, y)).py_mod
+    top = py_mod.allocator_top()
+    assert top > 0
+
+    # A fresh thread sees its own, untouched, arena
+    thread_tops = []
+    t = threading.Thread(target=lambda: thread_tops.append(py_mod.allocator_top()))
+    t.start()
+    t.join()
+    assert thread_tops == [0]
+    assert py_mod.allocator_top() == top
+
+
+def test_zero_copy_outputs():
+    @knossos.register(generate_lm=True)
+    def f(x: torch.Tensor, y: torch.Tensor):
+        return torch.cat([x, y], dim=1)
+
+    x = torch.randn(2, 3)
+    y = torch.randn(2, 5)
+    py_mod = f.ensure_compiled((x, y)).py_mod
+    py_ans = f.raw_f(x, y)
+
+    py_mod.set_zero_copy_outputs(True)
+    try:
+        py_mod.reset_allocator()
+        ks_ans = f._entry(x, y)
+
+        # The result is leased from the arena, so resetting the arena
+        # must not let a second call overwrite it
+        py_mod.reset_allocator()
+        assert py_mod.allocator_top() > 0
+        ks_ans2 = f._entry(2 * x, 2 * y)
+        assert (ks_ans.numpy() == py_ans.numpy()).all()
+        assert (ks_ans2.numpy() == 2 * py_ans.numpy()).all()
+
+        # Once the results are freed, the arena resets fully
+        del ks_ans, ks_ans2
+        py_mod.reset_allocator()
+        assert py_mod.allocator_top() == 0
+    finally:
+        py_mod.set_zero_copy_outputs(False)
+
+
+def test_memory_planning():
+    x = torch.randn(2, 3)
+    y = torch.randn(2, 5)
+    py_mod = far.ensure_compiled((x, y)).py_mod
+    ans = far.raw_f(x, y).item()
+
+    py_mod.set_memory_planning(True)
+    try:
+        # The first call with these shapes is measured in the arena...
+        py_mod.reset_allocator()
+        assert pytest.approx(far._entry(x, y), 1e-5) == ans
+        top = py_mod.allocator_top()
+        assert top > 0
+
+        # ...and later ones run in a planned workspace, taken from the same
+        # place in the arena each time
+        py_mod.reset_allocator()
+        assert pytest.approx(far._entry(x, y), 1e-5) == ans
+        planned_top = py_mod.allocator_top()
+        assert planned_top >= top
+        assert planned_top <= py_mod.allocator_peak()
+        py_mod.reset_allocator()
+        assert pytest.approx(far._entry(x, y), 1e-5) == ans
+        assert py_mod.allocator_top() == planned_top
+
+        # New shapes are measured again
+        x2 = torch.randn(4, 3)
+        y2 = torch.randn(4, 5)
+        assert pytest.approx(far._entry(x2, y2), 1e-5) == far.raw_f(x2, y2).item()
+        assert py_mod.allocator_top() > 0
+    finally:
+        py_mod.set_memory_planning(False)
+
+
+def test_call_async():
+    x = torch.randn(2, 3)
+    y = torch.randn(2, 5)
+
+    # Several calls are in flight at once, each in its own arena
+    futures = [far.call_async(i * x, y) for i in range(1, 4)]
+    for i, future in enumerate(futures, 1):
+        assert pytest.approx(future.result().item(), 1e-5) == far.raw_f(i * x, y).item()
+
+
 def test_cat():
     @knossos.register(generate_lm=True)
     def f(x: torch.Tensor, y: torch.Tensor):
@@ -204,3 +299,54 @@ def test_relu3(generate_lm):
         ks_ans = ks_relu3._entry_vjp(x, 1.0)
 
         assert pytest.approx(ks_ans, 1e-6) == py_ans
+
+
+def test_relu3_split_passes():
+    @knossos.register(generate_lm=False)
+    def ks_relu3(x: float):
+        return relu3(x)
+
+    py_mod = ks_relu3.ensure_compiled((0.5,)).py_mod
+    for x in [-0.1, 0.31221, 2.27160]:
+        # The forward pass returns the bog, which the reverse pass takes
+        # in place of the arguments
+        ks_ans, bog = py_mod.entry_fwdpass(x)
+        assert pytest.approx(ks_ans, 1e-6) == relu3(x)
+
+        py_mod.reset_allocator()
+        ks_grad = py_mod.entry_revpass(1.0, bog)
+        assert pytest.approx(ks_grad, 1e-6) == grad_relu3(x)
+
+
+class SquareSumSplitPasses:
+    """
+    A stand-in for a compiled module with split passes, whose bog is its
+    input itself, as a bog which refers to an input in place would be
+    """
+
+    __name__ = "square_sum_split_passes"
+
+    def reset_allocator(self):
+        pass
+
+    def entry_fwdpass(self, x):
+        return torch.sum(x * x), x
+
+    def entry_revpass(self, dret, bog):
+        return 2 * bog * dret
+
+
+def test_bog_input_modified_in_place():
+    f = knossos.make_KscAutogradFunction(SquareSumSplitPasses())
+
+    x = torch.randn(3, requires_grad=True)
+    y = x * 1
+    f.apply(y).backward()
+    assert torch.allclose(x.grad, 2 * y)
+
+    # Autograd raises, as it would if the bog were a saved tensor
+    y = x * 1
+    ans = f.apply(y)
+    y.add_(1.0)
+    with pytest.raises(RuntimeError, match="inplace"):
+        ans.backward()